@@ -0,0 +1,717 @@
+// implementation for the b-dot detumble executor
+// magnetometer samples are written to the bdot char device, and a fixed
+//   rate kernel thread turns the rate of change of the field into a
+//   dipole command for the magnetorquers
+//   m = -k * dB/dt
+//
+// by Mark Hill
+#include<linux/kernel.h>
+#include<linux/kthread.h>
+#include<linux/sched.h>
+#include<linux/err.h>
+#include<linux/fs.h>
+#include<linux/cdev.h>
+#include<linux/kfifo.h>
+#include<linux/spinlock.h>
+#include<linux/mutex.h>
+#include<linux/hrtimer.h>
+#include<linux/ktime.h>
+#include<linux/math64.h>
+#include<linux/uaccess.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/string.h>
+#include<linux/slab.h>
+
+#include "ccard.h"
+
+// number of samples the ring buffer holds
+// rounded up by kfifo to a power of two bytes
+#define BDOT_FIFO_SAMPLES 64
+// default loop period in ms
+// has to be longer than a magnetorquer brake, which takes 100ms
+#define bdot_dfl_period 500
+// default gain, in 16.16 fixed point, from nT/s to dipole units
+#define bdot_dfl_gain (1 << 16)
+// default limit on the magnitude of each dipole component
+#define bdot_dfl_max_dipole 1000
+// derivatives over gaps longer than this many ns are thrown away, the
+//   field has changed too much in between for them to mean anything
+#define BDOT_MAX_DT NSEC_PER_SEC
+// amplitude of the synthetic field in nT
+#define BDOT_SYNTH_AMPLITUDE 30000
+
+// one period of a sine wave in 1.15 fixed point, used by the synthetic feeder
+static const s16 _bdot_sine[32] = {
+	0, 6393, 12540, 18205, 23170, 27246, 30274, 32138,
+	32767, 32138, 30274, 27246, 23170, 18205, 12540, 6393,
+	0, -6393, -12540, -18205, -23170, -27246, -30274, -32138,
+	-32767, -32138, -30274, -27246, -23170, -18205, -12540, -6393
+};
+
+// statistics on the executor loop, times are in ns
+struct bdot_stats {
+	u32 cycles;
+	// cycles that found no new sample and held the last command
+	u32 underruns;
+	// samples dropped because the ring buffer was full
+	u32 overruns;
+	// cycles whose work ran past the start of the next cycle
+	u32 late;
+	// wakeup time relative to the scheduled cycle start
+	s64 jitter_last;
+	s64 jitter_max;
+	// time spent computing and applying the command
+	s64 loop_last;
+	s64 loop_max;
+	// number of cycles each axis hit the dipole limit
+	u32 saturated[3];
+};
+
+// the executor of one card
+// allocated the first time the card's magnetorquers come up and kept until
+//   the card goes away, so the configuration survives a replug
+struct card_bdot {
+	struct ccard *card;
+	// configuration, set through the bdot device attributes
+	u32 period;
+	s32 gain;
+	u32 max_dipole;
+	u8 synthetic;
+
+	// the executor thread, NULL while disabled, protected by thread_lock
+	struct task_struct *thread;
+	struct mutex thread_lock;
+	// holds the incoming samples, protected by fifo_lock
+	struct kfifo *fifo;
+	spinlock_t fifo_lock;
+	// protects stats
+	spinlock_t stats_lock;
+	struct bdot_stats stats;
+
+	// the char device samples are written to
+	dev_t dev;
+	struct cdev cdev;
+	struct device *device;
+};
+
+// starts and stops the executor thread
+static s8 start_bdot(struct card_bdot *bdot);
+static void stop_bdot(struct card_bdot *bdot);
+
+// creates and removes the bdot device
+static s8 create_bdot_device(struct card_bdot *bdot);
+static void remove_bdot_device(struct card_bdot *bdot);
+
+// char device file operations
+static int open_bdot(struct inode *inode, struct file *file);
+static ssize_t write_bdot_samples(struct file *file, const char __user *buf, \
+				  size_t count, loff_t *offset);
+
+static const struct file_operations _bdot_fops = {
+	.owner = THIS_MODULE,
+	.open = open_bdot,
+	.write = write_bdot_samples,
+};
+
+// definitions for the bdot attribute sysfs callbacks
+static ssize_t read_bdot_enable(struct device *dev, \
+				struct device_attribute *attr, char *buf);
+static ssize_t write_bdot_enable(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count);
+static ssize_t read_bdot_period(struct device *dev, \
+				struct device_attribute *attr, char *buf);
+static ssize_t write_bdot_period(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count);
+static ssize_t read_bdot_gain(struct device *dev, \
+			      struct device_attribute *attr, char *buf);
+static ssize_t write_bdot_gain(struct device *dev, \
+			       struct device_attribute *attr, \
+			       const char *buf, size_t count);
+static ssize_t read_bdot_max_dipole(struct device *dev, \
+				    struct device_attribute *attr, char *buf);
+static ssize_t write_bdot_max_dipole(struct device *dev, \
+				     struct device_attribute *attr, \
+				     const char *buf, size_t count);
+static ssize_t read_bdot_synthetic(struct device *dev, \
+				   struct device_attribute *attr, char *buf);
+static ssize_t write_bdot_synthetic(struct device *dev, \
+				    struct device_attribute *attr, \
+				    const char *buf, size_t count);
+static ssize_t read_bdot_stats(struct device *dev, \
+			       struct device_attribute *attr, char *buf);
+static ssize_t write_bdot_stats(struct device *dev, \
+				struct device_attribute *attr, \
+				const char *buf, size_t count);
+static ssize_t read_bdot_dipole(struct device *dev, \
+				struct device_attribute *attr, char *buf);
+static ssize_t write_bdot_dipole(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count);
+
+// device attributes for the executor
+static DEVICE_ATTR(enable, S_IRUSR | S_IWUSR, read_bdot_enable, \
+		   write_bdot_enable);
+static DEVICE_ATTR(period, S_IRUSR | S_IWUSR, read_bdot_period, \
+		   write_bdot_period);
+static DEVICE_ATTR(gain, S_IRUSR | S_IWUSR, read_bdot_gain, write_bdot_gain);
+static DEVICE_ATTR(max_dipole, S_IRUSR | S_IWUSR, read_bdot_max_dipole, \
+		   write_bdot_max_dipole);
+static DEVICE_ATTR(synthetic, S_IRUSR | S_IWUSR, read_bdot_synthetic, \
+		   write_bdot_synthetic);
+static DEVICE_ATTR(stats, S_IRUSR | S_IWUSR, read_bdot_stats, \
+		   write_bdot_stats);
+// the dipole class attribute of the magnetorquers drives the first card,
+//   this one drives the card the executor belongs to
+static DEVICE_ATTR(dipole, S_IRUSR | S_IWUSR, read_bdot_dipole, \
+		   write_bdot_dipole);
+
+
+
+s8 init_bdot(struct ccard *card)
+{
+	if (card->bdot == NULL) {
+		struct card_bdot *bdot = kzalloc(sizeof(struct card_bdot), \
+						 GFP_KERNEL);
+		if (bdot == NULL)
+			return 1;
+		bdot->card = card;
+		bdot->period = bdot_dfl_period;
+		bdot->gain = bdot_dfl_gain;
+		bdot->max_dipole = bdot_dfl_max_dipole;
+		spin_lock_init(&bdot->fifo_lock);
+		spin_lock_init(&bdot->stats_lock);
+		mutex_init(&bdot->thread_lock);
+		card->bdot = bdot;
+	}
+	struct card_bdot *bdot = card->bdot;
+
+	if (bdot->fifo != NULL)
+		return 0;
+
+	bdot->fifo = kfifo_alloc(BDOT_FIFO_SAMPLES * \
+				 sizeof(struct ccard_mag_sample), \
+				 GFP_KERNEL, &bdot->fifo_lock);
+	if (IS_ERR(bdot->fifo)) {
+		ccard_err("couldn't allocate bdot sample buffer\n");
+		bdot->fifo = NULL;
+		return 1;
+	}
+
+	if (create_bdot_device(bdot)) {
+		ccard_err("failed to create bdot device\n");
+		kfifo_free(bdot->fifo);
+		bdot->fifo = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+void cleanup_bdot(struct ccard *card)
+{
+	struct card_bdot *bdot = card->bdot;
+	if (bdot == NULL || bdot->fifo == NULL)
+		return;
+
+	// the enable file goes first, so nothing can start the thread again
+	remove_bdot_device(bdot);
+	stop_bdot(bdot);
+
+	kfifo_free(bdot->fifo);
+	bdot->fifo = NULL;
+}
+
+// adds a sample to the ring buffer
+// when the buffer is full the oldest sample is dropped, the newest samples
+//   are the ones the loop cares about
+static void push_bdot_sample(struct card_bdot *bdot, \
+			     const struct ccard_mag_sample *sample)
+{
+	struct ccard_mag_sample oldest;
+	unsigned long flags;
+	u8 dropped = 0;
+
+	spin_lock_irqsave(&bdot->fifo_lock, flags);
+	if (bdot->fifo->size - __kfifo_len(bdot->fifo) < sizeof(*sample)) {
+		__kfifo_get(bdot->fifo, (unsigned char *)&oldest, \
+			    sizeof(oldest));
+		dropped = 1;
+	}
+	__kfifo_put(bdot->fifo, (const unsigned char *)sample, sizeof(*sample));
+	spin_unlock_irqrestore(&bdot->fifo_lock, flags);
+
+	if (dropped) {
+		spin_lock(&bdot->stats_lock);
+		bdot->stats.overruns++;
+		spin_unlock(&bdot->stats_lock);
+	}
+}
+
+// empties the ring buffer into <sample>, leaving it holding the newest one
+// returns the number of samples taken out of the buffer
+static u32 pop_bdot_samples(struct card_bdot *bdot, \
+			    struct ccard_mag_sample *sample)
+{
+	u32 taken = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bdot->fifo_lock, flags);
+	while (__kfifo_len(bdot->fifo) >= sizeof(*sample)) {
+		__kfifo_get(bdot->fifo, (unsigned char *)sample, \
+			    sizeof(*sample));
+		taken++;
+	}
+	spin_unlock_irqrestore(&bdot->fifo_lock, flags);
+
+	return taken;
+}
+
+// feeds the loop a field tumbling about two axes at once
+static inline void synthesize_bdot_sample(struct card_bdot *bdot, u32 step)
+{
+	struct ccard_mag_sample sample;
+
+	sample.timestamp = ktime_to_ns(ktime_get());
+	sample.field.x = BDOT_SYNTH_AMPLITUDE * _bdot_sine[step % 32] >> 15;
+	sample.field.y = BDOT_SYNTH_AMPLITUDE * \
+			 _bdot_sine[(step + 8) % 32] >> 15;
+	sample.field.z = BDOT_SYNTH_AMPLITUDE * \
+			 _bdot_sine[(step / 2) % 32] >> 15;
+
+	push_bdot_sample(bdot, &sample);
+}
+
+// limits <value> to +-max_dipole, counting a hit against <axis>
+// must be called with bdot->stats_lock held
+static inline s32 saturate_bdot(struct card_bdot *bdot, s64 value, u8 axis)
+{
+	s64 limit = bdot->max_dipole;
+
+	if (value > limit || value < -limit) {
+		bdot->stats.saturated[axis]++;
+		return (value > 0) ? limit : -limit;
+	}
+
+	return value;
+}
+
+// computes one dipole component from two field samples <dt> ns apart
+static inline s64 bdot_component(struct card_bdot *bdot, s32 now, \
+				 s32 before, s32 dt)
+{
+	// nT/s, the field difference is well within range even multiplied
+	//   by a second worth of ns
+	s64 rate = div_s64((s64)(now - before) * NSEC_PER_SEC, dt);
+
+	return -((s64)bdot->gain * rate) >> 16;
+}
+
+// this function runs in its own thread while the executor is enabled
+// it wakes up every period ms, takes the newest sample and
+//   applies -k * dB/dt through the same path as a dipole command, so the
+//   magnetorquers brake exactly as they do for set_mt_state
+static int bdot_loop(void *data)
+{
+	struct card_bdot *bdot = data;
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO / 2 };
+	sched_setscheduler(current, SCHED_FIFO, &param);
+
+	struct ccard_mag_sample sample;
+	struct ccard_mag_sample previous = {};
+	u8 have_previous = 0;
+	u32 step = 0;
+
+	ktime_t next = ktime_get();
+	while (!kthread_should_stop()) {
+		next = ktime_add_ns(next, (u64)bdot->period * NSEC_PER_MSEC);
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+		if (kthread_should_stop())
+			break;
+
+		ktime_t wake = ktime_get();
+		s64 jitter = ktime_to_ns(ktime_sub(wake, next));
+
+		if (bdot->synthetic)
+			synthesize_bdot_sample(bdot, step++);
+
+		u32 taken = pop_bdot_samples(bdot, &sample);
+
+		spin_lock(&bdot->stats_lock);
+		bdot->stats.cycles++;
+		bdot->stats.jitter_last = jitter;
+		if (jitter > bdot->stats.jitter_max)
+			bdot->stats.jitter_max = jitter;
+		if (taken == 0)
+			bdot->stats.underruns++;
+		spin_unlock(&bdot->stats_lock);
+
+		// without a new sample the last command stays in place
+		if (taken == 0)
+			continue;
+
+		s64 dt = sample.timestamp - previous.timestamp;
+		if (have_previous && dt > 0 && dt <= BDOT_MAX_DT) {
+			struct ccard_vec3int dipole;
+
+			spin_lock(&bdot->stats_lock);
+			dipole.x = saturate_bdot(bdot, bdot_component(bdot, \
+					sample.field.x, previous.field.x, dt), 0);
+			dipole.y = saturate_bdot(bdot, bdot_component(bdot, \
+					sample.field.y, previous.field.y, dt), 1);
+			dipole.z = saturate_bdot(bdot, bdot_component(bdot, \
+					sample.field.z, previous.field.z, dt), 2);
+			spin_unlock(&bdot->stats_lock);
+
+			if (set_mt_dipole(bdot->card, &dipole, cause_bdot))
+				ccard_err_rl("bdot failed to apply dipole\n");
+		}
+		previous = sample;
+		have_previous = 1;
+
+		ktime_t done = ktime_get();
+		s64 loop = ktime_to_ns(ktime_sub(done, wake));
+
+		spin_lock(&bdot->stats_lock);
+		bdot->stats.loop_last = loop;
+		if (loop > bdot->stats.loop_max)
+			bdot->stats.loop_max = loop;
+		// a cycle that overran skips ahead instead of trying to catch up
+		if (ktime_to_ns(ktime_sub(done, next)) > \
+		    (s64)bdot->period * NSEC_PER_MSEC) {
+			bdot->stats.late++;
+			next = done;
+		}
+		spin_unlock(&bdot->stats_lock);
+	}
+
+	// leave the magnetorquers off when the executor stops
+	struct ccard_vec3int zero = {0, 0, 0};
+	set_mt_dipole(bdot->card, &zero, cause_bdot);
+
+	return 0;
+}
+
+static s8 start_bdot(struct card_bdot *bdot)
+{
+	mutex_lock(&bdot->thread_lock);
+	if (bdot->thread) {
+		mutex_unlock(&bdot->thread_lock);
+		return 0;
+	}
+
+	// stale samples would produce a bogus first derivative
+	unsigned long flags;
+	spin_lock_irqsave(&bdot->fifo_lock, flags);
+	__kfifo_reset(bdot->fifo);
+	spin_unlock_irqrestore(&bdot->fifo_lock, flags);
+
+	struct task_struct *thread = kthread_run(&bdot_loop, bdot, "bdot%u", \
+						 bdot->card->index);
+	if (IS_ERR(thread)) {
+		mutex_unlock(&bdot->thread_lock);
+		ccard_err("failed to create bdot thread\n");
+		return 1;
+	}
+	bdot->thread = thread;
+	mutex_unlock(&bdot->thread_lock);
+
+	ccard_notice("bdot executor started\n");
+	return 0;
+}
+
+static void stop_bdot(struct card_bdot *bdot)
+{
+	mutex_lock(&bdot->thread_lock);
+	if (bdot->thread == NULL) {
+		mutex_unlock(&bdot->thread_lock);
+		return;
+	}
+
+	kthread_stop(bdot->thread);
+	bdot->thread = NULL;
+	mutex_unlock(&bdot->thread_lock);
+
+	ccard_notice("bdot executor stopped\n");
+}
+
+
+
+//
+// char device section
+//
+
+static int open_bdot(struct inode *inode, struct file *file)
+{
+	file->private_data = container_of(inode->i_cdev, struct card_bdot, \
+					  cdev);
+	return 0;
+}
+
+// accepts whole struct ccard_mag_sample records
+// a sample with a timestamp of 0 is stamped with the time it arrived
+static ssize_t write_bdot_samples(struct file *file, const char __user *buf, \
+				  size_t count, loff_t *offset)
+{
+	struct card_bdot *bdot = file->private_data;
+	struct ccard_mag_sample sample;
+	size_t written = 0;
+
+	if (count < sizeof(sample))
+		return -EINVAL;
+
+	while (count - written >= sizeof(sample)) {
+		if (copy_from_user(&sample, buf + written, sizeof(sample)))
+			return written ? written : -EFAULT;
+		if (sample.timestamp == 0)
+			sample.timestamp = ktime_to_ns(ktime_get());
+
+		push_bdot_sample(bdot, &sample);
+		written += sizeof(sample);
+	}
+
+	return written;
+}
+
+
+
+//
+// sysfs section
+//
+
+// parses an unsigned value into <value>, leaving it alone if it's invalid
+static inline void write_bdot_u32(u32 *value, const char *buf, char *name)
+{
+	unsigned long parsed = 0;
+	if (strict_strtoul(buf, 10, &parsed))
+		ccard_warn_rl("%s is an invalid bdot %s\n", buf, name);
+	else
+		*value = (u32)parsed;
+}
+
+static ssize_t read_bdot_enable(struct device *dev, \
+				struct device_attribute *attr, char *buf)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%i\n", bdot->thread != NULL);
+}
+
+static ssize_t write_bdot_enable(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	u32 enable = 0;
+	write_bdot_u32(&enable, buf, "enable");
+
+	if (enable)
+		start_bdot(bdot);
+	else
+		stop_bdot(bdot);
+
+	return count;
+}
+
+static ssize_t read_bdot_period(struct device *dev, \
+				struct device_attribute *attr, char *buf)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u ms\n", bdot->period);
+}
+
+static ssize_t write_bdot_period(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	u32 period = bdot->period;
+	write_bdot_u32(&period, buf, "period");
+
+	if (period == 0)
+		ccard_warn_rl("bdot period must be positive\n");
+	else
+		bdot->period = period;
+
+	return count;
+}
+
+static ssize_t read_bdot_gain(struct device *dev, \
+			      struct device_attribute *attr, char *buf)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%i\n", bdot->gain);
+}
+
+// the gain is 16.16 fixed point, so 65536 is a gain of 1
+static ssize_t write_bdot_gain(struct device *dev, \
+			       struct device_attribute *attr, \
+			       const char *buf, size_t count)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	long value = 0;
+	if (strict_strtol(buf, 10, &value))
+		ccard_warn_rl("%s is an invalid bdot gain\n", buf);
+	else
+		bdot->gain = (s32)value;
+
+	return count;
+}
+
+static ssize_t read_bdot_max_dipole(struct device *dev, \
+				    struct device_attribute *attr, char *buf)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u\n", bdot->max_dipole);
+}
+
+static ssize_t write_bdot_max_dipole(struct device *dev, \
+				     struct device_attribute *attr, \
+				     const char *buf, size_t count)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	write_bdot_u32(&bdot->max_dipole, buf, "max dipole");
+	return count;
+}
+
+static ssize_t read_bdot_synthetic(struct device *dev, \
+				   struct device_attribute *attr, char *buf)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u\n", bdot->synthetic);
+}
+
+// while enabled the loop feeds itself a synthetic tumbling field, which
+//   is enough to exercise it without a magnetometer
+static ssize_t write_bdot_synthetic(struct device *dev, \
+				    struct device_attribute *attr, \
+				    const char *buf, size_t count)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	u32 synthetic = 0;
+	write_bdot_u32(&synthetic, buf, "synthetic");
+	bdot->synthetic = synthetic ? 1 : 0;
+
+	return count;
+}
+
+static ssize_t read_bdot_stats(struct device *dev, \
+			       struct device_attribute *attr, char *buf)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	struct bdot_stats stats;
+
+	spin_lock(&bdot->stats_lock);
+	stats = bdot->stats;
+	spin_unlock(&bdot->stats_lock);
+
+	return scnprintf(buf, PAGE_SIZE, \
+			 "cycles %u\n" \
+			 "underruns %u\n" \
+			 "overruns %u\n" \
+			 "late %u\n" \
+			 "jitter_last_ns %lli\n" \
+			 "jitter_max_ns %lli\n" \
+			 "loop_last_ns %lli\n" \
+			 "loop_max_ns %lli\n" \
+			 "saturated %u %u %u\n", \
+			 stats.cycles, stats.underruns, stats.overruns, \
+			 stats.late, stats.jitter_last, stats.jitter_max, \
+			 stats.loop_last, stats.loop_max, stats.saturated[0], \
+			 stats.saturated[1], stats.saturated[2]);
+}
+
+// any write resets the statistics
+static ssize_t write_bdot_stats(struct device *dev, \
+				struct device_attribute *attr, \
+				const char *buf, size_t count)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+
+	spin_lock(&bdot->stats_lock);
+	memset(&bdot->stats, 0, sizeof(bdot->stats));
+	spin_unlock(&bdot->stats_lock);
+
+	return count;
+}
+
+static ssize_t read_bdot_dipole(struct device *dev, \
+				struct device_attribute *attr, char *buf)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	return show_mt_dipole(bdot->card, buf);
+}
+
+// takes a dipole just like the magnetorquer class dipole file
+static ssize_t write_bdot_dipole(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count)
+{
+	struct card_bdot *bdot = dev_get_drvdata(dev);
+	return store_mt_dipole(bdot->card, buf, count);
+}
+
+static s8 create_bdot_device(struct card_bdot *bdot)
+{
+	struct ccard *card = bdot->card;
+	char name[32];
+
+	ccard_dbg("creating bdot device\n");
+
+	if (alloc_chrdev_region(&bdot->dev, 0, 1, "bdot")) {
+		ccard_err("couldn't create bdot dev_t\n");
+		return 1;
+	}
+
+	cdev_init(&bdot->cdev, &_bdot_fops);
+	bdot->cdev.owner = THIS_MODULE;
+	if (cdev_add(&bdot->cdev, bdot->dev, 1)) {
+		ccard_err("couldn't add bdot char device\n");
+		unregister_chrdev_region(bdot->dev, 1);
+		return 1;
+	}
+
+	ccard_dev_name(card, name, sizeof(name), "bdot");
+	bdot->device = device_create(&_mt_class, mt_expdr(card)->parent, \
+				     bdot->dev, bdot, name);
+	if (IS_ERR(bdot->device)) {
+		ccard_err("couldn't create bdot device\n");
+		bdot->device = NULL;
+		cdev_del(&bdot->cdev);
+		unregister_chrdev_region(bdot->dev, 1);
+		return 1;
+	}
+
+	if (device_create_file(bdot->device, &dev_attr_enable) || \
+	    device_create_file(bdot->device, &dev_attr_period) || \
+	    device_create_file(bdot->device, &dev_attr_gain) || \
+	    device_create_file(bdot->device, &dev_attr_max_dipole) || \
+	    device_create_file(bdot->device, &dev_attr_synthetic) || \
+	    device_create_file(bdot->device, &dev_attr_stats) || \
+	    device_create_file(bdot->device, &dev_attr_dipole)) {
+		ccard_err("error creating bdot sysfs files\n");
+		remove_bdot_device(bdot);
+		return 1;
+	}
+
+	ccard_dbg("created bdot device\n");
+	return 0;
+}
+
+static void remove_bdot_device(struct card_bdot *bdot)
+{
+	device_remove_file(bdot->device, &dev_attr_enable);
+	device_remove_file(bdot->device, &dev_attr_period);
+	device_remove_file(bdot->device, &dev_attr_gain);
+	device_remove_file(bdot->device, &dev_attr_max_dipole);
+	device_remove_file(bdot->device, &dev_attr_synthetic);
+	device_remove_file(bdot->device, &dev_attr_stats);
+	device_remove_file(bdot->device, &dev_attr_dipole);
+	device_destroy(&_mt_class, bdot->dev);
+
+	cdev_del(&bdot->cdev);
+	unregister_chrdev_region(bdot->dev, 1);
+}
@@ -0,0 +1,298 @@
+// board configuration of the c card
+// the expander pins, the i2c bus and addresses and the rail gpios default to
+//   the irvine02 card, and any of them can be replaced at load time, so a
+//   board revision only needs different parameters, e.g.
+//     insmod ccardmodule.ko mt_forward=1,3,5 mt_reverse=0,2,4 dsa_addr=0x39
+// several identical cards on separate buses are driven by giving one bus
+//   and one pair of rail gpios per card, e.g.
+//     insmod ccardmodule.ko i2c_bus=1,2 gpio_3v3=102,104 gpio_5v0=103,105
+// a card reached some other way than i2c names its transport, the i2c_bus
+//   entry of such a card only counts it, e.g. for a second card behind
+//   the usb bridge of IRVINE03
+//     insmod ccardmodule.ko i2c_bus=1,0 transport=i2c,usb ...
+// the kernel this runs on has no device tree for the board, so the module
+//   parameters are the only source
+// everything derived from the configuration is built once in
+//   ccard_init_board, the decode tables and masks are plain arrays afterwards
+//   and the hot paths cost what they did with the values compiled in
+//
+// by Mark Hill
+
+#include<linux/kernel.h>
+#include<linux/module.h>
+#include<linux/moduleparam.h>
+#include<linux/cache.h>
+#include<linux/gpio.h>
+
+#include "ccard.h"
+#include "ccard_pins.h"
+#include "decode.c"
+
+// the expander pins, see ccard_pins.h for the defaults
+static struct ccard_pin_map _pins = CCARD_DEFAULT_PINS;
+static unsigned int _dsa_res_out_count = CCARD_DSA_COUNT;
+static unsigned int _dsa_dep_out_count = CCARD_DSA_COUNT;
+static unsigned int _dsa_res_in_count = CCARD_DSA_COUNT;
+static unsigned int _dsa_dep_in_count = CCARD_DSA_COUNT;
+static unsigned int _mt_forward_count = CCARD_MT_COUNT;
+static unsigned int _mt_reverse_count = CCARD_MT_COUNT;
+
+module_param_array_named(dsa_res_out, _pins.dsa_res_out, byte, \
+			 &_dsa_res_out_count, S_IRUGO);
+MODULE_PARM_DESC(dsa_res_out, "output pin burning each dsa's release switch");
+module_param_array_named(dsa_dep_out, _pins.dsa_dep_out, byte, \
+			 &_dsa_dep_out_count, S_IRUGO);
+MODULE_PARM_DESC(dsa_dep_out, "output pin burning each dsa's deploy switch");
+module_param_array_named(dsa_res_in, _pins.dsa_res_in, byte, \
+			 &_dsa_res_in_count, S_IRUGO);
+MODULE_PARM_DESC(dsa_res_in, "input pin of each dsa's release sense, " \
+		 "8 if it isn't wired");
+module_param_array_named(dsa_dep_in, _pins.dsa_dep_in, byte, \
+			 &_dsa_dep_in_count, S_IRUGO);
+MODULE_PARM_DESC(dsa_dep_in, "input pin of each dsa's deploy sense, " \
+		 "8 if it isn't wired");
+module_param_array_named(mt_forward, _pins.mt_forward, byte, \
+			 &_mt_forward_count, S_IRUGO);
+MODULE_PARM_DESC(mt_forward, "output pin driving each magnetorquer forward");
+module_param_array_named(mt_reverse, _pins.mt_reverse, byte, \
+			 &_mt_reverse_count, S_IRUGO);
+MODULE_PARM_DESC(mt_reverse, "output pin driving each magnetorquer in " \
+		 "reverse");
+
+// the i2c bus of each card and the addresses of the devices on it, which
+//   are the same on every card
+static int _i2c_bus[CCARD_MAX_CARDS] = {1};
+static unsigned int _i2c_bus_count = 1;
+static unsigned short _dsa_addr = 0x38;
+static unsigned short _mt_addr = 0x38;
+static unsigned short _thruster_dac_addr = 0x0f;
+
+module_param_array_named(i2c_bus, _i2c_bus, int, &_i2c_bus_count, S_IRUGO);
+MODULE_PARM_DESC(i2c_bus, "i2c bus of each c card, one card per bus");
+module_param_named(dsa_addr, _dsa_addr, ushort, S_IRUGO);
+MODULE_PARM_DESC(dsa_addr, "i2c address of the dsa gpio expander");
+module_param_named(mt_addr, _mt_addr, ushort, S_IRUGO);
+MODULE_PARM_DESC(mt_addr, "i2c address of the magnetorquer gpio expander");
+module_param_named(dac_addr, _thruster_dac_addr, ushort, S_IRUGO);
+MODULE_PARM_DESC(dac_addr, "i2c address of the thruster dac");
+
+// the transport of each card by name, cards without one use i2c
+static char *_transport[CCARD_MAX_CARDS];
+static unsigned int _transport_count;
+// _transport looked up by ccard_init_board
+static const struct ccard_transport *_card_transport[CCARD_MAX_CARDS];
+
+module_param_array_named(transport, _transport, charp, &_transport_count, \
+			 S_IRUGO);
+MODULE_PARM_DESC(transport, "transport of each c card, i2c, usb or mock");
+
+// the gpios switching the power rails of each card
+static int _gpio_3v3[CCARD_MAX_CARDS] = {102};
+static int _gpio_5v0[CCARD_MAX_CARDS] = {103};
+static unsigned int _gpio_3v3_count = 1;
+static unsigned int _gpio_5v0_count = 1;
+
+module_param_array_named(gpio_3v3, _gpio_3v3, int, &_gpio_3v3_count, \
+			 S_IRUGO);
+MODULE_PARM_DESC(gpio_3v3, "gpio switching the 3v3 rail of each card");
+module_param_array_named(gpio_5v0, _gpio_5v0, int, &_gpio_5v0_count, \
+			 S_IRUGO);
+MODULE_PARM_DESC(gpio_5v0, "gpio switching the 5v0 rail of each card");
+
+// the decode tables for _pins, read by the dsa and magnetorquer code
+static struct ccard_decode _decode __read_mostly;
+
+
+
+// checks that <count> pins were given for <name> and that each of them is
+//   on the expander, or is the unwired pin 8 if <unwired_ok>
+// returns 0 if the pins can be used
+static s8 check_pins(const char *name, const u8 *pins, unsigned int count, \
+		     unsigned int expected, u8 unwired_ok)
+{
+	if (count != expected) {
+		ccard_err("%s needs %u pins, got %u\n", name, expected, \
+		       count);
+		return 1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (pins[i] < 8)
+			continue;
+		if (pins[i] == 8 && unwired_ok) {
+			ccard_warn("%s[%i] is not wired and always " \
+			       "reads as 0\n", name, i);
+			continue;
+		}
+		ccard_err("%s[%i] is pin %u, the expander only has 8\n", \
+		       name, i, pins[i]);
+		return 1;
+	}
+
+	return 0;
+}
+
+// checks that no output pin in <a> and <b> is used twice
+// returns 0 if they are all distinct
+static s8 check_outputs(const char *name, const u8 *a, const u8 *b, int count)
+{
+	u8 used = 0;
+	for (int i = 0; i < 2 * count; i++) {
+		u8 mask = 1 << ((i < count) ? a[i] : b[i - count]);
+		if (used & mask) {
+			ccard_err("%s pins drive the same output twice\n", \
+			       name);
+			return 1;
+		}
+		used |= mask;
+	}
+
+	return 0;
+}
+
+// returns 0 if <addr> is a usable 7 bit i2c address
+static s8 check_addr(const char *name, unsigned short addr)
+{
+	if (addr < 0x03 || addr > 0x77) {
+		ccard_err("%s 0x%x is not a valid i2c address\n", name, \
+		       addr);
+		return 1;
+	}
+
+	return 0;
+}
+
+// looks up the transport of every card
+// returns 0 if they all exist
+static s8 check_transports(void)
+{
+	if (_transport_count > _i2c_bus_count) {
+		ccard_err("%u transports given for %u cards\n", \
+		       _transport_count, _i2c_bus_count);
+		return 1;
+	}
+
+	for (int i = 0; i < _i2c_bus_count; i++) {
+		const char *name = i < _transport_count ? _transport[i] : "i2c";
+		_card_transport[i] = ccard_find_transport(name);
+		if (_card_transport[i] == NULL) {
+			ccard_err("%s is not a c card transport\n", name);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// checks that every card has a bus and rail gpios of its own
+// two cards on one bus would share its addresses, and two cards on one gpio
+//   would switch each other's rails
+// returns 0 if the cards can be used
+static s8 check_cards(void)
+{
+	if (_gpio_3v3_count != _i2c_bus_count || \
+	    _gpio_5v0_count != _i2c_bus_count) {
+		ccard_err("%u cards need %u gpio_3v3 and gpio_5v0 each\n", \
+		       _i2c_bus_count, _i2c_bus_count);
+		return 1;
+	}
+
+	for (int i = 0; i < _i2c_bus_count; i++) {
+		u8 on_i2c = _card_transport[i] == &ccard_i2c_transport;
+		if (on_i2c && _i2c_bus[i] < 0) {
+			ccard_err("i2c_bus %i doesn't exist\n", _i2c_bus[i]);
+			return 1;
+		}
+		if (!gpio_is_valid(_gpio_3v3[i]) || \
+		    !gpio_is_valid(_gpio_5v0[i]) || \
+		    _gpio_3v3[i] == _gpio_5v0[i]) {
+			ccard_err("rail gpios %i and %i can't be used\n", \
+			       _gpio_3v3[i], _gpio_5v0[i]);
+			return 1;
+		}
+
+		for (int j = 0; j < i; j++) {
+			if (on_i2c && _card_transport[j] == &ccard_i2c_transport && \
+			    _i2c_bus[i] == _i2c_bus[j]) {
+				ccard_err("cards %i and %i are both on " \
+				       "i2c bus %i\n", j, i, _i2c_bus[i]);
+				return 1;
+			}
+			if (_gpio_3v3[i] == _gpio_3v3[j] || \
+			    _gpio_3v3[i] == _gpio_5v0[j] || \
+			    _gpio_5v0[i] == _gpio_3v3[j] || \
+			    _gpio_5v0[i] == _gpio_5v0[j]) {
+				ccard_err("cards %i and %i share a rail " \
+				       "gpio\n", j, i);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// validates the module parameters and builds everything derived from them
+// must run before anything touches the hardware
+s8 ccard_init_board()
+{
+	s8 bad = 0;
+	bad |= check_pins("dsa_res_out", _pins.dsa_res_out, \
+			  _dsa_res_out_count, CCARD_DSA_COUNT, 0);
+	bad |= check_pins("dsa_dep_out", _pins.dsa_dep_out, \
+			  _dsa_dep_out_count, CCARD_DSA_COUNT, 0);
+	bad |= check_pins("dsa_res_in", _pins.dsa_res_in, \
+			  _dsa_res_in_count, CCARD_DSA_COUNT, 1);
+	bad |= check_pins("dsa_dep_in", _pins.dsa_dep_in, \
+			  _dsa_dep_in_count, CCARD_DSA_COUNT, 1);
+	bad |= check_pins("mt_forward", _pins.mt_forward, \
+			  _mt_forward_count, CCARD_MT_COUNT, 0);
+	bad |= check_pins("mt_reverse", _pins.mt_reverse, \
+			  _mt_reverse_count, CCARD_MT_COUNT, 0);
+	// the output checks shift by the pins, so they only run on pins that
+	//   passed the range checks
+	if (!bad) {
+		bad |= check_outputs("dsa", _pins.dsa_res_out, \
+				     _pins.dsa_dep_out, CCARD_DSA_COUNT);
+		bad |= check_outputs("magnetorquer", _pins.mt_forward, \
+				     _pins.mt_reverse, CCARD_MT_COUNT);
+	}
+
+	bad |= check_addr("dsa_addr", _dsa_addr);
+	bad |= check_addr("mt_addr", _mt_addr);
+	bad |= check_addr("dac_addr", _thruster_dac_addr);
+
+	// the bus checks depend on the transports
+	bad |= check_transports() || check_cards();
+
+	if (bad)
+		return 1;
+
+	ccard_build_decode(&_pins, &_decode);
+
+	return 0;
+}
+
+u8 ccard_board_cards()
+{
+	return _i2c_bus_count;
+}
+
+const struct ccard_transport *ccard_board_transport(u8 card)
+{
+	return _card_transport[card];
+}
+
+void ccard_dev_name(struct ccard *card, char *buf, size_t size, \
+		    const char *fmt, ...)
+{
+	va_list args;
+	size_t len = 0;
+
+	if (card->index)
+		len = scnprintf(buf, size, "card%u-", card->index);
+
+	va_start(args, fmt);
+	vscnprintf(buf + len, size - len, fmt, args);
+	va_end(args);
+}
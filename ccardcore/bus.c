@@ -0,0 +1,1095 @@
+// implementation of the bus of each card
+// every register read and write the actuators make goes through here to
+//   the transport of the card, which does the actual transfer
+// the transports are picked per card by the transport module parameter:
+//   i2c for IRVINE02, usb for the bridge of IRVINE03, and mock, which
+//   keeps the registers in memory for running the driver without a card
+// the statistics, circuit breakers and register cache sit above the
+//   transport, so they work the same on every board
+// the bus of a card is handed out by priority rather than in the order it
+//   was asked for: a waiting actuator command always goes ahead of waiting
+//   housekeeping, except that after housekeeping_share - 1 commands in a
+//   row housekeeping gets the next turn, so state reads keep at least one
+//   turn in housekeeping_share while commands pile up
+// a transaction that is under way is never cut short, so the worst a
+//   command waits is the longest transaction in front of it plus the
+//   housekeeping turns it owes, and the stats file reports what it was
+//
+// by Mark Hill
+
+#include<linux/kernel.h>
+#include<linux/types.h>
+#include<linux/ktime.h>
+#include<linux/spinlock.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/string.h>
+#include<linux/err.h>
+#include<linux/workqueue.h>
+#include<linux/wait.h>
+#include<linux/math64.h>
+#include<linux/slab.h>
+
+#include "ccard.h"
+#include "ccard_trace.h"
+
+// the transports a card can use, looked up by name
+static const struct ccard_transport *_transports[] = {
+	&ccard_i2c_transport,
+	&ccard_mock_transport,
+	&ccard_usb_transport,
+};
+// 1 once ccard_init_transports set them all up
+static u8 _transports_up;
+
+// what each device is and brings up
+static const struct {
+	const char *name;
+	// the name the device is announced with
+	const char *desc;
+	s8 (*init)(struct ccard *card);
+	void (*cleanup)(struct ccard *card);
+} _dev_types[CCARD_DEV_COUNT] = {
+	{"dsa_expdr", "dsa controller", init_dsa, cleanup_dsa},
+	{"mt_expdr", "magnetorquer controller", init_mt, cleanup_mt},
+	{"thruster_dac", "thruster dac", init_thruster, cleanup_thruster},
+};
+
+// bus statistics, used by the benchmarks to work out the bus cost of each
+//   sysfs operation and how much the actuators fight over the bus
+struct bus_stats {
+	u64 reads;
+	u64 writes;
+	u64 errors;
+	// times the lock was taken, and how many of those had to wait
+	u64 locks;
+	u64 contended;
+	u64 wait_ns;
+	u64 wait_max_ns;
+	u64 hold_ns;
+	// the same split by enum ccard_bus_class
+	struct {
+		u64 locks;
+		u64 contended;
+		u64 wait_ns;
+		u64 wait_max_ns;
+	} cls[CCARD_BUS_CLASSES];
+};
+
+// default share of the turns housekeeping gets while commands wait, one in
+//   this many
+#define ccard_dfl_housekeeping_share 4
+
+// hands the bus of a card to one user at a time by priority
+// a user that finds the bus busy waits in its class, and whoever gives the
+//   bus back hands it straight to the class whose turn it is, so a user
+//   arriving in between can't take it from under the waiters
+struct bus_arbiter {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	// 1 while the bus is held or has been handed to a waiter
+	u8 busy;
+	// users waiting in each class, and turns handed to a class that one of
+	//   its waiters has yet to take
+	u32 waiting[CCARD_BUS_CLASSES];
+	u32 handoff[CCARD_BUS_CLASSES];
+	// commands in a row that went ahead of waiting housekeeping
+	u32 streak;
+	u32 share;
+	// turns a command took ahead of waiting housekeeping, and turns
+	//   housekeeping got over waiting commands through its share
+	u64 preemptions;
+	u64 share_grants;
+};
+
+// circuit breaker states for a device on the bus
+// a closed breaker lets transactions through, an open one fails them
+//   without touching the bus, and a half open one is being probed
+enum breaker_state {
+	breaker_closed,
+	breaker_open,
+	breaker_half_open,
+};
+
+// consecutive errors that open a device's breaker
+#define ccard_breaker_dfl_threshold 3
+// time before the first probe of an open breaker, doubled after every
+//   failed probe up to the maximum
+#define ccard_breaker_min_backoff 100
+#define ccard_breaker_max_backoff 30000
+
+// health of one device on the bus, protected by the health lock of its card
+// the registers last written to a device, written again after the 5v0
+//   rail was down and the device lost them
+// kept in register order, so the expander output registers are written
+//   before the configuration register turns the pins into outputs
+#define REG_CACHE_SIZE 4
+struct reg_cache {
+	u8 count;
+	// the dac has no registers, so only its last write is kept
+	u8 size;
+	u8 reg[REG_CACHE_SIZE];
+	u8 val[REG_CACHE_SIZE];
+};
+
+struct dev_health {
+	struct ccard_dev *dev;
+	enum breaker_state state;
+	u32 consecutive;
+	u64 errors;
+	u32 trips;
+	u32 recoveries;
+	// ms until the next probe while the breaker is open
+	u32 backoff;
+	// time of the last state change
+	ktime_t changed;
+	struct delayed_work probe_work;
+	// protected by the bus lock, like the writes that fill it
+	struct reg_cache cache;
+};
+
+// the bus of one card
+struct card_bus {
+	struct bus_stats stats;
+	spinlock_t stats_lock;
+	// in enum ccard_dev_id order
+	struct dev_health health[CCARD_DEV_COUNT];
+	spinlock_t health_lock;
+	u32 breaker_threshold;
+	struct bus_arbiter arb;
+	// the bus device in the c card class
+	struct device *device;
+};
+
+static void probe_dev_health(struct work_struct *work);
+
+static inline void create_bus_device(struct ccard *card);
+static inline void remove_bus_device(struct ccard *card);
+
+static ssize_t read_bus_stats(struct device *dev, \
+			      struct device_attribute *attr, char *buf);
+static ssize_t write_bus_stats(struct device *dev, \
+			       struct device_attribute *attr, \
+			       const char *buf, size_t count);
+// the b-dot executor already owns dev_attr_stats
+static struct device_attribute dev_attr_bus_stats = \
+	__ATTR(stats, S_IRUSR | S_IWUSR, read_bus_stats, write_bus_stats);
+static ssize_t read_bus_health(struct device *dev, \
+			       struct device_attribute *attr, char *buf);
+static ssize_t read_breaker_threshold(struct device *dev, \
+				      struct device_attribute *attr, char *buf);
+static ssize_t write_breaker_threshold(struct device *dev, \
+				       struct device_attribute *attr, \
+				       const char *buf, size_t count);
+static ssize_t read_bus_transport(struct device *dev, \
+				  struct device_attribute *attr, char *buf);
+static ssize_t read_housekeeping_share(struct device *dev, \
+				       struct device_attribute *attr, char *buf);
+static ssize_t write_housekeeping_share(struct device *dev, \
+					struct device_attribute *attr, \
+					const char *buf, size_t count);
+static DEVICE_ATTR(health, S_IRUSR, read_bus_health, NULL);
+static DEVICE_ATTR(breaker_threshold, S_IRUSR | S_IWUSR, \
+		   read_breaker_threshold, write_breaker_threshold);
+static DEVICE_ATTR(transport, S_IRUSR, read_bus_transport, NULL);
+static DEVICE_ATTR(housekeeping_share, S_IRUSR | S_IWUSR, \
+		   read_housekeeping_share, write_housekeeping_share);
+
+const struct ccard_transport *ccard_find_transport(const char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(_transports); i++) {
+		if (!strcmp(_transports[i]->name, name))
+			return _transports[i];
+	}
+
+	return NULL;
+}
+
+const char *ccard_dev_type(enum ccard_dev_id id)
+{
+	return _dev_types[id].name;
+}
+
+s8 ccard_init_transports()
+{
+	for (int i = 0; i < ARRAY_SIZE(_transports); i++) {
+		if (_transports[i]->init == NULL || !_transports[i]->init())
+			continue;
+
+		// the ones already set up are undone here, so a failure leaves
+		//   nothing for ccard_cleanup_transports
+		ccard_err("failed to set up the %s transport\n", \
+				_transports[i]->name);
+		while (--i >= 0) {
+			if (_transports[i]->cleanup != NULL)
+				_transports[i]->cleanup();
+		}
+		return 1;
+	}
+
+	_transports_up = 1;
+	return 0;
+}
+
+void ccard_cleanup_transports()
+{
+	if (!_transports_up)
+		return;
+
+	_transports_up = 0;
+	for (int i = ARRAY_SIZE(_transports) - 1; i >= 0; i--) {
+		if (_transports[i]->cleanup != NULL)
+			_transports[i]->cleanup();
+	}
+}
+
+s8 ccard_init_bus(struct ccard *card)
+{
+	const struct ccard_transport *t = ccard_board_transport(card->index);
+
+	struct card_bus *b = kzalloc(sizeof(struct card_bus), GFP_KERNEL);
+	if (b == NULL)
+		return 1;
+	spin_lock_init(&b->stats_lock);
+	spin_lock_init(&b->health_lock);
+	b->breaker_threshold = ccard_breaker_dfl_threshold;
+	spin_lock_init(&b->arb.lock);
+	init_waitqueue_head(&b->arb.wait);
+	b->arb.share = ccard_dfl_housekeeping_share;
+
+	unsigned short addrs[] = {_dsa_addr, _mt_addr, _thruster_dac_addr};
+	for (int i = 0; i < CCARD_DEV_COUNT; i++) {
+		struct ccard_dev *dev = &card->devs[i];
+		memset(dev, 0, sizeof(*dev));
+		dev->card = card;
+		dev->id = i;
+		dev->addr = addrs[i];
+
+		b->health[i].dev = dev;
+		INIT_DELAYED_WORK(&b->health[i].probe_work, probe_dev_health);
+		b->health[i].changed = ktime_get();
+		b->health[i].cache.size = (i == CCARD_DEV_DAC) ? \
+					  1 : REG_CACHE_SIZE;
+	}
+
+	card->transport = t;
+	card->bus = b;
+
+	// the devices are brought up as the transport binds them, which needs
+	//   the bus in place
+	if (t->attach(card)) {
+		ccard_err("couldn't attach c card %u over %s\n", \
+				card->index, t->name);
+		card->transport = NULL;
+		card->bus = NULL;
+		kfree(b);
+		return 1;
+	}
+
+	create_bus_device(card);
+
+	ccard_notice("c card %u attached over %s\n", card->index, t->name);
+
+	return 0;
+}
+
+void ccard_cleanup_bus(struct ccard *card)
+{
+	struct card_bus *b = card->bus;
+	if (b == NULL)
+		return;
+
+	ccard_notice("detaching c card %u\n", card->index);
+	remove_bus_device(card);
+	// a probe can't be left running against a device that is going away
+	for (int i = 0; i < ARRAY_SIZE(b->health); i++)
+		cancel_delayed_work_sync(&b->health[i].probe_work);
+	// the devices are unbound as the transport lets go of them
+	card->transport->detach(card);
+
+	card->transport = NULL;
+	card->bus = NULL;
+	kfree(b);
+}
+
+void ccard_dev_bound(struct ccard_dev *dev, struct device *parent, \
+		     void *priv)
+{
+	struct ccard *card = dev->card;
+
+	ccard_notice("found %s on card %u\n", _dev_types[dev->id].desc, \
+			card->index);
+	dev->parent = parent;
+	dev->priv = priv;
+	dev->bound = 1;
+	// the device stays bound even if the card isn't answering yet, the
+	//   presence monitor brings it up once it does
+	if (_dev_types[dev->id].init(card))
+		ccard_warn("%s not answering\n", \
+				_dev_types[dev->id].desc);
+}
+
+void ccard_dev_unbound(struct ccard_dev *dev)
+{
+	if (!dev->bound)
+		return;
+
+	ccard_notice("removing %s from card %u\n", \
+			_dev_types[dev->id].desc, dev->card->index);
+	_dev_types[dev->id].cleanup(dev->card);
+	dev->bound = 0;
+	dev->parent = NULL;
+	dev->priv = NULL;
+}
+
+
+// takes the turn handed to <cls>, if there is one
+static inline int take_handoff(struct bus_arbiter *arb, \
+			       enum ccard_bus_class cls)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&arb->lock, flags);
+	int taken = arb->handoff[cls] > 0;
+	if (taken)
+		arb->handoff[cls]--;
+	spin_unlock_irqrestore(&arb->lock, flags);
+
+	return taken;
+}
+
+// gives the bus back, handing it to the class whose turn it is next
+static void give_bus(struct bus_arbiter *arb)
+{
+	u32 *waiting = arb->waiting;
+	int next = -1;
+	unsigned long flags;
+
+	spin_lock_irqsave(&arb->lock, flags);
+	if (waiting[CCARD_BUS_COMMAND] && \
+	    (!waiting[CCARD_BUS_HOUSEKEEPING] || arb->streak + 1 < arb->share)) {
+		next = CCARD_BUS_COMMAND;
+		if (waiting[CCARD_BUS_HOUSEKEEPING]) {
+			arb->streak++;
+			arb->preemptions++;
+		} else {
+			arb->streak = 0;
+		}
+	} else if (waiting[CCARD_BUS_HOUSEKEEPING]) {
+		next = CCARD_BUS_HOUSEKEEPING;
+		if (waiting[CCARD_BUS_COMMAND])
+			arb->share_grants++;
+		arb->streak = 0;
+	}
+
+	if (next < 0) {
+		arb->busy = 0;
+	} else {
+		waiting[next]--;
+		arb->handoff[next]++;
+	}
+	spin_unlock_irqrestore(&arb->lock, flags);
+
+	if (next >= 0)
+		wake_up_all(&arb->wait);
+}
+
+// waits for the turn of a <cls> user of the bus
+// <queued> is set if the bus was busy
+// returns 0 once the bus is held, or -ERESTARTSYS if a signal came first
+static int take_bus(struct bus_arbiter *arb, enum ccard_bus_class cls, \
+		    u8 *queued)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&arb->lock, flags);
+	*queued = arb->busy;
+	if (!arb->busy) {
+		arb->busy = 1;
+		spin_unlock_irqrestore(&arb->lock, flags);
+		return 0;
+	}
+	arb->waiting[cls]++;
+	spin_unlock_irqrestore(&arb->lock, flags);
+
+	if (wait_event_interruptible(arb->wait, take_handoff(arb, cls)) == 0)
+		return 0;
+
+	// the turn may have been handed over while the signal arrived, and
+	//   it would be lost with nobody left to give the bus back
+	if (take_handoff(arb, cls)) {
+		give_bus(arb);
+	} else {
+		spin_lock_irqsave(&arb->lock, flags);
+		arb->waiting[cls]--;
+		spin_unlock_irqrestore(&arb->lock, flags);
+	}
+	return -ERESTARTSYS;
+}
+
+// takes the turn of a <cls> user and then the transport lock
+// <contended> is set if either had to be waited for
+static int acquire_bus(struct ccard *card, enum ccard_bus_class cls, \
+		       u8 *contended)
+{
+	struct bus_arbiter *arb = &card->bus->arb;
+	const struct ccard_transport *t = card->transport;
+
+	int ret = take_bus(arb, cls, contended);
+	if (ret)
+		return ret;
+
+	// nothing else in the driver takes the transport lock without a turn,
+	//   so it only waits when something outside the driver holds it, like
+	//   another driver on the same i2c adapter
+	ret = t->lock(card, 0);
+	if (ret == -EBUSY) {
+		*contended = 1;
+		ret = t->lock(card, 1);
+	}
+	if (ret)
+		give_bus(arb);
+	return ret;
+}
+
+// locks the bus of <card> for a <cls> user
+int ccard_lock_bus(struct ccard *card, enum ccard_bus_class cls)
+{
+	ktime_t start = ktime_get();
+	u8 contended = 0;
+	int ret = acquire_bus(card, cls, &contended);
+	ktime_t now = ktime_get();
+	s64 wait = ktime_to_ns(ktime_sub(now, start));
+	trace_ccard_bus_lock(wait, ret);
+	if (ret) {
+		ccard_log_record(card, CCARD_LOG_BUS_LOCK, cls, -ret);
+		return ret;
+	}
+
+	card->bus_locked_at = now;
+
+	// the devices only answer while the 5v0 rail is up, but a sleeping
+	//   card is only woken for a command, housekeeping reads are answered
+	//   from the register cache and a write wakes it when it gets there
+	if (cls == CCARD_BUS_COMMAND)
+		ccard_power_wake(card);
+
+	struct card_bus *b = card->bus;
+	unsigned long flags;
+	spin_lock_irqsave(&b->stats_lock, flags);
+	b->stats.locks++;
+	b->stats.cls[cls].locks++;
+	if (contended) {
+		b->stats.contended++;
+		b->stats.wait_ns += wait;
+		if (wait > b->stats.wait_max_ns)
+			b->stats.wait_max_ns = wait;
+		b->stats.cls[cls].contended++;
+		b->stats.cls[cls].wait_ns += wait;
+		if (wait > b->stats.cls[cls].wait_max_ns)
+			b->stats.cls[cls].wait_max_ns = wait;
+	}
+	spin_unlock_irqrestore(&b->stats_lock, flags);
+
+	return 0;
+}
+
+// unlocks the bus of <card>
+void ccard_unlock_bus(struct ccard *card)
+{
+	s64 held = ktime_to_ns(ktime_sub(ktime_get(), card->bus_locked_at));
+	trace_ccard_bus_unlock(held);
+
+	struct card_bus *b = card->bus;
+	unsigned long flags;
+	spin_lock_irqsave(&b->stats_lock, flags);
+	b->stats.hold_ns += held;
+	spin_unlock_irqrestore(&b->stats_lock, flags);
+
+	card->transport->unlock(card);
+	give_bus(&b->arb);
+}
+
+int ccard_hold_bus(struct ccard *card)
+{
+	u8 contended;
+	if (card->transport == NULL)
+		return -ENODEV;
+
+	return acquire_bus(card, CCARD_BUS_HOUSEKEEPING, &contended);
+}
+
+void ccard_release_bus(struct ccard *card)
+{
+	card->transport->unlock(card);
+	give_bus(&card->bus->arb);
+}
+
+// counts one transaction on the bus of <card> in the bus statistics
+static inline void count_bus_transaction(struct ccard *card, u8 write, int ret)
+{
+	struct card_bus *b = card->bus;
+	unsigned long flags;
+	spin_lock_irqsave(&b->stats_lock, flags);
+	if (write)
+		b->stats.writes++;
+	else
+		b->stats.reads++;
+	if (ret)
+		b->stats.errors++;
+	spin_unlock_irqrestore(&b->stats_lock, flags);
+
+	ccard_status_bus(card, write, ret);
+}
+
+// returns the health record of <dev>
+static inline struct dev_health *dev_health(struct ccard_dev *dev)
+{
+	struct ccard *card = dev->card;
+	if (card->bus == NULL)
+		return NULL;
+
+	return &card->bus->health[dev->id];
+}
+
+static const char *breaker_name(enum breaker_state state)
+{
+	switch (state) {
+	case breaker_open:
+		return "open";
+	case breaker_half_open:
+		return "half_open";
+	default:
+		return "closed";
+	}
+}
+
+// moves <health> to <state>, must be called with the health lock held
+static void set_breaker(struct dev_health *health, enum breaker_state state)
+{
+	if (health->state == state)
+		return;
+
+	// a device that stays away flaps between open and half open with
+	//   every probe, so the text is only in the verbose builds
+	ccard_info("%s breaker %s -> %s\n", \
+			_dev_types[health->dev->id].name, \
+			breaker_name(health->state), breaker_name(state));
+	ccard_log_record(health->dev->card, CCARD_LOG_BREAKER, \
+			 health->dev->id, state);
+	health->state = state;
+	health->changed = ktime_get();
+}
+
+// opens the breaker of <health> and schedules a probe after the backoff
+// must be called with the health lock held
+static void open_breaker(struct dev_health *health)
+{
+	set_breaker(health, breaker_open);
+	schedule_delayed_work(&health->probe_work, \
+			      msecs_to_jiffies(health->backoff));
+}
+
+// returns 0 if a transaction with <health> may use the bus
+static inline int breaker_blocks(struct dev_health *health)
+{
+	if (health == NULL)
+		return 0;
+
+	spinlock_t *lock = &health->dev->card->bus->health_lock;
+	unsigned long flags;
+	spin_lock_irqsave(lock, flags);
+	int blocked = health->state != breaker_closed;
+	spin_unlock_irqrestore(lock, flags);
+
+	return blocked;
+}
+
+// records the result of a transaction with <health>, opening its breaker
+//   after too many consecutive errors
+static inline void report_health(struct dev_health *health, int ret)
+{
+	if (health == NULL)
+		return;
+
+	struct card_bus *b = health->dev->card->bus;
+	unsigned long flags;
+	spin_lock_irqsave(&b->health_lock, flags);
+	if (ret == 0) {
+		health->consecutive = 0;
+	} else {
+		health->errors++;
+		if (++health->consecutive >= b->breaker_threshold && \
+		    health->state == breaker_closed) {
+			health->trips++;
+			health->backoff = ccard_breaker_min_backoff;
+			open_breaker(health);
+		}
+	}
+	spin_unlock_irqrestore(&b->health_lock, flags);
+}
+
+// probes a device whose breaker is open with a single byte read
+// success closes the breaker, failure doubles the time to the next probe
+static void probe_dev_health(struct work_struct *work)
+{
+	struct dev_health *health = container_of(work, struct dev_health, \
+						 probe_work.work);
+	struct ccard *card = health->dev->card;
+	spinlock_t *lock = &card->bus->health_lock;
+	unsigned long flags;
+
+	// a sleeping card can't answer, and waking it for a probe would keep
+	//   it from ever staying asleep, so the probe waits out another backoff
+	if (!ccard_power_awake(card)) {
+		spin_lock_irqsave(lock, flags);
+		open_breaker(health);
+		spin_unlock_irqrestore(lock, flags);
+		return;
+	}
+
+	spin_lock_irqsave(lock, flags);
+	set_breaker(health, breaker_half_open);
+	spin_unlock_irqrestore(lock, flags);
+
+	int ret = ccard_probe_dev(health->dev) ? 0 : -EIO;
+
+	spin_lock_irqsave(lock, flags);
+	if (ret == 0) {
+		health->consecutive = 0;
+		health->backoff = 0;
+		health->recoveries++;
+		set_breaker(health, breaker_closed);
+	} else {
+		health->errors++;
+		health->backoff = min_t(u32, health->backoff * 2, \
+					ccard_breaker_max_backoff);
+		open_breaker(health);
+	}
+	spin_unlock_irqrestore(lock, flags);
+}
+
+// called by the presence monitor when <dev> starts or stops answering
+// a device that went away has its breaker held open without probing, since
+//   the monitor is already watching for it to come back, and one that came
+//   back starts over with a closed breaker
+void ccard_set_dev_present(struct ccard_dev *dev, u8 present)
+{
+	struct dev_health *health = dev_health(dev);
+	if (health == NULL || !dev->bound)
+		return;
+
+	spinlock_t *lock = &dev->card->bus->health_lock;
+	unsigned long flags;
+	spin_lock_irqsave(lock, flags);
+	cancel_delayed_work(&health->probe_work);
+	if (present) {
+		health->consecutive = 0;
+		health->backoff = 0;
+		set_breaker(health, breaker_closed);
+	} else {
+		set_breaker(health, breaker_open);
+	}
+	spin_unlock_irqrestore(lock, flags);
+}
+
+// answers a read of a sleeping card with what was last written to <reg>,
+//   which for an expander output is what the pins go back to on the wake
+// must be called with the bus locked, like everything that changes the cache
+// returns -EAGAIN for a register that was never written, like an input
+static int read_cached_reg(struct dev_health *health, u8 reg, u8 *val)
+{
+	if (health == NULL)
+		return -EAGAIN;
+
+	struct reg_cache *c = &health->cache;
+	for (int i = 0; i < c->count; i++) {
+		if (c->reg[i] == reg) {
+			*val = c->val[i];
+			return 0;
+		}
+	}
+	return -EAGAIN;
+}
+
+// the expanders and the dac all take a register number followed by the
+//   data, so every transaction on the card goes through these helpers
+// a device whose breaker is open fails straight away with -ENODEV instead
+//   of making everyone else wait out the transport timeout behind it
+int ccard_read_reg(struct ccard_dev *dev, u8 reg, u8 *val)
+{
+	struct dev_health *health = dev_health(dev);
+	if (breaker_blocks(health))
+		return -ENODEV;
+	if (!ccard_power_awake(dev->card))
+		return read_cached_reg(health, reg, val);
+
+	ktime_t start = ktime_get();
+	int ret = dev->card->transport->read_reg(dev, reg, val);
+	trace_ccard_reg_read(dev->addr, reg, ret ? 0 : *val, \
+			     ktime_to_ns(ktime_sub(ktime_get(), start)), ret);
+	count_bus_transaction(dev->card, 0, ret);
+	if (ret)
+		ccard_log_record(dev->card, CCARD_LOG_REG_ERROR, \
+				 dev->id << 8 | reg, -ret);
+	report_health(health, ret);
+	return ret;
+}
+
+// remembers that <val> was written to <reg>
+static inline void cache_reg(struct reg_cache *c, u8 reg, u8 val)
+{
+	if (c->size == 1) {
+		c->reg[0] = reg;
+		c->val[0] = val;
+		c->count = 1;
+		return;
+	}
+
+	u8 i = 0;
+	while (i < c->count && c->reg[i] < reg)
+		i++;
+	if (i < c->count && c->reg[i] == reg) {
+		c->val[i] = val;
+		return;
+	} else if (c->count == c->size) {
+		ccard_warn_rl("no room to cache register %x\n", reg);
+		return;
+	}
+
+	memmove(&c->reg[i + 1], &c->reg[i], c->count - i);
+	memmove(&c->val[i + 1], &c->val[i], c->count - i);
+	c->reg[i] = reg;
+	c->val[i] = val;
+	c->count++;
+}
+
+// accounts for <count> writes to <dev> that took from <start> and returned
+//   <ret>
+// <restore> is set for the writes that put the registers back after a wake,
+//   which nobody asked for, so they are neither recorded nor count as use
+//   of the card
+static void finish_writes(struct ccard_dev *dev, const u8 *regs, \
+			  const u8 *vals, u8 count, int ret, ktime_t start, \
+			  u8 restore)
+{
+	struct ccard *card = dev->card;
+	struct dev_health *health = dev_health(dev);
+	s64 latency = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	for (int i = 0; i < count; i++) {
+		trace_ccard_reg_write(dev->addr, regs[i], vals[i], latency, ret);
+		if (!restore)
+			ccard_record_reg(card, dev->addr, regs[i], vals[i], ret, \
+					 start);
+		count_bus_transaction(card, 1, ret);
+		if (ret == 0 && health != NULL)
+			cache_reg(&health->cache, regs[i], vals[i]);
+	}
+	// a burst fails as a whole, so it is logged against its first register
+	if (ret)
+		ccard_log_record(card, CCARD_LOG_REG_ERROR, \
+				 dev->id << 8 | regs[0], -ret);
+	report_health(health, ret);
+	if (ret == 0 && !restore)
+		ccard_power_used(card);
+}
+
+// writes <count> registers of <dev> in one burst where the transport has
+//   them, without waking the card, <restore> as for finish_writes
+static int write_regs(struct ccard_dev *dev, const u8 *regs, const u8 *vals, \
+		      u8 count, u8 restore)
+{
+	const struct ccard_transport *t = dev->card->transport;
+
+	if (breaker_blocks(dev_health(dev))) {
+		for (int i = 0; i < count && !restore; i++)
+			ccard_record_reg(dev->card, dev->addr, regs[i], vals[i], \
+					 -ENODEV, ktime_get());
+		return -ENODEV;
+	}
+
+	if (t->burst != NULL) {
+		ktime_t start = ktime_get();
+		int ret = t->burst(dev, regs, vals, count);
+		finish_writes(dev, regs, vals, count, ret, start, restore);
+		return ret;
+	}
+
+	for (int i = 0; i < count; i++) {
+		ktime_t start = ktime_get();
+		int ret = t->write_reg(dev, regs[i], vals[i]);
+		finish_writes(dev, &regs[i], &vals[i], 1, ret, start, restore);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+int ccard_write_reg(struct ccard_dev *dev, u8 reg, u8 val)
+{
+	return ccard_write_regs(dev, &reg, &val, 1);
+}
+
+int ccard_write_regs(struct ccard_dev *dev, const u8 *regs, const u8 *vals, \
+		     u8 count)
+{
+	// a housekeeping user that writes, like the setup of a device, finds
+	//   the card asleep, and the devices need the rail for any write
+	if (!ccard_power_awake(dev->card))
+		ccard_power_wake(dev->card);
+
+	return write_regs(dev, regs, vals, count, 0);
+}
+
+u8 ccard_probe_dev(struct ccard_dev *dev)
+{
+	struct ccard *card = dev->card;
+	if (!dev->bound || ccard_lock_bus(card, CCARD_BUS_HOUSEKEEPING))
+		return 0;
+	int ret = card->transport->probe(dev);
+	count_bus_transaction(card, 0, ret);
+	ccard_unlock_bus(card);
+
+	return ret == 0;
+}
+
+int ccard_restore_regs(struct ccard *card)
+{
+	int failed = 0;
+	if (card->bus == NULL)
+		return 0;
+
+	for (int i = 0; i < ARRAY_SIZE(card->bus->health); i++) {
+		struct dev_health *health = &card->bus->health[i];
+		if (!health->dev->bound)
+			continue;
+
+		// the cache is rewritten with the same values as it goes, all of
+		//   a device's registers in one transfer
+		struct reg_cache c = health->cache;
+		failed += write_regs(health->dev, c.reg, c.val, c.count, 1) != 0;
+	}
+
+	return failed;
+}
+
+static inline struct ccard_dev *bound_dev(struct ccard *card, \
+					  enum ccard_dev_id id)
+{
+	return card->devs[id].bound ? &card->devs[id] : NULL;
+}
+
+// returns the magnetorquer GPIO expdr
+struct ccard_dev *mt_expdr(struct ccard *card)
+{
+	return bound_dev(card, CCARD_DEV_MT);
+}
+
+// returns the dsa GPIO expdr
+struct ccard_dev *dsa_expdr(struct ccard *card)
+{
+	return bound_dev(card, CCARD_DEV_DSA);
+}
+
+// returns the DAC controlling the thruster
+struct ccard_dev *thruster_dac(struct ccard *card)
+{
+	return bound_dev(card, CCARD_DEV_DAC);
+}
+
+
+
+//
+// sysfs section
+//
+
+// prints one "name value" pair per line so that scripts can pick out the
+//   counters they need without caring about the order
+static ssize_t read_bus_stats(struct device *dev, \
+			      struct device_attribute *attr, char *buf)
+{
+	struct card_bus *b = ((struct ccard *)dev_get_drvdata(dev))->bus;
+	struct bus_stats stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&b->stats_lock, flags);
+	stats = b->stats;
+	spin_unlock_irqrestore(&b->stats_lock, flags);
+	spin_lock_irqsave(&b->arb.lock, flags);
+	u64 preemptions = b->arb.preemptions;
+	u64 share_grants = b->arb.share_grants;
+	spin_unlock_irqrestore(&b->arb.lock, flags);
+
+	ssize_t len = scnprintf(buf, PAGE_SIZE, "reads %llu\nwrites %llu\n" \
+				"errors %llu\nlocks %llu\ncontended %llu\n" \
+				"wait_ns %llu\nwait_max_ns %llu\nhold_ns %llu\n", \
+				stats.reads, stats.writes, stats.errors, \
+				stats.locks, stats.contended, stats.wait_ns, \
+				stats.wait_max_ns, stats.hold_ns);
+	// the same for each class, cmd_wait_max_ns is the worst a command
+	//   waited for the bus since the last reset
+	const char *prefix[] = {"cmd", "hk"};
+	for (int i = 0; i < CCARD_BUS_CLASSES; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s_locks %llu\n" \
+				 "%s_contended %llu\n%s_wait_ns %llu\n" \
+				 "%s_wait_max_ns %llu\n", prefix[i], \
+				 stats.cls[i].locks, prefix[i], \
+				 stats.cls[i].contended, prefix[i], \
+				 stats.cls[i].wait_ns, prefix[i], \
+				 stats.cls[i].wait_max_ns);
+	return len + scnprintf(buf + len, PAGE_SIZE - len, \
+			       "preemptions %llu\nshare_grants %llu\n", \
+			       preemptions, share_grants);
+}
+
+// writing "reset" clears the statistics
+static ssize_t write_bus_stats(struct device *dev, \
+			       struct device_attribute *attr, \
+			       const char *buf, size_t count)
+{
+	struct card_bus *b = ((struct ccard *)dev_get_drvdata(dev))->bus;
+	unsigned long flags;
+
+	if (strcmp(buf, "reset\n") && strcmp(buf, "reset")) {
+		ccard_warn_rl("%s is an invalid bus stats command\n", buf);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&b->stats_lock, flags);
+	memset(&b->stats, 0, sizeof(b->stats));
+	spin_unlock_irqrestore(&b->stats_lock, flags);
+	spin_lock_irqsave(&b->arb.lock, flags);
+	b->arb.preemptions = 0;
+	b->arb.share_grants = 0;
+	spin_unlock_irqrestore(&b->arb.lock, flags);
+
+	return count;
+}
+
+// prints one line per device with its breaker state and error counts
+static ssize_t read_bus_health(struct device *dev, \
+			       struct device_attribute *attr, char *buf)
+{
+	struct card_bus *b = ((struct ccard *)dev_get_drvdata(dev))->bus;
+	ssize_t len = 0;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&b->health_lock, flags);
+	for (int i = 0; i < ARRAY_SIZE(b->health); i++) {
+		struct dev_health *health = &b->health[i];
+		s64 since = ktime_to_ns(ktime_sub(now, health->changed));
+		len += scnprintf(buf + len, PAGE_SIZE - len, \
+				 "%s [%s] consecutive %u errors %llu trips %u " \
+				 "recoveries %u backoff_ms %u since_ms %lli\n", \
+				 _dev_types[i].name, breaker_name(health->state), \
+				 health->consecutive, health->errors, \
+				 health->trips, health->recoveries, \
+				 health->backoff, div_s64(since, NSEC_PER_MSEC));
+	}
+	spin_unlock_irqrestore(&b->health_lock, flags);
+
+	return len;
+}
+
+static ssize_t read_breaker_threshold(struct device *dev, \
+				      struct device_attribute *attr, char *buf)
+{
+	struct card_bus *b = ((struct ccard *)dev_get_drvdata(dev))->bus;
+	return scnprintf(buf, 20, "%u\n", b->breaker_threshold);
+}
+
+static ssize_t write_breaker_threshold(struct device *dev, \
+				       struct device_attribute *attr, \
+				       const char *buf, size_t count)
+{
+	struct card_bus *b = ((struct ccard *)dev_get_drvdata(dev))->bus;
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value) || value == 0) {
+		ccard_warn_rl("%s is an invalid breaker threshold\n", buf);
+		return -EINVAL;
+	}
+
+	b->breaker_threshold = value;
+	return count;
+}
+
+static ssize_t read_housekeeping_share(struct device *dev, \
+				       struct device_attribute *attr, char *buf)
+{
+	struct card_bus *b = ((struct ccard *)dev_get_drvdata(dev))->bus;
+	return scnprintf(buf, 20, "%u\n", b->arb.share);
+}
+
+// housekeeping gets one turn in every <value> while commands wait, so at
+//   least 2 is needed for commands to go first at all
+static ssize_t write_housekeeping_share(struct device *dev, \
+					struct device_attribute *attr, \
+					const char *buf, size_t count)
+{
+	struct card_bus *b = ((struct ccard *)dev_get_drvdata(dev))->bus;
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value) || value < 2 || value > 1000) {
+		ccard_warn_rl("%s is an invalid housekeeping share\n", buf);
+		return -EINVAL;
+	}
+
+	unsigned long flags;
+	spin_lock_irqsave(&b->arb.lock, flags);
+	b->arb.share = value;
+	spin_unlock_irqrestore(&b->arb.lock, flags);
+	return count;
+}
+
+// prints the transport and which devices it has bound
+static ssize_t read_bus_transport(struct device *dev, \
+				  struct device_attribute *attr, char *buf)
+{
+	struct ccard *card = dev_get_drvdata(dev);
+	ssize_t len = scnprintf(buf, PAGE_SIZE, "[%s]", card->transport->name);
+
+	for (int i = 0; i < CCARD_DEV_COUNT; i++) {
+		if (card->devs[i].bound)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %s", \
+					 _dev_types[i].name);
+	}
+
+	return len + scnprintf(buf + len, PAGE_SIZE - len, "\n");
+}
+
+static inline void create_bus_device(struct ccard *card)
+{
+	struct card_bus *b = card->bus;
+	char name[32];
+
+	ccard_dev_name(card, name, sizeof(name), "bus");
+	b->device = device_create(ccard_core_class(), NULL, MKDEV(0, 0), \
+				  card, name);
+	if (IS_ERR(b->device)) {
+		ccard_err("couldn't create bus device\n");
+		b->device = NULL;
+		return;
+	}
+
+	if (device_create_file(b->device, &dev_attr_bus_stats) || \
+	    device_create_file(b->device, &dev_attr_health) || \
+	    device_create_file(b->device, &dev_attr_breaker_threshold) || \
+	    device_create_file(b->device, &dev_attr_transport) || \
+	    device_create_file(b->device, &dev_attr_housekeeping_share))
+		ccard_err("couldn't create bus device files\n");
+}
+
+static inline void remove_bus_device(struct ccard *card)
+{
+	struct card_bus *b = card->bus;
+	if (b->device == NULL)
+		return;
+
+	device_remove_file(b->device, &dev_attr_bus_stats);
+	device_remove_file(b->device, &dev_attr_health);
+	device_remove_file(b->device, &dev_attr_breaker_threshold);
+	device_remove_file(b->device, &dev_attr_transport);
+	device_remove_file(b->device, &dev_attr_housekeeping_share);
+	device_unregister(b->device);
+	b->device = NULL;
+}
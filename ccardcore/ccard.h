@@ -1,8 +1,8 @@
 // c card driver header
 // yes, the spi and uart devices are unimplemented
 // I didn't realize the atmel driver controls them currently
-// however, with the move to usb on IRVINE03, it may be necessary to finish
-//   the implementation
+// the devices on the card are reached through a transport, i2c on
+//   IRVINE02 and a usb bridge on IRVINE03, see bus.c
 //
 // by Mark Hill
 
@@ -10,6 +10,9 @@
 #include<linux/i2c.h>
 #include<linux/fs.h>
 #include<linux/device.h>
+#include<linux/mutex.h>
+#include<linux/workqueue.h>
+#include<linux/ktime.h>
 
 #ifndef _cleanheader
 #define _cleanheader
@@ -62,6 +65,14 @@ enum mt_state {
 	transitioning = 0b11 // 3
 };
 
+// enum ccard_actuator and enum ccard_cause live in the netlink header,
+//   since the events carry them to userspace
+#include "ccard_netlink.h"
+// struct ccard_gps_fix is handed to userspace as it is
+#include "ccard_gps.h"
+// every message goes through the ccard_ logging macros
+#include "ccard_log.h"
+
 // structure representing a 3d vector with integer components
 struct ccard_vec3int {
 	s32 x;
@@ -70,32 +81,210 @@ struct ccard_vec3int {
 };
 
 
+// a reference counted power rail switched by a gpio
+// the rail stays on while it has users, and for off_delay ms after the
+//   last user lets go so that back to back operations don't power cycle it
+struct ccard_rail {
+	const char *name;
+	// the card the rail is on
+	struct ccard *card;
+	u8 gpio;
+	// number of users currently holding the rail on
+	u32 users;
+	// level last written to the gpio, 1 = on, 0 = off
+	u8 level;
+	// time in ms to wait after the last user lets go before switching off
+	u32 off_delay;
+	struct delayed_work off_work;
+	struct mutex lock;
+	// time the rail last switched on and the total on time before that
+	ktime_t on_since;
+	u64 on_time_ns;
+	// number of times the gpio was actually switched
+	u32 toggles;
+	// sysfs device for the rail
+	struct device *dev;
+};
+
+// the most c cards one module can drive, one per entry of the i2c_bus
+//   module parameter
+#define CCARD_MAX_CARDS 4
+
+// the parts of a card kept by the individual files, see each of them for
+//   what they hold
+struct card_bus;
+struct card_presence;
+struct card_status;
+struct card_usage;
+struct card_dsa;
+struct card_mt;
+struct card_bdot;
+struct card_thruster;
+struct card_sched;
+struct card_idle;
+
+// the devices on a card
+// also the order of the bus health and presence tables
+enum ccard_dev_id {
+	CCARD_DEV_DSA = 0,
+	CCARD_DEV_MT,
+	CCARD_DEV_DAC,
+	CCARD_DEV_COUNT
+};
+
+// one device on a card as the actuators see it, whatever carries its
+//   register reads and writes
+struct ccard_dev {
+	struct ccard *card;
+	enum ccard_dev_id id;
+	// 1 while the transport has the device bound
+	u8 bound;
+	// the i2c address from the module parameters, which the traces and
+	//   recordings name the device by on every transport
+	u8 addr;
+	// the device the actuator devices are created under, NULL if the
+	//   transport has none
+	struct device *parent;
+	// the transport's handle on the device, the i2c_client for i2c
+	void *priv;
+};
+
+// a way of reaching the devices of a card
+// the actuators only ever go through ccard_lock_bus, ccard_read_reg,
+//   ccard_write_reg and ccard_write_regs, which call these, so a new
+//   board only needs a new transport
+// every transaction is made with the card locked through lock
+struct ccard_transport {
+	const char *name;
+	// sets up the module wide parts of the transport, like its driver
+	// either may be NULL
+	s8 (*init)(void);
+	void (*cleanup)(void);
+	// connects <card>, whose devices are brought up through
+	//   ccard_dev_bound as the transport finds them, now or later
+	// returns 0 on success
+	s8 (*attach)(struct ccard *card);
+	// lets go of every bound device through ccard_dev_unbound and
+	//   disconnects <card>
+	void (*detach)(struct ccard *card);
+	// takes <card> for a run of transactions, without waiting if <wait>
+	//   is 0
+	// returns 0 once it is held, -EBUSY if it would have to wait and
+	//   <wait> is 0, or another negative error
+	int (*lock)(struct ccard *card, u8 wait);
+	void (*unlock)(struct ccard *card);
+	// each returns 0 on success or a negative error code
+	int (*read_reg)(struct ccard_dev *dev, u8 reg, u8 *val);
+	int (*write_reg)(struct ccard_dev *dev, u8 reg, u8 val);
+	// writes <count> registers in order in as few transfers as it can
+	// NULL if the transport can only write one at a time
+	int (*burst)(struct ccard_dev *dev, const u8 *regs, const u8 *vals, \
+		     u8 count);
+	// checks that the device answers at all
+	int (*probe)(struct ccard_dev *dev);
+};
+
+extern const struct ccard_transport ccard_i2c_transport;
+extern const struct ccard_transport ccard_mock_transport;
+extern const struct ccard_transport ccard_usb_transport;
+
+// one c card
+// every card has its own transport link, devices, rails, workers and
+//   actuator state, so cards on different buses run side by side without
+//   ever waiting on each other
+// the context is allocated when the card's bus is attached, right before
+//   its devices are bound, and lives until the module unloads
+struct ccard {
+	// position of the card in the i2c_bus module parameter
+	// card 0 keeps the sysfs names of a single card, the devices of the
+	//   others are prefixed with card<index>-, see ccard_dev_name
+	u8 index;
+	// how the devices of the card are reached, and the state the
+	//   transport keeps for the card
+	const struct ccard_transport *transport;
+	void *link;
+	// the devices on the card, in enum ccard_dev_id order
+	struct ccard_dev devs[CCARD_DEV_COUNT];
+	// time the bus lock was last taken, used to trace how long it was held
+	ktime_t bus_locked_at;
+	// the dsas are the only users of the 3v3 source, the 5v0 source powers
+	//   everything else
+	struct ccard_rail rail_3v3;
+	struct ccard_rail rail_5v0;
+	// takes the 5v0 rail down while the card is idle, see power.c
+	struct card_idle *idle;
+
+	struct card_bus *bus;
+	struct card_presence *presence;
+	struct card_status *status;
+	struct card_usage *usage;
+	struct card_dsa *dsa;
+	struct card_mt *mt;
+	struct card_bdot *bdot;
+	struct card_thruster *thruster;
+	struct card_sched *sched;
+};
+
+// one actuator of a card, the drvdata of its sysfs device
+struct ccard_unit {
+	struct ccard *card;
+	u8 index;
+};
+
+// returns card <index>, or NULL if it isn't attached
+struct ccard *ccard_get(u8 index);
+
+// formats the name of a device of <card> into <buf>
+// card 0 keeps the plain name, so a single card looks exactly as it always
+//   has, and every other card's devices are prefixed with card<index>-
+void ccard_dev_name(struct ccard *card, char *buf, size_t size, \
+		    const char *fmt, ...);
+
+// takes a reference on the rail, switching it on if needed
+void ccard_rail_get(struct ccard_rail *rail);
+// drops a reference, the rail switches off off_delay ms after the last one
+void ccard_rail_put(struct ccard_rail *rail);
+// switches the rail off immediately regardless of its users
+void ccard_rail_force_off(struct ccard_rail *rail);
+
+// a magnetometer sample fed to the b-dot executor through its char device
+// the field is in nT, and the timestamp is the monotonic time the sample
+//   was taken in ns, or 0 to have the driver stamp it on arrival
+struct ccard_mag_sample {
+	s64 timestamp;
+	struct ccard_vec3int field;
+};
+
 // 1 = on, 0 = off
-// flags: 0 = normal, !0 = emergency shutoff (ignore semaphore)
-// the dsas are the only users of the 3v3 source
-void set_dsa_pwr(u8 state, s8 flags);
-// the main 5v0 source for all components
-void set_5v0_pwr(u8 state, s8 flags);
+// flags: 0 = normal, !0 = emergency shutoff (ignore other users)
+// switches the 3v3 source of <card>, the dsas are its only users
+void set_dsa_pwr(struct ccard *card, u8 state, s8 flags);
+// the main 5v0 source for all components of <card>
+void set_5v0_pwr(struct ccard *card, u8 state, s8 flags);
 
 
-// sets and gets the current thrust values for thruster <num>
+// sets and gets the current thrust values for thruster <num> of <card>
 // returns the current thrust as a percent * 1000, or a negative error
-s32 current_thrust(u8 thuster_num);
+s32 current_thrust(struct ccard *card, u8 thuster_num);
 // the thrust value should be the percent multiplied by 1000
 // passing a value of 1000 = 100% thrust, 30 = 3%, 7 = 0.7%
+// <cause> is passed on to the actuator events
 // returns 0 on success or a nonzero error code
-s8 set_thrust(u8 thruster_num, u16 thrust);
+s8 set_thrust(struct ccard *card, u8 thruster_num, u16 thrust, \
+	      enum ccard_cause cause);
 
 
-// returns a struct pointer containing the i2c infomation for the GPIO
-//   expanders
-// these are implemented by their respective controllers
-struct i2c_client *dsa_expdr(void);
-struct i2c_client *mt_expdr(void);
-// returns a struct pointer to the thruster spi_device
-struct i2c_client *thruster_dac(void);
-// returns a struct pointer to the gps device
+// returns the GPIO expanders of <card>, or NULL while they aren't bound
+struct ccard_dev *dsa_expdr(struct ccard *card);
+struct ccard_dev *mt_expdr(struct ccard *card);
+// returns the DAC controlling the thruster, or NULL while it isn't bound
+struct ccard_dev *thruster_dac(struct ccard *card);
+// returns a struct pointer to the device of the first gps receiver, or
+//   NULL while no receiver is attached
 struct device *gps(void);
+// copies the latest fix of gps receiver <receiver> to <fix>
+// returns 0 on success or 1 if the receiver has no fix yet
+s8 ccard_gps_latest(u8 receiver, struct ccard_gps_fix *fix);
 // returns a struct pointer to the LED device
 struct device *led(void);
 
@@ -104,6 +293,10 @@ struct device *led(void);
 // will return NULL if the class doesn't exist or couldn't be created
 struct class *ccard_nav_class(void);
 
+// returns a pointer to the c card class object, which holds the devices
+//   describing the card itself, like the power rails
+struct class *ccard_core_class(void);
+
 
 //
 // devices
@@ -112,46 +305,236 @@ struct class *ccard_nav_class(void);
 // this function initializes the DSA hardware so that it is ready for release
 //   and/or deploy operations
 // returns 0 on success and -1 on failure
-s8 init_dsa(void);
+s8 init_dsa(struct ccard *card);
 
 // this function initializes the magnetorquer hardware so that it is ready
 // for forward or reverse operations
 // returns 0 on success and -1 on failure
-s8 init_mt(void);
+s8 init_mt(struct ccard *card);
 
-// initializes the thruster
-s8 init_thruster(void);
+// sets up the b-dot detumble executor, which is part of the magnetorquers
+s8 init_bdot(struct ccard *card);
 
-
-// starts the i2c driver
-s8 ccard_init_i2c(void);
+// initializes the thruster
+s8 init_thruster(struct ccard *card);
+
+
+// validates the board configuration in the module parameters and builds
+//   the expander decode tables from it
+s8 ccard_init_board(void);
+// returns the number of cards the module parameters configure
+u8 ccard_board_cards(void);
+// returns the transport the module parameters give <card>
+const struct ccard_transport *ccard_board_transport(u8 card);
+// returns the transport called <name>, or NULL if there is none
+const struct ccard_transport *ccard_find_transport(const char *name);
+
+// sets up the power rails of <card>
+s8 ccard_init_power(struct ccard *card);
+
+// brings the 5v0 rail of <card> back up if it was taken down while the
+//   card was idle, and restores the registers the devices lost
+// called by ccard_lock_bus for a command and by the first write to a
+//   sleeping card, so it must be called with the bus locked
+void ccard_power_wake(struct ccard *card);
+// notes a command to <card>, which keeps its 5v0 rail up for another idle
+//   timeout
+// only writes count, polling a state doesn't keep the card awake
+void ccard_power_used(struct ccard *card);
+// returns 1 unless the 5v0 rail of <card> is down because it is idle
+u8 ccard_power_awake(struct ccard *card);
+// keeps the 5v0 rail of <card> up from now on, so that the card can be
+//   torn down without it going idle underneath
+void ccard_power_hold(struct ccard *card);
+// writes the registers last written to every device on <card> again
+// must be called with the bus locked
+// returns the number of writes that failed
+int ccard_restore_regs(struct ccard *card);
+
+// records a state transition in the per actuator usage counters of <card>
+// these are cheap and are called on every transition by the actuator code
+// magnetorquer <mt> entered <state>
+void ccard_usage_mt(struct ccard *card, u8 mt, enum mt_state state);
+// thruster <thruster> was set to <thrust> percent
+void ccard_usage_thrust(struct ccard *card, u8 thruster, u16 thrust);
+// dsa <dsa> started (burning = 1) or stopped (burning = 0) burning for
+//   operation <op>, 0 = release, 1 = deploy
+void ccard_usage_dsa(struct ccard *card, u8 dsa, u8 op, u8 burning);
+
+// returns 1 if any actuator of <card> is on, thrusting or burning
+u8 ccard_usage_active(struct ccard *card);
+
+// sets up the usage counters of <card>
+s8 ccard_init_usage(struct ccard *card);
+
+// registers the netlink family for actuator events
+s8 ccard_init_events(void);
+
+// allocates the status page of <card> and creates its char device
+s8 ccard_init_status(struct ccard *card);
+
+// allocates the record buffer and creates its char device
+s8 ccard_init_record(void);
+
+// registers the gps line discipline and the char devices of the receivers
+s8 ccard_init_gps(void);
+
+// sets up every transport, like the i2c driver the devices of the i2c
+//   cards bind to
+s8 ccard_init_transports(void);
+
+// attaches <card> through the transport the module parameters give it,
+//   which binds the devices on it and brings them up
+s8 ccard_init_bus(struct ccard *card);
+
+// starts watching for <card> being plugged in and unplugged
+s8 ccard_init_presence(struct ccard *card);
+
+// starts the time tagged command scheduler of <card>
+s8 ccard_init_scheduler(struct ccard *card);
 
 
 // cleans up data for the DSAs and turns off power
-void cleanup_dsa(void);
+void cleanup_dsa(struct ccard *card);
 
 // cleans up data for the magnetoruqers and safely switches them off
-void cleanup_mt(void);
+void cleanup_mt(struct ccard *card);
+
+// stops the b-dot executor and removes its device
+void cleanup_bdot(struct ccard *card);
 
 // cleans up the thruster data
-void cleanup_thruster(void);
+void cleanup_thruster(struct ccard *card);
+
+// stops the scheduler, dropping any commands that haven't run
+void ccard_cleanup_scheduler(struct ccard *card);
+
+// stops the presence monitor
+void ccard_cleanup_presence(struct ccard *card);
+
+// unregisters the devices of <card> and lets go of its bus
+void ccard_cleanup_bus(struct ccard *card);
+
+// undoes ccard_init_transports
+void ccard_cleanup_transports(void);
+
+// removes the usage counter device
+void ccard_cleanup_usage(struct ccard *card);
 
-// ends the i2c driver
-void ccard_cleanup_i2c(void);
+// unregisters the netlink family for actuator events
+void ccard_cleanup_events(void);
 
-// provides a mechanism to restrict i2c bus usage
-int ccard_lock_bus(void);
-void ccard_unlock_bus(void);
+// removes the status char device and frees the page
+void ccard_cleanup_status(struct ccard *card);
+
+// removes the record char device and frees the buffer
+void ccard_cleanup_record(void);
+
+// unregisters the gps line discipline and its char devices
+void ccard_cleanup_gps(void);
+
+// switches off and releases the power rails
+void ccard_cleanup_power(struct ccard *card);
+
+// the classes of bus users, the bus is handed to a waiting command before
+//   any waiting housekeeping, except for the share of the bus housekeeping
+//   is guaranteed, see bus.c
+enum ccard_bus_class {
+	// actuator commands, which the flight software is waiting on
+	CCARD_BUS_COMMAND = 0,
+	// state reads, presence checks, setup and anything else that can wait
+	CCARD_BUS_HOUSEKEEPING,
+	CCARD_BUS_CLASSES
+};
+
+// provides a mechanism to restrict bus usage
+// every card has its own lock, so cards never wait for each other
+int ccard_lock_bus(struct ccard *card, enum ccard_bus_class cls);
+void ccard_unlock_bus(struct ccard *card);
+// takes the bus of <card> as housekeeping without waking the card or
+//   counting the wait, for the idle power down
+int ccard_hold_bus(struct ccard *card);
+void ccard_release_bus(struct ccard *card);
+
+// reads and writes one register of a device, must be called with the bus
+//   of its card locked
+// all return 0 on success or a negative error code
+int ccard_read_reg(struct ccard_dev *dev, u8 reg, u8 *val);
+int ccard_write_reg(struct ccard_dev *dev, u8 reg, u8 val);
+// writes <count> registers of <dev> in order, in one transfer where the
+//   transport can
+int ccard_write_regs(struct ccard_dev *dev, const u8 *regs, const u8 *vals, \
+		     u8 count);
+// returns 1 if <dev> answers a single read, locking the bus itself
+u8 ccard_probe_dev(struct ccard_dev *dev);
+// tells the bus health tracking that <dev> started or stopped answering
+void ccard_set_dev_present(struct ccard_dev *dev, u8 present);
+
+// called by the transports when they find or lose a device of a card,
+//   which brings the actuators on it up or down
+// <parent> is the device the actuator devices go under, and <priv> the
+//   transport's handle on the device
+void ccard_dev_bound(struct ccard_dev *dev, struct device *parent, \
+		     void *priv);
+void ccard_dev_unbound(struct ccard_dev *dev);
+// returns the name of device <id>, like dsa_expdr
+const char *ccard_dev_type(enum ccard_dev_id id);
 
 // gets the dsa state of dsa 'dsa'
-enum dsa_state get_dsa_state(u8 dsa);
+enum dsa_state get_dsa_state(struct ccard *card, u8 dsa);
 // gets the magnetorquer state of magnetorquer 'mt'
-enum mt_state get_mt_state(u8 mt);
+enum mt_state get_mt_state(struct ccard *card, u8 mt);
 
 // sets the dsa state to the desired state
-s8 set_dsa_state(u8 dsa, enum dsa_state desired_state);
+s8 set_dsa_state(struct ccard *card, u8 dsa, enum dsa_state desired_state);
+// the magnetorquer setters pass <cause> on to the actuator events
 // sets the magnetorquer state to the desired state
-s8 set_mt_state(u8 mt, enum mt_state desired_state);
+s8 set_mt_state(struct ccard *card, u8 mt, enum mt_state desired_state, \
+		enum ccard_cause cause);
+// sets the state of every magnetorquer whose bit is set in <which> to the
+//   matching entry in <desired>, braking them together when needed
+// returns 0 on success or a nonzero error code
+s8 set_mt_states(struct ccard *card, const enum mt_state *desired, u8 which, \
+		 enum ccard_cause cause);
+// drives all magnetorquers from one dipole command
+// each component of <dipole> is mapped to one magnetorquer, whose direction
+//   follows the sign of the component
+// returns 0 on success or a nonzero error code
+s8 set_mt_dipole(struct ccard *card, const struct ccard_vec3int *dipole, \
+		 enum ccard_cause cause);
+
+// multicasts a state change of actuator <index> of kind <actuator> on
+//   <card> to the netlink events group
+void ccard_notify(struct ccard *card, enum ccard_actuator actuator, u8 index, \
+		  u32 old_state, u32 new_state, enum ccard_cause cause);
+// multicasts the binary log record <id> with <arg0> and <arg1> for <card>
+//   to the netlink log group, safe from atomic context
+void ccard_log_record(struct ccard *card, enum ccard_log_id id, u32 arg0, \
+		      u32 arg1);
+
+// publish the latest state to the status page of <card>, cheap enough for
+//   any path
+// actuator <index> of kind <actuator> is now in <state>
+void ccard_status_actuator(struct ccard *card, enum ccard_actuator actuator, \
+			   u8 index, u32 state);
+// rail <rail>, 0 = 3v3 and 1 = 5v0, changed level, users or toggles
+void ccard_status_rail(struct ccard *card, u8 rail, u8 on, u32 users, \
+		       u32 toggles);
+// presence device <dev> started or stopped answering
+void ccard_status_present(struct ccard *card, u8 dev, u8 present);
+// one register read or write (<write> = 1) finished with <ret>
+void ccard_status_bus(struct ccard *card, u8 write, int ret);
+
+// add to the command recording while one is running, see ccard_record.h
+// a command from file <source> for actuator <index> of <card> that arrived
+//   at <start> with <len> bytes of <data> was answered with <result>
+void ccard_record_command(struct ccard *card, u8 source, u8 index, \
+			  const void *data, size_t len, s32 result, \
+			  ktime_t start);
+// <val> was written to register <reg> of i2c address <addr> on <card>
+//   with <ret>
+void ccard_record_reg(struct ccard *card, u8 addr, u8 reg, u8 val, int ret, \
+		      ktime_t start);
 
 
 
@@ -0,0 +1,70 @@
+// ioctl interface of the dsa char devices
+// a release or deploy can be submitted on /dev/dsa0 or /dev/dsa1 together
+//   with an eventfd, which the driver signals once the operation is over
+// the outcome and the measured duration are then read back by the id the
+//   submission returned
+// this header is shared with userspace, so it must only depend on headers
+//   that userspace has as well
+//
+// by Mark Hill
+
+#ifndef _ccard_dsa
+#define _ccard_dsa
+
+#include<linux/types.h>
+#include<linux/ioctl.h>
+
+// operations that can be submitted
+#define CCARD_DSA_RELEASE 0
+#define CCARD_DSA_DEPLOY 1
+
+// how a submitted operation ended
+enum ccard_dsa_outcome {
+	// still queued or running
+	CCARD_DSA_PENDING = 0,
+	// the dsa reached the requested state
+	CCARD_DSA_SUCCESS = 1,
+	// the burn ran for the whole release or deploy timeout
+	CCARD_DSA_TIMEOUT = 2,
+	// something else was requested for the dsa before it finished
+	CCARD_DSA_CANCELLED = 3,
+	// the gpio expander couldn't be read or written
+	CCARD_DSA_BUS_ERROR = 4,
+	// the driver couldn't start the operation at all
+	CCARD_DSA_FAILED = 5
+};
+
+struct ccard_dsa_submit {
+	// CCARD_DSA_RELEASE or CCARD_DSA_DEPLOY
+	__u32 op;
+	// eventfd to signal on completion, or -1 to only poll the result
+	__s32 eventfd;
+	// filled in by the driver, used to look up the result
+	__u64 id;
+};
+
+struct ccard_dsa_result {
+	// set by the caller to the id returned by the submission
+	__u64 id;
+	__u32 op;
+	// an enum ccard_dsa_outcome
+	__u32 outcome;
+	// the dsa_state the dsa was in when the operation ended
+	__u32 state;
+	__u32 reserved;
+	// time the switch was burning, 0 if it never started
+	__u64 burn_ns;
+	// time from the submission to the end of the operation
+	__u64 elapsed_ns;
+};
+
+#define CCARD_DSA_IOC_MAGIC 0xcc
+// queues an operation, like writing to desired_state
+#define CCARD_DSA_IOC_SUBMIT _IOWR(CCARD_DSA_IOC_MAGIC, 1, \
+				   struct ccard_dsa_submit)
+// fills in the result of a submission, fails with ENOENT once the result
+//   has been pushed out by newer ones
+#define CCARD_DSA_IOC_RESULT _IOWR(CCARD_DSA_IOC_MAGIC, 2, \
+				   struct ccard_dsa_result)
+
+#endif
@@ -0,0 +1,65 @@
+// format of the GPS fixes
+// the receiver's NMEA stream is parsed in the driver once the gps line
+//   discipline is attached to its tty, and every fix it puts together is
+//   kept in a history that /dev/gps<n> hands out as struct ccard_gps_fix
+// a reader starts with the oldest fix still in the history and then gets
+//   every new fix as it arrives; the sequence numbers show where a slow
+//   reader lost fixes
+// this header is shared with userspace, so it must only depend on headers
+//   that userspace has as well
+//
+// by Mark Hill
+
+#ifndef _ccard_gps
+#define _ccard_gps
+
+#include<linux/types.h>
+
+// the line discipline the driver registers when the gps_ldisc module
+//   parameter isn't given, it is set on the receiver's tty with TIOCSETD
+// N_MASC is reserved but has no driver in the kernel
+#define CCARD_GPS_DFL_LDISC 8
+
+// parts of the fix that were received
+enum ccard_gps_flags {
+	// the position came with a GGA sentence, so quality, satellites,
+	//   hdop and altitude are set
+	CCARD_GPS_HAVE_GGA = 1 << 0,
+	// an RMC sentence was received, so speed, course and the date are set
+	CCARD_GPS_HAVE_RMC = 1 << 1,
+	// the RMC sentence reported the fix as valid
+	CCARD_GPS_VALID = 1 << 2
+};
+
+struct ccard_gps_fix {
+	// monotonic time the last sentence of the fix reached the driver
+	__u64 timestamp_ns;
+	// counts every fix of the receiver from 0
+	__u32 sequence;
+	// UTC time of the fix in ms since midnight
+	__u32 time_ms;
+	// UTC date of the fix, 0 when no RMC sentence was received
+	__u8 day;
+	__u8 month;
+	__u16 year;
+	// in 1e-7 degrees, north and east are positive
+	__s32 latitude;
+	__s32 longitude;
+	// above mean sea level in mm
+	__s32 altitude;
+	// over ground in mm/s
+	__u32 speed;
+	// true course over ground in 0.01 degrees
+	__u16 course;
+	// horizontal dilution of precision in 0.01
+	__u16 hdop;
+	// GGA fix quality, 0 for no fix
+	__u8 quality;
+	__u8 satellites;
+	// enum ccard_gps_flags
+	__u8 flags;
+	// the receiver the fix came from, the n of /dev/gps<n>
+	__u8 receiver;
+};
+
+#endif
@@ -0,0 +1,83 @@
+// logging for the c card driver
+// every message of the driver goes through these macros instead of printk
+// a build only carries the messages at or above CCARD_LOG_LEVEL, the others
+//   are dropped by the compiler along with the evaluation of their
+//   arguments, so a production build costs nothing for them on the command
+//   paths, where the serial console would otherwise set the latency
+// the level is a build option, see Kbuild, e.g. for a bench build with the
+//   debug messages
+//     make module CCARD_LOG_LEVEL=7
+// on a kernel with dynamic debug the debug messages of such a build are
+//   still off until they are switched on through its control file, e.g.
+//     echo 'file dsa.c +p' > /sys/kernel/debug/dynamic_debug/control
+// the _rl variants are for the messages that a failing bus or a stream of
+//   bad commands repeats, each call site of those prints at most
+//   DEFAULT_RATELIMIT_BURST messages every DEFAULT_RATELIMIT_INTERVAL
+// failures that a daemon has to act on don't depend on the level at all,
+//   they are also sent as binary records by ccard_log_record, see
+//   ccard_netlink.h
+//
+// by Mark Hill
+
+#ifndef _ccard_log
+#define _ccard_log
+
+#include<linux/kernel.h>
+#include<linux/ratelimit.h>
+
+// the same levels as the KERN_ prefixes
+#define CCARD_LOG_EMERG 0
+#define CCARD_LOG_ERR 3
+#define CCARD_LOG_WARNING 4
+#define CCARD_LOG_NOTICE 5
+#define CCARD_LOG_INFO 6
+#define CCARD_LOG_DEBUG 7
+
+// the least severe level that is built in
+#ifndef CCARD_LOG_LEVEL
+#define CCARD_LOG_LEVEL CCARD_LOG_NOTICE
+#endif
+
+// <level> and CCARD_LOG_LEVEL are constants, so a message below the level
+//   is dead code, but its format is still checked against its arguments
+#define ccard_log(level, fmt, ...) \
+	do { \
+		if ((level) <= CCARD_LOG_LEVEL) \
+			printk(fmt, ##__VA_ARGS__); \
+	} while (0)
+
+#define ccard_log_rl(level, fmt, ...) \
+	do { \
+		static DEFINE_RATELIMIT_STATE(_ccard_rs, \
+					      DEFAULT_RATELIMIT_INTERVAL, \
+					      DEFAULT_RATELIMIT_BURST); \
+		if ((level) <= CCARD_LOG_LEVEL && __ratelimit(&_ccard_rs)) \
+			printk(fmt, ##__VA_ARGS__); \
+	} while (0)
+
+#define ccard_emerg(fmt, ...) \
+	ccard_log(CCARD_LOG_EMERG, KERN_EMERG fmt, ##__VA_ARGS__)
+#define ccard_err(fmt, ...) \
+	ccard_log(CCARD_LOG_ERR, KERN_ERR fmt, ##__VA_ARGS__)
+#define ccard_warn(fmt, ...) \
+	ccard_log(CCARD_LOG_WARNING, KERN_WARNING fmt, ##__VA_ARGS__)
+#define ccard_notice(fmt, ...) \
+	ccard_log(CCARD_LOG_NOTICE, KERN_NOTICE fmt, ##__VA_ARGS__)
+#define ccard_info(fmt, ...) \
+	ccard_log(CCARD_LOG_INFO, KERN_INFO fmt, ##__VA_ARGS__)
+
+#define ccard_err_rl(fmt, ...) \
+	ccard_log_rl(CCARD_LOG_ERR, KERN_ERR fmt, ##__VA_ARGS__)
+#define ccard_warn_rl(fmt, ...) \
+	ccard_log_rl(CCARD_LOG_WARNING, KERN_WARNING fmt, ##__VA_ARGS__)
+
+// with dynamic debug every debug message is a call site of its own that is
+//   switched on at runtime, without it a build that keeps them prints them
+#if CCARD_LOG_LEVEL >= CCARD_LOG_DEBUG && defined(CONFIG_DYNAMIC_DEBUG)
+#define ccard_dbg(fmt, ...) pr_debug(fmt, ##__VA_ARGS__)
+#else
+#define ccard_dbg(fmt, ...) \
+	ccard_log(CCARD_LOG_DEBUG, KERN_DEBUG fmt, ##__VA_ARGS__)
+#endif
+
+#endif
@@ -0,0 +1,108 @@
+// generic netlink interface of the c card driver
+// the driver multicasts an event on the "events" group of the "ccard"
+//   family whenever it changes or observes the state of an actuator, and a
+//   binary log record on the "log" group whenever something fails that a
+//   daemon has to know about
+// this header is shared with userspace, so it must not depend on any
+//   kernel header
+//
+// by Mark Hill
+
+#ifndef _ccard_netlink
+#define _ccard_netlink
+
+#define CCARD_GENL_NAME "ccard"
+#define CCARD_GENL_VERSION 1
+#define CCARD_GENL_EVENTS "events"
+#define CCARD_GENL_LOG "log"
+
+// generic netlink commands
+enum ccard_genl_cmd {
+	CCARD_CMD_UNSPEC,
+	// an actuator changed state, sent on the events group
+	CCARD_CMD_EVENT,
+	// a binary log record, sent on the log group
+	CCARD_CMD_LOG,
+	__CCARD_CMD_MAX,
+};
+
+// attributes of an event and of a log record
+// a log record carries the timestamp, the card and the three log attributes
+enum ccard_genl_attr {
+	CCARD_ATTR_UNSPEC,
+	// u8, an enum ccard_actuator
+	CCARD_ATTR_ACTUATOR,
+	// u8, which dsa, magnetorquer or thruster
+	CCARD_ATTR_INDEX,
+	// u32, the old and new state
+	// a dsa_state for the dsas, an mt_state for the magnetorquers and the
+	//   thrust as written to the thrust file for the thrusters
+	CCARD_ATTR_OLD,
+	CCARD_ATTR_NEW,
+	// u64, monotonic time of the change in ns
+	CCARD_ATTR_TIMESTAMP,
+	// u8, an enum ccard_cause
+	CCARD_ATTR_CAUSE,
+	// u8, which card, its position in the i2c_bus module parameter
+	CCARD_ATTR_CARD,
+	// u16, an enum ccard_log_id
+	CCARD_ATTR_LOG_ID,
+	// u32, the two arguments of the record, see enum ccard_log_id
+	CCARD_ATTR_LOG_ARG0,
+	CCARD_ATTR_LOG_ARG1,
+	__CCARD_ATTR_MAX,
+};
+#define CCARD_ATTR_MAX (__CCARD_ATTR_MAX - 1)
+
+// the kinds of actuator on the c card, used wherever a command or event
+//   has to say which actuator it is about
+enum ccard_actuator {
+	act_dsa = 0,
+	act_mt = 1,
+	act_thruster = 2
+};
+
+// what made an actuator change state
+enum ccard_cause {
+	// a write to one of the sysfs files
+	cause_command = 0,
+	// a command from the time tagged scheduler
+	cause_scheduler = 1,
+	// the b-dot executor
+	cause_bdot = 2,
+	// a dsa release or deploy operation
+	cause_dsa_op = 3,
+	// a hardware read found a state nobody asked for
+	cause_observed = 4,
+	// the driver setting up or shutting down an actuator
+	cause_reset = 5
+};
+
+// what a log record is about
+// a record has no text, the numbers only become a message in userspace, so
+//   it costs the driver no formatting and no console time
+enum ccard_log_id {
+	// taking the bus failed, arg0 is the enum ccard_bus_class of the
+	//   caller and arg1 the error
+	CCARD_LOG_BUS_LOCK = 1,
+	// a transfer failed, arg0 is the device, an enum ccard_dev_id, in the
+	//   high byte and the register in the low byte, arg1 the error
+	CCARD_LOG_REG_ERROR = 2,
+	// the breaker of a device changed, arg0 is the device and arg1 the new
+	//   state, 0 closed, 1 open and 2 half open
+	CCARD_LOG_BREAKER = 3,
+	// a dsa operation failed, arg0 is the dsa and arg1 the operation, 0
+	//   release and 1 deploy
+	CCARD_LOG_DSA_OP = 4,
+	// setting the magnetorquers failed, arg0 is the mask of magnetorquers
+	//   and arg1 the enum ccard_cause of the command
+	CCARD_LOG_MT_SET = 5,
+	// setting a thruster failed, arg0 is the thruster and arg1 the thrust
+	CCARD_LOG_THRUST_SET = 6,
+	// the magnetorquers were braked for a command that then failed, and
+	//   couldn't be put back, arg0 is the mask of the braked magnetorquers
+	//   and arg1 the enum ccard_cause of the command
+	CCARD_LOG_MT_BRAKED = 7
+};
+
+#endif
@@ -0,0 +1,75 @@
+// pin maps for the c card gpio expanders
+// the maps below are the irvine02 wiring, the driver starts from them and
+//   lets module parameters replace any of them at load time
+// this header is shared by the driver and by gen_decode, which checks the
+//   table builder in decode.c at build time, so it must not depend on any
+//   kernel header
+//
+// by Mark Hill
+
+#ifndef _ccard_pins
+#define _ccard_pins
+
+// defines the pin location for each value, which corresponds to the
+//   bit number on the device's registers
+// the value at index 0 is the corresponding value for DSA 1, and
+//   the value at each subsequent index 'n' is the corresponding value
+//   for DSA 'n + 1'
+// its a useless feature, because I don't think the cubesat will ever
+//   have more than 1 DSA, but who knows what the EXA has planned
+#define CCARD_DSA_COUNT 2
+#define CCARD_DSA_RES_OUT {0, 2}
+#define CCARD_DSA_DEP_OUT {1, 3}
+#define CCARD_DSA_RES_IN {5, 7}
+// the expander only has 8 pins, so pin 8 never reads as set
+// gen_decode keeps that behaviour and warns about it
+#define CCARD_DSA_DEP_IN {6, 8}
+
+// basically its like this [forwardPinMT1, forwardPinMT2, ... forwardPinMTn]
+#define CCARD_MT_COUNT 3
+#define CCARD_MT_FORWARD {0, 2, 4}
+#define CCARD_MT_REVERSE {1, 3, 5}
+
+// number of values an 8 bit register can hold
+#define CCARD_REG_VALUES 256
+
+// the pin of every signal on the expanders, indexed like the maps above
+struct ccard_pin_map {
+	unsigned char dsa_res_out[CCARD_DSA_COUNT];
+	unsigned char dsa_dep_out[CCARD_DSA_COUNT];
+	unsigned char dsa_res_in[CCARD_DSA_COUNT];
+	unsigned char dsa_dep_in[CCARD_DSA_COUNT];
+	unsigned char mt_forward[CCARD_MT_COUNT];
+	unsigned char mt_reverse[CCARD_MT_COUNT];
+};
+
+#define CCARD_DEFAULT_PINS { \
+	.dsa_res_out = CCARD_DSA_RES_OUT, \
+	.dsa_dep_out = CCARD_DSA_DEP_OUT, \
+	.dsa_res_in = CCARD_DSA_RES_IN, \
+	.dsa_dep_in = CCARD_DSA_DEP_IN, \
+	.mt_forward = CCARD_MT_FORWARD, \
+	.mt_reverse = CCARD_MT_REVERSE, \
+}
+
+// the decode tables built from a pin map by ccard_build_decode
+struct ccard_decode {
+	// release input in bit 0 and deploy input in bit 1, indexed by dsa
+	//   and input register
+	unsigned char dsa_in_code[CCARD_DSA_COUNT][CCARD_REG_VALUES];
+	// release output in bit 0 and deploy output in bit 1, indexed by dsa
+	//   and output register
+	unsigned char dsa_out_code[CCARD_DSA_COUNT][CCARD_REG_VALUES];
+	// dsa_state for an input code and an output code
+	unsigned char dsa_state_code[4][4];
+	// output register bit that burns each dsa's release switch
+	unsigned char dsa_res_mask[CCARD_DSA_COUNT];
+	// output register bit that burns each dsa's deploy switch
+	unsigned char dsa_dep_mask[CCARD_DSA_COUNT];
+	// mt_state indexed by magnetorquer and output register
+	unsigned char mt_decode[CCARD_MT_COUNT][CCARD_REG_VALUES];
+	// output register bits for each magnetorquer and mt_state
+	unsigned char mt_encode[CCARD_MT_COUNT][4];
+};
+
+#endif
@@ -0,0 +1,78 @@
+// format of the c card command recordings
+// while /dev/record is held open, every external command the driver gets
+//   and every register it writes are appended to a stream of records,
+//   which tools/ccardreplay can feed back into the driver later
+// this header is shared with userspace, so it must only depend on headers
+//   that userspace has as well
+//
+// a recording is a sequence of struct ccard_rec, each followed by len bytes
+//   of data, in the byte order of the machine that recorded it
+//
+// by Mark Hill
+
+#ifndef _ccard_record
+#define _ccard_record
+
+#include<linux/types.h>
+
+#define CCARD_REC_VERSION 1
+// commands longer than this are cut off, a sysfs write is at most a page
+#define CCARD_REC_MAX_DATA 4096
+
+enum ccard_rec_type {
+	// first record of every recording, result is CCARD_REC_VERSION
+	CCARD_REC_START = 0,
+	// a write to one of the command files, or a dsa submission
+	// target is an enum ccard_rec_source, index the actuator number,
+	//   result what the driver returned to the writer and the data is
+	//   exactly what was written
+	CCARD_REC_COMMAND = 1,
+	// a register write on the bus
+	// target is the i2c address, index the register, result the return
+	//   value of the write and the data is the one byte written
+	CCARD_REC_REG_WRITE = 2,
+	// records were dropped because nobody read them in time, result is
+	//   the number lost
+	CCARD_REC_LOST = 3
+};
+
+// the files a command can come from
+// the paths are those of card 0, the files of any other card have their
+//   device names prefixed with card<n>-, and its dipole is written to
+//   /sys/class/magnetorquer/card<n>-bdot/dipole
+enum ccard_rec_source {
+	// /sys/class/dsa/dsa<n>/desired_state
+	CCARD_SRC_DSA_DESIRED = 0,
+	// CCARD_DSA_IOC_SUBMIT on /dev/dsa<n>, the data is the __u32 op
+	CCARD_SRC_DSA_SUBMIT = 1,
+	// /sys/class/magnetorquer/magnetorquer<n>/state
+	CCARD_SRC_MT_STATE = 2,
+	// /sys/class/magnetorquer/dipole
+	CCARD_SRC_MT_DIPOLE = 3,
+	// /sys/class/thruster/thruster<n>/thrust
+	CCARD_SRC_THRUST = 4,
+	// /sys/class/ccard/scheduler/schedule
+	CCARD_SRC_SCHEDULE = 5,
+	// /sys/class/ccard/scheduler/cancel
+	CCARD_SRC_SCHED_CANCEL = 6
+};
+
+struct ccard_rec {
+	// monotonic time the command arrived or the write started
+	__u64 timestamp_ns;
+	// how long the command or the write took
+	__u32 duration_ns;
+	__s32 result;
+	// an enum ccard_rec_type
+	__u8 type;
+	__u8 target;
+	__u8 index;
+	// the card the command or write was for, its position in the i2c_bus
+	//   module parameter
+	__u8 card;
+	// bytes of data following the record
+	__u16 len;
+	__u16 reserved2;
+};
+
+#endif
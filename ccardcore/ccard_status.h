@@ -0,0 +1,66 @@
+// layout of the c card status page
+// the driver keeps the latest state of every actuator and power rail in one
+//   page, which userspace maps read only through /dev/status and reads
+//   without any syscall or bus traffic
+// this header is shared with userspace, so it must only depend on headers
+//   that userspace has as well
+//
+// reading a consistent snapshot works like a seqcount:
+//   1. load sequence, and start over while it is odd
+//   2. read barrier, then copy the fields you need
+//   3. read barrier, and start over if sequence changed
+// tools/ccardstatus.c does exactly this
+//
+// by Mark Hill
+
+#ifndef _ccard_status
+#define _ccard_status
+
+#include<linux/types.h>
+
+#include "ccard_pins.h"
+
+#define CCARD_STATUS_MAGIC 0x43435354
+#define CCARD_STATUS_VERSION 1
+
+// room in the page for each kind of actuator
+#define CCARD_STATUS_THRUSTERS 4
+// 3v3 first, then 5v0
+#define CCARD_STATUS_RAILS 2
+// dsa expander, magnetorquer expander, thruster dac, in the same order as
+//   /sys/class/ccard/presence/state
+#define CCARD_STATUS_DEVICES 3
+
+struct ccard_status {
+	// CCARD_STATUS_MAGIC and CCARD_STATUS_VERSION, set once when the
+	//   driver loads
+	__u32 magic;
+	__u32 version;
+	// odd while the driver is updating the page
+	__u32 sequence;
+	// bit n is set while device n answers the presence checks
+	__u32 present;
+	// monotonic time of the last update in ns
+	__u64 updated_ns;
+	// number of updates since the driver loaded
+	__u64 updates;
+	// every register read and write on the bus, and the ones that failed
+	__u64 bus_reads;
+	__u64 bus_writes;
+	__u64 bus_errors;
+
+	// an enum dsa_state per dsa and an enum mt_state per magnetorquer
+	__u32 dsa_state[CCARD_DSA_COUNT];
+	__u32 mt_state[CCARD_MT_COUNT];
+	// thrust as written to the thrust file
+	__u32 thrust[CCARD_STATUS_THRUSTERS];
+
+	// 1 while the rail is switched on
+	__u32 rail_on[CCARD_STATUS_RAILS];
+	// number of users currently holding the rail on
+	__u32 rail_users[CCARD_STATUS_RAILS];
+	// number of times the rail gpio was switched
+	__u32 rail_toggles[CCARD_STATUS_RAILS];
+};
+
+#endif
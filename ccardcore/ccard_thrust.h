@@ -0,0 +1,47 @@
+// format of the thrust calibration tables
+// a table is written to the calibration file of a thruster,
+//   /sys/class/thruster/thruster0/calibration, in one write, and maps the
+//   thrust written to the thrust file to the code written to the DAC
+// between two breakpoints the code is interpolated linearly
+// reading the file back returns the table in use, with the crc the driver
+//   checked it against
+// this header is shared with userspace, so it must only depend on headers
+//   that userspace has as well
+//
+// by Mark Hill
+
+#ifndef _ccard_thrust
+#define _ccard_thrust
+
+#include<linux/types.h>
+
+#define CCARD_THRUST_CAL_MAGIC 0x6c616374 // "tcal"
+#define CCARD_THRUST_CAL_MAX_POINTS 32
+// the breakpoint thrust is the thrust file value * CCARD_THRUST_CAL_SCALE,
+//   so 0 to 10000 for 0 to 100
+#define CCARD_THRUST_CAL_SCALE 100
+
+struct ccard_thrust_cal_point {
+	__u16 thrust;
+	// DAC code, at most 2047
+	__u16 code;
+};
+
+// the table is the header followed by <count> points
+// the points must start at thrust 0, end at 100 * CCARD_THRUST_CAL_SCALE
+//   and be strictly increasing in thrust, and the codes may never decrease
+// a table without points goes back to the linear map between the minimum
+//   and maximum control voltage
+struct ccard_thrust_cal {
+	__u32 magic;
+	// chosen by whoever builds the table, so the table in use can be told
+	//   apart later
+	__u32 version;
+	// crc32 of the points, as computed by zlib's crc32()
+	__u32 crc;
+	__u16 count;
+	__u16 reserved;
+	struct ccard_thrust_cal_point points[0];
+};
+
+#endif
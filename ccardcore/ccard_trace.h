@@ -0,0 +1,75 @@
+// tracepoints for the c card driver
+// these are always compiled in and cost a single test of a flag until a
+//   probe is attached, so they can stay on the hot paths where a printk
+//   would be too slow
+// the 2.6.30 kernel on the board only has the plain tracepoints, module
+//   events through ftrace and perf came later, so a probe module attaches
+//   to them with register_trace_<name>, see the README
+// every tracepoint passes its fields separately so that a probe can line
+//   up a command with the bus writes that carried it out
+//
+// by Mark Hill
+
+#ifndef _CCARD_TRACE_H
+#define _CCARD_TRACE_H
+
+#include<linux/tracepoint.h>
+#include<linux/types.h>
+
+// a command arrived through sysfs or the scheduler
+// <len> is the length of the raw text that carried it
+DECLARE_TRACE(ccard_cmd_received,
+	TP_PROTO(u8 actuator, u8 index, size_t len),
+	TP_ARGS(actuator, index, len));
+
+// a command was parsed into the value that will be sent to the actuator
+DECLARE_TRACE(ccard_cmd_parsed,
+	TP_PROTO(u8 actuator, u8 index, s32 value),
+	TP_ARGS(actuator, index, value));
+
+// the bus lock was taken after waiting <wait_ns>
+// <ret> is nonzero when the wait was interrupted
+DECLARE_TRACE(ccard_bus_lock,
+	TP_PROTO(s64 wait_ns, int ret),
+	TP_ARGS(wait_ns, ret));
+
+// the bus lock was released after being held for <held_ns>
+DECLARE_TRACE(ccard_bus_unlock,
+	TP_PROTO(s64 held_ns),
+	TP_ARGS(held_ns));
+
+// register reads and writes pass the same fields
+DECLARE_TRACE(ccard_reg_read,
+	TP_PROTO(u16 addr, u8 reg, u8 val, s64 latency_ns, int ret),
+	TP_ARGS(addr, reg, val, latency_ns, ret));
+
+DECLARE_TRACE(ccard_reg_write,
+	TP_PROTO(u16 addr, u8 reg, u8 val, s64 latency_ns, int ret),
+	TP_ARGS(addr, reg, val, latency_ns, ret));
+
+// the magnetorquers in <mask> are being braked before a polarity change,
+//   and the brake was let go again
+DECLARE_TRACE(ccard_brake_start,
+	TP_PROTO(u8 mask),
+	TP_ARGS(mask));
+
+DECLARE_TRACE(ccard_brake_end,
+	TP_PROTO(u8 mask),
+	TP_ARGS(mask));
+
+// a dsa release or deploy began burning
+DECLARE_TRACE(ccard_dsa_op_start,
+	TP_PROTO(u8 dsa, u8 op),
+	TP_ARGS(dsa, op));
+
+// a dsa operation finished, <result> is the state the dsa ended up in
+DECLARE_TRACE(ccard_dsa_op_complete,
+	TP_PROTO(u8 dsa, u8 op, u8 result, s64 duration_ns),
+	TP_ARGS(dsa, op, result, duration_ns));
+
+// a dsa operation gave up after burning for its whole time limit
+DECLARE_TRACE(ccard_dsa_op_timeout,
+	TP_PROTO(u8 dsa, u8 op, s64 duration_ns),
+	TP_ARGS(dsa, op, duration_ns));
+
+#endif
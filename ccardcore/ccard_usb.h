@@ -0,0 +1,65 @@
+// framing of the usb bridge on IRVINE03
+// the bridge is a microcontroller on the card with one bulk endpoint each
+//   way, it turns every packet it gets into i2c transfers on the card and
+//   answers each with one packet
+// a packet starts with a header and is followed by <count> entries of the
+//   command, so a run of register writes, like putting back the registers
+//   after the 5v0 rail was down, costs a single round trip
+// the reply echoes the header with count replaced by the status, followed
+//   by the value for a read
+// this header is shared with the bridge firmware, so it must only depend on
+//   headers that it has as well
+//
+// by Mark Hill
+
+#ifndef _ccard_usb
+#define _ccard_usb
+
+#include<linux/types.h>
+
+#define CCARD_USB_MAGIC 0xcc
+// the size of a full speed bulk packet, which every packet fits in
+#define CCARD_USB_PACKET 64
+
+enum ccard_usb_cmd {
+	// writes every entry in order, stopping at the first that fails
+	CCARD_USB_WRITE = 1,
+	// reads the register of the one entry
+	CCARD_USB_READ = 2,
+	// checks that the address of the one entry acknowledges a read
+	CCARD_USB_PROBE = 3
+};
+
+// statuses of a reply
+enum ccard_usb_status {
+	CCARD_USB_OK = 0,
+	// the i2c slave didn't acknowledge
+	CCARD_USB_NACK = 1,
+	// the packet didn't make sense to the bridge
+	CCARD_USB_BAD = 2
+};
+
+struct ccard_usb_header {
+	__u8 magic;
+	// enum ccard_usb_cmd
+	__u8 cmd;
+	// copied into the reply, so a stale reply is never taken for the
+	//   current one
+	__u8 seq;
+	// entries that follow, or the status in a reply
+	__u8 count;
+};
+
+// an entry of a write, a read leaves val out, a probe only has the address
+struct ccard_usb_reg {
+	__u8 addr;
+	__u8 reg;
+	__u8 val;
+};
+
+// writes that fit in one packet
+#define CCARD_USB_MAX_WRITES \
+	((CCARD_USB_PACKET - sizeof(struct ccard_usb_header)) / \
+	 sizeof(struct ccard_usb_reg))
+
+#endif
@@ -7,28 +7,77 @@
 #include<linux/module.h>
 #include<linux/kernel.h>
 #include<linux/init.h>
-#include<linux/gpio.h>
-#include<linux/semaphore.h>
 #include<linux/device.h>
+#include<linux/slab.h>
 #include "ccard.h"
+#include "ccard_trace.h"
+#include "board.c"
+#include "power.c"
+#include "events.c"
+#include "status.c"
+#include "record.c"
+#include "bus.c"
 #include "i2c_ccard.c"
+#include "mock_ccard.c"
+#include "usb_ccard.c"
+#include "presence.c"
 #include "magnetorquer.c"
+#include "bdot.c"
 #include "dsa.c"
 #include "gps.c"
 #include "thruster.c"
-
-
-#define ccard_3v3_gpio 102
-#define ccard_5v0_gpio 103
+#include "usage.c"
+#include "scheduler.c"
+
+// the tracepoints are defined once here, and exported so that a probe
+//   module can attach to them
+DEFINE_TRACE(ccard_cmd_received);
+DEFINE_TRACE(ccard_cmd_parsed);
+DEFINE_TRACE(ccard_bus_lock);
+DEFINE_TRACE(ccard_bus_unlock);
+DEFINE_TRACE(ccard_reg_read);
+DEFINE_TRACE(ccard_reg_write);
+DEFINE_TRACE(ccard_brake_start);
+DEFINE_TRACE(ccard_brake_end);
+DEFINE_TRACE(ccard_dsa_op_start);
+DEFINE_TRACE(ccard_dsa_op_complete);
+DEFINE_TRACE(ccard_dsa_op_timeout);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_cmd_received);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_cmd_parsed);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_bus_lock);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_bus_unlock);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_reg_read);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_reg_write);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_brake_start);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_brake_end);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_dsa_op_start);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_dsa_op_complete);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ccard_dsa_op_timeout);
 
 static int __init start_ccard(void);
 static void __exit poweroff_ccard(void);
 
-static struct semaphore sem3v3power;
-static struct semaphore sem5v0power;
+// the attached cards, by their position in the i2c_bus module parameter
+static struct ccard *_cards[CCARD_MAX_CARDS];
+// brings up card <index> and everything on it
+// returns 0 on success or 1 if the card couldn't be attached
+static s8 create_ccard(u8 index);
+// tears down a card created by create_ccard and frees it
+static void destroy_ccard(struct ccard *card);
+// undoes the parts of start_ccard that are shared by every card
+static void cleanup_shared(void);
+
+// holds the class for the c card devices
+static struct class _ccard_class;
+// creates the _ccard_class object
+static inline s8 create_ccard_core_class(void);
+// unregisters the _ccard_class object
+static inline void remove_ccard_core_class(void);
 
 // holds the class for the navigation devices
+// the driver runs without it, so _nav_ready tells whether it was registered
 static struct class _nav_class;
+static u8 _nav_ready = 0;
 // creates the _nav_class object
 static inline s8 create_ccard_nav_class(void);
 // unregisters the _nav_class object
@@ -45,86 +94,202 @@ MODULE_SUPPORTED_DEVICE("IRVINE02 ccard");
 // init function
 static int __init start_ccard(void)
 {
-	sema_init(&sem3v3power, 0);
-	sema_init(&sem5v0power, 0);
-
-	int gpio_error = gpio_request(ccard_3v3_gpio, "3v3ccard");
-	if (gpio_error)
-		printk(KERN_DEBUG "stop exporting gpio %i\n", ccard_3v3_gpio);
-	gpio_error = gpio_request(ccard_5v0_gpio, "5v0ccard");
-	if (gpio_error)
-		printk(KERN_DEBUG "stop exporting gpio %i\n", ccard_5v0_gpio);
-
-	set_5v0_pwr(1, 0);
-
-	// start the i2c driver which will start up all the
-	//   components attached to the i2c bus
-	if (ccard_init_i2c()) {
-		printk(KERN_ERR "failed to initialize i2c driver\n");
+	// nothing may touch the hardware with a configuration that doesn't
+	//   match the board
+	if (ccard_init_board()) {
+		ccard_err("invalid c card board configuration\n");
+		return -EINVAL;
+	}
+
+	if (create_ccard_core_class()) {
+		ccard_err("failed to create the c card class\n");
 		return 1;
 	}
 
-	//if (create_ccard_nav_class()) {
-	//	printk(KERN_ERR "failed to create the navigation class\n");
-	//	return 1;
-	//}
+	if (ccard_init_record())
+		ccard_err("command recording unavailable\n");
+
+	// the gps receivers don't sit on the card, they come and go with
+	//   their ttys, so they only need their class
+	if (create_ccard_nav_class())
+		ccard_err("failed to create the navigation class\n");
+	else if (ccard_init_gps())
+		ccard_err("gps receivers unavailable\n");
+
+	// events can only reach userspace once the family is registered
+	if (ccard_init_events())
+		ccard_err("actuator events unavailable\n");
+
+	// the drivers have to be registered before any card adds its devices,
+	//   otherwise nothing would probe them
+	if (ccard_init_transports()) {
+		ccard_err("failed to initialize the transports\n");
+		cleanup_shared();
+		return 1;
+	}
 
+	// a card that can't be attached doesn't keep the others from running
+	u8 attached = 0;
+	for (u8 i = 0; i < ccard_board_cards(); i++) {
+		if (create_ccard(i))
+			ccard_err("failed to attach c card %u\n", i);
+		else
+			attached++;
+	}
+	if (attached == 0) {
+		ccard_err("no c card could be attached\n");
+		cleanup_shared();
+		return -ENODEV;
+	}
 
-	printk(KERN_NOTICE "c card driver loaded\n");
+	ccard_notice("c card driver loaded with %u card(s)\n", attached);
 
 	return 0;
 }
 
 // is only a concern when built as a loadable module (debugging)
 static void __exit poweroff_ccard(void) {
-	ccard_cleanup_i2c();
+	for (int i = CCARD_MAX_CARDS - 1; i >= 0; i--) {
+		if (_cards[i] != NULL)
+			destroy_ccard(_cards[i]);
+	}
 
-	//remove_ccard_nav_class();
+	cleanup_shared();
 
-	set_dsa_pwr(0, 1);
-	set_5v0_pwr(0, 1);
+	ccard_notice("exiting c card driver\n");
+}
 
-	gpio_free(ccard_3v3_gpio);
-	gpio_free(ccard_5v0_gpio);
+static void cleanup_shared()
+{
+	ccard_cleanup_transports();
 
-	printk(KERN_NOTICE "exiting c card driver\n");
-}
+	ccard_cleanup_events();
 
+	ccard_cleanup_gps();
 
+	remove_ccard_nav_class();
 
-//
-// power section
-//
+	ccard_cleanup_record();
+
+	remove_ccard_core_class();
+}
 
-static inline void set_power(u8 gpio, u8 state, s8 flags) {
-	struct semaphore *sem = (gpio == ccard_3v3_gpio) ? \
-			       &sem3v3power : &sem5v0power;
-	if (state == 0 && (down_trylock(sem) || flags)) {
-		gpio_direction_output(gpio, 0);
-		printk(KERN_NOTICE "turning off gpio %i\n", gpio);
-	} else {
-		up(sem);
-		gpio_direction_output(gpio, 1);
-		printk(KERN_NOTICE "turning on gpio %i\n", gpio);
+static s8 create_ccard(u8 index)
+{
+	struct ccard *card = kzalloc(sizeof(struct ccard), GFP_KERNEL);
+	if (card == NULL)
+		return 1;
+	card->index = index;
+
+	// the status page has to exist before anything it records changes
+	if (ccard_init_status(card))
+		ccard_err("status page of card %u unavailable\n", index);
+
+	// the card starts out awake, the 5v0 rail goes down once it is idle
+	ccard_init_power(card);
+
+	// the actuators report to the usage counters from the moment they
+	//   are initialized
+	ccard_init_usage(card);
+
+	// the probes of the card's devices look it up, so it has to be
+	//   reachable before the bus is attached
+	_cards[index] = card;
+
+	// attaching the bus registers the devices on it, which starts up all
+	//   the components of the card
+	if (ccard_init_bus(card)) {
+		_cards[index] = NULL;
+		ccard_cleanup_usage(card);
+		ccard_cleanup_power(card);
+		ccard_cleanup_status(card);
+		kfree(card);
+		return 1;
 	}
+
+	if (ccard_init_presence(card))
+		ccard_err("failed to start the presence monitor\n");
+
+	if (ccard_init_scheduler(card))
+		ccard_err("failed to start the command scheduler\n");
+
+	return 0;
 }
 
-void set_dsa_pwr(u8 state, s8 flags) {
-	set_power(ccard_3v3_gpio, state, flags);
+static void destroy_ccard(struct ccard *card)
+{
+	ccard_cleanup_scheduler(card);
+
+	ccard_cleanup_presence(card);
+
+	// the actuators are switched off through the bus as they go, so the
+	//   card mustn't go idle underneath them
+	ccard_power_hold(card);
+
+	// removing the clients cleans up the actuators on them
+	ccard_cleanup_bus(card);
+
+	ccard_cleanup_usage(card);
+
+	ccard_cleanup_power(card);
+
+	ccard_cleanup_status(card);
+
+	_cards[card->index] = NULL;
+
+	// the actuator state outlives presence changes, so it only goes with
+	//   the card
+	kfree(card->dsa);
+	kfree(card->mt);
+	kfree(card->bdot);
+	kfree(card->thruster);
+	kfree(card);
 }
 
-void set_5v0_pwr(u8 state, s8 flags) {
-	set_power(ccard_5v0_gpio, state, flags);
+struct ccard *ccard_get(u8 index)
+{
+	if (index >= CCARD_MAX_CARDS)
+		return NULL;
+
+	return _cards[index];
 }
 
 
+
 //
 // sysfs section
 //
 
 static void ccard_release_nav_dev(struct device *dev)
 {
-	printk(KERN_DEBUG "releasing nav device file\n");
+	ccard_dbg("releasing nav device file\n");
+}
+
+static void ccard_release_core_dev(struct device *dev)
+{
+	ccard_dbg("releasing c card device file\n");
+}
+
+static inline s8 create_ccard_core_class()
+{
+	struct class ccard = {
+		.name = "ccard",
+		.owner = THIS_MODULE,
+		.dev_release = ccard_release_core_dev,
+	};
+	_ccard_class = ccard;
+
+	return class_register(&_ccard_class);
+}
+
+static inline void remove_ccard_core_class()
+{
+	class_unregister(&_ccard_class);
+}
+
+struct class *ccard_core_class()
+{
+	return &_ccard_class;
 }
 
 static inline s8 create_ccard_nav_class()
@@ -136,12 +301,18 @@ static inline s8 create_ccard_nav_class()
 	};
 	_nav_class = nav;
 
-	return class_register(&_nav_class);
+	if (class_register(&_nav_class))
+		return 1;
+	_nav_ready = 1;
+	return 0;
 }
 
 static inline void remove_ccard_nav_class()
 {
+	if (!_nav_ready)
+		return;
 	class_unregister(&_nav_class);
+	_nav_ready = 0;
 }
 
 struct class *ccard_nav_class()
@@ -0,0 +1,78 @@
+// builds the expander decode tables from a pin map
+// decoding a register byte used to take a shift, a mask and an add per bit
+//   for every actuator, with these tables it is a couple of loads whatever
+//   pins the board uses
+// this file is compiled into the driver, which builds the tables once at
+//   load time, and into gen_decode, which checks them against the bit
+//   arithmetic at build time, so it must not depend on any kernel header
+//
+// by Mark Hill
+
+#include "ccard_pins.h"
+
+// returns bit <pin> of register value <value>
+// pins past the end of the register read as 0, same as the shift the
+//   driver used to do on the promoted byte
+static inline unsigned decode_bit(unsigned value, unsigned pin)
+{
+	return (pin < 8) ? (value >> pin) & 0x01 : 0;
+}
+
+// returns 1 << <pin>, or 0 if the pin is past the end of the register
+static inline unsigned char decode_mask(unsigned pin)
+{
+	return (pin < 8) ? (unsigned char)(1 << pin) : 0;
+}
+
+// fills <d> with the tables for the pins in <map>
+static void ccard_build_decode(const struct ccard_pin_map *map, \
+			       struct ccard_decode *d)
+{
+	// the input and output codes are the release bit in bit 0 and the
+	//   deploy bit in bit 1, the state table combines the two
+	for (int dsa = 0; dsa < CCARD_DSA_COUNT; dsa++) {
+		for (unsigned v = 0; v < CCARD_REG_VALUES; v++) {
+			d->dsa_in_code[dsa][v] = \
+				decode_bit(v, map->dsa_res_in[dsa]) | \
+				(decode_bit(v, map->dsa_dep_in[dsa]) << 1);
+			d->dsa_out_code[dsa][v] = \
+				decode_bit(v, map->dsa_res_out[dsa]) | \
+				(decode_bit(v, map->dsa_dep_out[dsa]) << 1);
+		}
+		d->dsa_res_mask[dsa] = decode_mask(map->dsa_res_out[dsa]);
+		d->dsa_dep_mask[dsa] = decode_mask(map->dsa_dep_out[dsa]);
+	}
+
+	// since its technically possible to run a deploy operation without
+	//   having first released the DSAs, the input release value is
+	//   ignored while a deploy operation is running
+	for (unsigned in = 0; in < 4; in++) {
+		for (unsigned out = 0; out < 4; out++) {
+			unsigned in_res = in & 0x01;
+			unsigned in_dep = in >> 1;
+			unsigned out_res = out & 0x01;
+			unsigned out_dep = out >> 1;
+			if (out_dep)
+				in_res = 0;
+			d->dsa_state_code[in][out] = (in_res << 1) + \
+						     (in_dep << 1) + \
+						     (in_dep << 3) + \
+						     out_res + (out_dep << 2);
+		}
+	}
+
+	// the state is a combination of the forward and reverse bits, with
+	//   the reverse bit being the high bit
+	for (int mt = 0; mt < CCARD_MT_COUNT; mt++) {
+		for (unsigned v = 0; v < CCARD_REG_VALUES; v++)
+			d->mt_decode[mt][v] = \
+				(decode_bit(v, map->mt_reverse[mt]) << 1) | \
+				decode_bit(v, map->mt_forward[mt]);
+		for (unsigned state = 0; state < 4; state++)
+			d->mt_encode[mt][state] = \
+				((state & 0x01) ? \
+				 decode_mask(map->mt_forward[mt]) : 0) | \
+				((state & 0x02) ? \
+				 decode_mask(map->mt_reverse[mt]) : 0);
+	}
+}
@@ -18,41 +18,165 @@
 #include<linux/sysfs.h>
 #include<linux/string.h>
 #include<linux/fs.h>
+#include<linux/list.h>
+#include<linux/mutex.h>
+#include<linux/ktime.h>
+#include<linux/cdev.h>
+#include<linux/eventfd.h>
+#include<linux/file.h>
+#include<linux/uaccess.h>
+#include<linux/seqlock.h>
+#include<linux/wait.h>
 
 #include "ccard.h"
+#include "ccard_trace.h"
+#include "ccard_pins.h"
+#include "ccard_dsa.h"
+#include "ccard_record.h"
 
 #define ccard_rel_dfl_timeout 12
 #define ccard_dep_dfl_timeout 10
-#define DSA_COUNT 2
-
-// defines the pin location for each value, which corresponds to the
-//   bit number on the device's registers
-// the value at index 0 is the corresponding value for DSA 1, and
-//   the value at each subsequent index 'n' is the corresponding value
-//   for DSA 'n + 1'
-// its a useless feature, because I don't think the cubesat will ever
-//   have more than 1 DSA, but who knows what the EXA has planned
-static const u8 _dsa_res_out[] = {0, 2};
-static const u8 _dsa_dep_out[] = {1, 3};
-static const u8 _dsa_res_in[] = {5, 7};
-static const u8 _dsa_dep_in[] = {6, 8};
-
-// flag indicating whether the DSA hardware has been properly
-//   configured
-// !0 = initialized, 0 = uninitialzed
-static int _dsa_initialized = 0;
+// how often a running operation reads the expander while it waits for the
+//   dsa to get where it is going, in ms
+#define DSA_POLL_MS 200
+#define DSA_COUNT CCARD_DSA_COUNT
+
+// current drawn from the 3V3 rail by a single release or deploy burn, and
+//   the total the rail is allowed to supply to the burns at once, in mA
+// with the defaults only one burn runs at a time
+#define ccard_burn_dfl_current 500
+#define ccard_rail_dfl_budget 500
+
+// priorities used to order queued operations, higher runs first
+// a release of a DSA that has already been released once is a retry and
+//   should never hold up a deploy
+#define DSA_PRIO_RERELEASE 0
+#define DSA_PRIO_RELEASE 1
+#define DSA_PRIO_DEPLOY 2
+
+// number of finished submissions whose results can still be read back
+#define DSA_RESULTS 32
+
+// the default pin locations for each dsa are in ccard_pins.h, board.c
+//   builds the tables that decode and set them from the module parameters
 
 // these store the user configured timeout values used by the system for the
 //   DSA operations
 // they are set to the defined value from ccard.h
+// like the rail budget below they are class attributes, shared by the dsas
+//   of every card
 static u32 _userReleaseTimeout = ccard_rel_dfl_timeout;
 static u32 _userDeployTimeout = ccard_dep_dfl_timeout;
 
-// stores the desired values for the DSAs
-static enum dsa_state _desiredDSAStates[DSA_COUNT];
-// stores the current state of the DSAs as determined by reading
-//   hardware state registers. see get_dsa_state(dsa)
-static enum dsa_state _currentDSAStates[DSA_COUNT];
+// the rail current budget and the current each burn draws from it, in mA
+// the number of burns allowed to overlap is budget / current, but at
+//   least one so that the queue always makes progress
+// every card has its own 3V3 rail, so the budget applies to each card
+static u32 _userRailBudget = ccard_rail_dfl_budget;
+static u32 _userBurnCurrent = ccard_burn_dfl_current;
+
+// a release or deploy operation, either waiting in the queue or holding
+//   a share of the 3V3 rail budget while it runs
+struct dsa_op {
+	struct list_head list;
+	// the card the dsa is on
+	struct ccard *card;
+	u8 dsa;
+	// 0 = release, 1 = deploy
+	u8 op;
+	u8 priority;
+	// time the operation was queued and, once running, started
+	struct timespec queued;
+	struct timespec started;
+};
+
+// an operation submitted through the char device, waiting to be told how
+//   the release or deploy it asked for ended
+// several submissions for the same dsa and operation share one burn
+struct dsa_waiter {
+	struct list_head list;
+	u64 id;
+	u8 dsa;
+	// 0 = release, 1 = deploy
+	u8 op;
+	// eventfd to signal, or NULL
+	struct file *eventfd;
+	ktime_t submitted;
+};
+
+// the dsas of one card
+// allocated the first time the card's expander is brought up and kept
+//   until the card goes away, so that a burn still running when the
+//   expander disappears has somewhere to finish
+struct card_dsa {
+	struct ccard *card;
+	// flag indicating whether the DSA hardware has been properly
+	//   configured
+	// !0 = initialized, 0 = uninitialzed
+	int initialized;
+
+	// the desired and current states are published under a seqlock, so
+	//   readers never block or touch the bus, and never see half of an
+	//   update, they just retry if a writer got in between
+	// use read_desired_state and read_current_state rather than the arrays
+	seqlock_t state_lock;
+	// stores the desired values for the DSAs
+	enum dsa_state desired_states[DSA_COUNT];
+	// stores the current state of the DSAs as determined by reading
+	//   hardware state registers. see update_dsa_state
+	enum dsa_state current_states[DSA_COUNT];
+	// woken whenever a state is published or an operation ends
+	// the operation threads wait on it between reads of the expander, and
+	//   cleanup waits on it for the operations to end
+	wait_queue_head_t state_wait;
+
+	// operations waiting for rail budget, ordered by priority and then by
+	//   the order they were requested in
+	struct list_head pending;
+	// operations currently burning
+	struct list_head running;
+	u8 running_count;
+	// protects both lists and the operations on them
+	struct mutex queue_lock;
+	// number of release operations started per DSA, used to spot
+	//   re-releases
+	u32 release_count[DSA_COUNT];
+
+	// submissions that haven't finished yet
+	struct list_head waiters;
+	// the results of the last DSA_RESULTS submissions, indexed by id
+	struct ccard_dsa_result results[DSA_RESULTS];
+	// the id of the last submission, 0 is never handed out
+	u64 next_id;
+	// protects the waiters, the results and next_id
+	// it may be taken with the queue lock held, but never the other way
+	//   around
+	struct mutex waiter_lock;
+
+	// the drvdata of each dsa device
+	struct ccard_unit units[DSA_COUNT];
+	// holds the dsa device structs
+	struct device *devices[DSA_COUNT];
+	// holds the device numbers
+	dev_t dev[DSA_COUNT];
+	// the char device both dsas share, for submitting operations
+	struct cdev cdev;
+};
+
+// finishes every submission for operation <op> on DSA <dsa> with
+//   <outcome>, and signals their eventfds
+static void complete_dsa_waiters(struct ccard *card, u8 dsa, u8 op, \
+				 enum ccard_dsa_outcome outcome, s64 burn_ns);
+
+// adds an operation for DSA <dsa> to the queue and starts whatever the
+//   rail budget allows
+// returns 0 on success or 1 if the operation couldn't be queued
+static int queue_dsa_op(struct ccard *card, u8 dsa, u8 op);
+// drops any queued (not yet running) operation for DSA <dsa>
+static void cancel_dsa_op(struct ccard *card, u8 dsa);
+// starts queued operations until the rail budget is used up
+// must be called with the queue lock held
+static void dispatch_dsa_ops(struct ccard *card);
 
 // this function is called when a discrepancy
 //   in the desired and current DSA states is found for
@@ -62,16 +186,23 @@ static enum dsa_state _currentDSAStates[DSA_COUNT];
 // returns 0 on success, indicating that it will (or has) attempted
 //   to correct the discrepancy
 // if it fails for any reason, it will return -1
-static int correct_dsa(u8 dsa);
+static int correct_dsa(struct ccard *card, u8 dsa);
 
 // holds the class object
+// the class is shared by every card, it is registered by the first card
+//   to bring its dsas up and unregistered by the last one
 static struct class _dsa_class;
-// holds the dsa device structs
-static struct device *_dsa0;
-static struct device *_dsa1;
-// holds the device numbers
-static dev_t _dev_dsa0;
-static dev_t _dev_dsa1;
+static u8 _dsa_class_users = 0;
+static DEFINE_MUTEX(_dsa_class_lock);
+// char device file operations
+static int open_dsa(struct inode *inode, struct file *file);
+static long ioctl_dsa(struct file *file, unsigned int cmd, unsigned long arg);
+
+static const struct file_operations _dsa_fops = {
+	.owner = THIS_MODULE,
+	.open = open_dsa,
+	.unlocked_ioctl = ioctl_dsa,
+};
 // callback function for attributes
 static ssize_t read_dsa_state(struct device *dev, \
 			      struct device_attribute *attr, \
@@ -82,12 +213,19 @@ static ssize_t read_target_dsa_state(struct device *dev, \
 static ssize_t write_target_dsa_state(struct device *dev, \
 				      struct device_attribute *attr, \
 				      const char *buf, size_t count);
+static ssize_t read_dsa_queue(struct device *dev, \
+			      struct device_attribute *attr, char *buf);
+static ssize_t write_dsa_refresh(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count);
 
 // stores the device attributes
 static DEVICE_ATTR(current_state, S_IRUSR, read_dsa_state, \
 		   write_target_dsa_state);
 static DEVICE_ATTR(desired_state, S_IRUSR | S_IWUSR, read_target_dsa_state, \
 		   write_target_dsa_state);
+static DEVICE_ATTR(queue, S_IRUSR, read_dsa_queue, NULL);
+static DEVICE_ATTR(refresh, S_IWUSR, NULL, write_dsa_refresh);
 // callback function for the dsa attributes
 static ssize_t read_dsa_release_timeout(struct class *class, char *buf);
 static ssize_t write_dsa_release_timeout(struct class *class, const char *buf, \
@@ -97,175 +235,248 @@ static ssize_t read_dsa_deploy_timeout(struct class *class, char *buf);
 
 static ssize_t write_dsa_deploy_timeout(struct class *class, const char *buf, \
 					size_t count);
+
+static ssize_t read_dsa_rail_budget(struct class *class, char *buf);
+static ssize_t write_dsa_rail_budget(struct class *class, const char *buf, \
+				     size_t count);
+
+static ssize_t read_dsa_burn_current(struct class *class, char *buf);
+static ssize_t write_dsa_burn_current(struct class *class, const char *buf, \
+				      size_t count);
 // stores the class attributes
 static CLASS_ATTR(release_timeout, S_IRUSR | S_IWUSR, \
 		  read_dsa_release_timeout, write_dsa_release_timeout);
 static CLASS_ATTR(deploy_timeout, S_IRUSR | S_IWUSR, \
 		  read_dsa_deploy_timeout, write_dsa_deploy_timeout);
+static CLASS_ATTR(rail_budget, S_IRUSR | S_IWUSR, \
+		  read_dsa_rail_budget, write_dsa_rail_budget);
+static CLASS_ATTR(burn_current, S_IRUSR | S_IWUSR, \
+		  read_dsa_burn_current, write_dsa_burn_current);
 
 // creates the sysfs interface for the dsas
-static inline void create_dsa_devices(void);
+static inline void create_dsa_devices(struct card_dsa *cd);
 // removes the sysfs objects
-static inline void remove_dsa_devices(void);
+static inline void remove_dsa_devices(struct card_dsa *cd);
 
 
 
 
 // sets the initial state of the GPIO expander and initializes configuration values
-s8 init_dsa()
+s8 init_dsa(struct ccard *card)
 {
-	printk(KERN_DEBUG "initializing dsa hardware\n");
+	ccard_dbg("initializing dsa hardware\n");
+	if (card->dsa == NULL) {
+		struct card_dsa *cd = kzalloc(sizeof(struct card_dsa), GFP_KERNEL);
+		if (cd == NULL)
+			return 1;
+		cd->card = card;
+		seqlock_init(&cd->state_lock);
+		init_waitqueue_head(&cd->state_wait);
+		INIT_LIST_HEAD(&cd->pending);
+		INIT_LIST_HEAD(&cd->running);
+		mutex_init(&cd->queue_lock);
+		INIT_LIST_HEAD(&cd->waiters);
+		mutex_init(&cd->waiter_lock);
+		card->dsa = cd;
+	}
+	struct card_dsa *cd = card->dsa;
+
 	// skip initialization if it has already been done
-	if (_dsa_initialized)
+	if (cd->initialized)
 		return 0;
 
 	// make sure the 3V3 power supply is off
-	set_dsa_pwr(0, 1);
+	set_dsa_pwr(card, 0, 1);
 
 	// initializes the pins as inputs or outputs, respectively
 	// setting a pin as an input requires a write of 1, while setting
 	//   it as an output requires a write of 0
-	s8 cfgval = 0xf0;
-	s8 cfgreg = 0x03;
-	s8 cfgbuf[] = {cfgreg, cfgval};
-	s8 outval = 0x00;
-	s8 outreg = 0x01;
-	s8 outbuf[] = {outreg, outval};
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
+	// both go out in one transfer where the transport can
+	u8 regs[] = {0x03, 0x01};
+	u8 vals[] = {0xf0, 0x00};
+	if (ccard_lock_bus(card, CCARD_BUS_HOUSEKEEPING)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
 		return 1;
-	} else if (i2c_master_send(dsa_expdr(), cfgbuf, 2) < 2 || \
-	    i2c_master_send(dsa_expdr(), outbuf, 2) < 2) {
-		printk(KERN_ERR "failed to configure DSA GPIO expander\n");
-		ccard_unlock_bus();
+	} else if (ccard_write_regs(dsa_expdr(card), regs, vals, 2)) {
+		ccard_err("failed to configure DSA GPIO expander\n");
+		ccard_unlock_bus(card);
 		return -1;
 	}
-	ccard_unlock_bus();
+	ccard_unlock_bus(card);
 
-	create_dsa_devices();
+	create_dsa_devices(cd);
 
-	printk(KERN_NOTICE "dsa initialization successful\n");
+	ccard_notice("dsa initialization successful\n");
 
-	_dsa_initialized = 1;
+	cd->initialized = 1;
 	return 0;
 }
 
 // cleans up and powers off the DSA hardware
-void cleanup_dsa()
+void cleanup_dsa(struct ccard *card)
 {
-	if (!_dsa_initialized)
+	struct card_dsa *cd = card->dsa;
+	if (cd == NULL || !cd->initialized)
 		return;
 	// since the update threads will exit when they detect a
 	//   change in the desired state, the desired state is set to to
 	//   stowed so that they can be closed
-	remove_dsa_devices();
+	remove_dsa_devices(cd);
 
 	for (int i = 0; i < DSA_COUNT; i++) {
-		set_dsa_state(i, stowed);
+		set_dsa_state(card, i, stowed);
 	}
 
 	// now wait for the threads to close
-	msleep(1000);
+	// the state is freed with the card, so nothing may still be burning
+	//   when this returns
+	wait_event(cd->state_wait, ACCESS_ONCE(cd->running_count) == 0);
+
+	// anything still waiting was for an operation that will never run
+	for (int i = 0; i < DSA_COUNT; i++) {
+		complete_dsa_waiters(card, i, 0, CCARD_DSA_CANCELLED, 0);
+		complete_dsa_waiters(card, i, 1, CCARD_DSA_CANCELLED, 0);
+	}
 
 	// turn off the outputs
-	s8 offreg = 0x01;
-	s8 offval = 0x00;
-	s8 offbuf[] = {offreg, offval};
-	if (ccard_lock_bus())
-		printk(KERN_ERR "unable to lock i2c bus\n");
-	i2c_master_send(dsa_expdr(), offbuf, 2);
-	ccard_unlock_bus();
+	// if the bus can't be had they are left as they are, the threads that
+	//   drive them are gone and the power below is cut anyway
+	u8 offreg = 0x01;
+	u8 offval = 0x00;
+	if (ccard_lock_bus(card, CCARD_BUS_COMMAND)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
+	} else {
+		ccard_write_reg(dsa_expdr(card), offreg, offval);
+		ccard_unlock_bus(card);
+	}
 
-	set_dsa_pwr(0, 1);
+	set_dsa_pwr(card, 0, 1);
 
 	// set the isInitialized flag off
-	_dsa_initialized = 0;
+	cd->initialized = 0;
+}
+
+
+// returns the entry for <dsa> in <states>, one of the arrays published
+//   under the state lock of <cd>
+static inline enum dsa_state read_published_state(struct card_dsa *cd, \
+						  const enum dsa_state *states, \
+						  u8 dsa)
+{
+	unsigned seq;
+	enum dsa_state state;
+
+	do {
+		seq = read_seqbegin(&cd->state_lock);
+		state = states[dsa];
+	} while (read_seqretry(&cd->state_lock, seq));
+
+	return state;
 }
 
+// the last state read from the expander, without reading it again
+static inline enum dsa_state read_current_state(struct card_dsa *cd, u8 dsa)
+{
+	return read_published_state(cd, cd->current_states, dsa);
+}
+
+static inline enum dsa_state read_desired_state(struct card_dsa *cd, u8 dsa)
+{
+	return read_published_state(cd, cd->desired_states, dsa);
+}
 
 // since the only 4 bits describe each dsa, but all registers have to be read,
 //   it is more efficient to update them all at the same time
-static inline void update_dsa_state(void)
+// <cause> is passed on to the event for every dsa whose state changed
+static inline void update_dsa_state(struct ccard *card, enum ccard_cause cause)
 {
+	struct card_dsa *cd = card->dsa;
 	// the TCA9554A represents the current state of its
 	//   input registers as one byte, and the value of its
 	//   output registers as a second byte
 	// both are needed to determine the state of the software
-	s8 inreg[] = {0x00};
-	s8 outreg[] = {0x01};
-	s8 inbuf[1];
-	s8 outbuf[1];
+	u8 inreg = 0x00;
+	u8 outreg = 0x01;
+	u8 inval;
+	u8 outval;
 	// the first value in this array is the input value, second
 	//   value is the output value
 	u8 gpioState[2] = {};
 
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
-	} else if (i2c_master_send(dsa_expdr(), inreg, 1) < 1 || \
-	    i2c_master_recv(dsa_expdr(), inbuf, 1) < 1 || \
-	    i2c_master_send(dsa_expdr(), outreg, 1) < 1 || \
-	    i2c_master_recv(dsa_expdr(), outbuf, 1) < 1) {
-		printk(KERN_ERR "couldn't read dsa pins in update_dsa_state\n");
-	} else {
-		gpioState[0] = inbuf[0];
-		gpioState[1] = outbuf[0];
+	if (ccard_lock_bus(card, CCARD_BUS_HOUSEKEEPING)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
+		return;
+	}
+	int ret = ccard_read_reg(dsa_expdr(card), inreg, &inval);
+	if (ret == 0)
+		ret = ccard_read_reg(dsa_expdr(card), outreg, &outval);
+	if (ret) {
+		// decoding zeros here would report every dsa as stowed, so the
+		//   last known states are kept instead
+		// a sleeping card has no inputs in its register cache, and
+		//   nothing burns while it sleeps, so that isn't worth a message
+		if (ret != -EAGAIN)
+			ccard_err_rl("couldn't read dsa pins in update_dsa_state\n");
+		ccard_unlock_bus(card);
+		return;
+	}
+	gpioState[0] = inval;
+	gpioState[1] = outval;
+
+	enum dsa_state old_states[DSA_COUNT];
+	enum dsa_state new_states[DSA_COUNT];
+	for (int i = 0; i < DSA_COUNT; i++) {
+		// the code tables pick out the release and deploy bits of this
+		//   dsa, and the state table combines them the same way the enum
+		//   raw values are laid out
+		// since its technically possible to run a deploy operation without
+		//   having first released the DSAs, the state table ignores the
+		//   input release value while a deploy operation is running
+		u8 in_code = _decode.dsa_in_code[i][gpioState[0]];
+		u8 out_code = _decode.dsa_out_code[i][gpioState[1]];
+		new_states[i] = _decode.dsa_state_code[in_code][out_code];
+	}
+
+	// publishing while the bus is still held keeps the published states
+	//   in the order the expander was read in
+	write_seqlock(&cd->state_lock);
+	for (int i = 0; i < DSA_COUNT; i++) {
+		old_states[i] = cd->current_states[i];
+		cd->current_states[i] = new_states[i];
 	}
-	ccard_unlock_bus();
+	write_sequnlock(&cd->state_lock);
+	ccard_unlock_bus(card);
 
+	wake_up_all(&cd->state_wait);
 	for (int i = 0; i < DSA_COUNT; i++) {
-		// uses the bit number (big endian format) to shift the bits
-		//   and determine the corresponding value
-		u16 in_res_val = (gpioState[0] >> \
-				  _dsa_res_in[i]) & 0b0001;
-		u16 in_dep_val = (gpioState[0] >> \
-				  _dsa_dep_in[i]) & 0b0001;
-		u16 out_res_val = (gpioState[1] >> \
-				   _dsa_res_out[i]) & 0b0001;
-		u16 out_dep_val = (gpioState[1] >> \
-				   _dsa_dep_out[i]) & 0b0001;
-
-		// because its technically possible to run a deploy operation without
-		//   having first released the DSAs, the raw enumvalue for deploying
-		//   ignores the input release value, so when a deploy operation is
-		//   running, the input release value must be set to zero regardless
-		//   of its true value
-		if (out_dep_val == 1)
-			in_res_val = 0;
-
-		// now, thanks to bitwise operations and a clever setup of the DSAState enum
-		//   raw values, creating the proper state value is easy
-		// to understand why the bits are shifted by the amount here, see
-		//   the raw enum values in cleanccard.h
-		enum dsa_state state = (in_res_val << 1) + \
-				       (in_dep_val << 1) + \
-				       (in_dep_val << 3) + \
-				       out_res_val + (out_dep_val << 2);
-
-		// now set the corresponding current state value
-		_currentDSAStates[i] = state;
+		if (old_states[i] != new_states[i])
+			ccard_notify(card, act_dsa, i, old_states[i], \
+				     new_states[i], cause);
 	}
 }
 
 // gets the current dsa state after calling update_dsa_state
-enum dsa_state get_dsa_state(u8 dsa)
+enum dsa_state get_dsa_state(struct ccard *card, u8 dsa)
 {
-	if (!_dsa_initialized)
+	struct card_dsa *cd = card->dsa;
+	if (cd == NULL || !cd->initialized)
 		return stowed;
 
 	// check to make sure the dsa isn't out of bounds
 	if (dsa >= DSA_COUNT) {
-		printk(KERN_ERR "dsa %i does not exist\n", dsa);
+		ccard_err_rl("dsa %i does not exist\n", dsa);
 		return -1;
 	}
 
-	update_dsa_state();
+	update_dsa_state(card, cause_observed);
 
-	return _currentDSAStates[dsa];
+	return read_current_state(cd, dsa);
 }
 
-s8 set_dsa_state(u8 dsa, enum dsa_state desiredState)
+s8 set_dsa_state(struct ccard *card, u8 dsa, enum dsa_state desiredState)
 {
-	if (!_dsa_initialized)
+	struct card_dsa *cd = card->dsa;
+	if (cd == NULL || !cd->initialized)
 		return -1;
 	// first, we need to check the input to ensure it makes sense
 	//   and isn't going to put the system in an invalid state
@@ -273,243 +484,568 @@ s8 set_dsa_state(u8 dsa, enum dsa_state desiredState)
 	// and if you're wondering why this isn't in the lock,
 	//   its because the lock is handled by get_dsa_state
 	if (dsa >= DSA_COUNT) {
-		printk(KERN_ERR "dsa %i does not exist\n", dsa);
+		ccard_err_rl("dsa %i does not exist\n", dsa);
 		return -1;
 	}
 
-	enum dsa_state currentState = get_dsa_state(dsa);
+	enum dsa_state currentState = get_dsa_state(card, dsa);
 	// stores the return value, which is determined by whether or
 	//   not the input makes sense
-	int returnValue = -1;
-	if (desiredState != released && desiredState != deployed) {
-		printk(KERN_ERR "impossible desired state in set_dsa_state\n");
-		return returnValue;
+	int returnValue = 0;
+	// stowed is accepted as well, it cancels any queued or running
+	//   operation for the dsa
+	if (desiredState != stowed && desiredState != released && \
+	    desiredState != deployed) {
+		ccard_err_rl("impossible desired state in set_dsa_state\n");
+		return -1;
 	}
 	if (desiredState == deployed && currentState == stowed) {
-		printk(KERN_ERR "performing dply op while dsa %i is stowed\n", \
+		ccard_warn_rl("performing dply op while dsa %i is stowed\n", \
 				dsa);
 		returnValue = 3;
 	}
 
 	// write the desired state to the appropriate array index
-	_desiredDSAStates[dsa] = desiredState;
-	correct_dsa(dsa);
+	write_seqlock(&cd->state_lock);
+	cd->desired_states[dsa] = desiredState;
+	write_sequnlock(&cd->state_lock);
+	// a running operation that is no longer wanted stops right away
+	//   rather than at its next read of the expander
+	wake_up_all(&cd->state_wait);
+	correct_dsa(card, dsa);
 
 	return returnValue;
 }
 
 
-static s8 shutoff_dsa(u8 dsa)
+static s8 shutoff_dsa(struct ccard *card, u8 dsa)
 {
 	// flag indicating failure condition
 	s8 failure = 0;
 
-	s8 valreg[] = {0x01};
+	u8 valreg = 0x01;
 	// read the existing value so that only the bit for this operation
 	//   is changed
-	s8 valbuf[1];
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
+	u8 val;
+	if (ccard_lock_bus(card, CCARD_BUS_COMMAND)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
 		return 1;
 	}
-	if (i2c_master_send(dsa_expdr(), valreg, 1) > 1 || \
-		 i2c_master_recv(dsa_expdr(), valbuf, 1) > 1) {
+	if (!ccard_read_reg(dsa_expdr(card), valreg, &val)) {
 		// mask used to set proper bits off
-		u8 mask = (0x01 << _dsa_res_out[dsa]) + \
-			  (0x01 << _dsa_dep_out[dsa]);
-		// now change the proper bit to enable release
-		valbuf[0] = (s8)((u8)valbuf[0] & mask);
+		u8 mask = _decode.dsa_res_mask[dsa] | _decode.dsa_dep_mask[dsa];
+		// now clear the release and deploy bits for this dsa only
 		// write the changed value
-		s8 writebuf[] = {valreg[0], valbuf[0]};
-		failure = i2c_master_send(dsa_expdr(), writebuf, 2) == 2;
+		failure = ccard_write_reg(dsa_expdr(card), valreg, val & ~mask) != 0;
 	} else {
-		printk(KERN_EMERG "failed to shut off power to dsa %i\n", dsa);
-		printk(KERN_EMERG "disabling 3v3 to protect c card\n");
+		failure = 1;
+	}
+	if (failure) {
+		ccard_emerg("failed to shut off power to dsa %i\n", dsa);
+		ccard_emerg("disabling 3v3 to protect c card\n");
 	}
-	ccard_unlock_bus();
+	ccard_unlock_bus(card);
 
 	return failure;
 }
 
 
 // for op, 0 = release, 1 = deploy
+// stores the time the switch was burning in <burn_ns> and returns how the
+//   operation ended
 // inlined to allow compiler to optimize away unnessecary variables
-static inline int exec_dsa_op(u8 dsa, u8 op)
+static inline enum ccard_dsa_outcome exec_dsa_op(struct ccard *card, u8 dsa, \
+						 u8 op, s64 *burn_ns)
 {
+	struct card_dsa *cd = card->dsa;
 	char *opstr = (op == 0) ? "release" : "deploy";
 	// log that the thread was started
-	printk(KERN_NOTICE "%s thread successfully created\n", opstr);
+	ccard_dbg("%s thread successfully created\n", opstr);
 
 	const s8 timeout = (op == 0) ? _userReleaseTimeout : _userDeployTimeout;
 	const enum dsa_state desired = (op == 0) ? released : deployed;
-	const u8 *pins = (op == 0) ? \
-			 _dsa_res_out : _dsa_dep_out;
+	const u8 *masks = (op == 0) ? \
+			  _decode.dsa_res_mask : _decode.dsa_dep_mask;
 
 	// get the start time, which will be used to determine if the operation has timed out
 	struct timespec start = current_kernel_time();
 
+	*burn_ns = 0;
+
 	// turn on 3V3 supply
-	set_dsa_pwr(1, 0);
+	set_dsa_pwr(card, 1, 0);
 
 	// turn on the GPIO on the expander which will enable power to
 	//   the proper switch for the operation
-	s8 valreg[] = {0x01};
+	u8 valreg = 0x01;
 	// read the existing value so that only the bit for this operation
 	//   is changed
-	s8 valbuf[1];
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
-		return 1;
-	} else if (i2c_master_send(dsa_expdr(), valreg, 1) < 1 || \
-	    i2c_master_recv(dsa_expdr(), valbuf, 1) < 1) {
-		printk(KERN_ERR "error reading dsa state for dsa %i", dsa);
-		ccard_unlock_bus();
-		return 1;
+	u8 val;
+	if (ccard_lock_bus(card, CCARD_BUS_COMMAND)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
+		set_dsa_pwr(card, 0, 0);
+		return CCARD_DSA_BUS_ERROR;
+	} else if (ccard_read_reg(dsa_expdr(card), valreg, &val)) {
+		ccard_err_rl("error reading dsa state for dsa %i\n", dsa);
+		ccard_unlock_bus(card);
+		set_dsa_pwr(card, 0, 0);
+		return CCARD_DSA_BUS_ERROR;
 	}
 
 	// now change the proper bit to enable release
-	u8 mask = (0x01 << pins[dsa]);
-	valbuf[0] = (s8)((u8)valbuf[0] | mask);
+	u8 mask = masks[dsa];
 	// write the changed value
-	s8 writebuf[] = {valreg[0], valbuf[0]};
-	if (i2c_master_send(dsa_expdr(), writebuf, 2) < 2) {
-		printk(KERN_ERR "dsa %i %s operation failed\n", dsa, opstr);
-		ccard_unlock_bus();
-		return 1;
+	if (ccard_write_reg(dsa_expdr(card), valreg, val | mask)) {
+		ccard_err("dsa %i %s operation failed\n", dsa, opstr);
+		ccard_unlock_bus(card);
+		set_dsa_pwr(card, 0, 0);
+		return CCARD_DSA_BUS_ERROR;
 	}
-	ccard_unlock_bus();
+	ccard_unlock_bus(card);
+	ccard_usage_dsa(card, dsa, op, 1);
+	ktime_t burn_start = ktime_get();
+	trace_ccard_dsa_op_start(dsa, op);
 
-	s8 retval = 0;
+	enum ccard_dsa_outcome outcome = CCARD_DSA_SUCCESS;
 	// loop that runs until the operaton has completed
 	while (1) {
 		// check the current time
 		struct timespec currentTime = current_kernel_time();
 		if (currentTime.tv_sec - start.tv_sec > timeout) {
-			printk(KERN_NOTICE "dsa %i %s operation timed out", \
+			ccard_notice("dsa %i %s operation timed out", \
 					dsa, opstr);
-			retval = 1;
+			outcome = CCARD_DSA_TIMEOUT;
 			break;
 		}
 		// check the current state
-		if (_currentDSAStates[dsa] == desired) {
-			printk(KERN_NOTICE "dsa %i %s operation successful", \
+		// nothing else is guaranteed to refresh the state while the
+		//   operation runs, so read the hardware here
+		update_dsa_state(card, cause_dsa_op);
+		if (read_current_state(cd, dsa) == desired) {
+			ccard_notice("dsa %i %s operation successful", \
 					dsa, opstr);
-			retval = 0;
+			outcome = CCARD_DSA_SUCCESS;
 			break;
 		}
 		// check if the user no longer wants a deploy operation to occur
-		if (_desiredDSAStates[dsa] != desired) {
-			printk(KERN_NOTICE "dsa %i %s operation terminated", \
+		if (read_desired_state(cd, dsa) != desired) {
+			ccard_notice("dsa %i %s operation terminated", \
 					dsa, opstr);
-			retval = 1;
+			outcome = CCARD_DSA_CANCELLED;
 			break;
 		}
 
-		// no need to hog resources
-		msleep(200);
+		// no need to hog resources, sleep until the next read of the
+		//   expander unless the request changes or another reader sees
+		//   the dsa get there first
+		wait_event_timeout(cd->state_wait, \
+				   read_desired_state(cd, dsa) != desired || \
+				   read_current_state(cd, dsa) == desired, \
+				   msecs_to_jiffies(DSA_POLL_MS));
 	}
 
 	// turn the switch off
-	set_dsa_pwr(0, shutoff_dsa(dsa));
+	set_dsa_pwr(card, 0, shutoff_dsa(card, dsa));
+	ccard_usage_dsa(card, dsa, op, 0);
+
+	*burn_ns = ktime_to_ns(ktime_sub(ktime_get(), burn_start));
+	if (outcome == CCARD_DSA_TIMEOUT)
+		trace_ccard_dsa_op_timeout(dsa, op, *burn_ns);
+	else
+		trace_ccard_dsa_op_complete(dsa, op, read_current_state(cd, dsa), \
+					    *burn_ns);
 
-	return retval;
+	return outcome;
 }
 
-// this function is run in its own thread and handles releasing the specified DSA
+// this function is run in its own thread and handles a release or deploy
+//   operation that the dispatcher has granted a share of the rail budget
 // it will automatically exit upon success, timeout, or if the desiredState changes to something
-//   other than released, which usually means a termination request
-// expects a pointer to an int containing the DSA number to release
-// frees the memory associated with the pointer after recording the value
+//   other than the target of the operation, which usually means a termination request
+// expects a pointer to the dsa_op on the running list, which it removes and
+//   frees when the operation is over, handing its budget to the next operation
 // returns the result of the operation
-static int res_dsa(void *dsa)
+static int dsa_op_thread(void *data)
 {
-	// store the dsa and free the pointer
-	u8 d = *(u8 *)dsa;
-	kfree(dsa);
+	struct dsa_op *op = (struct dsa_op *)data;
+	struct ccard *card = op->card;
+	struct card_dsa *cd = card->dsa;
+	const u8 d = op->dsa;
+	const enum dsa_state target = (op->op == 0) ? released : deployed;
+
+	s64 burn_ns;
+	enum ccard_dsa_outcome outcome = exec_dsa_op(card, d, op->op, &burn_ns);
+	s8 flag = outcome != CCARD_DSA_SUCCESS;
+	if (outcome == CCARD_DSA_BUS_ERROR)
+		ccard_log_record(card, CCARD_LOG_DSA_OP, d, op->op);
+
+	// the submitters hear about it before the rollback below, which
+	//   would otherwise report them as cancelled
+	complete_dsa_waiters(card, d, op->op, outcome, burn_ns);
+
+	// only roll back if nobody asked for something else in the meantime,
+	//   otherwise the new request would be cancelled
+	if (flag && read_desired_state(cd, d) == target)
+		set_dsa_state(card, d, stowed);
+
+	mutex_lock(&cd->queue_lock);
+	list_del(&op->list);
+	cd->running_count--;
+	kfree(op);
+	dispatch_dsa_ops(card);
+	mutex_unlock(&cd->queue_lock);
+	wake_up_all(&cd->state_wait);
 
-	s8 flag = exec_dsa_op(d, 0);
+	return flag;
+}
 
-	if (flag)
-		set_dsa_state(d, stowed);
+// returns the number of operations allowed to burn at the same time
+static inline u8 dsa_op_slots(void)
+{
+	u32 slots = (_userBurnCurrent == 0) ? \
+		    DSA_COUNT : _userRailBudget / _userBurnCurrent;
 
-	return flag;
+	if (slots < 1)
+		slots = 1;
+	if (slots > DSA_COUNT)
+		slots = DSA_COUNT;
+
+	return slots;
 }
 
-// this function is run in its own thread and handles deploying the specified DSA
-// it will automatically exit upon success, timeout, or if the desiredState changes to something
-//   other than released, which usually means a termination request
-// expects a pointer to an int containing the DSA number to deploy
-// frees the memory associated with the pointer after recording the value
-// returns the result of the operation
-static int dep_dsa(void *dsa)
+// returns the operation for DSA <dsa> on <list>, or NULL if there is none
+// must be called with the queue lock held
+static inline struct dsa_op *find_dsa_op(struct list_head *list, u8 dsa)
 {
-	// store the dsa and free the pointer
-	u8 d = *(u8 *)dsa;
-	kfree(dsa);
+	struct dsa_op *op;
+
+	list_for_each_entry(op, list, list) {
+		if (op->dsa == dsa)
+			return op;
+	}
 
-	s8 flag = exec_dsa_op(d, 1);
+	return NULL;
+}
 
-	if (flag)
-		set_dsa_state(d, stowed);
+// inserts <op> behind every pending operation of the same or higher priority
+// must be called with the queue lock held
+static inline void insert_dsa_op(struct card_dsa *cd, struct dsa_op *op)
+{
+	struct dsa_op *pos;
 
-	return flag;
+	list_for_each_entry(pos, &cd->pending, list) {
+		if (pos->priority < op->priority) {
+			list_add_tail(&op->list, &pos->list);
+			return;
+		}
+	}
+	list_add_tail(&op->list, &cd->pending);
+}
+
+static void dispatch_dsa_ops(struct ccard *card)
+{
+	struct card_dsa *cd = card->dsa;
+	struct dsa_op *op;
+	struct dsa_op *next;
+	const u8 slots = dsa_op_slots();
+
+	list_for_each_entry_safe(op, next, &cd->pending, list) {
+		if (cd->running_count >= slots)
+			break;
+		// the same dsa never burns twice at once, a new request for a
+		//   dsa waits until the previous operation has finished
+		if (find_dsa_op(&cd->running, op->dsa))
+			continue;
+
+		list_move_tail(&op->list, &cd->running);
+		cd->running_count++;
+		op->started = current_kernel_time();
+		if (op->op == 0)
+			cd->release_count[op->dsa]++;
+
+		struct task_struct *t = (op->op == 0) ? \
+			kthread_run(&dsa_op_thread, op, "res_dsa%u.%i", \
+				    card->index, op->dsa) : \
+			kthread_run(&dsa_op_thread, op, "dply_dsa%u.%i", \
+				    card->index, op->dsa);
+		if (IS_ERR(t)) {
+			ccard_err("failed to create dsa %i op thread\n", \
+					op->dsa);
+			complete_dsa_waiters(card, op->dsa, op->op, \
+					     CCARD_DSA_FAILED, 0);
+			list_del(&op->list);
+			cd->running_count--;
+			kfree(op);
+			wake_up_all(&cd->state_wait);
+		}
+	}
+}
+
+static int queue_dsa_op(struct ccard *card, u8 dsa, u8 op)
+{
+	struct card_dsa *cd = card->dsa;
+	u8 priority = (op == 1) ? DSA_PRIO_DEPLOY : \
+		      (cd->release_count[dsa] > 0) ? DSA_PRIO_RERELEASE : \
+		      DSA_PRIO_RELEASE;
+
+	mutex_lock(&cd->queue_lock);
+
+	// a running operation with the same target already covers the request
+	struct dsa_op *running = find_dsa_op(&cd->running, dsa);
+	if (running && running->op == op) {
+		mutex_unlock(&cd->queue_lock);
+		ccard_dbg("dsa %i op %i already running\n", dsa, op);
+		return 0;
+	}
+
+	// only the latest request for a dsa is kept in the queue, it keeps
+	//   its place if the operation doesn't change
+	struct dsa_op *queued = find_dsa_op(&cd->pending, dsa);
+	if (queued && queued->op == op) {
+		mutex_unlock(&cd->queue_lock);
+		return 0;
+	} else if (queued) {
+		// the operation it replaces will never run
+		complete_dsa_waiters(card, dsa, queued->op, CCARD_DSA_CANCELLED, \
+				     0);
+		list_del(&queued->list);
+	} else {
+		queued = kmalloc(sizeof(struct dsa_op), GFP_KERNEL);
+		if (queued == NULL) {
+			mutex_unlock(&cd->queue_lock);
+			ccard_err("no memory for dsa %i operation\n", dsa);
+			complete_dsa_waiters(card, dsa, op, CCARD_DSA_FAILED, 0);
+			return 1;
+		}
+		queued->queued = current_kernel_time();
+	}
+	queued->card = card;
+	queued->dsa = dsa;
+	queued->op = op;
+	queued->priority = priority;
+	insert_dsa_op(cd, queued);
+
+	dispatch_dsa_ops(card);
+	mutex_unlock(&cd->queue_lock);
+
+	return 0;
+}
+
+static void cancel_dsa_op(struct ccard *card, u8 dsa)
+{
+	struct card_dsa *cd = card->dsa;
+	mutex_lock(&cd->queue_lock);
+	struct dsa_op *queued = find_dsa_op(&cd->pending, dsa);
+	if (queued) {
+		ccard_info("cancelled queued op for dsa %i\n", dsa);
+		// a queued operation is also dropped when the dsa already got
+		//   where it was going, which counts as a success
+		enum dsa_state target = (queued->op == 0) ? released : deployed;
+		complete_dsa_waiters(card, dsa, queued->op, \
+				     (read_current_state(cd, dsa) == target) ? \
+				     CCARD_DSA_SUCCESS : CCARD_DSA_CANCELLED, 0);
+		list_del(&queued->list);
+		kfree(queued);
+	}
+	mutex_unlock(&cd->queue_lock);
 }
 
-// this is called by dsa_monitor when a discrepancy is found
-static int correct_dsa(u8 dsa)
+// this is called by set_dsa_state whenever the desired state changes
+static int correct_dsa(struct ccard *card, u8 dsa)
 {
+	struct card_dsa *cd = card->dsa;
 	// check that dsa is in bounds
 	if (dsa >= DSA_COUNT) {
-		printk(KERN_ERR "invalid dsa in correct_dsa\n");
+		ccard_err("invalid dsa in correct_dsa\n");
 		return -1;
 	}
 
 	// determines the discrepancy and schedules an operation if needed
-	enum dsa_state cur = _currentDSAStates[dsa];
-	enum dsa_state des = _desiredDSAStates[dsa];
-	if (cur == releasing || cur == deploying) {
-		printk(KERN_ERR "possible duplicate call to correct_dsa. exiting\n");
+	// a running operation that no longer matches the desired state
+	//   notices the change and ends on its own
+	enum dsa_state cur = read_current_state(cd, dsa);
+	enum dsa_state des = read_desired_state(cd, dsa);
+	if (des == stowed) {
+		cancel_dsa_op(card, dsa);
+		if (cur == releasing || cur == deploying) {
+			ccard_err("power cut to DSA %i based on desired state = stowed\n", dsa);
+			shutoff_dsa(card, dsa);
+		}
 		return 0;
-
 	} else if (des == cur) {
-		printk(KERN_DEBUG "dsa %i needs no correction\n", dsa);
+		cancel_dsa_op(card, dsa);
+		// a submission for a state the dsa is already in is done
+		complete_dsa_waiters(card, dsa, (des == released) ? 0 : 1, \
+				     CCARD_DSA_SUCCESS, 0);
+		ccard_dbg("dsa %i needs no correction\n", dsa);
 		return 0;
-	} else if (1 || (des == released && cur == stowed)) {
-		printk(KERN_DEBUG "scheduling release operation\n");
-
-		// creates a thread to release the specified DSA and manage timeouts
-		u8 *d = (u8 *)kmalloc(sizeof(u8), GFP_KERNEL);
-		*d = dsa;
-		struct task_struct *res = kthread_run(&res_dsa, d, \
-						      "res_dsa%i", *d);
-		if (IS_ERR(res)) {
-			printk(KERN_ERR "failed to create res_dsa thread\n");
-			return 1;
-		} else {
-			return 0;
+	} else if (des == released) {
+		ccard_dbg("queueing release operation\n");
+		return queue_dsa_op(card, dsa, 0);
+	} else if (des == deployed) {
+		ccard_dbg("queueing deploy operation\n");
+		return queue_dsa_op(card, dsa, 1);
+	}
+
+	return 1;
+}
+
+static void complete_dsa_waiters(struct ccard *card, u8 dsa, u8 op, \
+				 enum ccard_dsa_outcome outcome, s64 burn_ns)
+{
+	struct card_dsa *cd = card->dsa;
+	ktime_t now = ktime_get();
+	struct dsa_waiter *w;
+	struct dsa_waiter *next;
+
+	mutex_lock(&cd->waiter_lock);
+	list_for_each_entry_safe(w, next, &cd->waiters, list) {
+		if (w->dsa != dsa || w->op != op)
+			continue;
+
+		struct ccard_dsa_result *r = &cd->results[w->id % DSA_RESULTS];
+		r->id = w->id;
+		r->op = op;
+		r->outcome = outcome;
+		r->state = read_current_state(cd, dsa);
+		r->burn_ns = burn_ns;
+		r->elapsed_ns = ktime_to_ns(ktime_sub(now, w->submitted));
+
+		if (w->eventfd) {
+			eventfd_signal(w->eventfd, 1);
+			fput(w->eventfd);
 		}
-	} else if (des == deployed && (cur == released || cur == stowed)) {
-		printk(KERN_DEBUG "scheduling deploy operation\n");
-
-		// creates a thread to deploy the specified DSA and manage timeouts
-		u8 *d = (u8 *)kmalloc(sizeof(u8), GFP_KERNEL);
-		*d = dsa;
-		struct task_struct *dply = kthread_run(&dep_dsa, d, \
-						       "dply_dsa%i", *d);
-		if (IS_ERR(dply)) {
-			printk(KERN_ERR "failed to create dep_dsa thread\n");
-			return 1;
+		list_del(&w->list);
+		kfree(w);
+	}
+	mutex_unlock(&cd->waiter_lock);
+}
+
+// fills in <res> for the submission with id res->id
+// returns 0 on success or -ENOENT if the id is unknown or too old
+static int find_dsa_result(struct card_dsa *cd, struct ccard_dsa_result *res)
+{
+	int ret = -ENOENT;
+	struct dsa_waiter *w;
+
+	mutex_lock(&cd->waiter_lock);
+	list_for_each_entry(w, &cd->waiters, list) {
+		if (w->id == res->id) {
+			memset(res, 0, sizeof(*res));
+			res->id = w->id;
+			res->op = w->op;
+			res->outcome = CCARD_DSA_PENDING;
+			res->state = read_current_state(cd, w->dsa);
+			res->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), \
+							       w->submitted));
+			ret = 0;
+			goto result_unlock;
 		}
-		else {
-			return 0;
+	}
+
+	if (res->id != 0 && cd->results[res->id % DSA_RESULTS].id == res->id) {
+		*res = cd->results[res->id % DSA_RESULTS];
+		ret = 0;
+	}
+
+result_unlock:
+	mutex_unlock(&cd->waiter_lock);
+	return ret;
+}
+
+// queues operation <sub->op> on DSA <dsa> the same way a write to
+//   desired_state does, and registers a waiter for it
+static long submit_dsa_op(struct ccard *card, u8 dsa, \
+			  struct ccard_dsa_submit *sub, \
+			  struct ccard_dsa_submit __user *usub)
+{
+	struct card_dsa *cd = card->dsa;
+	if (sub->op != CCARD_DSA_RELEASE && sub->op != CCARD_DSA_DEPLOY)
+		return -EINVAL;
+	if (!cd->initialized)
+		return -ENODEV;
+
+	struct dsa_waiter *w = kzalloc(sizeof(struct dsa_waiter), GFP_KERNEL);
+	if (w == NULL)
+		return -ENOMEM;
+	if (sub->eventfd >= 0) {
+		w->eventfd = eventfd_fget(sub->eventfd);
+		if (IS_ERR(w->eventfd)) {
+			long ret = PTR_ERR(w->eventfd);
+			kfree(w);
+			return ret;
 		}
-	} else if (des == stowed && (cur != released || cur != deployed)) {
-		printk(KERN_ERR "power cut to DSA %i based on desired state = stowed\n", dsa);
-		shutoff_dsa(dsa);
-		return 0;
 	}
+	w->dsa = dsa;
+	w->op = sub->op;
+	w->submitted = ktime_get();
+
+	mutex_lock(&cd->waiter_lock);
+	w->id = ++cd->next_id;
+	sub->id = w->id;
+	// the caller has to know the id before the operation can finish
+	if (copy_to_user(usub, sub, sizeof(*sub))) {
+		mutex_unlock(&cd->waiter_lock);
+		if (w->eventfd)
+			fput(w->eventfd);
+		kfree(w);
+		return -EFAULT;
+	}
+	list_add_tail(&w->list, &cd->waiters);
+	mutex_unlock(&cd->waiter_lock);
 
-	return 1;
+	trace_ccard_cmd_parsed(act_dsa, dsa, \
+			       (sub->op == CCARD_DSA_RELEASE) ? released : deployed);
+	set_dsa_state(card, dsa, \
+		      (sub->op == CCARD_DSA_RELEASE) ? released : deployed);
+
+	return 0;
+}
+
+// each card has its own char device, so the card comes from the cdev and
+//   the dsa from the minor
+static int open_dsa(struct inode *inode, struct file *file)
+{
+	struct card_dsa *cd = container_of(inode->i_cdev, struct card_dsa, cdev);
+	u8 dsa = iminor(inode) - MINOR(cd->dev[0]);
+
+	file->private_data = &cd->units[dsa];
+	return 0;
+}
+
+static long ioctl_dsa(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct ccard_unit *unit = file->private_data;
+	struct ccard *card = unit->card;
+	u8 dsa = unit->index;
+	void __user *uarg = (void __user *)arg;
+
+	switch (cmd) {
+	case CCARD_DSA_IOC_SUBMIT: {
+		ktime_t start = ktime_get();
+		struct ccard_dsa_submit sub;
+		if (copy_from_user(&sub, uarg, sizeof(sub)))
+			return -EFAULT;
+		trace_ccard_cmd_received(act_dsa, dsa, sizeof(sub));
+		long ret = submit_dsa_op(card, dsa, &sub, uarg);
+		ccard_record_command(card, CCARD_SRC_DSA_SUBMIT, dsa, &sub.op, \
+				     sizeof(sub.op), ret, start);
+		return ret;
+	}
+	case CCARD_DSA_IOC_RESULT: {
+		struct ccard_dsa_result res;
+		if (copy_from_user(&res, uarg, sizeof(res)))
+			return -EFAULT;
+		int ret = find_dsa_result(card->dsa, &res);
+		if (ret)
+			return ret;
+		if (copy_to_user(uarg, &res, sizeof(res)))
+			return -EFAULT;
+		return 0;
+	}
+	default:
+		return -ENOTTY;
+	}
 }
 
 
@@ -535,13 +1071,16 @@ static char *possible_dplying_str[1] = {"deploying\n"};
 static char *possible_rlsing_str[1] = {"releasing\n"};
 
 
+// shows the last published state, a read never waits for the bus
+// the operation threads publish while they run, otherwise the refresh file
+//   reads the expander again
 static ssize_t read_dsa_state(struct device *dev, \
 				 struct device_attribute *attr, char *buf)
 {
-	printk("reading dsa state\n");
+	ccard_dbg("reading dsa state\n");
 
-	s8 dsa = (dev == _dsa0) ? 0 : 1;
-	enum dsa_state state = get_dsa_state(dsa);
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+	enum dsa_state state = read_current_state(unit->card->dsa, unit->index);
 	char *state_str;
 
 	switch (state) {
@@ -572,15 +1111,26 @@ static ssize_t read_dsa_state(struct device *dev, \
 	return scnprintf(buf, 92, "[%s] stowed releasing released deploying deployed\n", str);
 }
 
+// any write reads the expander and publishes the states of every dsa on
+//   the card
+static ssize_t write_dsa_refresh(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count)
+{
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+	update_dsa_state(unit->card, cause_observed);
+	return count;
+}
+
 
 static ssize_t read_target_dsa_state(struct device *dev, \
 					struct device_attribute *attr, \
 					char *buf)
 {
-	printk("reading target dsa state\n");
+	ccard_dbg("reading target dsa state\n");
 
-	s8 dsa = (dev == _dsa0) ? 0 : 1;
-	enum dsa_state state = _desiredDSAStates[dsa];
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+	enum dsa_state state = read_desired_state(unit->card->dsa, unit->index);
 	char *state_str;
 
 	switch (state) {
@@ -609,13 +1159,16 @@ static ssize_t write_target_dsa_state(struct device *dev, \
 					struct device_attribute *attr, \
 					const char *buf, size_t count)
 {
-	printk(KERN_DEBUG "asked to write %s\n", buf);
+	ktime_t start = ktime_get();
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+	struct ccard *card = unit->card;
+	u8 dsa = unit->index;
+	trace_ccard_cmd_received(act_dsa, dsa, count);
 
 	if (strcmp(buf, "he called us first\n") == 0 || \
 	    strcmp(buf, "Ronnie Nader\n") == 0)
-		printk(KERN_NOTICE "I'm not your girlfriend\n");
+		ccard_notice("I'm not your girlfriend\n");
 
-	s8 dsa = (dev == _dsa0) ? 0 : 1;
 	enum dsa_state state = stowed;
 
 	char **arrays[3] = {
@@ -632,32 +1185,100 @@ static ssize_t write_target_dsa_state(struct device *dev, \
 		}
 	}
 
-	correct_dsa(dsa);
-	set_dsa_state(dsa, state);
-	printk(KERN_DEBUG "setting dsa %i to state %i\n", dsa, state);
+	trace_ccard_cmd_parsed(act_dsa, dsa, state);
+	set_dsa_state(card, dsa, state);
 
+	ccard_record_command(card, CCARD_SRC_DSA_DESIRED, dsa, buf, count, count, \
+			     start);
 	return count;
 
 }
 
+// seconds left until <op> is done, assuming it runs to its timeout
+static inline s32 dsa_op_remaining(struct dsa_op *op, struct timespec now)
+{
+	s32 timeout = (op->op == 0) ? _userReleaseTimeout : _userDeployTimeout;
+	s32 remaining = timeout - (s32)(now.tv_sec - op->started.tv_sec);
+
+	return (remaining < 0) ? 0 : remaining;
+}
+
+static ssize_t read_dsa_queue(struct device *dev, \
+			      struct device_attribute *attr, char *buf)
+{
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+	struct card_dsa *cd = unit->card->dsa;
+	u8 dsa = unit->index;
+	struct timespec now = current_kernel_time();
+	ssize_t len = 0;
+
+	mutex_lock(&cd->queue_lock);
+
+	struct dsa_op *op = find_dsa_op(&cd->running, dsa);
+	if (op) {
+		len = scnprintf(buf, PAGE_SIZE, "[running] %s %li seconds elapsed\n", \
+				(op->op == 0) ? "release" : "deploy", \
+				now.tv_sec - op->started.tv_sec);
+		goto queue_unlock;
+	}
+
+	// the estimate walks the queue handing each operation the slot that
+	//   frees up first, and assumes every burn runs to its timeout
+	s32 slot_free[DSA_COUNT] = {};
+	u8 slots = dsa_op_slots();
+	u8 used = 0;
+	list_for_each_entry(op, &cd->running, list) {
+		if (used < slots)
+			slot_free[used++] = dsa_op_remaining(op, now);
+	}
+
+	u32 position = 0;
+	list_for_each_entry(op, &cd->pending, list) {
+		position++;
+
+		u8 first = 0;
+		for (u8 i = 1; i < slots; i++) {
+			if (slot_free[i] < slot_free[first])
+				first = i;
+		}
+
+		if (op->dsa == dsa) {
+			len = scnprintf(buf, PAGE_SIZE, \
+					"[queued] %s position %u starts in %i seconds\n", \
+					(op->op == 0) ? "release" : "deploy", \
+					position, slot_free[first]);
+			goto queue_unlock;
+		}
+
+		slot_free[first] += (op->op == 0) ? \
+				    _userReleaseTimeout : _userDeployTimeout;
+	}
+
+	len = scnprintf(buf, PAGE_SIZE, "[idle] running queued\n");
+
+queue_unlock:
+	mutex_unlock(&cd->queue_lock);
+	return len;
+}
+
 static __always_inline ssize_t read_timeout(u32 timeout, char *buf)
 {
-	printk(KERN_DEBUG "reading timeout\n");
+	ccard_dbg("reading timeout\n");
 	return scnprintf(buf, 20, "%i seconds\n", timeout);
 }
 
 static __always_inline ssize_t write_timeout(u32 *timeout, const char *buf, \
 					     size_t count)
 {
-	printk("writing %s to timeout with value %i\n", buf, *timeout);
+	ccard_dbg("writing %s to timeout with value %i\n", buf, *timeout);
 	unsigned long value = 0;
 	if (strict_strtoul(buf, 10, &value))
-		printk(KERN_WARNING "%s is an invalid timeout value\n", buf);
+		ccard_warn_rl("%s is an invalid timeout value\n", buf);
 	else
 		*timeout = (u32)value;
 
 	if (*timeout == value)
-		printk("wrote %lu to timeout", value);
+		ccard_dbg("wrote %lu to timeout\n", value);
 
 	return count;
 }
@@ -684,82 +1305,162 @@ static ssize_t write_dsa_deploy_timeout(struct class *class, const char *buf, \
 	return write_timeout(&_userDeployTimeout, buf, count);
 }
 
-static void ccard_release_dsa(struct device *dev)
+// runs the dispatcher of every card after the budget changed
+static void dispatch_every_card(void)
 {
-	printk(KERN_NOTICE "releasing dsa device file triggers cleanup\n");
+	for (int i = 0; i < CCARD_MAX_CARDS; i++) {
+		struct ccard *card = ccard_get(i);
+		if (card == NULL || card->dsa == NULL)
+			continue;
+
+		mutex_lock(&card->dsa->queue_lock);
+		dispatch_dsa_ops(card);
+		mutex_unlock(&card->dsa->queue_lock);
+	}
 }
 
-static inline void create_dsa_devices()
+static ssize_t read_dsa_rail_budget(struct class *class, char *buf)
 {
-	printk(KERN_DEBUG "creating dsa sysfs files\n");
-
-	struct device *parent = &dsa_expdr()->dev;
-
-	struct class dsa_class = {
-		.name = "dsa",
-		.owner = THIS_MODULE,
-		.dev_release = ccard_release_dsa,
-	};
-	_dsa_class = dsa_class;
+	return scnprintf(buf, 20, "%u mA\n", _userRailBudget);
+}
 
-	if (class_register(&_dsa_class)) {
-		printk(KERN_ERR "couldn't create dsa class\n");
-		return;
+static ssize_t write_dsa_rail_budget(struct class *class, const char *buf, \
+				     size_t count)
+{
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value)) {
+		ccard_warn_rl("%s is an invalid rail budget\n", buf);
+		return count;
 	}
+	_userRailBudget = (u32)value;
 
-	if (class_create_file(&_dsa_class, &class_attr_release_timeout) || \
-	    class_create_file(&_dsa_class, &class_attr_deploy_timeout)) {
-		printk(KERN_ERR "couldn't create dsa class attributes\n");
-		return;
-	}
+	// a larger budget may let queued operations start now
+	dispatch_every_card();
 
-	if (alloc_chrdev_region(&_dev_dsa0, 0, 2, "dsa")) {
-		printk(KERN_ERR "couldn't create dsa device numbers\n");
-		return;
-	}
-	_dev_dsa1 = MKDEV(MAJOR(_dev_dsa0), MINOR(_dev_dsa0) + 1);
+	return count;
+}
 
-	_dsa0 = device_create(&_dsa_class, parent, _dev_dsa0, NULL, "dsa0");
-	_dsa1 = device_create(&_dsa_class, parent, _dev_dsa1, NULL, "dsa1");
+static ssize_t read_dsa_burn_current(struct class *class, char *buf)
+{
+	return scnprintf(buf, 20, "%u mA\n", _userBurnCurrent);
+}
 
-	if (device_create_file(_dsa0, &dev_attr_current_state) || \
-	    device_create_file(_dsa0, &dev_attr_desired_state)) {
-		printk(KERN_ERR "couldn't create dsa0 device files\n");
-		return;
-	}
-	if (device_create_file(_dsa1, &dev_attr_current_state) || \
-	    device_create_file(_dsa1, &dev_attr_desired_state)) {
-		printk(KERN_ERR "couldn't create dsa1 device files\n");
-		return;
+static ssize_t write_dsa_burn_current(struct class *class, const char *buf, \
+				      size_t count)
+{
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value)) {
+		ccard_warn_rl("%s is an invalid burn current\n", buf);
+		return count;
 	}
+	_userBurnCurrent = (u32)value;
 
+	dispatch_every_card();
 
-	printk(KERN_DEBUG "created sysfs dsa files\n");
+	return count;
 }
 
-static inline void remove_dsa_devices()
+static void ccard_release_dsa(struct device *dev)
 {
-	device_remove_file(_dsa0, &dev_attr_current_state);
-	device_remove_file(_dsa0, &dev_attr_desired_state);
-	device_destroy(&_dsa_class, _dev_dsa0);
+	ccard_notice("releasing dsa device file triggers cleanup\n");
+}
 
-	device_remove_file(_dsa1, &dev_attr_current_state);
-	device_remove_file(_dsa1, &dev_attr_desired_state);
-	device_destroy(&_dsa_class, _dev_dsa1);
+// registers the dsa class for its first user
+// returns 0 if the class is ready
+static s8 get_dsa_class(void)
+{
+	mutex_lock(&_dsa_class_lock);
+	if (_dsa_class_users == 0) {
+		struct class dsa_class = {
+			.name = "dsa",
+			.owner = THIS_MODULE,
+			.dev_release = ccard_release_dsa,
+		};
+		_dsa_class = dsa_class;
+
+		if (class_register(&_dsa_class)) {
+			ccard_err("couldn't create dsa class\n");
+			mutex_unlock(&_dsa_class_lock);
+			return 1;
+		}
 
-	unregister_chrdev_region(_dev_dsa0, 2);
+		if (class_create_file(&_dsa_class, &class_attr_release_timeout) || \
+		    class_create_file(&_dsa_class, &class_attr_deploy_timeout) || \
+		    class_create_file(&_dsa_class, &class_attr_rail_budget) || \
+		    class_create_file(&_dsa_class, &class_attr_burn_current))
+			ccard_err("couldn't create dsa class attributes\n");
+	}
+	_dsa_class_users++;
+	mutex_unlock(&_dsa_class_lock);
 
-	class_unregister(&_dsa_class);
+	return 0;
 }
 
+// unregisters the dsa class once its last user is gone
+static void put_dsa_class(void)
+{
+	mutex_lock(&_dsa_class_lock);
+	if (--_dsa_class_users == 0)
+		class_unregister(&_dsa_class);
+	mutex_unlock(&_dsa_class_lock);
+}
 
+static inline void create_dsa_devices(struct card_dsa *cd)
+{
+	ccard_dbg("creating dsa sysfs files\n");
 
+	struct ccard *card = cd->card;
+	struct device *parent = dsa_expdr(card)->parent;
 
+	if (get_dsa_class())
+		return;
 
+	if (alloc_chrdev_region(&cd->dev[0], 0, DSA_COUNT, "dsa")) {
+		ccard_err("couldn't create dsa device numbers\n");
+		return;
+	}
 
+	cdev_init(&cd->cdev, &_dsa_fops);
+	cd->cdev.owner = THIS_MODULE;
+	if (cdev_add(&cd->cdev, cd->dev[0], DSA_COUNT)) {
+		ccard_err("couldn't add dsa char devices\n");
+		return;
+	}
 
+	for (int i = 0; i < DSA_COUNT; i++) {
+		char name[32];
+		ccard_dev_name(card, name, sizeof(name), "dsa%i", i);
+
+		cd->units[i].card = card;
+		cd->units[i].index = i;
+		cd->dev[i] = MKDEV(MAJOR(cd->dev[0]), MINOR(cd->dev[0]) + i);
+		cd->devices[i] = device_create(&_dsa_class, parent, cd->dev[i], \
+					       &cd->units[i], name);
+
+		if (device_create_file(cd->devices[i], &dev_attr_current_state) || \
+		    device_create_file(cd->devices[i], &dev_attr_desired_state) || \
+		    device_create_file(cd->devices[i], &dev_attr_queue) || \
+		    device_create_file(cd->devices[i], &dev_attr_refresh)) {
+			ccard_err("couldn't create %s device files\n", name);
+			return;
+		}
+	}
 
+	ccard_dbg("created sysfs dsa files\n");
+}
 
+static inline void remove_dsa_devices(struct card_dsa *cd)
+{
+	for (int i = 0; i < DSA_COUNT; i++) {
+		device_remove_file(cd->devices[i], &dev_attr_current_state);
+		device_remove_file(cd->devices[i], &dev_attr_desired_state);
+		device_remove_file(cd->devices[i], &dev_attr_queue);
+		device_remove_file(cd->devices[i], &dev_attr_refresh);
+		device_destroy(&_dsa_class, cd->dev[i]);
+	}
 
+	cdev_del(&cd->cdev);
+	unregister_chrdev_region(cd->dev[0], DSA_COUNT);
 
-
+	put_dsa_class();
+}
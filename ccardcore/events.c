@@ -0,0 +1,158 @@
+// implementation for the actuator event channel
+// every change of an actuator state is multicast over generic netlink, so
+//   any number of daemons can follow the actuators without reading sysfs
+//   and without costing any bus time
+// failures are multicast the same way as binary log records on a group of
+//   their own, so a daemon that only follows the actuators never sees them
+// the message layout is in ccard_netlink.h
+//
+// by Mark Hill
+#include<linux/kernel.h>
+#include<linux/ktime.h>
+#include<net/netlink.h>
+#include<net/genetlink.h>
+
+#include "ccard.h"
+
+static struct genl_family _ccard_genl_family = {
+	.id = GENL_ID_GENERATE,
+	.hdrsize = 0,
+	.name = CCARD_GENL_NAME,
+	.version = CCARD_GENL_VERSION,
+	.maxattr = CCARD_ATTR_MAX,
+};
+
+static struct genl_multicast_group _ccard_events_group = {
+	.name = CCARD_GENL_EVENTS,
+};
+
+static struct genl_multicast_group _ccard_log_group = {
+	.name = CCARD_GENL_LOG,
+};
+
+// 0 until the family has been registered
+static u8 _events_registered = 0;
+// events that couldn't be allocated or sent
+static u32 _events_dropped = 0;
+// the same for the log records
+static u32 _records_dropped = 0;
+
+void ccard_notify(struct ccard *card, enum ccard_actuator actuator, u8 index, \
+		  u32 old_state, u32 new_state, enum ccard_cause cause)
+{
+	// every change also lands in the status page, whether or not the
+	//   family is registered
+	ccard_status_actuator(card, actuator, index, new_state);
+
+	if (!_events_registered)
+		return;
+
+	// the b-dot executor and the scheduler run as realtime threads, so the
+	//   message is allocated without waiting on reclaim
+	struct sk_buff *msg = genlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+	if (msg == NULL) {
+		_events_dropped++;
+		return;
+	}
+
+	void *hdr = genlmsg_put(msg, 0, 0, &_ccard_genl_family, 0, \
+				CCARD_CMD_EVENT);
+	if (hdr == NULL)
+		goto failure;
+
+	if (nla_put_u8(msg, CCARD_ATTR_ACTUATOR, actuator) || \
+	    nla_put_u8(msg, CCARD_ATTR_INDEX, index) || \
+	    nla_put_u32(msg, CCARD_ATTR_OLD, old_state) || \
+	    nla_put_u32(msg, CCARD_ATTR_NEW, new_state) || \
+	    nla_put_u64(msg, CCARD_ATTR_TIMESTAMP, ktime_to_ns(ktime_get())) || \
+	    nla_put_u8(msg, CCARD_ATTR_CAUSE, cause) || \
+	    nla_put_u8(msg, CCARD_ATTR_CARD, card->index))
+		goto failure;
+
+	genlmsg_end(msg, hdr);
+
+	// -ESRCH only means nobody is listening right now
+	int ret = genlmsg_multicast(msg, 0, _ccard_events_group.id, GFP_ATOMIC);
+	if (ret && ret != -ESRCH)
+		_events_dropped++;
+	return;
+
+failure:
+	nlmsg_free(msg);
+	_events_dropped++;
+}
+
+void ccard_log_record(struct ccard *card, enum ccard_log_id id, u32 arg0, \
+		      u32 arg1)
+{
+	if (!_events_registered)
+		return;
+
+	// the records come from under spinlocks as well, like the breaker
+	//   changes
+	struct sk_buff *msg = genlmsg_new(nla_total_size(sizeof(u64)) + \
+					  nla_total_size(sizeof(u8)) + \
+					  nla_total_size(sizeof(u16)) + \
+					  2 * nla_total_size(sizeof(u32)), \
+					  GFP_ATOMIC);
+	if (msg == NULL) {
+		_records_dropped++;
+		return;
+	}
+
+	void *hdr = genlmsg_put(msg, 0, 0, &_ccard_genl_family, 0, \
+				CCARD_CMD_LOG);
+	if (hdr == NULL)
+		goto failure;
+
+	if (nla_put_u64(msg, CCARD_ATTR_TIMESTAMP, ktime_to_ns(ktime_get())) || \
+	    nla_put_u8(msg, CCARD_ATTR_CARD, card->index) || \
+	    nla_put_u16(msg, CCARD_ATTR_LOG_ID, id) || \
+	    nla_put_u32(msg, CCARD_ATTR_LOG_ARG0, arg0) || \
+	    nla_put_u32(msg, CCARD_ATTR_LOG_ARG1, arg1))
+		goto failure;
+
+	genlmsg_end(msg, hdr);
+
+	int ret = genlmsg_multicast(msg, 0, _ccard_log_group.id, GFP_ATOMIC);
+	if (ret && ret != -ESRCH)
+		_records_dropped++;
+	return;
+
+failure:
+	nlmsg_free(msg);
+	_records_dropped++;
+}
+
+s8 ccard_init_events()
+{
+	if (genl_register_family(&_ccard_genl_family)) {
+		ccard_err("couldn't register the ccard netlink family\n");
+		return 1;
+	}
+
+	if (genl_register_mc_group(&_ccard_genl_family, &_ccard_events_group) || \
+	    genl_register_mc_group(&_ccard_genl_family, &_ccard_log_group)) {
+		ccard_err("couldn't register the ccard multicast groups\n");
+		genl_unregister_family(&_ccard_genl_family);
+		return 1;
+	}
+
+	_events_registered = 1;
+	return 0;
+}
+
+void ccard_cleanup_events()
+{
+	if (!_events_registered)
+		return;
+
+	_events_registered = 0;
+	if (_events_dropped)
+		ccard_notice("%u actuator events were dropped\n", \
+				_events_dropped);
+	if (_records_dropped)
+		ccard_notice("%u log records were dropped\n", _records_dropped);
+	// unregistering the family also removes its multicast groups
+	genl_unregister_family(&_ccard_genl_family);
+}
@@ -0,0 +1,145 @@
+// host program that checks the decode table builder in decode.c
+// the driver builds its tables at load time from whatever pin map the
+//   module parameters give it, so instead of generating the tables this
+//   checks the builder against the bit arithmetic the tables replace, for
+//   every possible register value and for every pin a parameter can name,
+//   and fails the build if a single entry differs
+//
+// by Mark Hill
+
+#include<stdio.h>
+#include<stdlib.h>
+
+#include "decode.c"
+
+#define REG_VALUES CCARD_REG_VALUES
+// highest pin checked, one past the end of the register
+#define MAX_PIN 8
+
+// the map being checked, the reference functions read it
+static struct ccard_pin_map _map;
+static struct ccard_decode _tables;
+
+// returns bit <pin> of register value <value>, the way the driver did it
+//   before the tables, a shift on the promoted byte
+static unsigned bit(unsigned value, unsigned pin)
+{
+	return (value >> pin) & 0x01;
+}
+
+// the state decode from update_dsa_state, kept as the reference
+static unsigned ref_dsa_state(unsigned in, unsigned out, int dsa)
+{
+	unsigned in_res_val = bit(in, _map.dsa_res_in[dsa]);
+	unsigned in_dep_val = bit(in, _map.dsa_dep_in[dsa]);
+	unsigned out_res_val = bit(out, _map.dsa_res_out[dsa]);
+	unsigned out_dep_val = bit(out, _map.dsa_dep_out[dsa]);
+
+	if (out_dep_val == 1)
+		in_res_val = 0;
+
+	return (in_res_val << 1) + (in_dep_val << 1) + (in_dep_val << 3) + \
+	       out_res_val + (out_dep_val << 2);
+}
+
+// the state decode from decode_mt_state, kept as the reference
+static unsigned ref_mt_state(unsigned value, int mt)
+{
+	return (bit(value, _map.mt_reverse[mt]) << 1) | \
+	       bit(value, _map.mt_forward[mt]);
+}
+
+// the state encode from encode_mt_state, kept as the reference
+static unsigned ref_mt_encode(unsigned state, int mt)
+{
+	return (((state & 0x01) << _map.mt_forward[mt]) | \
+		(((state >> 1) & 0x01) << _map.mt_reverse[mt])) & 0xff;
+}
+
+// compares every table entry against the reference arithmetic
+// returns the number of mismatches
+static int check_tables(void)
+{
+	int errors = 0;
+
+	for (int dsa = 0; dsa < CCARD_DSA_COUNT; dsa++) {
+		for (unsigned in = 0; in < REG_VALUES; in++) {
+			for (unsigned out = 0; out < REG_VALUES; out++) {
+				unsigned got = _tables.dsa_state_code \
+					[_tables.dsa_in_code[dsa][in]] \
+					[_tables.dsa_out_code[dsa][out]];
+				unsigned want = ref_dsa_state(in, out, dsa);
+				if (got != want && errors++ < 10)
+					fprintf(stderr, "dsa %i in 0x%02x out " \
+						"0x%02x: %u, expected %u\n", \
+						dsa, in, out, got, want);
+			}
+		}
+
+		unsigned masks = ((1u << _map.dsa_res_out[dsa]) + \
+				  (1u << _map.dsa_dep_out[dsa])) & 0xff;
+		if ((_tables.dsa_res_mask[dsa] | \
+		     _tables.dsa_dep_mask[dsa]) != masks) {
+			fprintf(stderr, "dsa %i masks differ\n", dsa);
+			errors++;
+		}
+	}
+
+	for (int mt = 0; mt < CCARD_MT_COUNT; mt++) {
+		for (unsigned v = 0; v < REG_VALUES; v++) {
+			unsigned want = ref_mt_state(v, mt);
+			if (_tables.mt_decode[mt][v] != want && errors++ < 10)
+				fprintf(stderr, "mt %i value 0x%02x: %u, " \
+					"expected %u\n", mt, v, \
+					_tables.mt_decode[mt][v], want);
+		}
+		for (unsigned state = 0; state < 4; state++) {
+			unsigned want = ref_mt_encode(state, mt);
+			if (_tables.mt_encode[mt][state] != want && errors++ < 10)
+				fprintf(stderr, "mt %i state %u encodes to " \
+					"0x%02x, expected 0x%02x\n", mt, state, \
+					_tables.mt_encode[mt][state], want);
+			// an encoded state has to decode back to itself, unless
+			//   it names the unwired pin, which the driver refuses
+			//   for the outputs
+			unsigned v = _tables.mt_encode[mt][state];
+			if (_map.mt_forward[mt] < 8 && \
+			    _map.mt_reverse[mt] < 8 && \
+			    _tables.mt_decode[mt][v] != state && errors++ < 10)
+				fprintf(stderr, "mt %i state %u doesn't " \
+					"round trip\n", mt, state);
+		}
+	}
+
+	return errors;
+}
+
+// sets every pin of <map> to the default pin plus <shift>, wrapping past
+//   MAX_PIN, so that over MAX_PIN + 1 shifts every signal lands on every
+//   pin once, the unwired one included
+static void shift_map(struct ccard_pin_map *map, unsigned shift)
+{
+	const struct ccard_pin_map dfl = CCARD_DEFAULT_PINS;
+	const unsigned char *from = (const unsigned char *)&dfl;
+	unsigned char *to = (unsigned char *)map;
+	for (unsigned i = 0; i < sizeof(*map); i++)
+		to[i] = (from[i] + shift) % (MAX_PIN + 1);
+}
+
+int main(void)
+{
+	int errors = 0;
+
+	for (unsigned shift = 0; shift <= MAX_PIN; shift++) {
+		shift_map(&_map, shift);
+		ccard_build_decode(&_map, &_tables);
+		int map_errors = check_tables();
+		if (map_errors)
+			fprintf(stderr, "gen_decode: %i table entries don't " \
+				"match with the pins shifted by %u\n", \
+				map_errors, shift);
+		errors += map_errors;
+	}
+
+	return errors ? 1 : 0;
+}
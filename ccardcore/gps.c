@@ -0,0 +1,921 @@
+// implementation for the GPS receivers
+// a receiver streams NMEA 0183 sentences over a UART, and attaching the
+//   gps line discipline to its tty hands the stream to the driver, see
+//   tools/ccardgps
+// the bytes are parsed one at a time as they arrive, in place in a ring
+//   buffer, so a sentence is never copied out and the work per byte stays
+//   the same whatever the rate of the stream
+// the GGA and RMC sentences of one epoch are merged into a fix, the latest
+//   fix is published under a seqlock and the fixes are kept in a history
+//   that /dev/gps<n> reads out, see ccard_gps.h
+// the parser only depends on the bytes coming in, so a recorded log played
+//   into a pty with the discipline attached parses just like the receiver
+//
+// by Mark Hill
+#include<linux/kernel.h>
+#include<linux/module.h>
+#include<linux/moduleparam.h>
+#include<linux/fs.h>
+#include<linux/cdev.h>
+#include<linux/tty.h>
+#include<linux/tty_ldisc.h>
+#include<linux/seqlock.h>
+#include<linux/wait.h>
+#include<linux/poll.h>
+#include<linux/sched.h>
+#include<linux/mutex.h>
+#include<linux/slab.h>
+#include<linux/uaccess.h>
+#include<linux/ktime.h>
+#include<linux/math64.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/err.h>
+
+#include "ccard.h"
+#include "ccard_gps.h"
+
+// number of receivers that can be attached at once
+#define GPS_MAX_RECEIVERS 4
+// bytes in the receive ring, a power of two
+// it only ever holds the sentence being parsed and the bytes that arrived
+//   with the end of it
+#define GPS_RING_SIZE 1024
+// sentences longer than this are thrown away, NMEA allows 82 characters
+#define GPS_SENTENCE_MAX 128
+// most fields a sentence may have, GGA and RMC have 15 and 13
+#define GPS_MAX_FIELDS 24
+// number of fixes kept for the readers, a power of two
+// at one fix a second that is the last two minutes
+#define GPS_HISTORY 128
+
+static int _gps_ldisc = CCARD_GPS_DFL_LDISC;
+module_param_named(gps_ldisc, _gps_ldisc, int, S_IRUGO);
+MODULE_PARM_DESC(gps_ldisc, "line discipline number the gps receivers " \
+		 "are attached with");
+
+// where the parser is in a sentence
+enum gps_parse_state {
+	// looking for the '$' that starts a sentence
+	GPS_HUNT = 0,
+	// between the '$' and the '*'
+	GPS_BODY,
+	// the two hex digits of the checksum
+	GPS_CHECKSUM_HIGH,
+	GPS_CHECKSUM_LOW
+};
+
+// statistics on the stream of a receiver
+struct gps_stats {
+	u32 bytes;
+	u32 sentences;
+	u32 fixes;
+	// sentences dropped for a bad checksum, for being too long or for
+	//   characters that don't belong in a sentence
+	u32 checksum;
+	u32 oversize;
+	u32 garbage;
+	// sentences with a good checksum that aren't GGA or RMC, or that
+	//   didn't decode
+	u32 unknown;
+	// bytes the uart flagged as broken
+	u32 line_errors;
+	// time spent parsing, the longest call and the total, in ns
+	u32 busy_max_ns;
+	u64 busy_total_ns;
+};
+
+// the state of one attached receiver
+// the receivers are static, so a reader that still has the device open
+//   after the tty went away only finds the receiver detached
+struct gps_receiver {
+	u8 index;
+	u8 attached;
+	// bumped whenever the receiver is detached, so readers can tell
+	u32 generation;
+	char tty_name[64];
+	struct device *device;
+
+	// the receive ring, only touched by the line discipline
+	// the positions are free running and masked on access
+	u8 ring[GPS_RING_SIZE];
+	// next byte to be written and next byte to be parsed
+	u32 head;
+	u32 scan;
+	enum gps_parse_state state;
+	// position of the '$' of the sentence being parsed
+	u32 start;
+	u8 sum;
+	u8 checksum;
+	// ring positions of the first character of each field, the field
+	//   count is followed by the position just past the '*'
+	u8 field_count;
+	u32 fields[GPS_MAX_FIELDS + 1];
+	// when the bytes being parsed arrived
+	ktime_t arrival;
+	// the fix of the epoch being received
+	struct ccard_gps_fix pending;
+	struct gps_stats stats;
+
+	// protects latest, the history and published
+	seqlock_t lock;
+	struct ccard_gps_fix latest;
+	struct ccard_gps_fix history[GPS_HISTORY];
+	// fixes published since the receiver was attached, the sequence number
+	//   of the next fix
+	u32 published;
+	// readers wait here for a fix or the receiver to go away
+	wait_queue_head_t wait;
+};
+
+// an open /dev/gps<n>
+struct gps_reader {
+	struct gps_receiver *rx;
+	u32 generation;
+	// sequence number of the next fix to hand out
+	u32 next;
+};
+
+static struct gps_receiver _gps[GPS_MAX_RECEIVERS];
+// serializes attaching and detaching receivers against opening them
+static DEFINE_MUTEX(_gps_mutex);
+// 1 once the line discipline and the char devices are registered
+static u8 _gps_ready = 0;
+
+static dev_t _dev_gps;
+static struct cdev _gps_cdev;
+
+// line discipline operations
+static int open_gps_ldisc(struct tty_struct *tty);
+static void close_gps_ldisc(struct tty_struct *tty);
+static int hangup_gps_ldisc(struct tty_struct *tty);
+static void receive_gps_buf(struct tty_struct *tty, const unsigned char *cp, \
+			    char *fp, int count);
+
+static struct tty_ldisc_ops _gps_ldisc_ops = {
+	.magic = TTY_LDISC_MAGIC,
+	.name = "ccard_gps",
+	.owner = THIS_MODULE,
+	.open = open_gps_ldisc,
+	.close = close_gps_ldisc,
+	.hangup = hangup_gps_ldisc,
+	.receive_buf = receive_gps_buf,
+};
+
+// char device file operations
+static int open_gps(struct inode *inode, struct file *file);
+static int release_gps(struct inode *inode, struct file *file);
+static ssize_t read_gps(struct file *file, char __user *buf, size_t count, \
+			loff_t *offset);
+static unsigned int poll_gps(struct file *file, poll_table *wait);
+
+static const struct file_operations _gps_fops = {
+	.owner = THIS_MODULE,
+	.open = open_gps,
+	.release = release_gps,
+	.read = read_gps,
+	.poll = poll_gps,
+};
+
+// definitions for the gps attribute sysfs callbacks
+static ssize_t read_gps_fix(struct device *dev, \
+			    struct device_attribute *attr, char *buf);
+static ssize_t read_gps_stats(struct device *dev, \
+			      struct device_attribute *attr, char *buf);
+static ssize_t read_gps_tty(struct device *dev, \
+			    struct device_attribute *attr, char *buf);
+
+static DEVICE_ATTR(fix, S_IRUGO, read_gps_fix, NULL);
+// the b-dot executor already owns dev_attr_stats
+static struct device_attribute dev_attr_gps_stats = \
+	__ATTR(stats, S_IRUGO, read_gps_stats, NULL);
+static DEVICE_ATTR(tty, S_IRUGO, read_gps_tty, NULL);
+
+
+
+//
+// parser
+//
+
+static inline u8 ring_char(struct gps_receiver *rx, u32 pos)
+{
+	return rx->ring[pos & (GPS_RING_SIZE - 1)];
+}
+
+// returns the number of characters in field <f>
+static inline u32 field_len(struct gps_receiver *rx, u8 f)
+{
+	return rx->fields[f + 1] - rx->fields[f] - 1;
+}
+
+// returns the character of a one character field, or 0 if it has another
+//   length
+static inline u8 field_char(struct gps_receiver *rx, u8 f)
+{
+	return field_len(rx, f) == 1 ? ring_char(rx, rx->fields[f]) : 0;
+}
+
+// parses field <f> as a decimal number with <decimals> places into <out>,
+//   so "12.3" with 2 places gives 1230
+// places beyond <decimals> are cut off
+// returns 0 on success or 1 if the field is empty, malformed or too large
+static s8 field_fixed(struct gps_receiver *rx, u8 f, u8 decimals, s32 *out)
+{
+	u32 pos = rx->fields[f];
+	u32 end = rx->fields[f + 1] - 1;
+	u8 negative = 0;
+	u8 digits = 0;
+	// places seen after the point, -1 before it
+	s8 places = -1;
+	u32 val = 0;
+
+	if (pos != end && ring_char(rx, pos) == '-') {
+		negative = 1;
+		pos++;
+	}
+
+	for (; pos != end; pos++) {
+		u8 c = ring_char(rx, pos);
+		if (c == '.' && places < 0) {
+			places = 0;
+			continue;
+		}
+		if (c < '0' || c > '9')
+			return 1;
+		if (places >= decimals)
+			continue;
+		if (val > (INT_MAX - 9) / 10)
+			return 1;
+		val = val * 10 + (c - '0');
+		digits++;
+		if (places >= 0)
+			places++;
+	}
+	if (digits == 0)
+		return 1;
+
+	for (s8 i = places < 0 ? 0 : places; i < decimals; i++) {
+		if (val > INT_MAX / 10)
+			return 1;
+		val *= 10;
+	}
+
+	*out = negative ? -(s32)val : (s32)val;
+	return 0;
+}
+
+// parses the hhmmss.sss time in field <f> into ms since midnight
+static s8 field_time(struct gps_receiver *rx, u8 f, u32 *time_ms)
+{
+	s32 val;
+	if (field_fixed(rx, f, 3, &val) || val < 0)
+		return 1;
+
+	u32 hours = val / 10000000;
+	u32 minutes = val / 100000 % 100;
+	// a leap second makes 60 valid
+	u32 ms = val % 100000;
+	if (hours > 23 || minutes > 59 || ms >= 61000)
+		return 1;
+
+	*time_ms = hours * 3600000 + minutes * 60000 + ms;
+	return 0;
+}
+
+// parses the [d]ddmm.mmmmm coordinate in field <f> and the hemisphere in
+//   the field after it into 1e-7 degrees
+// <negative> is the hemisphere letter that makes the coordinate negative
+static s8 field_coord(struct gps_receiver *rx, u8 f, u8 positive, \
+		      u8 negative, s32 *coord)
+{
+	s32 val;
+	if (field_fixed(rx, f, 5, &val) || val < 0)
+		return 1;
+
+	u8 hemisphere = field_char(rx, f + 1);
+	if (hemisphere != positive && hemisphere != negative)
+		return 1;
+
+	// the minutes in 1e-5 are turned into 1e-7 degrees
+	u32 minutes = val % 10000000;
+	if (minutes >= 6000000)
+		return 1;
+	s32 degrees = (val / 10000000) * 10000000 + minutes * 100 / 60;
+
+	*coord = hemisphere == negative ? -degrees : degrees;
+	return 0;
+}
+
+// finishes the epoch being received and hands its fix to the readers
+static void publish_gps_fix(struct gps_receiver *rx)
+{
+	struct ccard_gps_fix *fix = &rx->pending;
+
+	fix->timestamp_ns = ktime_to_ns(rx->arrival);
+	fix->receiver = rx->index;
+
+	write_seqlock(&rx->lock);
+	fix->sequence = rx->published;
+	rx->history[rx->published & (GPS_HISTORY - 1)] = *fix;
+	rx->latest = *fix;
+	rx->published++;
+	write_sequnlock(&rx->lock);
+
+	rx->stats.fixes++;
+	memset(fix, 0, sizeof(*fix));
+
+	wake_up_interruptible(&rx->wait);
+}
+
+// a sentence for <time_ms> arrived, which ends the epoch being received if
+//   it was for another time
+// the receivers send GGA and RMC in either order, so an epoch that is
+//   missing one of them is only published once the next one starts
+static void begin_gps_epoch(struct gps_receiver *rx, u32 time_ms)
+{
+	if (rx->pending.flags && rx->pending.time_ms != time_ms)
+		publish_gps_fix(rx);
+
+	rx->pending.time_ms = time_ms;
+}
+
+// the epoch is complete once it has both sentences
+static inline void end_gps_sentence(struct gps_receiver *rx)
+{
+	u8 both = CCARD_GPS_HAVE_GGA | CCARD_GPS_HAVE_RMC;
+	if ((rx->pending.flags & both) == both)
+		publish_gps_fix(rx);
+}
+
+// $--GGA,time,lat,N,lon,E,quality,satellites,hdop,altitude,M,...
+// returns 0 on success or 1 if the sentence didn't decode
+static s8 decode_gga(struct gps_receiver *rx)
+{
+	if (rx->field_count < 10)
+		return 1;
+
+	u32 time_ms;
+	if (field_time(rx, 1, &time_ms))
+		return 1;
+
+	// without a fix the position, hdop and altitude are left empty
+	s32 quality, satellites = 0, hdop = 0, altitude = 0;
+	s32 latitude = 0, longitude = 0;
+	if (field_fixed(rx, 6, 0, &quality) || quality < 0 || quality > 255)
+		return 1;
+	if (quality && (field_coord(rx, 2, 'N', 'S', &latitude) || \
+			field_coord(rx, 4, 'E', 'W', &longitude)))
+		return 1;
+	field_fixed(rx, 7, 0, &satellites);
+	field_fixed(rx, 8, 2, &hdop);
+	field_fixed(rx, 9, 3, &altitude);
+
+	begin_gps_epoch(rx, time_ms);
+	struct ccard_gps_fix *fix = &rx->pending;
+	fix->latitude = latitude;
+	fix->longitude = longitude;
+	fix->altitude = altitude;
+	fix->quality = quality;
+	fix->satellites = clamp_t(s32, satellites, 0, 255);
+	fix->hdop = clamp_t(s32, hdop, 0, 65535);
+	fix->flags |= CCARD_GPS_HAVE_GGA;
+	end_gps_sentence(rx);
+
+	return 0;
+}
+
+// $--RMC,time,status,lat,N,lon,E,speed,course,date,...
+// returns 0 on success or 1 if the sentence didn't decode
+static s8 decode_rmc(struct gps_receiver *rx)
+{
+	if (rx->field_count < 10)
+		return 1;
+
+	u32 time_ms;
+	if (field_time(rx, 1, &time_ms))
+		return 1;
+
+	u8 valid = field_char(rx, 2) == 'A';
+	s32 latitude = 0, longitude = 0, knots = 0, course = 0, date = 0;
+	if (valid && (field_coord(rx, 3, 'N', 'S', &latitude) || \
+		      field_coord(rx, 5, 'E', 'W', &longitude)))
+		return 1;
+	field_fixed(rx, 7, 3, &knots);
+	field_fixed(rx, 8, 2, &course);
+	if (field_fixed(rx, 9, 0, &date) || date < 10100)
+		date = 0;
+
+	begin_gps_epoch(rx, time_ms);
+	struct ccard_gps_fix *fix = &rx->pending;
+	// GGA has the better position, RMC only fills it in without one
+	if (!(fix->flags & CCARD_GPS_HAVE_GGA)) {
+		fix->latitude = latitude;
+		fix->longitude = longitude;
+	}
+	// a knot is 1852 m per hour
+	fix->speed = knots > 0 ? div_u64((u64)knots * 1852, 3600) : 0;
+	fix->course = clamp_t(s32, course, 0, 35999);
+	if (date) {
+		fix->day = date / 10000;
+		fix->month = date / 100 % 100;
+		fix->year = 2000 + date % 100;
+	}
+	fix->flags |= CCARD_GPS_HAVE_RMC;
+	if (valid)
+		fix->flags |= CCARD_GPS_VALID;
+	end_gps_sentence(rx);
+
+	return 0;
+}
+
+// returns 1 if the address field is a talker followed by <type>
+static inline u8 sentence_is(struct gps_receiver *rx, const char *type)
+{
+	u32 pos = rx->fields[0];
+
+	return field_len(rx, 0) == 5 && ring_char(rx, pos + 2) == type[0] && \
+	       ring_char(rx, pos + 3) == type[1] && \
+	       ring_char(rx, pos + 4) == type[2];
+}
+
+// decodes a sentence whose checksum matched
+static void decode_sentence(struct gps_receiver *rx)
+{
+	rx->stats.sentences++;
+
+	s8 ret = 1;
+	if (sentence_is(rx, "GGA"))
+		ret = decode_gga(rx);
+	else if (sentence_is(rx, "RMC"))
+		ret = decode_rmc(rx);
+
+	if (ret)
+		rx->stats.unknown++;
+}
+
+static inline s8 hex_value(u8 c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+// moves the parser on by the character at <pos>
+static void parse_gps_char(struct gps_receiver *rx, u32 pos)
+{
+	u8 c = ring_char(rx, pos);
+	s8 hex;
+
+	// a '$' always starts over, so a sentence cut off by a reset of the
+	//   receiver only costs that sentence
+	if (c == '$') {
+		if (rx->state != GPS_HUNT)
+			rx->stats.garbage++;
+		rx->state = GPS_BODY;
+		rx->start = pos;
+		rx->sum = 0;
+		rx->field_count = 0;
+		rx->fields[0] = pos + 1;
+		return;
+	}
+
+	switch (rx->state) {
+	case GPS_HUNT:
+		break;
+	case GPS_BODY:
+		if (c == '*') {
+			rx->fields[++rx->field_count] = pos + 1;
+			rx->state = GPS_CHECKSUM_HIGH;
+			break;
+		}
+		if (c < 0x20 || c > 0x7e) {
+			rx->stats.garbage++;
+			rx->state = GPS_HUNT;
+			break;
+		}
+		if (pos - rx->start >= GPS_SENTENCE_MAX || \
+		    (c == ',' && rx->field_count + 1 >= GPS_MAX_FIELDS)) {
+			rx->stats.oversize++;
+			rx->state = GPS_HUNT;
+			break;
+		}
+		rx->sum ^= c;
+		if (c == ',')
+			rx->fields[++rx->field_count] = pos + 1;
+		break;
+	case GPS_CHECKSUM_HIGH:
+		hex = hex_value(c);
+		if (hex < 0) {
+			rx->stats.garbage++;
+			rx->state = GPS_HUNT;
+			break;
+		}
+		rx->checksum = hex << 4;
+		rx->state = GPS_CHECKSUM_LOW;
+		break;
+	case GPS_CHECKSUM_LOW:
+		hex = hex_value(c);
+		rx->state = GPS_HUNT;
+		if (hex < 0) {
+			rx->stats.garbage++;
+			break;
+		}
+		// the fields are decoded where they sit in the ring, the sentence
+		//   is still all there since the ring is only released up to its
+		//   start
+		if ((rx->checksum | hex) == rx->sum)
+			decode_sentence(rx);
+		else
+			rx->stats.checksum++;
+		break;
+	}
+}
+
+
+
+//
+// line discipline
+//
+
+// called in process context for every chunk the tty receives, one call at
+//   a time for each tty
+static void receive_gps_buf(struct tty_struct *tty, const unsigned char *cp, \
+			    char *fp, int count)
+{
+	struct gps_receiver *rx = tty->disc_data;
+	if (rx == NULL)
+		return;
+
+	rx->arrival = ktime_get();
+	rx->stats.bytes += count;
+
+	while (count > 0) {
+		// everything before the sentence being parsed is free again,
+		//   which always leaves room since sentences are bounded
+		u32 tail = rx->state == GPS_HUNT ? rx->scan : rx->start;
+		int n = min_t(int, count, GPS_RING_SIZE - (rx->head - tail));
+
+		for (int i = 0; i < n; i++) {
+			u8 c = cp[i];
+			// a broken byte becomes one that can't be in a sentence, so
+			//   the sentence it fell into is dropped
+			if (fp != NULL && fp[i] != TTY_NORMAL) {
+				rx->stats.line_errors++;
+				c = 0;
+			}
+			rx->ring[(rx->head + i) & (GPS_RING_SIZE - 1)] = c;
+		}
+		rx->head += n;
+		cp += n;
+		if (fp != NULL)
+			fp += n;
+		count -= n;
+
+		for (; rx->scan != rx->head; rx->scan++)
+			parse_gps_char(rx, rx->scan);
+	}
+
+	u32 busy = ktime_to_ns(ktime_sub(ktime_get(), rx->arrival));
+	rx->stats.busy_total_ns += busy;
+	if (busy > rx->stats.busy_max_ns)
+		rx->stats.busy_max_ns = busy;
+}
+
+static int open_gps_ldisc(struct tty_struct *tty)
+{
+	struct gps_receiver *rx = NULL;
+
+	mutex_lock(&_gps_mutex);
+	for (int i = 0; i < GPS_MAX_RECEIVERS; i++) {
+		if (!_gps[i].attached) {
+			rx = &_gps[i];
+			break;
+		}
+	}
+	if (rx == NULL) {
+		mutex_unlock(&_gps_mutex);
+		ccard_warn("no room for another gps receiver\n");
+		return -EBUSY;
+	}
+
+	// the parser and the history start over, the readers of an earlier
+	//   receiver in this slot were sent away when it was detached
+	rx->head = 0;
+	rx->scan = 0;
+	rx->state = GPS_HUNT;
+	memset(&rx->pending, 0, sizeof(rx->pending));
+	memset(&rx->stats, 0, sizeof(rx->stats));
+	write_seqlock(&rx->lock);
+	memset(&rx->latest, 0, sizeof(rx->latest));
+	rx->published = 0;
+	write_sequnlock(&rx->lock);
+	strlcpy(rx->tty_name, tty->name, sizeof(rx->tty_name));
+
+	rx->device = device_create(ccard_nav_class(), NULL, \
+				   MKDEV(MAJOR(_dev_gps), \
+					 MINOR(_dev_gps) + rx->index), \
+				   rx, "gps%u", rx->index);
+	if (IS_ERR(rx->device)) {
+		rx->device = NULL;
+		mutex_unlock(&_gps_mutex);
+		ccard_err("couldn't create gps%u device\n", rx->index);
+		return -ENOMEM;
+	}
+	if (device_create_file(rx->device, &dev_attr_fix) || \
+	    device_create_file(rx->device, &dev_attr_gps_stats) || \
+	    device_create_file(rx->device, &dev_attr_tty))
+		ccard_err("couldn't create gps%u device files\n", rx->index);
+
+	rx->attached = 1;
+	tty->disc_data = rx;
+	// the parser keeps up with whatever arrives, so the tty never has to
+	//   hold anything back
+	tty->receive_room = 65536;
+	mutex_unlock(&_gps_mutex);
+
+	ccard_notice("gps%u attached to %s\n", rx->index, rx->tty_name);
+	return 0;
+}
+
+static void close_gps_ldisc(struct tty_struct *tty)
+{
+	struct gps_receiver *rx = tty->disc_data;
+	if (rx == NULL)
+		return;
+
+	mutex_lock(&_gps_mutex);
+	tty->disc_data = NULL;
+	rx->attached = 0;
+	rx->generation++;
+
+	device_remove_file(rx->device, &dev_attr_fix);
+	device_remove_file(rx->device, &dev_attr_gps_stats);
+	device_remove_file(rx->device, &dev_attr_tty);
+	device_destroy(ccard_nav_class(), \
+		       MKDEV(MAJOR(_dev_gps), MINOR(_dev_gps) + rx->index));
+	rx->device = NULL;
+	mutex_unlock(&_gps_mutex);
+
+	wake_up_interruptible_all(&rx->wait);
+
+	ccard_notice("gps%u detached from %s\n", rx->index, rx->tty_name);
+}
+
+static int hangup_gps_ldisc(struct tty_struct *tty)
+{
+	close_gps_ldisc(tty);
+	return 0;
+}
+
+struct device *gps()
+{
+	return _gps[0].attached ? _gps[0].device : NULL;
+}
+
+s8 ccard_gps_latest(u8 receiver, struct ccard_gps_fix *fix)
+{
+	if (receiver >= GPS_MAX_RECEIVERS || !_gps_ready)
+		return 1;
+
+	struct gps_receiver *rx = &_gps[receiver];
+	u32 published;
+	unsigned seq;
+	do {
+		seq = read_seqbegin(&rx->lock);
+		published = rx->published;
+		*fix = rx->latest;
+	} while (read_seqretry(&rx->lock, seq));
+
+	return published ? 0 : 1;
+}
+
+
+
+//
+// char device
+//
+
+static int open_gps(struct inode *inode, struct file *file)
+{
+	if (file->f_mode & FMODE_WRITE)
+		return -EPERM;
+
+	u32 index = MINOR(inode->i_rdev) - MINOR(_dev_gps);
+	if (index >= GPS_MAX_RECEIVERS)
+		return -ENODEV;
+
+	struct gps_reader *r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (r == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&_gps_mutex);
+	struct gps_receiver *rx = &_gps[index];
+	if (!rx->attached) {
+		mutex_unlock(&_gps_mutex);
+		kfree(r);
+		return -ENODEV;
+	}
+	r->rx = rx;
+	r->generation = rx->generation;
+	// a new reader gets the whole history first
+	u32 published = ACCESS_ONCE(rx->published);
+	r->next = published > GPS_HISTORY ? published - GPS_HISTORY : 0;
+	mutex_unlock(&_gps_mutex);
+
+	file->private_data = r;
+	return 0;
+}
+
+static int release_gps(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+
+	return 0;
+}
+
+// copies the fix with sequence number r->next to <fix>, skipping ahead to
+//   the oldest fix still kept if the reader fell behind
+// returns 0 on success or 1 if there is no new fix
+static s8 next_gps_fix(struct gps_reader *r, struct ccard_gps_fix *fix)
+{
+	struct gps_receiver *rx = r->rx;
+	u32 next;
+	unsigned seq;
+
+	do {
+		seq = read_seqbegin(&rx->lock);
+		u32 published = rx->published;
+		next = r->next;
+		if (next == published)
+			return 1;
+		if (published - next > GPS_HISTORY)
+			next = published - GPS_HISTORY;
+		*fix = rx->history[next & (GPS_HISTORY - 1)];
+	} while (read_seqretry(&rx->lock, seq));
+
+	r->next = next + 1;
+	return 0;
+}
+
+// hands out as many whole fixes as fit in <count>, blocking until there is
+//   one unless the file is non blocking
+static ssize_t read_gps(struct file *file, char __user *buf, size_t count, \
+			loff_t *offset)
+{
+	struct gps_reader *r = file->private_data;
+	struct gps_receiver *rx = r->rx;
+
+	if (count < sizeof(struct ccard_gps_fix))
+		return -EINVAL;
+
+	if (ACCESS_ONCE(rx->published) == r->next) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(rx->wait, \
+				ACCESS_ONCE(rx->published) != r->next || \
+				ACCESS_ONCE(rx->generation) != r->generation))
+			return -ERESTARTSYS;
+	}
+	if (ACCESS_ONCE(rx->generation) != r->generation)
+		return -ENODEV;
+
+	size_t copied = 0;
+	struct ccard_gps_fix fix;
+	while (copied + sizeof(fix) <= count && next_gps_fix(r, &fix) == 0) {
+		if (copy_to_user(buf + copied, &fix, sizeof(fix)))
+			return -EFAULT;
+		copied += sizeof(fix);
+	}
+
+	return copied;
+}
+
+static unsigned int poll_gps(struct file *file, poll_table *wait)
+{
+	struct gps_reader *r = file->private_data;
+	struct gps_receiver *rx = r->rx;
+
+	poll_wait(file, &rx->wait, wait);
+
+	if (ACCESS_ONCE(rx->generation) != r->generation)
+		return POLLHUP | POLLERR;
+	return ACCESS_ONCE(rx->published) != r->next ? POLLIN | POLLRDNORM : 0;
+}
+
+s8 ccard_init_gps()
+{
+	if (_gps_ldisc <= N_TTY || _gps_ldisc >= NR_LDISCS) {
+		ccard_err("gps line discipline %i out of range\n", \
+				_gps_ldisc);
+		return 1;
+	}
+
+	for (int i = 0; i < GPS_MAX_RECEIVERS; i++) {
+		_gps[i].index = i;
+		seqlock_init(&_gps[i].lock);
+		init_waitqueue_head(&_gps[i].wait);
+	}
+
+	if (alloc_chrdev_region(&_dev_gps, 0, GPS_MAX_RECEIVERS, "gps")) {
+		ccard_err("couldn't create gps dev_t\n");
+		return 1;
+	}
+
+	cdev_init(&_gps_cdev, &_gps_fops);
+	_gps_cdev.owner = THIS_MODULE;
+	if (cdev_add(&_gps_cdev, _dev_gps, GPS_MAX_RECEIVERS)) {
+		ccard_err("couldn't add gps char device\n");
+		unregister_chrdev_region(_dev_gps, GPS_MAX_RECEIVERS);
+		return 1;
+	}
+
+	if (tty_register_ldisc(_gps_ldisc, &_gps_ldisc_ops)) {
+		ccard_err("couldn't register gps line discipline %i\n", \
+				_gps_ldisc);
+		cdev_del(&_gps_cdev);
+		unregister_chrdev_region(_dev_gps, GPS_MAX_RECEIVERS);
+		return 1;
+	}
+
+	_gps_ready = 1;
+	return 0;
+}
+
+void ccard_cleanup_gps()
+{
+	if (!_gps_ready)
+		return;
+
+	// an attached tty holds the module, so no receiver is left here
+	tty_unregister_ldisc(_gps_ldisc);
+
+	cdev_del(&_gps_cdev);
+	unregister_chrdev_region(_dev_gps, GPS_MAX_RECEIVERS);
+	_gps_ready = 0;
+}
+
+
+
+//
+// sysfs section
+//
+
+static ssize_t read_gps_fix(struct device *dev, \
+			    struct device_attribute *attr, char *buf)
+{
+	struct gps_receiver *rx = dev_get_drvdata(dev);
+	struct ccard_gps_fix fix;
+
+	if (ccard_gps_latest(rx->index, &fix))
+		return scnprintf(buf, PAGE_SIZE, "[none]\n");
+
+	const char *tag = fix.quality || (fix.flags & CCARD_GPS_VALID) ? \
+			  "fix" : "nofix";
+	u32 lat = abs(fix.latitude), lon = abs(fix.longitude);
+	u32 alt = abs(fix.altitude);
+	s64 age = ktime_to_ms(ktime_sub(ktime_get(), \
+					ns_to_ktime(fix.timestamp_ns)));
+
+	return scnprintf(buf, PAGE_SIZE, "[%s] seq %u time %02u:%02u:%02u.%03u " \
+			 "date %04u-%02u-%02u lat %s%u.%07u lon %s%u.%07u " \
+			 "alt %s%u.%03u quality %u sats %u hdop %u.%02u " \
+			 "speed %u.%03u course %u.%02u age %lld ms\n", tag, \
+			 fix.sequence, fix.time_ms / 3600000, \
+			 fix.time_ms / 60000 % 60, fix.time_ms / 1000 % 60, \
+			 fix.time_ms % 1000, fix.year, fix.month, fix.day, \
+			 fix.latitude < 0 ? "-" : "", lat / 10000000, \
+			 lat % 10000000, fix.longitude < 0 ? "-" : "", \
+			 lon / 10000000, lon % 10000000, \
+			 fix.altitude < 0 ? "-" : "", alt / 1000, alt % 1000, \
+			 fix.quality, fix.satellites, \
+			 fix.hdop / 100, fix.hdop % 100, fix.speed / 1000, \
+			 fix.speed % 1000, fix.course / 100, fix.course % 100, \
+			 age);
+}
+
+static ssize_t read_gps_stats(struct device *dev, \
+			      struct device_attribute *attr, char *buf)
+{
+	struct gps_receiver *rx = dev_get_drvdata(dev);
+	struct gps_stats *s = &rx->stats;
+	u32 per_byte = s->bytes ? div_u64(s->busy_total_ns, s->bytes) : 0;
+
+	return scnprintf(buf, PAGE_SIZE, "bytes %u sentences %u fixes %u " \
+			 "checksum %u oversize %u garbage %u unknown %u " \
+			 "line_errors %u busy_max %u ns per_byte %u ns\n", \
+			 s->bytes, s->sentences, s->fixes, s->checksum, \
+			 s->oversize, s->garbage, s->unknown, s->line_errors, \
+			 s->busy_max_ns, per_byte);
+}
+
+static ssize_t read_gps_tty(struct device *dev, \
+			    struct device_attribute *attr, char *buf)
+{
+	struct gps_receiver *rx = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%s\n", rx->tty_name);
+}
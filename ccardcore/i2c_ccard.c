@@ -1,9 +1,16 @@
-// implementation of the i2c driver
+// implementation of the i2c transport
+// the devices of every i2c card are registered on the card's bus with this
+//   one driver, and the probe hands each of them to bus.c
+//
 // by Mark Hill
 
 #include<linux/kernel.h>
 #include<linux/i2c.h>
 #include<linux/types.h>
+#include<linux/mutex.h>
+#include<linux/device.h>
+#include<linux/string.h>
+#include<linux/slab.h>
 
 #include "ccard.h"
 
@@ -13,27 +20,23 @@ static int ccard_i2c_probe(struct i2c_client *client, \
 static int ccard_i2c_remove(struct i2c_client *client);
 
 
-#define _dsa_addr 0x38
-#define _mt_addr 0x38
-#define _thruster_dac_addr 0x0f
-#define _i2c_bus 1
-
 // holds the board info to pass to the i2c subsystem
+// the bus and the addresses are module parameters in board.c, the
+//   addresses and the card are filled in by i2c_card_attach
 static struct i2c_board_info ccard_board_info[] = {
-	{I2C_BOARD_INFO("ccard_dsa", _dsa_addr),},
-	{I2C_BOARD_INFO("ccard_mt", _mt_addr),},
-	{I2C_BOARD_INFO("ccard_thruster_dac", _thruster_dac_addr),},
+	{I2C_BOARD_INFO("ccard_dsa", 0),},
+	{I2C_BOARD_INFO("ccard_mt", 0),},
+	{I2C_BOARD_INFO("ccard_thruster_dac", 0),},
 };
 
 // array containing i2c board ids for use with the i2c subsystem detection
 //   mechanism
-#define _dsa_id 512
-#define _mt_id 1024
-#define _dac_id 768
+// the expanders can share an address on different boards, so the device
+//   is told apart by its id rather than its address
 static struct i2c_device_id ccard_i2c_ids[] = {
-	{"ccard_dsa", _dsa_id},
-	{"ccard_mt", _mt_id},
-	{"ccard_thruster_dac", _dac_id},
+	{"ccard_dsa", CCARD_DEV_DSA},
+	{"ccard_mt", CCARD_DEV_MT},
+	{"ccard_thruster_dac", CCARD_DEV_DAC},
 };
 
 // struct containing i2c driver info for the c card
@@ -48,166 +51,220 @@ static struct i2c_driver _drvr = {
 	.id_table = ccard_i2c_ids,
 };
 
-static struct i2c_client *_dsa;
-static struct i2c_client *_mt;
-static struct i2c_client *_thruster_dac;
+// what the transport keeps for an i2c card
+struct i2c_link {
+	struct i2c_adapter *adapter;
+	// in enum ccard_dev_id order, NULL where registering failed
+	struct i2c_client *clients[CCARD_DEV_COUNT];
+};
 
-static struct mutex *_ccard_i2c_lock;
+// returns the card <client> is on
+static inline struct ccard *client_card(struct i2c_client *client)
+{
+	return client->dev.platform_data;
+}
 
-// creates the controller devices for the corresponding
-//   gpio expander chip
-static inline void create_dsa_expdr_device(void);
-static inline void create_mt_expdr_device(void);
-static inline void create_thruster_dac_device(void);
+// returns the client of <dev>
+static inline struct i2c_client *dev_client(struct ccard_dev *dev)
+{
+	return dev->priv;
+}
 
 // initializes the i2c driver for the c card
-s8 ccard_init_i2c()
+// the devices of every card bind to this one driver
+static s8 i2c_card_init()
 {
-	// for a loadable module, registering the devices must be
-	//   done with i2c_new_device
-	// get the adapter for i2c bus 1
-	struct i2c_adapter *a = i2c_get_adapter(_i2c_bus);
-	_ccard_i2c_lock = &a->clist_lock;
-	_dsa = i2c_new_device(a , &ccard_board_info[0]);
-	_mt = i2c_new_device(a , &ccard_board_info[1]);
-	_thruster_dac = i2c_new_device(a, &ccard_board_info[2]);
-	// for a builtin module, register the i2c devices with the kernel
-	//i2c_register_board_info(_i2c_bus, ccard_board_info,
-	//			ARRAY_SIZE(ccard_board_info));
-	// initialize the driver
 	if (i2c_add_driver(&_drvr)) {
-		printk(KERN_ERR "failed to add i2c driver to kernel\n");
+		ccard_err("failed to add i2c driver to kernel\n");
 		return 1;
 	}
 
-	printk(KERN_NOTICE "successfully added i2c driver to kernel\n");
+	ccard_notice("successfully added i2c driver to kernel\n");
 
 	return 0;
 }
 
 // cleans up the i2c driver and removes it from the runtime
-void ccard_cleanup_i2c()
+static void i2c_card_cleanup()
 {
-	printk(KERN_NOTICE "removing i2c driver from kernel\n");
-	if (_mt != NULL)
-		i2c_unregister_device(_mt);
-	if (_dsa != NULL)
-		i2c_unregister_device(_dsa);
-	if (_thruster_dac != NULL)
-		i2c_unregister_device(_thruster_dac);
+	ccard_notice("removing i2c driver from kernel\n");
 	i2c_del_driver(&_drvr);
 }
 
+static s8 i2c_card_attach(struct ccard *card)
+{
+	// for a loadable module, registering the devices must be
+	//   done with i2c_new_device
+	// get the adapter for the configured i2c bus
+	int bus = _i2c_bus[card->index];
+	struct i2c_adapter *a = i2c_get_adapter(bus);
+	if (a == NULL) {
+		ccard_err("i2c bus %i doesn't exist\n", bus);
+		return 1;
+	}
+
+	struct i2c_link *link = kzalloc(sizeof(struct i2c_link), GFP_KERNEL);
+	if (link == NULL) {
+		i2c_put_adapter(a);
+		return 1;
+	}
+	link->adapter = a;
+	// the probes lock the bus as they bring the devices up
+	card->link = link;
+
+	// the probes find their card through the platform data
+	struct i2c_board_info info[ARRAY_SIZE(ccard_board_info)];
+	memcpy(info, ccard_board_info, sizeof(info));
+	for (int i = 0; i < ARRAY_SIZE(info); i++) {
+		info[i].addr = card->devs[i].addr;
+		info[i].platform_data = card;
+		link->clients[i] = i2c_new_device(a, &info[i]);
+	}
+	// for a builtin module, register the i2c devices with the kernel
+	//i2c_register_board_info(bus, ccard_board_info,
+	//			ARRAY_SIZE(ccard_board_info));
+
+	ccard_notice("c card %u on i2c bus %i\n", card->index, bus);
+
+	return 0;
+}
+
+static void i2c_card_detach(struct ccard *card)
+{
+	struct i2c_link *link = card->link;
+
+	// the devices are unbound by the remove callback
+	for (int i = 0; i < ARRAY_SIZE(link->clients); i++) {
+		if (link->clients[i] != NULL)
+			i2c_unregister_device(link->clients[i]);
+	}
+
+	i2c_put_adapter(link->adapter);
+	card->link = NULL;
+	kfree(link);
+}
+
 // probe function called by the kernel when a matching i2c_client is found
 static int ccard_i2c_probe(struct i2c_client *client, \
 			   const struct i2c_device_id *id)
 {
-	if (client->addr == _dsa_addr) {
-		printk(KERN_NOTICE "found dsa controller\n");
-		_dsa = client;
-		create_dsa_expdr_device();
-		return init_dsa();
-	} else if (client->addr == _mt_addr) {
-		printk(KERN_NOTICE "found magnetorquer controller\n");
-		_mt = client;
-		create_mt_expdr_device();
-		return init_mt();
-	} else if (client->addr == _thruster_dac_addr) {
-		printk(KERN_NOTICE "found thruster dac\n");
-		_thruster_dac = client;
-		create_thruster_dac_device();
-		return init_thruster();
-	} else {
-		printk(KERN_ERR "found unknown i2c slave at address %x", \
+	struct ccard *card = client_card(client);
+	if (card == NULL) {
+		ccard_err("i2c slave at address %x isn't on a c card\n", \
+				client->addr);
+		return 1;
+	} else if (id->driver_data >= CCARD_DEV_COUNT) {
+		ccard_err("found unknown i2c slave at address %x", \
 				client->addr);
 		return 1;
 	}
+
+	struct ccard_dev *dev = &card->devs[id->driver_data];
+	scnprintf(client->name, I2C_NAME_SIZE, ccard_dev_type(dev->id));
+	i2c_set_clientdata(client, dev);
+	ccard_dev_bound(dev, &client->dev, client);
+	return 0;
 }
 
 // remove function called by the kernel when the i2c_client must be removed
 static int ccard_i2c_remove(struct i2c_client *client)
 {
-	if (client->addr == _dsa_addr) {
-		printk(KERN_NOTICE "kernel wants to remove dsa controller\n");
-		cleanup_dsa();
-		_dsa = NULL;
-	} else if (client->addr == _mt_addr) {
-		printk(KERN_NOTICE "kernel wants to remove magnetorquer \
-				controller\n");
-		cleanup_mt();
-		_mt = NULL;
-	} else if (client->addr == _thruster_dac_addr) {
-		printk(KERN_NOTICE "kernel wants to remove thruster dac\n");
-		cleanup_thruster();
-		_thruster_dac = NULL;
-	} else {
-		printk(KERN_ERR "anyone know why the kernel wants to remove \
+	struct ccard_dev *dev = i2c_get_clientdata(client);
+	if (dev == NULL) {
+		ccard_err("anyone know why the kernel wants to remove \
 		       i2c slave at address %x and asked the c card driver \
 		       to take of it?\n", client->addr);
 		return 1;
 	}
-	return 0;
-}
-
 
-// locks the i2c bus
-int ccard_lock_bus()
-{
-	return mutex_lock_interruptible(_ccard_i2c_lock);
+	ccard_notice("kernel wants to remove %s\n", \
+			ccard_dev_type(dev->id));
+	ccard_dev_unbound(dev);
+	i2c_set_clientdata(client, NULL);
+	return 0;
 }
 
-// unlocks the i2c bus
-void ccard_unlock_bus()
+// the client list lock of the adapter serializes every transaction with
+//   the card
+static int i2c_card_lock(struct ccard *card, u8 wait)
 {
-	mutex_unlock(_ccard_i2c_lock);
-}
-
+	struct i2c_link *link = card->link;
 
-// returns the i2c_client struct for the magnetorquer GPIO expdr
-struct i2c_client *mt_expdr()
-{
-	return _mt;
+	if (!wait)
+		return mutex_trylock(&link->adapter->clist_lock) ? 0 : -EBUSY;
+	return mutex_lock_interruptible(&link->adapter->clist_lock);
 }
 
-// returns the i2c_client struct for the dsa GPIO expdr
-struct i2c_client *dsa_expdr()
+static void i2c_card_unlock(struct ccard *card)
 {
-	return _dsa;
+	struct i2c_link *link = card->link;
+	mutex_unlock(&link->adapter->clist_lock);
 }
 
-// returns the i2c_client struct for the DAC controlling the thruster
-struct i2c_client *thruster_dac()
+static int i2c_card_read(struct ccard_dev *dev, u8 reg, u8 *val)
 {
-	return _thruster_dac;
+	struct i2c_client *client = dev_client(dev);
+	if (i2c_master_send(client, &reg, 1) < 1 || \
+	    i2c_master_recv(client, val, 1) < 1)
+		return -EIO;
+	return 0;
 }
 
-
-
-//
-// sysfs section
-//
-
-static inline void name_i2c_client(struct i2c_client *client, \
-				   const char name[])
+static int i2c_card_write(struct ccard_dev *dev, u8 reg, u8 val)
 {
-	scnprintf(client->name, I2C_NAME_SIZE, name);
+	u8 buf[] = {reg, val};
+	if (i2c_master_send(dev_client(dev), buf, 2) < 2)
+		return -EIO;
+	return 0;
 }
 
-static inline void create_dsa_expdr_device()
+// the writes go out as one combined transfer with a repeated start
+//   between them, so the adapter is only taken once
+#define I2C_BURST_MAX 8
+static int i2c_card_burst(struct ccard_dev *dev, const u8 *regs, \
+			  const u8 *vals, u8 count)
 {
-	name_i2c_client(_dsa, "dsa_expdr");
-}
+	struct i2c_client *client = dev_client(dev);
+	struct i2c_msg msgs[I2C_BURST_MAX];
+	u8 bufs[I2C_BURST_MAX][2];
+
+	while (count > 0) {
+		u8 n = min_t(u8, count, I2C_BURST_MAX);
+		for (int i = 0; i < n; i++) {
+			bufs[i][0] = regs[i];
+			bufs[i][1] = vals[i];
+			msgs[i].addr = client->addr;
+			msgs[i].flags = 0;
+			msgs[i].len = 2;
+			msgs[i].buf = bufs[i];
+		}
+		if (i2c_transfer(client->adapter, msgs, n) != n)
+			return -EIO;
+
+		regs += n;
+		vals += n;
+		count -= n;
+	}
 
-static inline void create_mt_expdr_device()
-{
-	name_i2c_client(_mt, "mt_expdr");
+	return 0;
 }
 
-static inline void create_thruster_dac_device()
+// the result doesn't matter, only that something acknowledged the read
+static int i2c_card_ping(struct ccard_dev *dev)
 {
-	name_i2c_client(_thruster_dac, "thruster_dac");
+	return i2c_smbus_read_byte(dev_client(dev)) < 0 ? -EIO : 0;
 }
 
-
-
-
+const struct ccard_transport ccard_i2c_transport = {
+	.name = "i2c",
+	.init = i2c_card_init,
+	.cleanup = i2c_card_cleanup,
+	.attach = i2c_card_attach,
+	.detach = i2c_card_detach,
+	.lock = i2c_card_lock,
+	.unlock = i2c_card_unlock,
+	.read_reg = i2c_card_read,
+	.write_reg = i2c_card_write,
+	.burst = i2c_card_burst,
+	.probe = i2c_card_ping,
+};
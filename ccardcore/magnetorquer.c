@@ -10,27 +10,65 @@
 #include<linux/sysfs.h>
 #include<linux/string.h>
 #include<linux/fs.h>
+#include<linux/mutex.h>
+#include<linux/slab.h>
 
 #include "ccard.h"
+#include "ccard_trace.h"
+#include "ccard_pins.h"
+#include "ccard_record.h"
 
 
 // defines the number of magnetorquers connected to the ccard
-#define MT_COUNT 3
-
-// basically its like this [forwardPinMT1, forwardPinMT2, ... forwardPinMTn]
-static const u8 _forwardBits[] = {0, 2, 4};
-static const u8 _reverseBits[] = {1, 3, 5};
-
-// flag that indicates if the magnetorquer hardware has been
-//   initialized properly
-// 1 == initialized, 0 = uninitialized
-static s8 _mt_initialized = 0;
+// the default forward and reverse pins of each one are in ccard_pins.h,
+//   the module parameters in board.c can move them
+#define MT_COUNT CCARD_MT_COUNT
+
+// maps the x, y and z components of a dipole command onto the
+//   magnetorquers, [mtForX, mtForY, mtForZ]
+static const u8 _dipole_axis_mt[] = {0, 1, 2};
+
+// dipole components with a magnitude at or below this value switch
+//   their magnetorquer off instead of driving it
+// shared by every card, like the other class attributes
+static u32 _userDipoleDeadband = 0;
+
+// the magnetorquers of one card
+// allocated the first time the card's expander is brought up and kept
+//   until the card goes away, so a card that is unplugged and plugged back
+//   in keeps its last dipole
+struct card_mt {
+	struct ccard *card;
+	// flag that indicates if the magnetorquer hardware has been
+	//   initialized properly
+	// 1 == initialized, 0 = uninitialized
+	s8 initialized;
+	// the output register as the driver last wrote or read it, so that a
+	//   read which finds something else can be reported
+	u8 value;
+	// held from the read of the output register to the final write, so
+	//   the b-dot executor, the scheduler and sysfs can't each start from
+	//   the same register and undo each other's magnetorquers
+	struct mutex write_lock;
+	// stores the last dipole that was successfully applied
+	struct ccard_vec3int last_dipole;
+	// the drvdata of each magnetorquer device
+	struct ccard_unit units[MT_COUNT];
+	// stores the device numbers
+	dev_t dev[MT_COUNT];
+	// stores the device structs
+	struct device *devices[MT_COUNT];
+};
 
 // function to create the device structs fro the magnetorquers and
 //   add them to the sysfs
-static inline void create_mt_devices(void);
+static inline void create_mt_devices(struct card_mt *mt);
 // removes the magnetorquer devices from sysfs
-static inline void remove_mt_devices(void);
+static inline void remove_mt_devices(struct card_mt *mt);
+
+// convert between a magnetorquer state and its output register bits
+static inline enum mt_state decode_mt_state(u8 value, u8 mt_num);
+static inline u8 encode_mt_state(enum mt_state state, u8 mt_num);
 
 // definitions for the magnetorquer sysfs callbacks
 static ssize_t read_mt_state(struct device *dev, \
@@ -40,186 +78,392 @@ static ssize_t write_mt_state(struct device *dev, \
 				 const char *buf, size_t count);
 
 // stores the magnetorquer class
+// the class is shared by every card, it is registered by the first card
+//   to bring its magnetorquers up and unregistered by the last one
 static struct class _mt_class;
-// stores the device numbers
-static dev_t _dev_mt[MT_COUNT];
-// stores the device structs
-static struct device *_mt_devices[MT_COUNT];
+static u8 _mt_class_users = 0;
+static DEFINE_MUTEX(_mt_class_lock);
 // device attributes for the magnetorquers
 static DEVICE_ATTR(state, S_IRUSR | S_IWUSR, read_mt_state, \
 		   write_mt_state);
 
+// callback functions for the magnetorquer class attributes
+static ssize_t read_mt_dipole(struct class *class, char *buf);
+static ssize_t write_mt_dipole(struct class *class, const char *buf, \
+			       size_t count);
+static ssize_t read_mt_dipole_deadband(struct class *class, char *buf);
+static ssize_t write_mt_dipole_deadband(struct class *class, \
+					const char *buf, size_t count);
+// class attributes for the magnetorquers
+// the dipole of the class drives the first card, the dipole file of each
+//   card's bdot device drives that card
+static CLASS_ATTR(dipole, S_IRUSR | S_IWUSR, read_mt_dipole, \
+		  write_mt_dipole);
+static CLASS_ATTR(dipole_deadband, S_IRUSR | S_IWUSR, \
+		  read_mt_dipole_deadband, write_mt_dipole_deadband);
+
 
 
 // sets magnetorquer hardware into a default state and prepares
 //   for subsequent state changes
-s8 init_mt() {
+s8 init_mt(struct ccard *card) {
+	if (card->mt == NULL) {
+		card->mt = kzalloc(sizeof(struct card_mt), GFP_KERNEL);
+		if (card->mt == NULL)
+			return 1;
+		card->mt->card = card;
+		mutex_init(&card->mt->write_lock);
+	}
+	struct card_mt *mt = card->mt;
+
 	// checks if the hardware has already been initialized
-	if (_mt_initialized)
+	if (mt->initialized)
 		return 0;
 
-	create_mt_devices();
-
-	// configure all pins as outputs
-	s8 cfgreg = 0x03;
-	s8 cfgval = 0x00;
-	const char buf[] = {cfgreg, cfgval};
-	// write all off to the i2c device
-	s8 outreg = 0x01;
-	s8 outval = 0x00;
-	const char buf2[] = {outreg, outval};
+	// configure all pins as outputs and write all off to the expander,
+	//   in one transfer where the transport can
+	u8 outval = 0x00;
+	u8 regs[] = {0x03, 0x01};
+	u8 vals[] = {0x00, outval};
 
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
+	if (ccard_lock_bus(card, CCARD_BUS_HOUSEKEEPING)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
 		return 1;
-	} else if (i2c_master_send(mt_expdr(), buf, 2) < 2 || \
-	    i2c_master_send(mt_expdr(), buf2, 2) < 2) {
-		ccard_unlock_bus();
-		printk(KERN_ERR "failed to configure magnetorquer GPIO expander\n");
+	} else if (ccard_write_regs(mt_expdr(card), regs, vals, 2)) {
+		ccard_unlock_bus(card);
+		ccard_err("failed to configure magnetorquer GPIO expander\n");
 		return -1;
 	}
-	ccard_unlock_bus();
+	ccard_unlock_bus(card);
+	mt->value = outval;
 
-	create_mt_devices();
+	create_mt_devices(mt);
 
-	printk(KERN_NOTICE "magnetorquer initialization successful\n");
+	// the executor lives in the magnetorquer class, so it can only be
+	//   created once the class exists
+	if (init_bdot(card))
+		ccard_err("b-dot executor unavailable\n");
+
+	ccard_notice("magnetorquer initialization successful\n");
 	// initializaton was successful
-	_mt_initialized = 1;
+	mt->initialized = 1;
 	return 0;
 }
 
 // cleans up and powers off the magnetorquer hardware
-void cleanup_mt() {
-	if (!_mt_initialized)
+void cleanup_mt(struct ccard *card) {
+	struct card_mt *mt = card->mt;
+	if (mt == NULL || !mt->initialized)
 		return;
 
-	remove_mt_devices();
+	// the executor has to stop driving the magnetorquers before
+	//   they are switched off
+	cleanup_bdot(card);
+
+	remove_mt_devices(mt);
 
 	// allows the magnetic field to be discharged before
 	//   shutting the hardware off
 	for (s8 i = 0; i < MT_COUNT; i++) {
-		set_mt_state(i, off);
+		set_mt_state(card, i, off, cause_reset);
 	}
 
 	// resets the isInitialized flag
-	_mt_initialized = 0;
+	mt->initialized = 0;
+}
+
+// reports every magnetorquer whose state in output register <value> differs
+//   from the last known register value
+// must be called with the write lock held
+static inline void observe_mt_value(struct card_mt *mt, u8 value)
+{
+	if (value == mt->value)
+		return;
+
+	for (int i = 0; i < MT_COUNT; i++) {
+		enum mt_state old_state = decode_mt_state(mt->value, i);
+		enum mt_state new_state = decode_mt_state(value, i);
+		if (old_state != new_state)
+			ccard_notify(mt->card, act_mt, i, old_state, new_state, \
+				     cause_observed);
+	}
+	mt->value = value;
 }
 
 // retrieves the state of magnetorquer <mt_num>
-enum mt_state get_mt_state(u8 mt_num) {
-	if (!_mt_initialized)
+// the write lock keeps the read and the last known value from interleaving
+//   with a write, which would report a change that didn't happen
+enum mt_state get_mt_state(struct ccard *card, u8 mt_num) {
+	struct card_mt *mt = card->mt;
+	if (mt == NULL || !mt->initialized)
 		return off;
 	// read the current value from the GPIO expander
-	u8 valbuf[1];
-	s8 valregbuf[] = {0x01};
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
+	u8 val;
+	u8 valreg = 0x01;
+	mutex_lock(&mt->write_lock);
+	if (ccard_lock_bus(card, CCARD_BUS_HOUSEKEEPING)) {
+		mutex_unlock(&mt->write_lock);
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
 		return 1;
-	} else if (i2c_master_send(mt_expdr(), valregbuf, 1) < 1 || \
-	    i2c_master_recv(mt_expdr(), valbuf, 1) < 1) {
-		printk(KERN_ERR "error reading magnetorquer expander\n");
-		ccard_unlock_bus();
+	} else if (ccard_read_reg(mt_expdr(card), valreg, &val)) {
+		ccard_unlock_bus(card);
+		mutex_unlock(&mt->write_lock);
+		ccard_err_rl("error reading magnetorquer expander\n");
 		return off;
 	}
-	ccard_unlock_bus();
+	ccard_unlock_bus(card);
+	observe_mt_value(mt, val);
+	mutex_unlock(&mt->write_lock);
 
-	u8 value = (u8)valbuf[0];
-	// flags that indicate the state of their corresponding
-	//   direction, where 1 = on and 0 = off
-	u8 forwardOn = (value >> _forwardBits[mt_num]) & 0x01;
-	u8 reverseOn = (value >> _reverseBits[mt_num]) & 0x01;
+	return decode_mt_state(val, mt_num);
+}
 
-	// the state is actually a combination of the two bits, with the
-	//   reverse bit being the high bit
-	return (reverseOn << 1) | forwardOn;
+// returns the state of magnetorquer <mt_num> encoded in output register <value>
+static inline enum mt_state decode_mt_state(u8 value, u8 mt_num)
+{
+	// the state is actually a combination of the forward and reverse
+	//   bits, with the reverse bit being the high bit
+	return _decode.mt_decode[mt_num][value];
 }
 
-// sets the state of magnetorquer <mt_num> to the
-//   desired state, after entering the transition state if
-//   needed for a brief period of time
-// returns 0 if successful and -1 if not successful
-s8 set_mt_state(u8 mt_num, enum mt_state desired_state) {
-	if (!_mt_initialized)
-		return 1;
-	// get the current state first to determine whether a transition state
-	//   is needed to prevent large back emf, and to determine if a
-	//   state change is even necessary
-	enum mt_state currentState = get_mt_state(mt_num);
-	// determine if state change is needed
-	if (currentState == desired_state) {
-		printk(KERN_DEBUG "cur state already equals desired state\n");
-		return 0;
+// returns the output register bits that put magnetorquer <mt_num> in <state>
+static inline u8 encode_mt_state(enum mt_state state, u8 mt_num)
+{
+	return _decode.mt_encode[mt_num][state & 0x03];
+}
+
+// reports the state of every magnetorquer whose bit is set in <which> to
+//   the usage counters and the actuator events, after <value> replaced <old>
+//   in the output register
+static inline void account_mt_states(struct card_mt *mt, u8 old, u8 value, \
+				     u8 which, enum ccard_cause cause)
+{
+	for (int i = 0; i < MT_COUNT; i++) {
+		if (!(which & (1 << i)))
+			continue;
+
+		enum mt_state old_state = decode_mt_state(old, i);
+		enum mt_state new_state = decode_mt_state(value, i);
+		ccard_usage_mt(mt->card, i, new_state);
+		if (old_state != new_state)
+			ccard_notify(mt->card, act_mt, i, old_state, new_state, \
+				     cause);
 	}
+	mt->value = value;
+}
 
-	s8 outregbuf[] = {0x01};
-	s8 valbuf[1];
+// the final write of apply_mt_states didn't go out after the magnetorquers
+//   in <braked_mts> were braked, moving the output register from <unbraked>
+//   to <braked>
+// with the bus still <held> the value from before the brake is written back,
+//   otherwise, or if that fails too, they stay braked and a log record says
+//   so, the brake itself was already reported
+static void recover_mt_brake(struct ccard *card, u8 held, u8 unbraked, \
+			     u8 braked, u8 braked_mts, enum ccard_cause cause)
+{
+	struct card_mt *mt = card->mt;
+	u8 outreg = 0x01;
+
+	if (held) {
+		int ret = ccard_write_reg(mt_expdr(card), outreg, unbraked);
+		ccard_unlock_bus(card);
+		if (ret == 0) {
+			account_mt_states(mt, braked, unbraked, braked_mts, cause);
+			return;
+		}
+	}
+
+	ccard_err_rl("magnetorquers 0x%x left braked\n", braked_mts);
+	ccard_log_record(card, CCARD_LOG_MT_BRAKED, braked_mts, cause);
+}
+
+// moves every magnetorquer whose bit is set in <which> to desired[mt]
+// must be called with the write lock held
+// magnetorquers that are on and change state are braked together first, so
+//   the whole update costs one register read, at most one brake write and
+//   one final write no matter how many magnetorquers change
+// returns 0 if successful and 1 if not successful
+static s8 apply_mt_states(struct ccard *card, const enum mt_state *desired, \
+			  u8 which, enum ccard_cause cause)
+{
+	struct card_mt *mt = card->mt;
+	u8 outreg = 0x01;
+	u8 value;
 
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
+	if (ccard_lock_bus(card, CCARD_BUS_COMMAND)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
 		return 1;
-	} else if (i2c_master_send(mt_expdr(), outregbuf, 1) < 1 || \
-	    i2c_master_recv(mt_expdr(), valbuf, 1) < 1) {
-		printk(KERN_ERR "error reading mt state for mt %i\n", mt_num);
-		ccard_unlock_bus();
+	} else if (ccard_read_reg(mt_expdr(card), outreg, &value)) {
+		ccard_err_rl("error reading magnetorquer expander\n");
+		ccard_unlock_bus(card);
 		return 1;
 	}
-	ccard_unlock_bus();
+	ccard_unlock_bus(card);
+	observe_mt_value(mt, value);
+
+	// bits that brake the magnetorquers that need it, and the bits that
+	//   belong to the magnetorquers being changed
+	u8 brake = 0;
+	u8 changed = 0;
+	u8 target = 0;
+	// the same, but one bit per magnetorquer
+	u8 braked_mts = 0;
+	u8 changed_mts = 0;
+	u8 unbraked = value;
+	for (int i = 0; i < MT_COUNT; i++) {
+		if (!(which & (1 << i)))
+			continue;
+
+		// determine if state change is needed
+		enum mt_state currentState = decode_mt_state(value, i);
+		if (currentState == desired[i])
+			continue;
+
+		u8 mask = encode_mt_state(transitioning, i);
+		changed |= mask;
+		changed_mts |= 1 << i;
+		target |= encode_mt_state(desired[i], i);
+		// on to anything else creates a back emf, so enter the
+		//   transition state first
+		if (currentState != off) {
+			brake |= mask;
+			braked_mts |= 1 << i;
+		}
+	}
 
-	u8 value = (s8)valbuf[0];
-	// enter transition state if needed
-	if (currentState != off) {
-		printk(KERN_NOTICE "enabling brake mode for mt %i\n", mt_num);
+	if (changed == 0)
+		return 0;
 
-		// mask used for setting the proper bits
-		u8 mask = (0x01 << _forwardBits[mt_num]) | \
-			  (0x01 << _reverseBits[mt_num]);
+	// enter transition state if needed
+	if (brake) {
+		trace_ccard_brake_start(braked_mts);
 
-		// modify the correct values with bitwise operations
-		value |= mask;
+		value |= brake;
 
-		s8 outbuf[] = {outregbuf[0], (s8)value};
-		if (ccard_lock_bus()) {
-			printk(KERN_ERR "unable to lock i2c bus\n");
+		if (ccard_lock_bus(card, CCARD_BUS_COMMAND)) {
+			ccard_err_rl("unable to lock the bus of card %u\n", \
+				     card->index);
 			return 1;
-		} else if (i2c_master_send(mt_expdr(), outbuf, 2) < 2) {
-			printk(KERN_ERR "setting magnetorquer to state %i failed\n", \
-					desired_state);
-			ccard_unlock_bus();
+		} else if (ccard_write_reg(mt_expdr(card), outreg, value)) {
+			ccard_err_rl("braking magnetorquers failed\n");
+			ccard_unlock_bus(card);
 			return 1;
 		}
-		ccard_unlock_bus();
+		ccard_unlock_bus(card);
+		account_mt_states(mt, unbraked, value, braked_mts, cause);
 
 		// give the magnetic field time to collapse
 		msleep(100);
-
-		// if the desired state is transitioning, then this function
-		//   has already done it's work
-		if (desired_state == transitioning)
-			return 0;
+		trace_ccard_brake_end(braked_mts);
 	}
 
 	// write the desired state
-	printk(KERN_DEBUG "updating MT state\n");
-	// set the proper bits using bitwise operations
-	u8 forwardValue = (desired_state == forward) ? 1 : 0;
-	u8 reverseValue = (desired_state == reverse) ? 1 : 0;
-	value &= forwardValue << _forwardBits[mt_num];
-	value &= reverseValue << _reverseBits[mt_num];
-	// modify the correct values with bitwise operations
-	s8 outbuf[] = {outregbuf[0], (s8)value};
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
+	u8 final = (value & ~changed) | target;
+	// braking may already have produced the target, for instance when
+	//   the desired state is transitioning
+	if (final == value)
+		return 0;
+
+	if (ccard_lock_bus(card, CCARD_BUS_COMMAND)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
+		if (braked_mts)
+			recover_mt_brake(card, 0, unbraked, value, braked_mts, \
+					 cause);
 		return 1;
-	} else if (i2c_master_send(mt_expdr(), outbuf, 2) < 2) {
-		printk(KERN_ERR "failed to set magnetorquer state\n");
-		ccard_unlock_bus();
+	} else if (ccard_write_reg(mt_expdr(card), outreg, final)) {
+		ccard_err_rl("failed to set magnetorquer state\n");
+		if (braked_mts)
+			recover_mt_brake(card, 1, unbraked, value, braked_mts, \
+					 cause);
+		else
+			ccard_unlock_bus(card);
 		return 1;
 	}
-	ccard_unlock_bus();
+	ccard_unlock_bus(card);
+	account_mt_states(mt, value, final, changed_mts, cause);
 
 	return 0;
 }
 
+// applies the states and sends a log record if that failed
+static s8 write_mt_states(struct ccard *card, const enum mt_state *desired, \
+			  u8 which, enum ccard_cause cause)
+{
+	mutex_lock(&card->mt->write_lock);
+	s8 ret = apply_mt_states(card, desired, which, cause);
+	mutex_unlock(&card->mt->write_lock);
+	if (ret)
+		ccard_log_record(card, CCARD_LOG_MT_SET, which, cause);
+	return ret;
+}
+
+// sets the state of magnetorquer <mt_num> to the
+//   desired state, after entering the transition state if
+//   needed for a brief period of time
+// returns 0 if successful and 1 if not successful
+s8 set_mt_state(struct ccard *card, u8 mt_num, enum mt_state desired_state, \
+		enum ccard_cause cause) {
+	if (card->mt == NULL || !card->mt->initialized)
+		return 1;
+	if (mt_num >= MT_COUNT) {
+		ccard_err_rl("magnetorquer %i does not exist\n", mt_num);
+		return 1;
+	}
+
+	enum mt_state desired[MT_COUNT];
+	desired[mt_num] = desired_state;
+
+	return write_mt_states(card, desired, 1 << mt_num, cause);
+}
+
+s8 set_mt_states(struct ccard *card, const enum mt_state *desired, u8 which, \
+		 enum ccard_cause cause)
+{
+	if (card->mt == NULL || !card->mt->initialized)
+		return 1;
+	if (which >> MT_COUNT) {
+		ccard_err_rl("magnetorquer mask %x out of range\n", which);
+		return 1;
+	}
+
+	return write_mt_states(card, desired, which, cause);
+}
+
+// returns the state a dipole component of <value> calls for
+static inline enum mt_state dipole_mt_state(s32 value)
+{
+	s32 magnitude = (value < 0) ? -value : value;
+
+	if (magnitude <= _userDipoleDeadband)
+		return off;
+
+	return (value > 0) ? forward : reverse;
+}
+
+s8 set_mt_dipole(struct ccard *card, const struct ccard_vec3int *dipole, \
+		 enum ccard_cause cause)
+{
+	if (card->mt == NULL || !card->mt->initialized)
+		return 1;
+
+	// the magnetorquers are switched by a GPIO expander, so they are either
+	//   fully on or off and only the sign of each component matters
+	const s32 axes[] = {dipole->x, dipole->y, dipole->z};
+	enum mt_state desired[MT_COUNT];
+	u8 which = 0;
+	for (int i = 0; i < MT_COUNT; i++) {
+		u8 mt = _dipole_axis_mt[i];
+		desired[mt] = dipole_mt_state(axes[i]);
+		which |= 1 << mt;
+	}
+
+	s8 result = write_mt_states(card, desired, which, cause);
+	if (result == 0)
+		card->mt->last_dipole = *dipole;
+
+	return result;
+}
+
 
 
 // if the user writes any of these strings to the 'state' file for
@@ -252,17 +496,9 @@ static char *possible_trans_str[16] = {
 static ssize_t read_mt_state(struct device *dev, \
 				struct device_attribute *attr, char *buf)
 {
-	printk(KERN_DEBUG "reading magnetorquer state\n");
-
-	s8 mt_num = 0;
-	for (int i = 1; i < MT_COUNT; i++) {
-		if (dev == _mt_devices[i]) {
-			mt_num = i;
-			break;
-		}
-	}
+	struct ccard_unit *unit = dev_get_drvdata(dev);
 
-	enum mt_state cur_state = get_mt_state(mt_num);
+	enum mt_state cur_state = get_mt_state(unit->card, unit->index);
 
 	char *state_str = possible_off_str[0];
 	switch (cur_state) {
@@ -292,15 +528,10 @@ static ssize_t write_mt_state(struct device *dev, \
 				 struct device_attribute *attr, \
 				 const char *buf, size_t count)
 {
-	printk(KERN_DEBUG "asked to write %s\n", buf);
-
-	s8 mt_num = 0;
-	for (int i = 1; i < MT_COUNT; i++) {
-		if (dev == _mt_devices[i]) {
-			mt_num = i;
-			break;
-		}
-	}
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+	u8 mt_num = unit->index;
+	ktime_t start = ktime_get();
+	trace_ccard_cmd_received(act_mt, mt_num, count);
 
 	enum mt_state state = off;
 	char **arrays[4] = {
@@ -316,76 +547,169 @@ static ssize_t write_mt_state(struct device *dev, \
 		}
 	}
 
-	printk(KERN_DEBUG "setting mt %i to state %i\n", mt_num, state);
-	set_mt_state(mt_num, state);
+	trace_ccard_cmd_parsed(act_mt, mt_num, state);
+	set_mt_state(unit->card, mt_num, state, cause_command);
 
+	ccard_record_command(unit->card, CCARD_SRC_MT_STATE, mt_num, buf, count, \
+			     count, start);
 	return count;
 }
 
 
+// prints the last dipole applied to <card>
+static ssize_t show_mt_dipole(struct ccard *card, char *buf)
+{
+	struct ccard_vec3int dipole = {};
+	if (card != NULL && card->mt != NULL)
+		dipole = card->mt->last_dipole;
+
+	return scnprintf(buf, 50, "%i %i %i\n", dipole.x, dipole.y, dipole.z);
+}
+
+// applies the dipole in <buf> to <card>
+// expects the x, y and z components separated by whitespace
+static ssize_t store_mt_dipole(struct ccard *card, const char *buf, \
+			       size_t count)
+{
+	ktime_t start = ktime_get();
+	struct ccard_vec3int dipole;
+	ssize_t ret = count;
+
+	if (card == NULL)
+		return -ENODEV;
+
+	if (sscanf(buf, "%i %i %i", &dipole.x, &dipole.y, &dipole.z) != 3) {
+		ccard_warn_rl("%s is an invalid dipole\n", buf);
+		ret = -EINVAL;
+	} else if (set_mt_dipole(card, &dipole, cause_command)) {
+		ret = -EIO;
+	}
+
+	ccard_record_command(card, CCARD_SRC_MT_DIPOLE, 0, buf, count, ret, \
+			     start);
+	return ret;
+}
+
+static ssize_t read_mt_dipole(struct class *class, char *buf)
+{
+	return show_mt_dipole(ccard_get(0), buf);
+}
+
+static ssize_t write_mt_dipole(struct class *class, const char *buf, \
+			       size_t count)
+{
+	return store_mt_dipole(ccard_get(0), buf, count);
+}
+
+static ssize_t read_mt_dipole_deadband(struct class *class, char *buf)
+{
+	return scnprintf(buf, 20, "%u\n", _userDipoleDeadband);
+}
+
+static ssize_t write_mt_dipole_deadband(struct class *class, \
+					const char *buf, size_t count)
+{
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value))
+		ccard_warn_rl("%s is an invalid dipole deadband\n", buf);
+	else
+		_userDipoleDeadband = (u32)value;
+
+	return count;
+}
+
 static void ccard_release_mt(struct device *dev)
 {
-	printk(KERN_DEBUG "releasing magnetorquer device file\n");
+	ccard_dbg("releasing magnetorquer device file\n");
 }
 
 
-static inline void create_mt_devices()
+// registers the magnetorquer class for its first user
+// returns 0 if the class is ready
+static s8 get_mt_class(void)
 {
-	printk(KERN_DEBUG "creating magnetorquer sysfs files\n");
+	mutex_lock(&_mt_class_lock);
+	if (_mt_class_users == 0) {
+		struct class mt_class = {
+			.name = "magnetorquer",
+			.owner = THIS_MODULE,
+			.dev_release = ccard_release_mt,
+		};
+		_mt_class = mt_class;
+
+		if (class_register(&_mt_class)) {
+			ccard_err("failed to create magnetorquer class\n");
+			mutex_unlock(&_mt_class_lock);
+			return 1;
+		}
 
-	struct device *parent = &mt_expdr()->dev;
+		if (class_create_file(&_mt_class, &class_attr_dipole) || \
+		    class_create_file(&_mt_class, &class_attr_dipole_deadband))
+			ccard_err("couldn't create magnetorquer class \
+					attributes\n");
+	}
+	_mt_class_users++;
+	mutex_unlock(&_mt_class_lock);
 
-	struct class mt_class = {
-		.name = "magnetorquer",
-		.owner = THIS_MODULE,
-		.dev_release = ccard_release_mt,
-	};
-	_mt_class = mt_class;
+	return 0;
+}
 
-	if (class_register(&_mt_class)) {
-		printk(KERN_ERR "failed to create magnetorquer class\n");
-		return;
+// unregisters the magnetorquer class once its last user is gone
+static void put_mt_class(void)
+{
+	mutex_lock(&_mt_class_lock);
+	if (--_mt_class_users == 0) {
+		class_remove_file(&_mt_class, &class_attr_dipole);
+		class_remove_file(&_mt_class, &class_attr_dipole_deadband);
+
+		class_unregister(&_mt_class);
 	}
+	mutex_unlock(&_mt_class_lock);
+}
+
+static inline void create_mt_devices(struct card_mt *mt)
+{
+	ccard_dbg("creating magnetorquer sysfs files\n");
+
+	struct ccard *card = mt->card;
+	struct device *parent = mt_expdr(card)->parent;
+
+	if (get_mt_class())
+		return;
 
-	if (alloc_chrdev_region(&_dev_mt[0], 0, MT_COUNT, "magnetorquer")) {
-		printk(KERN_ERR "couldn't create magnetorquer dev_t's\n");
+	if (alloc_chrdev_region(&mt->dev[0], 0, MT_COUNT, "magnetorquer")) {
+		ccard_err("couldn't create magnetorquer dev_t's\n");
 		return;
 	}
 
 	for (int i = 0; i < MT_COUNT; i++) {
-		char name[15];
-		scnprintf(name, 15, "magnetorquer%i", i);
+		char name[32];
+		ccard_dev_name(card, name, sizeof(name), "magnetorquer%i", i);
 
-		_dev_mt[i] = MKDEV(MAJOR(_dev_mt[0]), MINOR(_dev_mt[0]) + i);
+		mt->units[i].card = card;
+		mt->units[i].index = i;
+		mt->dev[i] = MKDEV(MAJOR(mt->dev[0]), MINOR(mt->dev[0]) + i);
 
-		_mt_devices[i] = device_create(&_mt_class, parent, _dev_mt[i], \
-					       NULL, name);
+		mt->devices[i] = device_create(&_mt_class, parent, mt->dev[i], \
+					       &mt->units[i], name);
 
-		if (device_create_file(_mt_devices[i], &dev_attr_state)) {
-			printk(KERN_ERR "error creating sysfs files\n");
+		if (device_create_file(mt->devices[i], &dev_attr_state)) {
+			ccard_err("error creating sysfs files\n");
 			return;
 		}
 	}
 
-	printk(KERN_DEBUG "created magnetorquer sysfs files\n");
+	ccard_dbg("created magnetorquer sysfs files\n");
 }
 
-static inline void remove_mt_devices()
+static inline void remove_mt_devices(struct card_mt *mt)
 {
 	for (int i = 0; i < MT_COUNT; i++) {
-		device_remove_file(_mt_devices[i], &dev_attr_state);
-		device_destroy(&_mt_class, _dev_mt[i]);
+		device_remove_file(mt->devices[i], &dev_attr_state);
+		device_destroy(&_mt_class, mt->dev[i]);
 	}
 
-	unregister_chrdev_region(_dev_mt[0], MT_COUNT);
+	unregister_chrdev_region(mt->dev[0], MT_COUNT);
 
-	class_unregister(&_mt_class);
+	put_mt_class();
 }
-
-
-
-
-
-
-
-
@@ -0,0 +1,344 @@
+// implementation of the mock transport
+// a mock card keeps the registers of its devices in memory, so the whole
+//   driver runs without a card on the bus, e.g. for the ground tests
+//     insmod ccardmodule.ko transport=mock
+// its mock device shows what the actuators wrote, lets a test set what
+//   they read back, make a device stop answering and slow the transfers
+//   down to the speed of a real bus
+//
+// by Mark Hill
+
+#include<linux/kernel.h>
+#include<linux/types.h>
+#include<linux/mutex.h>
+#include<linux/delay.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/string.h>
+#include<linux/bitops.h>
+#include<linux/err.h>
+#include<linux/slab.h>
+
+#include "ccard.h"
+
+// longest a transfer can be made to take, udelay doesn't go much further
+#define MOCK_MAX_LATENCY 10000
+
+// what the transport keeps for a mock card
+struct mock_link {
+	// stands in for the bus lock, and also protects everything below
+	struct mutex lock;
+	u8 regs[CCARD_DEV_COUNT][256];
+	// the registers written since the card was attached
+	unsigned long written[CCARD_DEV_COUNT][BITS_TO_LONGS(256)];
+	// a device that isn't present fails every transfer with -EIO
+	u8 present[CCARD_DEV_COUNT];
+	// time every transfer takes in us
+	u32 latency_us;
+	u64 transfers;
+	// the mock device in the c card class
+	struct device *device;
+};
+
+static inline void create_mock_device(struct ccard *card);
+static inline void remove_mock_device(struct ccard *card);
+
+static ssize_t read_mock_regs(struct device *dev, \
+			      struct device_attribute *attr, char *buf);
+static ssize_t write_mock_regs(struct device *dev, \
+			       struct device_attribute *attr, \
+			       const char *buf, size_t count);
+static ssize_t read_mock_present(struct device *dev, \
+				 struct device_attribute *attr, char *buf);
+static ssize_t write_mock_present(struct device *dev, \
+				  struct device_attribute *attr, \
+				  const char *buf, size_t count);
+static ssize_t read_mock_latency(struct device *dev, \
+				 struct device_attribute *attr, char *buf);
+static ssize_t write_mock_latency(struct device *dev, \
+				  struct device_attribute *attr, \
+				  const char *buf, size_t count);
+static DEVICE_ATTR(regs, S_IRUSR | S_IWUSR, read_mock_regs, write_mock_regs);
+static struct device_attribute dev_attr_mock_present = \
+	__ATTR(present, S_IRUSR | S_IWUSR, read_mock_present, \
+	       write_mock_present);
+static DEVICE_ATTR(latency_us, S_IRUSR | S_IWUSR, read_mock_latency, \
+		   write_mock_latency);
+
+static inline struct mock_link *card_mock_link(struct ccard *card)
+{
+	return card->link;
+}
+
+// takes the time of one transfer with <dev>
+// returns 0 if the device answers
+static int mock_transfer(struct ccard_dev *dev)
+{
+	struct mock_link *link = card_mock_link(dev->card);
+
+	if (link->latency_us)
+		udelay(link->latency_us);
+	link->transfers++;
+
+	return link->present[dev->id] ? 0 : -EIO;
+}
+
+static s8 mock_card_attach(struct ccard *card)
+{
+	struct mock_link *link = kzalloc(sizeof(struct mock_link), GFP_KERNEL);
+	if (link == NULL)
+		return 1;
+	mutex_init(&link->lock);
+	memset(link->present, 1, sizeof(link->present));
+	card->link = link;
+
+	// the actuator devices go under the mock device, like they go under
+	//   the i2c client on a real card
+	create_mock_device(card);
+	for (int i = 0; i < CCARD_DEV_COUNT; i++)
+		ccard_dev_bound(&card->devs[i], link->device, link);
+
+	ccard_notice("c card %u is a mock\n", card->index);
+
+	return 0;
+}
+
+static void mock_card_detach(struct ccard *card)
+{
+	struct mock_link *link = card_mock_link(card);
+
+	for (int i = 0; i < CCARD_DEV_COUNT; i++)
+		ccard_dev_unbound(&card->devs[i]);
+	remove_mock_device(card);
+
+	card->link = NULL;
+	kfree(link);
+}
+
+static int mock_card_lock(struct ccard *card, u8 wait)
+{
+	struct mock_link *link = card_mock_link(card);
+
+	if (!wait)
+		return mutex_trylock(&link->lock) ? 0 : -EBUSY;
+	return mutex_lock_interruptible(&link->lock);
+}
+
+static void mock_card_unlock(struct ccard *card)
+{
+	mutex_unlock(&card_mock_link(card)->lock);
+}
+
+static int mock_card_read(struct ccard_dev *dev, u8 reg, u8 *val)
+{
+	int ret = mock_transfer(dev);
+	if (ret == 0)
+		*val = card_mock_link(dev->card)->regs[dev->id][reg];
+	return ret;
+}
+
+static int mock_card_write(struct ccard_dev *dev, u8 reg, u8 val)
+{
+	struct mock_link *link = card_mock_link(dev->card);
+
+	int ret = mock_transfer(dev);
+	if (ret == 0) {
+		link->regs[dev->id][reg] = val;
+		__set_bit(reg, link->written[dev->id]);
+	}
+	return ret;
+}
+
+// a burst takes the time of a single transfer, like a usb packet does
+static int mock_card_burst(struct ccard_dev *dev, const u8 *regs, \
+			   const u8 *vals, u8 count)
+{
+	struct mock_link *link = card_mock_link(dev->card);
+
+	int ret = mock_transfer(dev);
+	for (int i = 0; ret == 0 && i < count; i++) {
+		link->regs[dev->id][regs[i]] = vals[i];
+		__set_bit(regs[i], link->written[dev->id]);
+	}
+	return ret;
+}
+
+static int mock_card_ping(struct ccard_dev *dev)
+{
+	return mock_transfer(dev);
+}
+
+const struct ccard_transport ccard_mock_transport = {
+	.name = "mock",
+	.attach = mock_card_attach,
+	.detach = mock_card_detach,
+	.lock = mock_card_lock,
+	.unlock = mock_card_unlock,
+	.read_reg = mock_card_read,
+	.write_reg = mock_card_write,
+	.burst = mock_card_burst,
+	.probe = mock_card_ping,
+};
+
+
+
+//
+// sysfs section
+//
+
+// returns the device called <name>, or -1 if there is none
+static int mock_dev_id(const char *name)
+{
+	for (int i = 0; i < CCARD_DEV_COUNT; i++) {
+		if (!strcmp(name, ccard_dev_type(i)))
+			return i;
+	}
+	return -1;
+}
+
+// prints every register that was written as "<device> <reg> <value>",
+//   followed by the number of transfers so far
+static ssize_t read_mock_regs(struct device *dev, \
+			      struct device_attribute *attr, char *buf)
+{
+	struct mock_link *link = card_mock_link(dev_get_drvdata(dev));
+	ssize_t len = 0;
+
+	mutex_lock(&link->lock);
+	for (int i = 0; i < CCARD_DEV_COUNT; i++) {
+		for (int reg = 0; reg < 256; reg++) {
+			if (!test_bit(reg, link->written[i]))
+				continue;
+			len += scnprintf(buf + len, PAGE_SIZE - len, \
+					 "%s 0x%02x 0x%02x\n", ccard_dev_type(i), \
+					 reg, link->regs[i][reg]);
+		}
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len, "transfers %llu\n", \
+			 link->transfers);
+	mutex_unlock(&link->lock);
+
+	return len;
+}
+
+// writing "<device> <reg> <value>" sets what the register reads back as,
+//   e.g. "dsa_expdr 0x00 0x05" for the dsa inputs
+static ssize_t write_mock_regs(struct device *dev, \
+			       struct device_attribute *attr, \
+			       const char *buf, size_t count)
+{
+	struct mock_link *link = card_mock_link(dev_get_drvdata(dev));
+	char name[16];
+	unsigned int reg, val;
+
+	int id = -1;
+	if (sscanf(buf, "%15s %i %i", name, &reg, &val) == 3)
+		id = mock_dev_id(name);
+	if (id < 0 || reg > 0xff || val > 0xff) {
+		ccard_warn_rl("%s is an invalid mock register write\n", buf);
+		return -EINVAL;
+	}
+
+	mutex_lock(&link->lock);
+	link->regs[id][reg] = val;
+	mutex_unlock(&link->lock);
+
+	return count;
+}
+
+static ssize_t read_mock_present(struct device *dev, \
+				 struct device_attribute *attr, char *buf)
+{
+	struct mock_link *link = card_mock_link(dev_get_drvdata(dev));
+	ssize_t len = 0;
+
+	for (int i = 0; i < CCARD_DEV_COUNT; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %u\n", \
+				 ccard_dev_type(i), link->present[i]);
+
+	return len;
+}
+
+// writing "<device> 0" makes the device stop answering, and "<device> 1"
+//   brings it back, which the presence monitor picks up like a card
+//   being unplugged and plugged in
+static ssize_t write_mock_present(struct device *dev, \
+				  struct device_attribute *attr, \
+				  const char *buf, size_t count)
+{
+	struct mock_link *link = card_mock_link(dev_get_drvdata(dev));
+	char name[16];
+	unsigned int present;
+
+	int id = -1;
+	if (sscanf(buf, "%15s %u", name, &present) == 2)
+		id = mock_dev_id(name);
+	if (id < 0 || present > 1) {
+		ccard_warn_rl("%s is an invalid mock presence\n", buf);
+		return -EINVAL;
+	}
+
+	mutex_lock(&link->lock);
+	link->present[id] = present;
+	mutex_unlock(&link->lock);
+
+	return count;
+}
+
+static ssize_t read_mock_latency(struct device *dev, \
+				 struct device_attribute *attr, char *buf)
+{
+	struct mock_link *link = card_mock_link(dev_get_drvdata(dev));
+	return scnprintf(buf, 20, "%u\n", link->latency_us);
+}
+
+static ssize_t write_mock_latency(struct device *dev, \
+				  struct device_attribute *attr, \
+				  const char *buf, size_t count)
+{
+	struct mock_link *link = card_mock_link(dev_get_drvdata(dev));
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value) || value > MOCK_MAX_LATENCY) {
+		ccard_warn_rl("%s is an invalid mock latency\n", buf);
+		return -EINVAL;
+	}
+
+	mutex_lock(&link->lock);
+	link->latency_us = value;
+	mutex_unlock(&link->lock);
+
+	return count;
+}
+
+static inline void create_mock_device(struct ccard *card)
+{
+	struct mock_link *link = card_mock_link(card);
+	char name[32];
+
+	ccard_dev_name(card, name, sizeof(name), "mock");
+	link->device = device_create(ccard_core_class(), NULL, MKDEV(0, 0), \
+				     card, name);
+	if (IS_ERR(link->device)) {
+		ccard_err("couldn't create mock device\n");
+		link->device = NULL;
+		return;
+	}
+
+	if (device_create_file(link->device, &dev_attr_regs) || \
+	    device_create_file(link->device, &dev_attr_mock_present) || \
+	    device_create_file(link->device, &dev_attr_latency_us))
+		ccard_err("couldn't create mock device files\n");
+}
+
+static inline void remove_mock_device(struct ccard *card)
+{
+	struct mock_link *link = card_mock_link(card);
+	if (link->device == NULL)
+		return;
+
+	device_remove_file(link->device, &dev_attr_regs);
+	device_remove_file(link->device, &dev_attr_mock_present);
+	device_remove_file(link->device, &dev_attr_latency_us);
+	device_unregister(link->device);
+	link->device = NULL;
+}
@@ -0,0 +1,626 @@
+// implementation for the c card power rails
+// each rail is reference counted so that back to back operations share
+//   one power cycle instead of switching the supply for every operation
+// the 5v0 rail is also taken down while nothing on the card is on, and
+//   brought back up by the next command or write, which first writes back
+//   the registers the devices lost
+// reads while the card sleeps are answered from the register cache, so
+//   polling a state doesn't wake it
+//
+// by Mark Hill
+
+#include<linux/kernel.h>
+#include<linux/gpio.h>
+#include<linux/mutex.h>
+#include<linux/workqueue.h>
+#include<linux/ktime.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/string.h>
+#include<linux/err.h>
+#include<linux/slab.h>
+#include<linux/delay.h>
+#include<linux/jiffies.h>
+#include<asm/div64.h>
+
+#include "ccard.h"
+
+// default time in ms a rail stays up after its last user lets go of it
+// a new user within this window keeps the rail up without touching the gpio
+#define ccard_3v3_dfl_off_delay 1000
+// the idle timeout decides when the 5v0 rail goes down, so it doesn't wait
+//   any longer once its only user lets go
+#define ccard_5v0_dfl_off_delay 0
+
+// default time in ms the card has to be idle before the 5v0 rail goes down,
+//   0 keeps it up for good
+#define ccard_idle_dfl_timeout 30000
+// time in us the devices need after the 5v0 rail comes up before they
+//   answer
+#define ccard_wake_settle 200
+// default bound on the time a wake may take in us, wakes that take longer
+//   are counted and logged
+#define ccard_wake_dfl_bound 2000
+
+// takes the 5v0 rail down once the card has been idle for a while
+// while the card is awake the idle state holds one reference on the rail
+struct card_idle {
+	struct ccard *card;
+	// protects everything below
+	// taken inside the bus lock, never the other way around
+	struct mutex lock;
+	// 1 while the rail is held up
+	u8 awake;
+	// 0 once the card is being torn down, the rail then stays up
+	u8 running;
+	// jiffies of the last bus transaction
+	unsigned long last_used;
+	u32 timeout;
+	struct delayed_work work;
+	// the wakes so far, how long they took and how many took longer than
+	//   the bound
+	u32 bound;
+	u32 sleeps;
+	u32 wakes;
+	u32 late;
+	u32 restore_errors;
+	s64 wake_last_ns;
+	s64 wake_max_ns;
+	u64 wake_total_ns;
+};
+
+// creates and removes the rail sysfs files
+static inline void create_rail_device(struct ccard_rail *rail);
+static inline void remove_rail_device(struct ccard_rail *rail);
+// creates and removes the idle files of the 5v0 rail
+static inline void create_idle_files(struct ccard *card);
+static inline void remove_idle_files(struct ccard *card);
+
+// definitions for the rail attribute sysfs callbacks
+static ssize_t read_rail_state(struct device *dev, \
+			       struct device_attribute *attr, char *buf);
+static ssize_t read_rail_users(struct device *dev, \
+			       struct device_attribute *attr, char *buf);
+static ssize_t read_rail_off_delay(struct device *dev, \
+				   struct device_attribute *attr, char *buf);
+static ssize_t write_rail_off_delay(struct device *dev, \
+				    struct device_attribute *attr, \
+				    const char *buf, size_t count);
+static ssize_t read_rail_on_time(struct device *dev, \
+				 struct device_attribute *attr, char *buf);
+static ssize_t read_rail_toggles(struct device *dev, \
+				 struct device_attribute *attr, char *buf);
+static ssize_t read_idle_timeout(struct device *dev, \
+				 struct device_attribute *attr, char *buf);
+static ssize_t write_idle_timeout(struct device *dev, \
+				  struct device_attribute *attr, \
+				  const char *buf, size_t count);
+static ssize_t read_wake_bound(struct device *dev, \
+			       struct device_attribute *attr, char *buf);
+static ssize_t write_wake_bound(struct device *dev, \
+				struct device_attribute *attr, \
+				const char *buf, size_t count);
+static ssize_t read_wake_stats(struct device *dev, \
+			       struct device_attribute *attr, char *buf);
+
+// device attributes for the rails
+// the magnetorquers already own dev_attr_state, so these are spelled out
+//   with a rail_ prefix
+static struct device_attribute dev_attr_rail_state = \
+	__ATTR(state, S_IRUSR, read_rail_state, NULL);
+static struct device_attribute dev_attr_rail_users = \
+	__ATTR(users, S_IRUSR, read_rail_users, NULL);
+static struct device_attribute dev_attr_rail_off_delay = \
+	__ATTR(off_delay, S_IRUSR | S_IWUSR, read_rail_off_delay, \
+	       write_rail_off_delay);
+static struct device_attribute dev_attr_rail_on_time = \
+	__ATTR(on_time, S_IRUSR, read_rail_on_time, NULL);
+static struct device_attribute dev_attr_rail_toggles = \
+	__ATTR(toggles, S_IRUSR, read_rail_toggles, NULL);
+// only the 5v0 rail goes down while the card is idle, so only it has these
+static DEVICE_ATTR(idle_timeout, S_IRUSR | S_IWUSR, read_idle_timeout, \
+		   write_idle_timeout);
+static DEVICE_ATTR(wake_bound, S_IRUSR | S_IWUSR, read_wake_bound, \
+		   write_wake_bound);
+static DEVICE_ATTR(wake, S_IRUSR, read_wake_stats, NULL);
+
+
+
+// copies the rail to the status page, 3v3 is rail 0 and 5v0 is rail 1
+// must be called with rail->lock held
+static inline void publish_rail(struct ccard_rail *rail)
+{
+	ccard_status_rail(rail->card, rail == &rail->card->rail_5v0, \
+			  rail->level, rail->users, rail->toggles);
+}
+
+// drives the rail gpio to <level>
+// the gpio is only written when the level actually changes
+// must be called with rail->lock held
+static void drive_rail(struct ccard_rail *rail, u8 level)
+{
+	if (rail->level == level)
+		return;
+
+	gpio_direction_output(rail->gpio, level);
+
+	ktime_t now = ktime_get();
+	if (level) {
+		rail->on_since = now;
+	} else {
+		rail->on_time_ns += ktime_to_ns(ktime_sub(now, rail->on_since));
+	}
+	rail->level = level;
+	rail->toggles++;
+
+	ccard_info("turning %s gpio %i\n", level ? "on" : "off", \
+			rail->gpio);
+}
+
+// runs once the off delay has passed after the last user let go
+static void rail_off_work(struct work_struct *work)
+{
+	struct ccard_rail *rail = container_of(work, struct ccard_rail, \
+					       off_work.work);
+
+	mutex_lock(&rail->lock);
+	// someone may have taken the rail again while this was waiting
+	if (rail->users == 0)
+		drive_rail(rail, 0);
+	publish_rail(rail);
+	mutex_unlock(&rail->lock);
+}
+
+void ccard_rail_get(struct ccard_rail *rail)
+{
+	mutex_lock(&rail->lock);
+	rail->users++;
+	// a pending shutdown is simply dropped, the rail never went down
+	cancel_delayed_work(&rail->off_work);
+	drive_rail(rail, 1);
+	publish_rail(rail);
+	mutex_unlock(&rail->lock);
+}
+
+void ccard_rail_put(struct ccard_rail *rail)
+{
+	mutex_lock(&rail->lock);
+	if (rail->users == 0) {
+		ccard_warn("unbalanced put on rail %s\n", rail->name);
+	} else if (--rail->users == 0) {
+		if (rail->off_delay == 0)
+			drive_rail(rail, 0);
+		else
+			schedule_delayed_work(&rail->off_work, \
+					      msecs_to_jiffies(rail->off_delay));
+	}
+	publish_rail(rail);
+	mutex_unlock(&rail->lock);
+}
+
+void ccard_rail_force_off(struct ccard_rail *rail)
+{
+	mutex_lock(&rail->lock);
+	cancel_delayed_work(&rail->off_work);
+	rail->users = 0;
+	drive_rail(rail, 0);
+	// the gpio may have been left on by someone else before the module
+	//   loaded, so always write it on an emergency shutoff
+	gpio_direction_output(rail->gpio, 0);
+	publish_rail(rail);
+	mutex_unlock(&rail->lock);
+}
+
+// maps the old on/off + flags interface onto the rail object
+// flags != 0 is an emergency shutoff which ignores the other users
+static inline void set_power(struct ccard_rail *rail, u8 state, s8 flags)
+{
+	if (flags && state == 0)
+		ccard_rail_force_off(rail);
+	else if (state)
+		ccard_rail_get(rail);
+	else
+		ccard_rail_put(rail);
+}
+
+void set_dsa_pwr(struct ccard *card, u8 state, s8 flags) {
+	set_power(&card->rail_3v3, state, flags);
+}
+
+void set_5v0_pwr(struct ccard *card, u8 state, s8 flags) {
+	set_power(&card->rail_5v0, state, flags);
+}
+
+// runs idle->timeout ms after the last bus transaction, and takes the 5v0
+//   rail down if nothing on the card is on
+static void idle_work(struct work_struct *work)
+{
+	struct card_idle *idle = container_of(work, struct card_idle, \
+					      work.work);
+	struct ccard *card = idle->card;
+
+	// the bus has to be quiet, a transaction that is under way would fail
+	//   when the rail goes down
+	// ccard_lock_bus would wake the card again, so the bus is only held
+	if (card->bus == NULL || ccard_hold_bus(card)) {
+		// nothing else arms the work while the card stays awake, so
+		//   the rail would stay up for good without another try
+		mutex_lock(&idle->lock);
+		if (idle->running && idle->awake && idle->timeout)
+			schedule_delayed_work(&idle->work, \
+					      msecs_to_jiffies(idle->timeout));
+		mutex_unlock(&idle->lock);
+		return;
+	}
+	mutex_lock(&idle->lock);
+	if (!idle->running || !idle->awake || idle->timeout == 0)
+		goto idle_unlock;
+
+	unsigned long due = idle->last_used + msecs_to_jiffies(idle->timeout);
+	if (time_before(jiffies, due)) {
+		schedule_delayed_work(&idle->work, due - jiffies);
+		goto idle_unlock;
+	} else if (ccard_usage_active(card)) {
+		// something is on, look again after another timeout
+		schedule_delayed_work(&idle->work, \
+				      msecs_to_jiffies(idle->timeout));
+		goto idle_unlock;
+	}
+
+	ccard_dbg("card %u idle, taking 5v0 down\n", card->index);
+	idle->awake = 0;
+	idle->sleeps++;
+	set_5v0_pwr(card, 0, 0);
+
+idle_unlock:
+	mutex_unlock(&idle->lock);
+	ccard_release_bus(card);
+}
+
+void ccard_power_wake(struct ccard *card)
+{
+	struct card_idle *idle = card->idle;
+	if (idle == NULL)
+		return;
+
+	mutex_lock(&idle->lock);
+	if (!idle->awake) {
+		ktime_t start = ktime_get();
+		set_5v0_pwr(card, 1, 0);
+		udelay(ccard_wake_settle);
+		// everything is written back in one go while the bus is held,
+		//   so the caller's transaction finds the devices as it left them
+		idle->restore_errors += ccard_restore_regs(card);
+		idle->awake = 1;
+
+		s64 wake_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		idle->wakes++;
+		idle->wake_last_ns = wake_ns;
+		idle->wake_total_ns += wake_ns;
+		if (wake_ns > idle->wake_max_ns)
+			idle->wake_max_ns = wake_ns;
+		if (wake_ns > (s64)idle->bound * NSEC_PER_USEC) {
+			idle->late++;
+			ccard_warn_rl("card %u took %lli us to wake\n", \
+					card->index, div_s64(wake_ns, NSEC_PER_USEC));
+		}
+	}
+	// the work looks at last_used when it runs, so it only has to be
+	//   armed here
+	if (idle->running && idle->timeout && !delayed_work_pending(&idle->work))
+		schedule_delayed_work(&idle->work, \
+				      msecs_to_jiffies(idle->timeout));
+	mutex_unlock(&idle->lock);
+}
+
+void ccard_power_used(struct ccard *card)
+{
+	// the idle work is always armed while the card is awake, and it only
+	//   looks at the time when it runs, so a store is enough
+	if (card->idle != NULL)
+		card->idle->last_used = jiffies;
+}
+
+u8 ccard_power_awake(struct ccard *card)
+{
+	return card->idle == NULL || card->idle->awake;
+}
+
+void ccard_power_hold(struct ccard *card)
+{
+	struct card_idle *idle = card->idle;
+	if (idle == NULL)
+		return;
+
+	mutex_lock(&idle->lock);
+	idle->running = 0;
+	mutex_unlock(&idle->lock);
+	cancel_delayed_work_sync(&idle->work);
+
+	// the rail may be down, the next transaction brings it back
+}
+
+static inline void init_rail(struct ccard *card, struct ccard_rail *rail, \
+			     const char *name, int gpio, u32 off_delay)
+{
+	rail->card = card;
+	rail->name = name;
+	rail->gpio = gpio;
+	rail->off_delay = off_delay;
+	mutex_init(&rail->lock);
+	INIT_DELAYED_WORK(&rail->off_work, rail_off_work);
+
+	if (gpio_request(rail->gpio, rail->name))
+		ccard_dbg("stop exporting gpio %i\n", rail->gpio);
+
+	create_rail_device(rail);
+}
+
+static inline void cleanup_rail(struct ccard_rail *rail)
+{
+	remove_rail_device(rail);
+
+	cancel_delayed_work_sync(&rail->off_work);
+	ccard_rail_force_off(rail);
+
+	gpio_free(rail->gpio);
+}
+
+s8 ccard_init_power(struct ccard *card)
+{
+	// the gpios come from the module parameters in board.c
+	init_rail(card, &card->rail_3v3, "3v3", _gpio_3v3[card->index], \
+		  ccard_3v3_dfl_off_delay);
+	init_rail(card, &card->rail_5v0, "5v0", _gpio_5v0[card->index], \
+		  ccard_5v0_dfl_off_delay);
+
+	// the card starts out awake, with the idle state holding the rail
+	struct card_idle *idle = kzalloc(sizeof(struct card_idle), GFP_KERNEL);
+	if (idle == NULL) {
+		ccard_err("no idle power down for card %u\n", card->index);
+		set_5v0_pwr(card, 1, 0);
+		return 0;
+	}
+	idle->card = card;
+	mutex_init(&idle->lock);
+	idle->timeout = ccard_idle_dfl_timeout;
+	idle->bound = ccard_wake_dfl_bound;
+	idle->last_used = jiffies;
+	idle->running = 1;
+	INIT_DELAYED_WORK(&idle->work, idle_work);
+
+	set_5v0_pwr(card, 1, 0);
+	idle->awake = 1;
+	card->idle = idle;
+	create_idle_files(card);
+	schedule_delayed_work(&idle->work, msecs_to_jiffies(idle->timeout));
+
+	return 0;
+}
+
+void ccard_cleanup_power(struct ccard *card)
+{
+	ccard_power_hold(card);
+	remove_idle_files(card);
+
+	cleanup_rail(&card->rail_3v3);
+	cleanup_rail(&card->rail_5v0);
+
+	kfree(card->idle);
+	card->idle = NULL;
+}
+
+
+
+//
+// sysfs section
+//
+
+// returns the time the rail has been on in ns, including the current
+//   on period
+static inline u64 rail_on_time(struct ccard_rail *rail)
+{
+	u64 on_time = rail->on_time_ns;
+	if (rail->level)
+		on_time += ktime_to_ns(ktime_sub(ktime_get(), rail->on_since));
+	return on_time;
+}
+
+static ssize_t read_rail_state(struct device *dev, \
+			       struct device_attribute *attr, char *buf)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "[%s] on off\n", rail->level ? "on" : "off");
+}
+
+static ssize_t read_rail_users(struct device *dev, \
+			       struct device_attribute *attr, char *buf)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u\n", rail->users);
+}
+
+static ssize_t read_rail_off_delay(struct device *dev, \
+				   struct device_attribute *attr, char *buf)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u ms\n", rail->off_delay);
+}
+
+static ssize_t write_rail_off_delay(struct device *dev, \
+				    struct device_attribute *attr, \
+				    const char *buf, size_t count)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value))
+		ccard_warn_rl("%s is an invalid off delay\n", buf);
+	else
+		rail->off_delay = (u32)value;
+
+	return count;
+}
+
+static ssize_t read_rail_on_time(struct device *dev, \
+				 struct device_attribute *attr, char *buf)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+
+	mutex_lock(&rail->lock);
+	u64 on_time = rail_on_time(rail);
+	mutex_unlock(&rail->lock);
+
+	do_div(on_time, NSEC_PER_MSEC);
+	return scnprintf(buf, 30, "%llu ms\n", (unsigned long long)on_time);
+}
+
+static ssize_t read_rail_toggles(struct device *dev, \
+				 struct device_attribute *attr, char *buf)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u\n", rail->toggles);
+}
+
+static ssize_t read_idle_timeout(struct device *dev, \
+				 struct device_attribute *attr, char *buf)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u ms\n", rail->card->idle->timeout);
+}
+
+// expects the time in ms, 0 keeps the rail up for good
+static ssize_t write_idle_timeout(struct device *dev, \
+				  struct device_attribute *attr, \
+				  const char *buf, size_t count)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+	struct card_idle *idle = rail->card->idle;
+
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value)) {
+		ccard_warn_rl("%s is an invalid idle timeout\n", buf);
+		return -EINVAL;
+	}
+
+	mutex_lock(&idle->lock);
+	idle->timeout = (u32)value;
+	// a shorter timeout has to be looked at before the old one runs out
+	cancel_delayed_work(&idle->work);
+	if (idle->running && idle->awake && idle->timeout)
+		schedule_delayed_work(&idle->work, \
+				      msecs_to_jiffies(idle->timeout));
+	mutex_unlock(&idle->lock);
+
+	return count;
+}
+
+static ssize_t read_wake_bound(struct device *dev, \
+			       struct device_attribute *attr, char *buf)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u us\n", rail->card->idle->bound);
+}
+
+static ssize_t write_wake_bound(struct device *dev, \
+				struct device_attribute *attr, \
+				const char *buf, size_t count)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value) || value == 0) {
+		ccard_warn_rl("%s is an invalid wake bound\n", buf);
+		return -EINVAL;
+	}
+	rail->card->idle->bound = (u32)value;
+
+	return count;
+}
+
+static ssize_t read_wake_stats(struct device *dev, \
+			       struct device_attribute *attr, char *buf)
+{
+	struct ccard_rail *rail = dev_get_drvdata(dev);
+	struct card_idle *idle = rail->card->idle;
+
+	mutex_lock(&idle->lock);
+	u64 mean = idle->wake_total_ns;
+	if (idle->wakes)
+		do_div(mean, idle->wakes);
+	ssize_t len = scnprintf(buf, PAGE_SIZE, \
+				"[%s] sleeps %u wakes %u late %u " \
+				"restore_errors %u\n" \
+				"last_us %lli max_us %lli mean_us %llu\n", \
+				idle->awake ? "awake" : "asleep", \
+				idle->sleeps, idle->wakes, idle->late, \
+				idle->restore_errors, \
+				div_s64(idle->wake_last_ns, NSEC_PER_USEC), \
+				div_s64(idle->wake_max_ns, NSEC_PER_USEC), \
+				div_u64(mean, NSEC_PER_USEC));
+	mutex_unlock(&idle->lock);
+
+	return len;
+}
+
+static inline void create_idle_files(struct ccard *card)
+{
+	struct device *dev = card->rail_5v0.dev;
+	if (dev == NULL || card->idle == NULL)
+		return;
+
+	if (device_create_file(dev, &dev_attr_idle_timeout) || \
+	    device_create_file(dev, &dev_attr_wake_bound) || \
+	    device_create_file(dev, &dev_attr_wake))
+		ccard_err("couldn't create 5v0 idle files\n");
+}
+
+static inline void remove_idle_files(struct ccard *card)
+{
+	struct device *dev = card->rail_5v0.dev;
+	if (dev == NULL || card->idle == NULL)
+		return;
+
+	device_remove_file(dev, &dev_attr_idle_timeout);
+	device_remove_file(dev, &dev_attr_wake_bound);
+	device_remove_file(dev, &dev_attr_wake);
+}
+
+static inline void create_rail_device(struct ccard_rail *rail)
+{
+	ccard_dbg("creating rail %s sysfs files\n", rail->name);
+
+	char name[32];
+	ccard_dev_name(rail->card, name, sizeof(name), "%s", rail->name);
+	rail->dev = device_create(ccard_core_class(), NULL, MKDEV(0, 0), \
+				  rail, name);
+	if (IS_ERR(rail->dev)) {
+		ccard_err("couldn't create rail %s device\n", rail->name);
+		rail->dev = NULL;
+		return;
+	}
+
+	if (device_create_file(rail->dev, &dev_attr_rail_state) || \
+	    device_create_file(rail->dev, &dev_attr_rail_users) || \
+	    device_create_file(rail->dev, &dev_attr_rail_off_delay) || \
+	    device_create_file(rail->dev, &dev_attr_rail_on_time) || \
+	    device_create_file(rail->dev, &dev_attr_rail_toggles)) {
+		ccard_err("couldn't create rail %s device files\n", \
+				rail->name);
+		return;
+	}
+}
+
+static inline void remove_rail_device(struct ccard_rail *rail)
+{
+	if (rail->dev == NULL)
+		return;
+
+	device_remove_file(rail->dev, &dev_attr_rail_state);
+	device_remove_file(rail->dev, &dev_attr_rail_users);
+	device_remove_file(rail->dev, &dev_attr_rail_off_delay);
+	device_remove_file(rail->dev, &dev_attr_rail_on_time);
+	device_remove_file(rail->dev, &dev_attr_rail_toggles);
+	device_unregister(rail->dev);
+	rail->dev = NULL;
+}
@@ -0,0 +1,328 @@
+// implementation for the c card presence monitor
+// the card can be plugged in and unplugged while the module is loaded, so
+//   every device is quick read at a low rate, and the actuator code is
+//   brought up or torn down through the normal init and cleanup paths when
+//   a device starts or stops answering
+// a uevent is sent on every change so userspace can follow along
+// every card has its own monitor, so a card that is unplugged never holds
+//   up the checks of the others
+//
+// by Mark Hill
+#include<linux/kernel.h>
+#include<linux/workqueue.h>
+#include<linux/ktime.h>
+#include<linux/kobject.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/string.h>
+#include<linux/err.h>
+#include<linux/math64.h>
+#include<linux/slab.h>
+
+#include "ccard.h"
+
+// default time between presence checks in ms
+#define presence_dfl_period 1000
+// default share of the bus the presence checks may use, in tenths of a
+//   percent, so 10 is 1%
+#define presence_dfl_duty 10
+
+// one device the monitor watches
+struct presence_dev {
+	const char *name;
+	// filled in with the device on the card by ccard_init_presence
+	struct ccard_dev *bus_dev;
+	s8 (*init)(struct ccard *card);
+	void (*cleanup)(struct ccard *card);
+	// 1 if the device answered the last check
+	u8 present;
+	u32 arrivals;
+	u32 departures;
+};
+static const struct presence_dev _presence_devs[] = {
+	{"dsa_expdr", NULL, init_dsa, cleanup_dsa},
+	{"mt_expdr", NULL, init_mt, cleanup_mt},
+	{"thruster_dac", NULL, init_thruster, cleanup_thruster},
+};
+
+// the presence monitor of one card
+struct card_presence {
+	struct ccard *card;
+	struct presence_dev devs[ARRAY_SIZE(_presence_devs)];
+	struct delayed_work work;
+	u8 running;
+	// 0 until the first round of checks has set the initial presence
+	u8 checked;
+	// time the last round of checks took on the bus, and the delay that
+	//   was chosen after it
+	s64 bus_ns;
+	u32 delay;
+	u32 period;
+	u32 duty;
+	// the presence device in the c card class
+	struct device *device;
+};
+
+static inline void create_presence_device(struct card_presence *p);
+static inline void remove_presence_device(struct card_presence *p);
+
+// definitions for the presence attribute sysfs callbacks
+static ssize_t read_presence_state(struct device *dev, \
+				   struct device_attribute *attr, char *buf);
+static ssize_t read_presence_period(struct device *dev, \
+				    struct device_attribute *attr, char *buf);
+static ssize_t write_presence_period(struct device *dev, \
+				     struct device_attribute *attr, \
+				     const char *buf, size_t count);
+static ssize_t read_presence_duty(struct device *dev, \
+				  struct device_attribute *attr, char *buf);
+static ssize_t write_presence_duty(struct device *dev, \
+				   struct device_attribute *attr, \
+				   const char *buf, size_t count);
+
+// the magnetorquers and the b-dot executor already own dev_attr_state and
+//   dev_attr_period, so these are spelled out with a presence_ prefix
+static struct device_attribute dev_attr_presence_state = \
+	__ATTR(state, S_IRUSR, read_presence_state, NULL);
+static struct device_attribute dev_attr_presence_period = \
+	__ATTR(period, S_IRUSR | S_IWUSR, read_presence_period, \
+	       write_presence_period);
+static struct device_attribute dev_attr_presence_duty = \
+	__ATTR(duty, S_IRUSR | S_IWUSR, read_presence_duty, \
+	       write_presence_duty);
+
+
+// tells userspace that device <dev> came or went
+static void send_presence_event(struct card_presence *p, \
+				struct presence_dev *dev)
+{
+	char name[40];
+	char present[20];
+	char card[20];
+	char *envp[] = {name, present, card, NULL};
+
+	if (p->device == NULL)
+		return;
+
+	scnprintf(name, sizeof(name), "CCARD_DEVICE=%s", dev->name);
+	scnprintf(present, sizeof(present), "CCARD_PRESENT=%u", dev->present);
+	scnprintf(card, sizeof(card), "CCARD_CARD=%u", p->card->index);
+	kobject_uevent_env(&p->device->kobj, KOBJ_CHANGE, envp);
+}
+
+// checks every device of a card once and reacts to any change
+static void check_presence(struct work_struct *work)
+{
+	struct card_presence *p = container_of(work, struct card_presence, \
+					       work.work);
+	struct ccard *card = p->card;
+
+	// nothing answers while the card is idle with its 5v0 rail down, and
+	//   reading would only wake it, so the round is skipped
+	if (p->checked && !ccard_power_awake(card)) {
+		if (p->running)
+			schedule_delayed_work(&p->work, \
+					      msecs_to_jiffies(p->period));
+		return;
+	}
+
+	ktime_t start = ktime_get();
+	u8 answered[ARRAY_SIZE(p->devs)];
+	for (int i = 0; i < ARRAY_SIZE(p->devs); i++)
+		answered[i] = ccard_probe_dev(p->devs[i].bus_dev);
+	s64 bus_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	// bringing subsystems up and down is slow, so it is kept out of the
+	//   timed part
+	for (int i = 0; i < ARRAY_SIZE(p->devs); i++) {
+		struct presence_dev *dev = &p->devs[i];
+
+		// binding already tried to bring up whatever was there
+		//   when the module loaded, so the first round only records
+		//   what answers and retries anything that failed to come up
+		if (!p->checked) {
+			dev->present = answered[i];
+			ccard_set_dev_present(dev->bus_dev, dev->present);
+			ccard_status_present(card, i, dev->present);
+			if (dev->present && dev->init(card))
+				ccard_err("couldn't bring up %s\n", \
+						dev->name);
+			continue;
+		}
+
+		if (answered[i] == dev->present)
+			continue;
+
+		dev->present = answered[i];
+		ccard_set_dev_present(dev->bus_dev, dev->present);
+		ccard_status_present(card, i, dev->present);
+		if (dev->present) {
+			ccard_notice("%s appeared on card %u\n", dev->name, \
+					card->index);
+			dev->arrivals++;
+			if (dev->init(card))
+				ccard_err("couldn't bring up %s\n", \
+						dev->name);
+		} else {
+			ccard_notice("%s disappeared from card %u\n", \
+					dev->name, card->index);
+			dev->departures++;
+			dev->cleanup(card);
+		}
+		send_presence_event(p, dev);
+	}
+	p->checked = 1;
+
+	// stretch the period so that the checks never take more than the
+	//   allowed share of the bus
+	u32 delay = p->period;
+	u32 duty = p->duty ? p->duty : 1;
+	u64 capped = div_u64(div_u64((u64)bus_ns * 1000, duty), NSEC_PER_MSEC);
+	if (capped > delay)
+		delay = capped;
+	p->bus_ns = bus_ns;
+	p->delay = delay;
+
+	if (p->running)
+		schedule_delayed_work(&p->work, msecs_to_jiffies(delay));
+}
+
+s8 ccard_init_presence(struct ccard *card)
+{
+	struct card_presence *p = kzalloc(sizeof(struct card_presence), \
+					  GFP_KERNEL);
+	if (p == NULL)
+		return 1;
+
+	p->card = card;
+	memcpy(p->devs, _presence_devs, sizeof(p->devs));
+	for (int i = 0; i < ARRAY_SIZE(p->devs); i++)
+		p->devs[i].bus_dev = &card->devs[i];
+	p->period = presence_dfl_period;
+	p->duty = presence_dfl_duty;
+	card->presence = p;
+
+	create_presence_device(p);
+
+	INIT_DELAYED_WORK(&p->work, check_presence);
+	p->running = 1;
+	schedule_delayed_work(&p->work, 0);
+
+	return 0;
+}
+
+void ccard_cleanup_presence(struct ccard *card)
+{
+	struct card_presence *p = card->presence;
+	if (p == NULL)
+		return;
+
+	p->running = 0;
+	cancel_delayed_work_sync(&p->work);
+
+	remove_presence_device(p);
+	card->presence = NULL;
+	kfree(p);
+}
+
+
+
+//
+// sysfs section
+//
+
+static ssize_t read_presence_state(struct device *dev, \
+				   struct device_attribute *attr, char *buf)
+{
+	struct card_presence *p = dev_get_drvdata(dev);
+	ssize_t len = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(p->devs); i++) {
+		struct presence_dev *pdev = &p->devs[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len, \
+				 "%s [%s] arrivals %u departures %u\n", \
+				 pdev->name, pdev->present ? "present" : "absent", \
+				 pdev->arrivals, pdev->departures);
+	}
+	len += scnprintf(buf + len, PAGE_SIZE - len, \
+			 "check_us %lli next_ms %u\n", \
+			 div_s64(p->bus_ns, NSEC_PER_USEC), p->delay);
+
+	return len;
+}
+
+static ssize_t read_presence_period(struct device *dev, \
+				    struct device_attribute *attr, char *buf)
+{
+	struct card_presence *p = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u ms\n", p->period);
+}
+
+static ssize_t write_presence_period(struct device *dev, \
+				     struct device_attribute *attr, \
+				     const char *buf, size_t count)
+{
+	struct card_presence *p = dev_get_drvdata(dev);
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value) || value == 0) {
+		ccard_warn_rl("%s is an invalid presence period\n", buf);
+		return -EINVAL;
+	}
+
+	p->period = value;
+	return count;
+}
+
+static ssize_t read_presence_duty(struct device *dev, \
+				  struct device_attribute *attr, char *buf)
+{
+	struct card_presence *p = dev_get_drvdata(dev);
+	return scnprintf(buf, 20, "%u.%u%%\n", p->duty / 10, p->duty % 10);
+}
+
+// expects the duty cycle in tenths of a percent
+static ssize_t write_presence_duty(struct device *dev, \
+				   struct device_attribute *attr, \
+				   const char *buf, size_t count)
+{
+	struct card_presence *p = dev_get_drvdata(dev);
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value) || value == 0 || value > 1000) {
+		ccard_warn_rl("%s is an invalid presence duty\n", buf);
+		return -EINVAL;
+	}
+
+	p->duty = value;
+	return count;
+}
+
+static inline void create_presence_device(struct card_presence *p)
+{
+	char name[32];
+
+	ccard_dev_name(p->card, name, sizeof(name), "presence");
+	p->device = device_create(ccard_core_class(), NULL, MKDEV(0, 0), p, \
+				  name);
+	if (IS_ERR(p->device)) {
+		ccard_err("couldn't create presence device\n");
+		p->device = NULL;
+		return;
+	}
+
+	if (device_create_file(p->device, &dev_attr_presence_state) || \
+	    device_create_file(p->device, &dev_attr_presence_period) || \
+	    device_create_file(p->device, &dev_attr_presence_duty))
+		ccard_err("couldn't create presence device files\n");
+}
+
+static inline void remove_presence_device(struct card_presence *p)
+{
+	if (p->device == NULL)
+		return;
+
+	device_remove_file(p->device, &dev_attr_presence_state);
+	device_remove_file(p->device, &dev_attr_presence_period);
+	device_remove_file(p->device, &dev_attr_presence_duty);
+	device_unregister(p->device);
+	p->device = NULL;
+}
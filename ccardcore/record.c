@@ -0,0 +1,325 @@
+// implementation for the c card command recorder
+// while the record char device is held open, every external command and
+//   every register write is appended to a ring buffer that the reader
+//   drains into a file, so an anomaly seen in flight can be replayed on the
+//   ground with the same commands at the same times
+// nothing is recorded while nobody has the device open, and the hooks cost
+//   a single flag check then
+// the format is in ccard_record.h
+//
+// by Mark Hill
+#include<linux/kernel.h>
+#include<linux/fs.h>
+#include<linux/cdev.h>
+#include<linux/kfifo.h>
+#include<linux/spinlock.h>
+#include<linux/wait.h>
+#include<linux/poll.h>
+#include<linux/sched.h>
+#include<linux/uaccess.h>
+#include<linux/ktime.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/err.h>
+
+#include "ccard.h"
+#include "ccard_record.h"
+
+// size of the ring buffer in bytes, rounded up to a power of two by kfifo
+// at 24 bytes a record this holds a few thousand register writes
+#define RECORD_FIFO_SIZE 65536
+
+static struct kfifo *_rec_fifo = NULL;
+// protects the fifo and the counters below
+static DEFINE_SPINLOCK(_rec_lock);
+static DECLARE_WAIT_QUEUE_HEAD(_rec_wait);
+// 1 while the device is open, checked without the lock by the hooks
+static u8 _recording = 0;
+// records written, records dropped in total, and records dropped since
+//   the last CCARD_REC_LOST went out
+static u32 _rec_records = 0;
+static u32 _rec_lost = 0;
+static u32 _rec_lost_pending = 0;
+
+// the char device the recording is read from
+static dev_t _dev_record;
+static struct cdev _record_cdev;
+static struct device *_record_device;
+
+// char device file operations
+static int open_record(struct inode *inode, struct file *file);
+static int release_record(struct inode *inode, struct file *file);
+static ssize_t read_record(struct file *file, char __user *buf, \
+			   size_t count, loff_t *offset);
+static unsigned int poll_record(struct file *file, poll_table *wait);
+
+static const struct file_operations _record_fops = {
+	.owner = THIS_MODULE,
+	.open = open_record,
+	.release = release_record,
+	.read = read_record,
+	.poll = poll_record,
+};
+
+// definitions for the record attribute sysfs callbacks
+static ssize_t read_record_stats(struct device *dev, \
+				 struct device_attribute *attr, char *buf);
+
+// the b-dot executor already owns dev_attr_stats
+static struct device_attribute dev_attr_record_stats = \
+	__ATTR(stats, S_IRUSR, read_record_stats, NULL);
+
+
+
+// appends <rec> and its data to the ring buffer
+// a record that doesn't fit is dropped whole, a partial one would leave
+//   the rest of the stream unreadable
+static void put_record(const struct ccard_rec *rec, const void *data)
+{
+	unsigned long flags;
+	u8 added = 0;
+
+	spin_lock_irqsave(&_rec_lock, flags);
+	if (!_recording)
+		goto put_unlock;
+
+	u32 need = sizeof(*rec) + rec->len;
+	if (_rec_lost_pending)
+		need += sizeof(*rec);
+	if (_rec_fifo->size - __kfifo_len(_rec_fifo) < need) {
+		_rec_lost++;
+		_rec_lost_pending++;
+		goto put_unlock;
+	}
+
+	// the reader learns about a gap before the record that follows it
+	if (_rec_lost_pending) {
+		struct ccard_rec lost = {
+			.timestamp_ns = rec->timestamp_ns,
+			.result = _rec_lost_pending,
+			.type = CCARD_REC_LOST,
+		};
+		__kfifo_put(_rec_fifo, (unsigned char *)&lost, sizeof(lost));
+		_rec_lost_pending = 0;
+	}
+	__kfifo_put(_rec_fifo, (unsigned char *)rec, sizeof(*rec));
+	if (rec->len)
+		__kfifo_put(_rec_fifo, (unsigned char *)data, rec->len);
+	_rec_records++;
+	added = 1;
+
+put_unlock:
+	spin_unlock_irqrestore(&_rec_lock, flags);
+	if (added)
+		wake_up_interruptible(&_rec_wait);
+}
+
+void ccard_record_command(struct ccard *card, u8 source, u8 index, \
+			  const void *data, size_t len, s32 result, \
+			  ktime_t start)
+{
+	if (!_recording)
+		return;
+
+	struct ccard_rec rec = {
+		.timestamp_ns = ktime_to_ns(start),
+		.duration_ns = ktime_to_ns(ktime_sub(ktime_get(), start)),
+		.result = result,
+		.type = CCARD_REC_COMMAND,
+		.target = source,
+		.index = index,
+		.card = card->index,
+		.len = min_t(size_t, len, CCARD_REC_MAX_DATA),
+	};
+	put_record(&rec, data);
+}
+
+void ccard_record_reg(struct ccard *card, u8 addr, u8 reg, u8 val, int ret, \
+		      ktime_t start)
+{
+	if (!_recording)
+		return;
+
+	struct ccard_rec rec = {
+		.timestamp_ns = ktime_to_ns(start),
+		.duration_ns = ktime_to_ns(ktime_sub(ktime_get(), start)),
+		.result = ret,
+		.type = CCARD_REC_REG_WRITE,
+		.target = addr,
+		.index = reg,
+		.card = card->index,
+		.len = 1,
+	};
+	put_record(&rec, &val);
+}
+
+// only one recording runs at a time, it starts when the device is opened
+//   and ends when it is closed
+static int open_record(struct inode *inode, struct file *file)
+{
+	if (file->f_mode & FMODE_WRITE)
+		return -EPERM;
+
+	unsigned long flags;
+	spin_lock_irqsave(&_rec_lock, flags);
+	if (_recording) {
+		spin_unlock_irqrestore(&_rec_lock, flags);
+		return -EBUSY;
+	}
+	__kfifo_reset(_rec_fifo);
+	_rec_records = 0;
+	_rec_lost = 0;
+	_rec_lost_pending = 0;
+	_recording = 1;
+	spin_unlock_irqrestore(&_rec_lock, flags);
+
+	struct ccard_rec start = {
+		.timestamp_ns = ktime_to_ns(ktime_get()),
+		.result = CCARD_REC_VERSION,
+		.type = CCARD_REC_START,
+	};
+	put_record(&start, NULL);
+
+	return 0;
+}
+
+static int release_record(struct inode *inode, struct file *file)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&_rec_lock, flags);
+	_recording = 0;
+	spin_unlock_irqrestore(&_rec_lock, flags);
+
+	return 0;
+}
+
+// hands out whatever is buffered, blocking until there is something unless
+//   the file is non blocking
+// records can be split across reads, the reader is expected to append
+//   everything to one file
+static ssize_t read_record(struct file *file, char __user *buf, \
+			   size_t count, loff_t *offset)
+{
+	if (kfifo_len(_rec_fifo) == 0) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(_rec_wait, \
+					     kfifo_len(_rec_fifo) > 0))
+			return -ERESTARTSYS;
+	}
+
+	unsigned char chunk[256];
+	size_t copied = 0;
+	while (copied < count) {
+		unsigned int n = kfifo_get(_rec_fifo, chunk, \
+					   min_t(size_t, sizeof(chunk), \
+						 count - copied));
+		if (n == 0)
+			break;
+		if (copy_to_user(buf + copied, chunk, n))
+			return -EFAULT;
+		copied += n;
+	}
+
+	return copied;
+}
+
+static unsigned int poll_record(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &_rec_wait, wait);
+
+	return kfifo_len(_rec_fifo) ? POLLIN | POLLRDNORM : 0;
+}
+
+static s8 create_record_device(void);
+static void remove_record_device(void);
+
+s8 ccard_init_record()
+{
+	_rec_fifo = kfifo_alloc(RECORD_FIFO_SIZE, GFP_KERNEL, &_rec_lock);
+	if (IS_ERR(_rec_fifo)) {
+		ccard_err("couldn't allocate the record buffer\n");
+		_rec_fifo = NULL;
+		return 1;
+	}
+
+	if (create_record_device()) {
+		kfifo_free(_rec_fifo);
+		_rec_fifo = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+void ccard_cleanup_record()
+{
+	if (_rec_fifo == NULL)
+		return;
+
+	// the reader holds the module while the device is open, so nothing
+	//   can be recording here
+	remove_record_device();
+
+	kfifo_free(_rec_fifo);
+	_rec_fifo = NULL;
+}
+
+
+
+//
+// sysfs section
+//
+
+static ssize_t read_record_stats(struct device *dev, \
+				 struct device_attribute *attr, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, \
+			 "[%s] records %u lost %u buffered %u\n", \
+			 _recording ? "recording" : "idle", _rec_records, \
+			 _rec_lost, kfifo_len(_rec_fifo));
+}
+
+static s8 create_record_device()
+{
+	if (alloc_chrdev_region(&_dev_record, 0, 1, "record")) {
+		ccard_err("couldn't create record dev_t\n");
+		return 1;
+	}
+
+	cdev_init(&_record_cdev, &_record_fops);
+	_record_cdev.owner = THIS_MODULE;
+	if (cdev_add(&_record_cdev, _dev_record, 1)) {
+		ccard_err("couldn't add record char device\n");
+		unregister_chrdev_region(_dev_record, 1);
+		return 1;
+	}
+
+	_record_device = device_create(ccard_core_class(), NULL, _dev_record, \
+				       NULL, "record");
+	if (IS_ERR(_record_device)) {
+		ccard_err("couldn't create record device\n");
+		_record_device = NULL;
+		cdev_del(&_record_cdev);
+		unregister_chrdev_region(_dev_record, 1);
+		return 1;
+	}
+
+	if (device_create_file(_record_device, &dev_attr_record_stats))
+		ccard_err("couldn't create record device files\n");
+
+	return 0;
+}
+
+static void remove_record_device()
+{
+	if (_record_device == NULL)
+		return;
+
+	device_remove_file(_record_device, &dev_attr_record_stats);
+	device_destroy(ccard_core_class(), _dev_record);
+	_record_device = NULL;
+
+	cdev_del(&_record_cdev);
+	unregister_chrdev_region(_dev_record, 1);
+}
@@ -0,0 +1,688 @@
+// implementation for the time tagged actuator command scheduler
+// commands are written to /sys/class/ccard/scheduler/schedule with the
+//   monotonic time they should run at, kept in an rbtree ordered by that
+//   time, and run by a realtime thread woken by an hrtimer
+// every card has its own queue and thread, so the commands for one card
+//   never wait behind a slow bus on another
+//
+// by Mark Hill
+#include<linux/kernel.h>
+#include<linux/kthread.h>
+#include<linux/sched.h>
+#include<linux/err.h>
+#include<linux/slab.h>
+#include<linux/rbtree.h>
+#include<linux/list.h>
+#include<linux/spinlock.h>
+#include<linux/hrtimer.h>
+#include<linux/ktime.h>
+#include<linux/math64.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/string.h>
+
+#include "ccard.h"
+#include "ccard_trace.h"
+#include "ccard_record.h"
+
+// maximum number of commands waiting to run
+#define SCHED_MAX_PENDING 256
+// number of executed commands kept for the history file
+#define SCHED_HISTORY 32
+
+// a command waiting in the scheduler
+struct sched_cmd {
+	struct rb_node node;
+	// used to gather the commands that run together
+	struct list_head batch;
+	u32 id;
+	// monotonic time the command should run at
+	ktime_t when;
+	enum ccard_actuator actuator;
+	u8 index;
+	s32 value;
+};
+
+// what happened to a command once it ran
+struct sched_result {
+	u32 id;
+	enum ccard_actuator actuator;
+	u8 index;
+	s32 value;
+	ktime_t requested;
+	ktime_t achieved;
+	s8 result;
+};
+
+// the scheduler of one card
+struct card_sched {
+	struct ccard *card;
+	// pending commands ordered by time and then by id, protected by lock
+	struct rb_root queue;
+	u32 pending;
+	u32 next_id;
+	spinlock_t lock;
+
+	// ring of the last SCHED_HISTORY commands that ran, protected by lock
+	struct sched_result history[SCHED_HISTORY];
+	u32 executed;
+	// worst and total lateness of executed commands in ns
+	s64 late_max;
+	s64 late_total;
+
+	// wakes the thread when the first pending command is due
+	// once stopping is set, protected by lock, the timer isn't armed again
+	struct hrtimer timer;
+	struct task_struct *thread;
+	u8 stopping;
+
+	// the scheduler device in the c card class
+	struct device *device;
+};
+
+static inline void create_sched_device(struct card_sched *sched);
+static inline void remove_sched_device(struct card_sched *sched);
+
+// definitions for the scheduler attribute sysfs callbacks
+static ssize_t read_sched_queue(struct device *dev, \
+				struct device_attribute *attr, char *buf);
+static ssize_t write_sched_queue(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count);
+static ssize_t write_sched_cancel(struct device *dev, \
+				  struct device_attribute *attr, \
+				  const char *buf, size_t count);
+static ssize_t read_sched_history(struct device *dev, \
+				  struct device_attribute *attr, char *buf);
+
+// device attributes for the scheduler
+static DEVICE_ATTR(schedule, S_IRUSR | S_IWUSR, read_sched_queue, \
+		   write_sched_queue);
+static DEVICE_ATTR(cancel, S_IWUSR, NULL, write_sched_cancel);
+static DEVICE_ATTR(history, S_IRUSR, read_sched_history, NULL);
+
+// names used for the actuators in the scheduler files
+static const char *_sched_actuator_names[] = {
+	[act_dsa] = "dsa",
+	[act_mt] = "magnetorquer",
+	[act_thruster] = "thruster",
+};
+
+
+
+// returns < 0 if <a> runs before <b>
+static inline int compare_sched_cmd(struct sched_cmd *a, struct sched_cmd *b)
+{
+	if (a->when.tv64 != b->when.tv64)
+		return (a->when.tv64 < b->when.tv64) ? -1 : 1;
+	return (a->id < b->id) ? -1 : (a->id > b->id);
+}
+
+// adds <cmd> to the queue
+// must be called with sched->lock held
+static void insert_sched_cmd(struct card_sched *sched, struct sched_cmd *cmd)
+{
+	struct rb_node **link = &sched->queue.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		struct sched_cmd *entry = rb_entry(parent, struct sched_cmd, node);
+		if (compare_sched_cmd(cmd, entry) < 0)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&cmd->node, parent, link);
+	rb_insert_color(&cmd->node, &sched->queue);
+	sched->pending++;
+}
+
+// removes <cmd> from the queue
+// must be called with sched->lock held
+static inline void erase_sched_cmd(struct card_sched *sched, \
+				   struct sched_cmd *cmd)
+{
+	rb_erase(&cmd->node, &sched->queue);
+	sched->pending--;
+}
+
+static enum hrtimer_restart sched_timer_fired(struct hrtimer *timer)
+{
+	struct card_sched *sched = container_of(timer, struct card_sched, \
+						timer);
+	wake_up_process(sched->thread);
+	return HRTIMER_NORESTART;
+}
+
+// moves every due command requested for the same instant as the first
+//   one in the queue onto <batch>
+// returns the number of commands moved, 0 if nothing is due yet, in which
+//   case the timer is armed for the first command
+static u32 take_sched_batch(struct card_sched *sched, struct list_head *batch)
+{
+	unsigned long flags;
+	u32 taken = 0;
+
+	spin_lock_irqsave(&sched->lock, flags);
+
+	struct rb_node *first = rb_first(&sched->queue);
+	if (first == NULL) {
+		spin_unlock_irqrestore(&sched->lock, flags);
+		return 0;
+	}
+
+	struct sched_cmd *cmd = rb_entry(first, struct sched_cmd, node);
+	ktime_t when = cmd->when;
+	if (when.tv64 > ktime_get().tv64) {
+		if (!sched->stopping)
+			hrtimer_start(&sched->timer, when, HRTIMER_MODE_ABS);
+		spin_unlock_irqrestore(&sched->lock, flags);
+		return 0;
+	}
+
+	while (first) {
+		cmd = rb_entry(first, struct sched_cmd, node);
+		if (cmd->when.tv64 != when.tv64)
+			break;
+		first = rb_next(first);
+		erase_sched_cmd(sched, cmd);
+		list_add_tail(&cmd->batch, batch);
+		taken++;
+	}
+
+	spin_unlock_irqrestore(&sched->lock, flags);
+	return taken;
+}
+
+// records the outcome of <cmd>, which ran at <achieved>
+static void record_sched_result(struct card_sched *sched, \
+				struct sched_cmd *cmd, ktime_t achieved, s8 result)
+{
+	unsigned long flags;
+	s64 late = ktime_to_ns(ktime_sub(achieved, cmd->when));
+
+	spin_lock_irqsave(&sched->lock, flags);
+	struct sched_result *entry = \
+		&sched->history[sched->executed % SCHED_HISTORY];
+	entry->id = cmd->id;
+	entry->actuator = cmd->actuator;
+	entry->index = cmd->index;
+	entry->value = cmd->value;
+	entry->requested = cmd->when;
+	entry->achieved = achieved;
+	entry->result = result;
+
+	sched->executed++;
+	sched->late_total += late;
+	if (late > sched->late_max)
+		sched->late_max = late;
+	spin_unlock_irqrestore(&sched->lock, flags);
+}
+
+// runs a batch of commands requested for the same instant
+// all magnetorquer commands in the batch are merged into one update of the
+//   magnetorquer expander, and only the last command for each thruster is
+//   written to its DAC
+static void run_sched_batch(struct card_sched *sched, struct list_head *batch)
+{
+	struct ccard *card = sched->card;
+	enum mt_state mt_desired[MT_COUNT];
+	u8 mt_which = 0;
+	struct sched_cmd *thrust_cmds[THRUSTER_COUNT] = {};
+	struct sched_cmd *cmd;
+	struct sched_cmd *next;
+
+	ktime_t achieved = ktime_get();
+
+	list_for_each_entry(cmd, batch, batch) {
+		switch (cmd->actuator) {
+		case act_mt:
+			mt_desired[cmd->index] = cmd->value;
+			mt_which |= 1 << cmd->index;
+			break;
+		case act_thruster:
+			thrust_cmds[cmd->index] = cmd;
+			break;
+		default:
+			break;
+		}
+	}
+
+	s8 mt_result = mt_which ? set_mt_states(card, mt_desired, mt_which, \
+						    cause_scheduler) : 0;
+
+	s8 thrust_results[THRUSTER_COUNT] = {};
+	for (int i = 0; i < THRUSTER_COUNT; i++) {
+		if (thrust_cmds[i])
+			thrust_results[i] = set_thrust(card, i, \
+						       thrust_cmds[i]->value, \
+						       cause_scheduler);
+	}
+
+	list_for_each_entry_safe(cmd, next, batch, batch) {
+		s8 result = 0;
+		switch (cmd->actuator) {
+		case act_dsa:
+			result = set_dsa_state(card, cmd->index, cmd->value);
+			break;
+		case act_mt:
+			result = mt_result;
+			break;
+		case act_thruster:
+			result = thrust_results[cmd->index];
+			break;
+		}
+
+		record_sched_result(sched, cmd, achieved, result);
+		list_del(&cmd->batch);
+		kfree(cmd);
+	}
+}
+
+// this function runs in its own thread for the lifetime of the card
+// it sleeps until the timer or a new command wakes it, and then runs every
+//   command that is due
+static int sched_loop(void *data)
+{
+	struct card_sched *sched = data;
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
+	sched_setscheduler(current, SCHED_FIFO, &param);
+
+	// the state is set before testing for a stop, so that a kthread_stop or
+	//   a wakeup that lands in between makes the schedule return at once
+	LIST_HEAD(batch);
+	while (1) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		if (take_sched_batch(sched, &batch) == 0) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		run_sched_batch(sched, &batch);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+s8 ccard_init_scheduler(struct ccard *card)
+{
+	struct card_sched *sched = kzalloc(sizeof(struct card_sched), \
+					   GFP_KERNEL);
+	if (sched == NULL)
+		return 1;
+
+	sched->card = card;
+	sched->queue = RB_ROOT;
+	sched->next_id = 1;
+	spin_lock_init(&sched->lock);
+	hrtimer_init(&sched->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	sched->timer.function = sched_timer_fired;
+
+	sched->thread = kthread_run(&sched_loop, sched, "ccard_sched%u", \
+				    card->index);
+	if (IS_ERR(sched->thread)) {
+		ccard_err("failed to create scheduler thread\n");
+		kfree(sched);
+		return 1;
+	}
+	card->sched = sched;
+
+	create_sched_device(sched);
+
+	return 0;
+}
+
+void ccard_cleanup_scheduler(struct ccard *card)
+{
+	struct card_sched *sched = card->sched;
+	if (sched == NULL)
+		return;
+
+	remove_sched_device(sched);
+
+	// the timer wakes the thread, so it has to be gone for good before the
+	//   thread is
+	unsigned long flags;
+	spin_lock_irqsave(&sched->lock, flags);
+	sched->stopping = 1;
+	spin_unlock_irqrestore(&sched->lock, flags);
+	hrtimer_cancel(&sched->timer);
+
+	kthread_stop(sched->thread);
+
+	// whatever didn't run by now never will
+	struct rb_node *node;
+	while ((node = rb_first(&sched->queue))) {
+		struct sched_cmd *cmd = rb_entry(node, struct sched_cmd, node);
+		erase_sched_cmd(sched, cmd);
+		kfree(cmd);
+	}
+
+	card->sched = NULL;
+	kfree(sched);
+}
+
+
+
+//
+// sysfs section
+//
+
+// parses a time, either "+seconds[.fraction]" relative to <now> or
+//   "@ns" as an absolute monotonic time
+// returns 0 on success
+static s8 parse_sched_time(const char *str, ktime_t now, ktime_t *when)
+{
+	if (str[0] == '@') {
+		char *end;
+		u64 ns = simple_strtoull(str + 1, &end, 10);
+		if (end == str + 1 || *end != '\0')
+			return 1;
+		*when = ns_to_ktime(ns);
+		return 0;
+	} else if (str[0] != '+') {
+		return 1;
+	}
+
+	char *end;
+	u64 ns = (u64)simple_strtoul(str + 1, &end, 10) * NSEC_PER_SEC;
+	if (end == str + 1)
+		return 1;
+	if (*end == '.') {
+		// up to 9 digits of fraction, the rest are ignored
+		u32 scale = NSEC_PER_SEC / 10;
+		for (end++; *end >= '0' && *end <= '9'; end++) {
+			ns += (*end - '0') * scale;
+			scale /= 10;
+		}
+	}
+	if (*end != '\0')
+		return 1;
+
+	*when = ktime_add_ns(now, ns);
+	return 0;
+}
+
+// parses an actuator name and number like "magnetorquer1"
+// returns 0 on success
+static s8 parse_sched_actuator(const char *str, struct sched_cmd *cmd)
+{
+	static const u8 counts[] = {
+		[act_dsa] = DSA_COUNT,
+		[act_mt] = MT_COUNT,
+		[act_thruster] = THRUSTER_COUNT,
+	};
+
+	for (int i = 0; i < ARRAY_SIZE(_sched_actuator_names); i++) {
+		size_t len = strlen(_sched_actuator_names[i]);
+		if (strncmp(str, _sched_actuator_names[i], len))
+			continue;
+
+		char *end;
+		unsigned long index = simple_strtoul(str + len, &end, 10);
+		if (end == str + len || *end != '\0' || index >= counts[i])
+			return 1;
+
+		cmd->actuator = i;
+		cmd->index = index;
+		return 0;
+	}
+
+	return 1;
+}
+
+// parses the state the command should set, which depends on the actuator
+// returns 0 on success
+static s8 parse_sched_value(const char *str, struct sched_cmd *cmd)
+{
+	switch (cmd->actuator) {
+	case act_dsa:
+		if (!strcmp(str, "stow") || !strcmp(str, "stowed"))
+			cmd->value = stowed;
+		else if (!strcmp(str, "release") || !strcmp(str, "released"))
+			cmd->value = released;
+		else if (!strcmp(str, "deploy") || !strcmp(str, "deployed"))
+			cmd->value = deployed;
+		else
+			return 1;
+		return 0;
+	case act_mt:
+		if (!strcmp(str, "off"))
+			cmd->value = off;
+		else if (!strcmp(str, "forward"))
+			cmd->value = forward;
+		else if (!strcmp(str, "reverse"))
+			cmd->value = reverse;
+		else if (!strcmp(str, "brake"))
+			cmd->value = transitioning;
+		else
+			return 1;
+		return 0;
+	case act_thruster: {
+		char *end;
+		unsigned long thrust = simple_strtoul(str, &end, 10);
+		if (end == str || (*end != '\0' && strcmp(end, "%")) || \
+		    thrust > THRUST_RESOLUTION)
+			return 1;
+		cmd->value = thrust;
+		return 0;
+	}
+	}
+
+	return 1;
+}
+
+// queues one command line of the form "<time> <actuator> <state>", with a
+//   relative time counted from <now>
+// returns the id of the command, or 0 if it couldn't be queued
+static u32 queue_sched_line(struct card_sched *sched, const char *line, \
+			    ktime_t now)
+{
+	char time[32];
+	char actuator[32];
+	char value[32];
+	unsigned long flags;
+
+	if (sscanf(line, "%31s %31s %31s", time, actuator, value) != 3) {
+		ccard_err_rl("scheduler can't parse '%s'\n", line);
+		return 0;
+	}
+
+	struct sched_cmd *cmd = kmalloc(sizeof(struct sched_cmd), GFP_KERNEL);
+	if (cmd == NULL)
+		return 0;
+
+	if (parse_sched_time(time, now, &cmd->when) || \
+	    parse_sched_actuator(actuator, cmd) || \
+	    parse_sched_value(value, cmd)) {
+		ccard_err_rl("scheduler can't parse '%s'\n", line);
+		kfree(cmd);
+		return 0;
+	}
+	trace_ccard_cmd_parsed(cmd->actuator, cmd->index, cmd->value);
+
+	spin_lock_irqsave(&sched->lock, flags);
+	if (sched->pending >= SCHED_MAX_PENDING) {
+		spin_unlock_irqrestore(&sched->lock, flags);
+		ccard_err_rl("scheduler queue is full\n");
+		kfree(cmd);
+		return 0;
+	}
+	cmd->id = sched->next_id++;
+	insert_sched_cmd(sched, cmd);
+	spin_unlock_irqrestore(&sched->lock, flags);
+
+	return cmd->id;
+}
+
+static ssize_t read_sched_queue(struct device *dev, \
+				struct device_attribute *attr, char *buf)
+{
+	struct card_sched *sched = dev_get_drvdata(dev);
+	unsigned long flags;
+	ssize_t len = 0;
+	s64 now = ktime_to_ns(ktime_get());
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "now %lli\n", now);
+
+	spin_lock_irqsave(&sched->lock, flags);
+	for (struct rb_node *node = rb_first(&sched->queue); node; \
+	     node = rb_next(node)) {
+		struct sched_cmd *cmd = rb_entry(node, struct sched_cmd, node);
+		len += scnprintf(buf + len, PAGE_SIZE - len, \
+				 "%u @%lli %s%u %i\n", cmd->id, \
+				 ktime_to_ns(cmd->when), \
+				 _sched_actuator_names[cmd->actuator], \
+				 cmd->index, cmd->value);
+	}
+	spin_unlock_irqrestore(&sched->lock, flags);
+
+	return len;
+}
+
+// accepts one command per line, commands with the same time run together
+// every relative time of one write counts from the same instant, so lines
+//   with the same offset end up with the same time and are batched
+static ssize_t write_sched_queue(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count)
+{
+	struct card_sched *sched = dev_get_drvdata(dev);
+	ktime_t start = ktime_get();
+	char *copy = kstrndup(buf, count, GFP_KERNEL);
+	if (copy == NULL) {
+		ccard_record_command(sched->card, CCARD_SRC_SCHEDULE, 0, buf, \
+				     count, -ENOMEM, start);
+		return -ENOMEM;
+	}
+
+	char *lines = copy;
+	char *line;
+	u32 queued = 0;
+	while ((line = strsep(&lines, "\n"))) {
+		if (*line == '\0')
+			continue;
+		if (queue_sched_line(sched, line, start))
+			queued++;
+	}
+	kfree(copy);
+
+	// the new commands may be due before whatever the timer is armed for
+	if (queued)
+		wake_up_process(sched->thread);
+
+	ccard_record_command(sched->card, CCARD_SRC_SCHEDULE, 0, buf, count, \
+			     count, start);
+	return count;
+}
+
+// cancels the command with the given id, or every command for "all"
+static ssize_t write_sched_cancel(struct device *dev, \
+				  struct device_attribute *attr, \
+				  const char *buf, size_t count)
+{
+	struct card_sched *sched = dev_get_drvdata(dev);
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	unsigned long id = 0;
+	u8 all = !strcmp(buf, "all\n") || !strcmp(buf, "all");
+
+	if (!all && strict_strtoul(buf, 10, &id)) {
+		ccard_warn_rl("%s is an invalid command id\n", buf);
+		ccard_record_command(sched->card, CCARD_SRC_SCHED_CANCEL, 0, \
+				     buf, count, count, start);
+		return count;
+	}
+
+	spin_lock_irqsave(&sched->lock, flags);
+	struct rb_node *node = rb_first(&sched->queue);
+	while (node) {
+		struct sched_cmd *cmd = rb_entry(node, struct sched_cmd, node);
+		node = rb_next(node);
+		if (all || cmd->id == id) {
+			erase_sched_cmd(sched, cmd);
+			kfree(cmd);
+		}
+	}
+	spin_unlock_irqrestore(&sched->lock, flags);
+
+	ccard_record_command(sched->card, CCARD_SRC_SCHED_CANCEL, 0, buf, \
+			     count, count, start);
+	return count;
+}
+
+// prints the executed commands, oldest first, with the time each was
+//   requested for and how late it actually ran
+static ssize_t read_sched_history(struct device *dev, \
+				  struct device_attribute *attr, char *buf)
+{
+	struct card_sched *sched = dev_get_drvdata(dev);
+	unsigned long flags;
+	ssize_t len = 0;
+
+	spin_lock_irqsave(&sched->lock, flags);
+	s64 late_avg = sched->executed ? \
+		       div_s64(sched->late_total, sched->executed) : 0;
+	len += scnprintf(buf + len, PAGE_SIZE - len, \
+			 "executed %u late_avg_ns %lli late_max_ns %lli\n", \
+			 sched->executed, late_avg, sched->late_max);
+
+	u32 first = (sched->executed > SCHED_HISTORY) ? \
+		    sched->executed - SCHED_HISTORY : 0;
+	for (u32 i = first; i < sched->executed; i++) {
+		struct sched_result *entry = &sched->history[i % SCHED_HISTORY];
+		len += scnprintf(buf + len, PAGE_SIZE - len, \
+				 "%u %s%u %i requested %lli late_ns %lli result %i\n", \
+				 entry->id, \
+				 _sched_actuator_names[entry->actuator], \
+				 entry->index, entry->value, \
+				 ktime_to_ns(entry->requested), \
+				 ktime_to_ns(ktime_sub(entry->achieved, \
+						       entry->requested)), \
+				 entry->result);
+	}
+	spin_unlock_irqrestore(&sched->lock, flags);
+
+	return len;
+}
+
+static inline void create_sched_device(struct card_sched *sched)
+{
+	char name[32];
+
+	ccard_dbg("creating scheduler sysfs files\n");
+
+	ccard_dev_name(sched->card, name, sizeof(name), "scheduler");
+	sched->device = device_create(ccard_core_class(), NULL, MKDEV(0, 0), \
+				      sched, name);
+	if (IS_ERR(sched->device)) {
+		ccard_err("couldn't create scheduler device\n");
+		sched->device = NULL;
+		return;
+	}
+
+	if (device_create_file(sched->device, &dev_attr_schedule) || \
+	    device_create_file(sched->device, &dev_attr_cancel) || \
+	    device_create_file(sched->device, &dev_attr_history)) {
+		ccard_err("couldn't create scheduler device files\n");
+		return;
+	}
+}
+
+static inline void remove_sched_device(struct card_sched *sched)
+{
+	if (sched->device == NULL)
+		return;
+
+	device_remove_file(sched->device, &dev_attr_schedule);
+	device_remove_file(sched->device, &dev_attr_cancel);
+	device_remove_file(sched->device, &dev_attr_history);
+	device_unregister(sched->device);
+	sched->device = NULL;
+}
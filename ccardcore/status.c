@@ -0,0 +1,279 @@
+// implementation for the c card status page
+// the latest state of every actuator and power rail, the device presence
+//   and the bus counters of a card are kept in one page that userspace maps
+//   read only through the status char device of the card
+// every change the driver makes or observes is written to the page under a
+//   sequence count, so the fastest readers take consistent snapshots with no
+//   syscall and no bus traffic at all
+// the layout is in ccard_status.h
+//
+// by Mark Hill
+#include<linux/kernel.h>
+#include<linux/fs.h>
+#include<linux/cdev.h>
+#include<linux/mm.h>
+#include<linux/gfp.h>
+#include<linux/spinlock.h>
+#include<linux/ktime.h>
+#include<linux/device.h>
+#include<linux/err.h>
+#include<linux/slab.h>
+#include<asm/io.h>
+
+#include "ccard.h"
+#include "ccard_status.h"
+
+// the status page of one card
+struct card_status {
+	// the page itself
+	struct ccard_status *page;
+	// serializes the writers, the readers never take it
+	spinlock_t lock;
+
+	// the char device the page is mapped through
+	dev_t devt;
+	struct cdev cdev;
+	struct device *device;
+};
+
+// char device file operations
+static int open_status(struct inode *inode, struct file *file);
+static int mmap_status(struct file *file, struct vm_area_struct *vma);
+
+static const struct file_operations _status_fops = {
+	.owner = THIS_MODULE,
+	.open = open_status,
+	.mmap = mmap_status,
+};
+
+// the sequence is odd while the page is being written, the same protocol
+//   as write_seqcount_begin and write_seqcount_end
+// the sequence count lives in the shared page rather than in a seqcount_t,
+//   since userspace has to be able to read it
+static inline void status_write_begin(struct card_status *status, \
+				      unsigned long *flags)
+{
+	spin_lock_irqsave(&status->lock, *flags);
+	status->page->sequence++;
+	smp_wmb();
+}
+
+static inline void status_write_end(struct card_status *status, \
+				    unsigned long flags)
+{
+	status->page->updated_ns = ktime_to_ns(ktime_get());
+	status->page->updates++;
+	smp_wmb();
+	status->page->sequence++;
+	spin_unlock_irqrestore(&status->lock, flags);
+}
+
+void ccard_status_actuator(struct ccard *card, enum ccard_actuator actuator, \
+			   u8 index, u32 state)
+{
+	struct card_status *status = card->status;
+	if (status == NULL)
+		return;
+
+	struct ccard_status *page = status->page;
+	unsigned long flags;
+	status_write_begin(status, &flags);
+	switch (actuator) {
+	case act_dsa:
+		if (index < ARRAY_SIZE(page->dsa_state))
+			page->dsa_state[index] = state;
+		break;
+	case act_mt:
+		if (index < ARRAY_SIZE(page->mt_state))
+			page->mt_state[index] = state;
+		break;
+	case act_thruster:
+		if (index < ARRAY_SIZE(page->thrust))
+			page->thrust[index] = state;
+		break;
+	}
+	status_write_end(status, flags);
+}
+
+void ccard_status_rail(struct ccard *card, u8 rail, u8 on, u32 users, \
+		       u32 toggles)
+{
+	struct card_status *status = card->status;
+	if (status == NULL || rail >= CCARD_STATUS_RAILS)
+		return;
+
+	unsigned long flags;
+	status_write_begin(status, &flags);
+	status->page->rail_on[rail] = on;
+	status->page->rail_users[rail] = users;
+	status->page->rail_toggles[rail] = toggles;
+	status_write_end(status, flags);
+}
+
+void ccard_status_present(struct ccard *card, u8 dev, u8 present)
+{
+	struct card_status *status = card->status;
+	if (status == NULL || dev >= CCARD_STATUS_DEVICES)
+		return;
+
+	unsigned long flags;
+	status_write_begin(status, &flags);
+	if (present)
+		status->page->present |= 1 << dev;
+	else
+		status->page->present &= ~(1 << dev);
+	status_write_end(status, flags);
+}
+
+void ccard_status_bus(struct ccard *card, u8 write, int ret)
+{
+	struct card_status *status = card->status;
+	if (status == NULL)
+		return;
+
+	unsigned long flags;
+	status_write_begin(status, &flags);
+	if (write)
+		status->page->bus_writes++;
+	else
+		status->page->bus_reads++;
+	if (ret)
+		status->page->bus_errors++;
+	status_write_end(status, flags);
+}
+
+static int open_status(struct inode *inode, struct file *file)
+{
+	file->private_data = container_of(inode->i_cdev, struct card_status, \
+					  cdev);
+	return 0;
+}
+
+// maps the page into userspace
+// only a read only mapping of the whole page is allowed, a writable one
+//   would let a reader corrupt the page for everyone else
+static int mmap_status(struct file *file, struct vm_area_struct *vma)
+{
+	struct card_status *status = file->private_data;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	// mprotect mustn't be able to make it writable later either
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_RESERVED;
+
+	return remap_pfn_range(vma, vma->vm_start, \
+			       virt_to_phys(status->page) >> PAGE_SHIFT, \
+			       vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+static s8 create_status_device(struct ccard *card);
+static void remove_status_device(struct card_status *status);
+
+s8 ccard_init_status(struct ccard *card)
+{
+	BUILD_BUG_ON(sizeof(struct ccard_status) > PAGE_SIZE);
+
+	struct card_status *status = kzalloc(sizeof(struct card_status), \
+					     GFP_KERNEL);
+	if (status == NULL) {
+		ccard_err("couldn't allocate the status page\n");
+		return 1;
+	}
+	spin_lock_init(&status->lock);
+
+	struct ccard_status *page = (struct ccard_status *) \
+		get_zeroed_page(GFP_KERNEL);
+	if (page == NULL) {
+		ccard_err("couldn't allocate the status page\n");
+		kfree(status);
+		return 1;
+	}
+	// the page is handed to remap_pfn_range, so it must stay put
+	SetPageReserved(virt_to_page(page));
+	page->magic = CCARD_STATUS_MAGIC;
+	page->version = CCARD_STATUS_VERSION;
+	page->updated_ns = ktime_to_ns(ktime_get());
+	status->page = page;
+	card->status = status;
+
+	if (create_status_device(card)) {
+		ccard_cleanup_status(card);
+		return 1;
+	}
+
+	return 0;
+}
+
+void ccard_cleanup_status(struct ccard *card)
+{
+	struct card_status *status = card->status;
+	if (status == NULL)
+		return;
+
+	remove_status_device(status);
+
+	// a process that still has the page mapped holds the char device
+	//   open, and with it the module, so nothing can be mapped here
+	unsigned long flags;
+	spin_lock_irqsave(&status->lock, flags);
+	card->status = NULL;
+	spin_unlock_irqrestore(&status->lock, flags);
+
+	ClearPageReserved(virt_to_page(status->page));
+	free_page((unsigned long)status->page);
+	kfree(status);
+}
+
+
+
+//
+// sysfs section
+//
+
+static s8 create_status_device(struct ccard *card)
+{
+	struct card_status *status = card->status;
+
+	if (alloc_chrdev_region(&status->devt, 0, 1, "status")) {
+		ccard_err("couldn't create status dev_t\n");
+		return 1;
+	}
+
+	cdev_init(&status->cdev, &_status_fops);
+	status->cdev.owner = THIS_MODULE;
+	if (cdev_add(&status->cdev, status->devt, 1)) {
+		ccard_err("couldn't add status char device\n");
+		unregister_chrdev_region(status->devt, 1);
+		return 1;
+	}
+
+	char name[32];
+	ccard_dev_name(card, name, sizeof(name), "status");
+	status->device = device_create(ccard_core_class(), NULL, status->devt, \
+				       NULL, name);
+	if (IS_ERR(status->device)) {
+		ccard_err("couldn't create status device\n");
+		status->device = NULL;
+		cdev_del(&status->cdev);
+		unregister_chrdev_region(status->devt, 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void remove_status_device(struct card_status *status)
+{
+	if (status->device == NULL)
+		return;
+
+	device_destroy(ccard_core_class(), status->devt);
+	status->device = NULL;
+
+	cdev_del(&status->cdev);
+	unregister_chrdev_region(status->devt, 1);
+}
@@ -10,15 +10,27 @@
 #include<linux/sysfs.h>
 #include<linux/device.h>
 #include<linux/string.h>
+#include<linux/mutex.h>
+#include<linux/hrtimer.h>
+#include<linux/workqueue.h>
+#include<linux/ktime.h>
+#include<linux/math64.h>
+#include<linux/slab.h>
+#include<linux/crc32.h>
 
 #include "ccard.h"
+#include "ccard_trace.h"
+#include "ccard_record.h"
+#include "ccard_thrust.h"
 
 // defines the number of thrusters present on the device
 #define THRUSTER_COUNT 1
 
+struct card_thruster;
+
 // creates and removes the thruster sysfs object
-static s8 create_thruster_devices(void);
-static void remove_thruster_devices(void);
+static s8 create_thruster_devices(struct card_thruster *th);
+static void remove_thruster_devices(struct card_thruster *th);
 
 // definitions for the thruster attributes sysfs callbacks
 static ssize_t read_thruster_percent(struct device *dev, \
@@ -26,21 +38,52 @@ static ssize_t read_thruster_percent(struct device *dev, \
 static ssize_t write_thruster_percent(struct device *dev, \
 				      struct device_attribute *attr, \
 				      const char *buf, size_t count);
+static ssize_t read_thruster_output(struct device *dev, \
+				    struct device_attribute *attr, char *buf);
+static ssize_t read_thruster_calibration_info(struct device *dev, \
+					      struct device_attribute *attr, \
+					      char *buf);
+static ssize_t read_thruster_calibration(struct kobject *kobj, \
+					 struct bin_attribute *attr, \
+					 char *buf, loff_t off, size_t count);
+static ssize_t write_thruster_calibration(struct kobject *kobj, \
+					  struct bin_attribute *attr, \
+					  char *buf, loff_t off, size_t count);
+
+// callback functions for the thruster class attributes
+static ssize_t read_thruster_slew_rate(struct class *class, char *buf);
+static ssize_t write_thruster_slew_rate(struct class *class, \
+					const char *buf, size_t count);
+static ssize_t read_thruster_update_rate(struct class *class, char *buf);
+static ssize_t write_thruster_update_rate(struct class *class, \
+					  const char *buf, size_t count);
 
 
 // stores the thruster class
+// the class is shared by every card, it is registered by the first card
+//   to bring its thrusters up and unregistered by the last one
 static struct class _thruster_class;
-// stores the device numbers
-static dev_t _dev_thruster[THRUSTER_COUNT];
-// stores the device structs
-static struct device *_thruster_devices[THRUSTER_COUNT];
+static u8 _thruster_class_users = 0;
+static DEFINE_MUTEX(_thruster_class_lock);
 // device attribute for the thrusters
 static DEVICE_ATTR(thrust, S_IRUSR | S_IWUSR, read_thruster_percent, \
 		   write_thruster_percent);
-
-// stores a flag indicating if the thruster has been initialized
-// 0 = uninitialized, 1 = initialized
-static s8 _thruster_initialized = 0;
+static DEVICE_ATTR(output, S_IRUSR, read_thruster_output, NULL);
+static DEVICE_ATTR(calibration_info, S_IRUSR, read_thruster_calibration_info, \
+		   NULL);
+// the calibration table goes through a binary file, see ccard_thrust.h
+static struct bin_attribute bin_attr_calibration = {
+	.attr = {.name = "calibration", .mode = S_IRUSR | S_IWUSR},
+	.size = sizeof(struct ccard_thrust_cal) + \
+		CCARD_THRUST_CAL_MAX_POINTS * sizeof(struct ccard_thrust_cal_point),
+	.read = read_thruster_calibration,
+	.write = write_thruster_calibration,
+};
+// class attributes for the thrusters
+static CLASS_ATTR(slew_rate, S_IRUSR | S_IWUSR, read_thruster_slew_rate, \
+		  write_thruster_slew_rate);
+static CLASS_ATTR(update_rate, S_IRUSR | S_IWUSR, read_thruster_update_rate, \
+		  write_thruster_update_rate);
 
 // determines the number of discrete values the thrust percentage can take on
 #define THRUST_RESOLUTION 100 // 100 counts
@@ -52,50 +95,186 @@ static s8 _thruster_initialized = 0;
 #define THRUST_MAX_CONTROL_VOLTAGE 27 // 2.7V
 // declares the minimum thruster control voltage * 10
 #define THRUST_MIN_CONTROL_VOLTAGE 7 // 0.7V
-
-// stores the current value written to the DAC since the device
-//   is read only hardware
-// value is equal to (true percent) * THRUST_RESOLUTION
-static u16 _thrust_percents[THRUSTER_COUNT] = {0};
-
-
-s8 init_thruster()
+// the DAC codes for the maximum and minimum control voltage
+// the multiplication has to come first, the voltage ratios are below 1
+#define DAC_MAX_CODE ((DAC_RESOLUTION - 1) * THRUST_MAX_CONTROL_VOLTAGE / \
+		      DAC_MAX_VOLTAGE)
+#define DAC_MIN_CODE (DAC_RESOLUTION * THRUST_MIN_CONTROL_VOLTAGE / \
+		      DAC_MAX_VOLTAGE)
+
+// the output stage ramps in thrust * THRUST_POS_SCALE, so that slow slew
+//   rates still move the output a little on every update
+#define THRUST_POS_SCALE 1000
+// default slew rate limit in thrust counts per second, 0 = no limit
+#define thrust_dfl_slew_rate 0
+// default number of ramp steps per second
+#define thrust_dfl_update_rate 100
+#define thrust_max_update_rate 1000
+
+// the largest position and the number of steps the lookup table splits
+//   the positions into
+// the table is a little finer than the DAC codes between the minimum and
+//   maximum control voltage, so the default map loses nothing to it
+#define THRUST_POS_MAX (THRUST_RESOLUTION * THRUST_POS_SCALE)
+#define THRUST_LUT_SIZE 2048
+
+// the map from thrust to DAC code of one thruster
+// it is kept with the card rather than the stage, so an uploaded table
+//   survives the thruster going away and coming back
+struct thrust_cal {
+	// the uploaded table, count == 0 for the linear default
+	struct ccard_thrust_cal table;
+	struct ccard_thrust_cal_point points[CCARD_THRUST_CAL_MAX_POINTS];
+	// the code for every THRUST_POS_MAX / THRUST_LUT_SIZE of thrust, so
+	//   finding the code for a position is a single load
+	// read and replaced with the stage lock held
+	u16 lut[THRUST_LUT_SIZE + 1];
+};
+
+// the output stage between the commanded thrust and the DAC
+// it skips writes of the code the DAC already has, and when a slew rate
+//   limit is set it walks the output to the new thrust in steps instead of
+//   stepping the valve control voltage at once
+// the steps are timed by an hrtimer, since jiffies are far too coarse for
+//   the update rate, and written from a work item because the bus lock
+//   can sleep
+struct thrust_stage {
+	// the thruster the stage drives
+	struct ccard *card;
+	u8 index;
+	struct thrust_cal *cal;
+	// protects everything below, the bus lock is taken inside it
+	struct mutex lock;
+	// commanded thrust and the thrust currently output, both in
+	//   thrust * THRUST_POS_SCALE
+	u32 target;
+	u32 pos;
+	// the code last written to the DAC, only meaningful while dac_valid
+	//   is set, which it isn't until the first write succeeds
+	u16 dac_code;
+	u8 dac_valid;
+	// 1 while the output is being walked to the target
+	u8 ramping;
+	ktime_t ramp_start;
+	struct hrtimer timer;
+	struct work_struct step_work;
+	// writes that went to the bus, were skipped because the code didn't
+	//   change, or failed
+	u32 writes;
+	u32 suppressed;
+	u32 errors;
+	// ramps started, steps taken and how long the ramps took
+	u32 ramps;
+	u32 steps;
+	s64 ramp_last_ns;
+	s64 ramp_max_ns;
+};
+
+// the thrusters of one card
+// allocated the first time the card's DAC is brought up and kept until
+//   the card goes away
+struct card_thruster {
+	struct ccard *card;
+	// stores a flag indicating if the thruster has been initialized
+	// 0 = uninitialized, 1 = initialized
+	s8 initialized;
+	// stores the current value written to the DAC since the device
+	//   is read only hardware
+	// value is equal to (true percent) * THRUST_RESOLUTION
+	u16 percents[THRUSTER_COUNT];
+	struct thrust_stage stages[THRUSTER_COUNT];
+	struct thrust_cal cal[THRUSTER_COUNT];
+	// the drvdata of each thruster device
+	struct ccard_unit units[THRUSTER_COUNT];
+	// stores the device numbers
+	dev_t dev[THRUSTER_COUNT];
+	// stores the device structs
+	struct device *devices[THRUSTER_COUNT];
+};
+
+// the slew limit is shared by every card, like the other class attributes
+static u32 _userSlewRate = thrust_dfl_slew_rate;
+static u32 _userSlewUpdateRate = thrust_dfl_update_rate;
+
+// resets a stage to an unknown DAC output with no ramp running
+static void init_thrust_stage(struct ccard *card, u8 index, \
+			      struct thrust_stage *stage);
+// fills <lut> from the breakpoints of <table>, or with the linear map
+//   when it has none
+static void build_thrust_lut(const struct ccard_thrust_cal *table, \
+			     const struct ccard_thrust_cal_point *points, \
+			     u16 *lut);
+
+
+s8 init_thruster(struct ccard *card)
 {
+	if (card->thruster == NULL) {
+		card->thruster = kzalloc(sizeof(struct card_thruster), \
+					 GFP_KERNEL);
+		if (card->thruster == NULL)
+			return 1;
+		card->thruster->card = card;
+		for (int i = 0; i < THRUSTER_COUNT; i++) {
+			struct thrust_cal *cal = &card->thruster->cal[i];
+			build_thrust_lut(&cal->table, cal->points, cal->lut);
+		}
+	}
+	struct card_thruster *th = card->thruster;
+
 	// checks if the hardware has been initialized
-	if (_thruster_initialized)
+	if (th->initialized)
 		return 0;
 
+	// nothing is known about the DAC output until it has been written
+	for (int i = 0; i < THRUSTER_COUNT; i++)
+		init_thrust_stage(card, i, &th->stages[i]);
+
 	// creates the thrust device files
-	if (create_thruster_devices())
+	if (create_thruster_devices(th))
 		goto init_failure;
 
 	for (int i = 0; i < THRUSTER_COUNT; i++) {
-		if (set_thrust(i, 0))
-		    goto init_failure;
+		if (set_thrust(card, i, 0, cause_reset))
+		    goto remove_devices;
 	}
 
-	printk(KERN_DEBUG "thruster DAC initialization successful\n");
-	_thruster_initialized = 1;
+	ccard_dbg("thruster DAC initialization successful\n");
+	th->initialized = 1;
 	return 0;
 
+// the devices have to go, otherwise the next attempt can't create them
+remove_devices:
+	remove_thruster_devices(th);
 init_failure:
-	printk(KERN_ERR "failed to initialize thruster DAC\n");
+	ccard_err("failed to initialize thruster DAC\n");
 	return 1;
 }
 
 
-void cleanup_thruster()
+void cleanup_thruster(struct ccard *card)
 {
-	if (!_thruster_initialized)
+	struct card_thruster *th = card->thruster;
+	if (th == NULL || !th->initialized)
 		return;
 
-	remove_thruster_devices();
+	remove_thruster_devices(th);
+
+	// stop any ramp before the thrust is cut, so no late step can open
+	//   the valve again
+	for (int i = 0; i < THRUSTER_COUNT; i++) {
+		struct thrust_stage *stage = &th->stages[i];
+		mutex_lock(&stage->lock);
+		stage->ramping = 0;
+		mutex_unlock(&stage->lock);
+		hrtimer_cancel(&stage->timer);
+		cancel_work_sync(&stage->step_work);
+	}
 
 	for (int i = 0; i < THRUSTER_COUNT; i++) {
-		set_thrust(i, 0);
+		set_thrust(card, i, 0, cause_reset);
 	}
 
-	_thruster_initialized = 0;
+	th->initialized = 0;
 }
 
 
@@ -103,52 +282,233 @@ void cleanup_thruster()
 // no, you can not replace it with an i2c read
 // why? because the DAC has readonly registers
 // why is it being used then? cost and package size/pin pitch
-s32 current_thrust(u8 thruster_num)
+s32 current_thrust(struct ccard *card, u8 thruster_num)
 {
 	if (thruster_num >= THRUSTER_COUNT) {
-		printk(KERN_ERR "thruster %i does not exist\n", thruster_num);
+		ccard_err_rl("thruster %i does not exist\n", thruster_num);
 		return -1;
 	}
+	if (card->thruster == NULL)
+		return 0;
+
+	return card->thruster->percents[thruster_num];
+}
+
+
+// returns the code of the linear map for thrust <pos> in
+//   thrust * THRUST_POS_SCALE, which spreads the thrust over the control
+//   voltage range
+static inline u16 linear_dac_code(u32 pos)
+{
+	return DAC_MIN_CODE + (u32)(DAC_MAX_CODE - DAC_MIN_CODE) * pos / \
+	       THRUST_POS_MAX;
+}
+
+static void build_thrust_lut(const struct ccard_thrust_cal *table, \
+			     const struct ccard_thrust_cal_point *points, \
+			     u16 *lut)
+{
+	u16 seg = 0;
+
+	for (u32 i = 0; i <= THRUST_LUT_SIZE; i++) {
+		u32 pos = i * THRUST_POS_MAX / THRUST_LUT_SIZE;
+		if (table->count == 0) {
+			lut[i] = linear_dac_code(pos);
+			continue;
+		}
+
+		// the positions only grow, so the segment is found by walking on
+		u32 t = pos / (THRUST_POS_SCALE / CCARD_THRUST_CAL_SCALE);
+		while (seg + 2 < table->count && points[seg + 1].thrust <= t)
+			seg++;
+
+		const struct ccard_thrust_cal_point *a = &points[seg];
+		const struct ccard_thrust_cal_point *b = &points[seg + 1];
+		lut[i] = a->code + (u32)(b->code - a->code) * (t - a->thrust) / \
+			 (b->thrust - a->thrust);
+	}
+}
+
+// returns the DAC code for thrust <pos> in thrust * THRUST_POS_SCALE
+// no thrust closes the valve completely, anything else comes from the
+//   lookup table of the thruster
+// must be called with the stage lock held
+static inline u16 thrust_dac_code(struct thrust_stage *stage, u32 pos)
+{
+	if (pos == 0)
+		return 0;
+
+	return stage->cal->lut[pos * THRUST_LUT_SIZE / THRUST_POS_MAX];
+}
+
+// sets the output of <stage> to <pos>, writing the DAC only if its code
+//   changes
+// must be called with the stage lock held
+// returns 0 on success or 1 if the DAC couldn't be written
+static s8 output_thrust(struct thrust_stage *stage, u32 pos)
+{
+	struct ccard *card = stage->card;
+	u16 code = thrust_dac_code(stage, pos);
+
+	stage->pos = pos;
+	if (stage->dac_valid && stage->dac_code == code) {
+		stage->suppressed++;
+		return 0;
+	}
+
+	// the dac has no registers, but the command and the high bits take the
+	//   place of one, so the write goes through the same helper
+	u8 command = 0b0011 << 4;
+	if (ccard_lock_bus(card, CCARD_BUS_COMMAND)) {
+		ccard_err_rl("unable to lock the bus of card %u\n", card->index);
+		stage->errors++;
+		return 1;
+	} else if (ccard_write_reg(thruster_dac(card), \
+				   command + ((code & 0x0f00) >> 8), \
+				   code & 0xfc)) {
+		ccard_unlock_bus(card);
+		// the write may or may not have reached the DAC
+		stage->dac_valid = 0;
+		stage->errors++;
+		return 1;
+	}
+	ccard_unlock_bus(card);
+
+	stage->dac_code = code;
+	stage->dac_valid = 1;
+	stage->writes++;
+	return 0;
+}
+
+// moves the output of <stage> one step towards its target, and arms the
+//   timer for the next step until it gets there
+// must be called with the stage lock held
+static void step_thrust(struct thrust_stage *stage)
+{
+	if (!stage->ramping)
+		return;
+
+	// with the limit taken away mid ramp the output goes straight to the
+	//   target
+	u32 rate = _userSlewUpdateRate;
+	u32 step = _userSlewRate ? _userSlewRate * THRUST_POS_SCALE / rate : \
+		   UINT_MAX;
+	if (step == 0)
+		step = 1;
+
+	u32 pos = stage->pos;
+	if (pos < stage->target)
+		pos = (stage->target - pos > step) ? pos + step : stage->target;
+	else
+		pos = (pos - stage->target > step) ? pos - step : stage->target;
+
+	// a failed step is retried with the next one, since the DAC code is
+	//   marked unknown
+	if (output_thrust(stage, pos)) {
+		ccard_err_rl("thruster %i ramp step failed\n", stage->index);
+		ccard_log_record(stage->card, CCARD_LOG_THRUST_SET, \
+				 stage->index, pos / THRUST_POS_SCALE);
+	}
+	stage->steps++;
+
+	if (pos == stage->target) {
+		stage->ramping = 0;
+		stage->ramp_last_ns = ktime_to_ns(ktime_sub(ktime_get(), \
+							 stage->ramp_start));
+		if (stage->ramp_last_ns > stage->ramp_max_ns)
+			stage->ramp_max_ns = stage->ramp_last_ns;
+		return;
+	}
 
-	return _thrust_percents[thruster_num];
+	hrtimer_start(&stage->timer, ktime_set(0, NSEC_PER_SEC / rate), \
+		      HRTIMER_MODE_REL);
 }
 
+static void thrust_step_work(struct work_struct *work)
+{
+	struct thrust_stage *stage = container_of(work, struct thrust_stage, \
+						  step_work);
 
-s8 set_thrust(u8 thruster_num, u16 thrust)
+	mutex_lock(&stage->lock);
+	step_thrust(stage);
+	mutex_unlock(&stage->lock);
+}
+
+// runs in interrupt context, so the step itself is left to the work item
+static enum hrtimer_restart thrust_step_timer(struct hrtimer *timer)
 {
+	struct thrust_stage *stage = container_of(timer, struct thrust_stage, \
+						  timer);
+
+	schedule_work(&stage->step_work);
+	return HRTIMER_NORESTART;
+}
+
+static void init_thrust_stage(struct ccard *card, u8 index, \
+			      struct thrust_stage *stage)
+{
+	memset(stage, 0, sizeof(*stage));
+	stage->card = card;
+	stage->index = index;
+	stage->cal = &card->thruster->cal[index];
+	mutex_init(&stage->lock);
+	hrtimer_init(&stage->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	stage->timer.function = thrust_step_timer;
+	INIT_WORK(&stage->step_work, thrust_step_work);
+}
+
+s8 set_thrust(struct ccard *card, u8 thruster_num, u16 thrust, \
+	       enum ccard_cause cause)
+{
+	struct card_thruster *th = card->thruster;
+	if (th == NULL)
+		return 1;
 	if (thruster_num >= THRUSTER_COUNT) {
-		printk(KERN_ERR "thruster %i does not exist\n", thruster_num);
+		ccard_err_rl("thruster %i does not exist\n", thruster_num);
 		return -1;
 	} else if (thrust > THRUST_RESOLUTION) {
-		printk(KERN_ERR "thrust %i larger than maximum %i\n", thrust, \
+		ccard_err_rl("thrust %i larger than maximum %i\n", thrust, \
 				THRUST_RESOLUTION);
 		return 1;
 	}
 
-	
-	u16 max = (DAC_RESOLUTION - 1) * (THRUST_MAX_CONTROL_VOLTAGE / DAC_MAX_VOLTAGE);
-	u16 min = DAC_RESOLUTION * (THRUST_MIN_CONTROL_VOLTAGE / DAC_MAX_VOLTAGE);
-	u16 rawThrust = (max - min) * thrust / THRUST_RESOLUTION + min;
-	if (rawThrust > max || rawThrust < min) {
-		printk(KERN_ERR "math error when calculating thruster thrust %i\
-				\n", thrust);
-		return 1;
+	struct thrust_stage *stage = &th->stages[thruster_num];
+	s8 ret = 0;
+
+	mutex_lock(&stage->lock);
+	stage->target = thrust * THRUST_POS_SCALE;
+	if (_userSlewRate == 0 || cause == cause_reset || !stage->dac_valid) {
+		// a reset always goes straight to the target, and so does
+		//   anything while the DAC output is unknown, since there is
+		//   nothing to ramp from
+		stage->ramping = 0;
+		ret = output_thrust(stage, stage->target);
+	} else if (stage->ramping) {
+		// a ramp that is already running simply follows the new target
+	} else if (stage->pos == stage->target) {
+		// nothing to ramp, this only counts the skipped write
+		ret = output_thrust(stage, stage->target);
+	} else {
+		stage->ramping = 1;
+		stage->ramps++;
+		stage->ramp_start = ktime_get();
+		step_thrust(stage);
 	}
-	if (thrust == 0)
-		rawThrust = 0;
+	mutex_unlock(&stage->lock);
 
-	s8 command = 0b0011 << 4;
-	s8 outbuf[] = {command + ((rawThrust & 0x0f00) >> 8), rawThrust & 0xfc};
-	if (ccard_lock_bus()) {
-		printk(KERN_ERR "unable to lock i2c bus\n");
-		return 1;
-	} else if (i2c_master_send(thruster_dac(), outbuf, 2) < 2) {
-		printk(KERN_ERR "setting thruster to thrust %i init_failed\n", \
-				thrust);
-		ccard_unlock_bus();
+	if (ret) {
+		ccard_err_rl("setting thruster to thrust %i failed\n", thrust);
+		ccard_log_record(card, CCARD_LOG_THRUST_SET, thruster_num, thrust);
 		return 1;
 	}
-	ccard_unlock_bus();
+
+	// the DAC can't be read back, so this is the only record of the thrust
+	u16 old_thrust = th->percents[thruster_num];
+	th->percents[thruster_num] = thrust;
+	ccard_usage_thrust(card, thruster_num, thrust);
+	if (old_thrust != thrust)
+		ccard_notify(card, act_thruster, thruster_num, old_thrust, \
+			     thrust, cause);
 
 	return 0;
 }
@@ -162,120 +522,327 @@ s8 set_thrust(u8 thruster_num, u16 thrust)
 static ssize_t read_thruster_percent(struct device *dev, \
 				     struct device_attribute *attr, char *buf)
 {
-	s8 thrust_num = -1;
-	for (int i = 0; i < THRUSTER_COUNT; i++) {
-		if (dev == _thruster_devices[i]) {
-			thrust_num = i;
-			break;
-		}
-	}
+	struct ccard_unit *unit = dev_get_drvdata(dev);
 
-	if (thrust_num < 0 || thrust_num >= THRUSTER_COUNT) {
-		printk(KERN_DEBUG "invalid thruster number %i\n", thrust_num);
+	if (unit == NULL || unit->index >= THRUSTER_COUNT) {
+		ccard_dbg("invalid thruster device\n");
 		return scnprintf(buf, 50, "thruster not recognized\n");
 	}
 
-	printk(KERN_DEBUG "reading thrust for thruster %i\n", thrust_num);
-	return scnprintf(buf, 20, "%i%%\n", current_thrust(thrust_num) / \
-						THRUST_RESOLUTION * 100);
+	return scnprintf(buf, 20, "%i%%\n", \
+			 current_thrust(unit->card, unit->index) / \
+			 THRUST_RESOLUTION * 100);
 }
 
 static ssize_t write_thruster_percent(struct device *dev, \
 				      struct device_attribute *attr, \
 				      const char *buf, size_t count)
 {
-	s8 thrust_num = -1;
-	for (int i = 0; i < THRUSTER_COUNT; i++) {
-		if (dev == _thruster_devices[i]) {
-			thrust_num = i;
-			break;
-		}
-	}
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+	u8 thrust_num = unit->index;
 
-	if (thrust_num < 0 || thrust_num >= THRUSTER_COUNT)
-		printk(KERN_DEBUG "invalid thruster number %i\n", thrust_num);
+	ktime_t start = ktime_get();
+	if (thrust_num >= THRUSTER_COUNT)
+		ccard_dbg("invalid thruster number %i\n", thrust_num);
+	trace_ccard_cmd_received(act_thruster, thrust_num, count);
 
 	unsigned long value = 0;
 	if (strict_strtoul(buf, 10, &value))
-		printk(KERN_ERR "%s is an invalid thrust value\n", buf);
+		ccard_warn_rl("%s is an invalid thrust value\n", buf);
+	trace_ccard_cmd_parsed(act_thruster, thrust_num, value & 0xffff);
 
-	if (set_thrust(thrust_num, value & 0xffff))
-		printk(KERN_ERR "unable to set thrust to %lu\n", \
+	if (set_thrust(unit->card, thrust_num, value & 0xffff, cause_command))
+		ccard_err_rl("unable to set thrust to %lu\n", \
 				value & 0xffff);
 
-	printk(KERN_DEBUG "successfully set thrust for thruster %i to %lu\n", \
-			thrust_num, value & 0xffff);
-
+	ccard_record_command(unit->card, CCARD_SRC_THRUST, thrust_num, buf, \
+			     count, count, start);
 	return count;
 }
 
-static void ccard_release_thruster(struct device *dev)
+// shows the output stage of a thruster
+static ssize_t read_thruster_output(struct device *dev, \
+				    struct device_attribute *attr, char *buf)
 {
-	printk(KERN_DEBUG "releasing thruster device file\n");
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+
+	if (unit == NULL || unit->card->thruster == NULL)
+		return scnprintf(buf, 50, "thruster not recognized\n");
+
+	struct thrust_stage *stage = &unit->card->thruster->stages[unit->index];
+	mutex_lock(&stage->lock);
+	ssize_t len = scnprintf(buf, PAGE_SIZE, \
+		"target %u.%03u output %u.%03u dac %u%s [%s]\n" \
+		"writes %u suppressed %u errors %u\n" \
+		"ramps %u steps %u last_ms %lli max_ms %lli\n", \
+		stage->target / THRUST_POS_SCALE, \
+		stage->target % THRUST_POS_SCALE, \
+		stage->pos / THRUST_POS_SCALE, stage->pos % THRUST_POS_SCALE, \
+		stage->dac_code, stage->dac_valid ? "" : " (unknown)", \
+		stage->ramping ? "ramping" : "steady", \
+		stage->writes, stage->suppressed, stage->errors, \
+		stage->ramps, stage->steps, \
+		div_s64(stage->ramp_last_ns, NSEC_PER_MSEC), \
+		div_s64(stage->ramp_max_ns, NSEC_PER_MSEC));
+	mutex_unlock(&stage->lock);
+
+	return len;
 }
 
-static s8 create_thruster_devices()
+static ssize_t read_thruster_slew_rate(struct class *class, char *buf)
 {
-	printk(KERN_DEBUG "creating thruster sysfs files\n");
+	if (_userSlewRate == 0)
+		return scnprintf(buf, 20, "0 (unlimited)\n");
+	return scnprintf(buf, 20, "%u per second\n", _userSlewRate);
+}
 
-	struct device *parent = &thruster_dac()->dev;
+// expects the largest change of thrust per second, 0 removes the limit
+// a ramp that is already running picks the new rate up on its next step
+static ssize_t write_thruster_slew_rate(struct class *class, \
+					const char *buf, size_t count)
+{
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value)) {
+		ccard_warn_rl("%s is an invalid slew rate\n", buf);
+		return -EINVAL;
+	}
 
-	struct class thruster_class = {
-		.name = "thruster",
-		.owner = THIS_MODULE,
-		.dev_release = ccard_release_thruster,
-	};
-	_thruster_class = thruster_class;
+	_userSlewRate = value;
+	return count;
+}
 
-	if (class_register(&_thruster_class)) {
-		printk(KERN_ERR "failed to create thruster class\n");
-		return 1;
+static ssize_t read_thruster_update_rate(struct class *class, char *buf)
+{
+	return scnprintf(buf, 20, "%u Hz\n", _userSlewUpdateRate);
+}
+
+static ssize_t write_thruster_update_rate(struct class *class, \
+					  const char *buf, size_t count)
+{
+	unsigned long value = 0;
+	if (strict_strtoul(buf, 10, &value) || value == 0 || \
+	    value > thrust_max_update_rate) {
+		ccard_warn_rl("%s is an invalid update rate\n", buf);
+		return -EINVAL;
 	}
 
-	if (alloc_chrdev_region(_dev_thruster, 0, THRUSTER_COUNT, "thruster")) {
-		printk(KERN_ERR "couldn't create thruster dev_t's\n");
-		return 1;
+	_userSlewUpdateRate = value;
+	return count;
+}
+
+static void ccard_release_thruster(struct device *dev)
+{
+	ccard_dbg("releasing thruster device file\n");
+}
+
+// returns the thruster unit behind the binary file <kobj> belongs to
+static inline struct ccard_unit *bin_unit(struct kobject *kobj)
+{
+	return dev_get_drvdata(container_of(kobj, struct device, kobj));
+}
+
+static ssize_t read_thruster_calibration_info(struct device *dev, \
+					      struct device_attribute *attr, \
+					      char *buf)
+{
+	struct ccard_unit *unit = dev_get_drvdata(dev);
+	struct thrust_stage *stage = &unit->card->thruster->stages[unit->index];
+
+	mutex_lock(&stage->lock);
+	const struct ccard_thrust_cal *table = &stage->cal->table;
+	ssize_t len = table->count ? \
+		scnprintf(buf, PAGE_SIZE, "[table] version %u crc %08x " \
+			  "points %u\n", table->version, table->crc, \
+			  table->count) : \
+		scnprintf(buf, PAGE_SIZE, "[linear] codes %u to %u\n", \
+			  DAC_MIN_CODE, DAC_MAX_CODE);
+	mutex_unlock(&stage->lock);
+
+	return len;
+}
+
+static ssize_t read_thruster_calibration(struct kobject *kobj, \
+					 struct bin_attribute *attr, \
+					 char *buf, loff_t off, size_t count)
+{
+	struct ccard_unit *unit = bin_unit(kobj);
+	struct thrust_stage *stage = &unit->card->thruster->stages[unit->index];
+	ssize_t len = 0;
+
+	mutex_lock(&stage->lock);
+	struct thrust_cal *cal = stage->cal;
+	size_t size = sizeof(cal->table) + \
+		      cal->table.count * sizeof(cal->points[0]);
+	if (off < size) {
+		len = min_t(size_t, count, size - off);
+		// the points follow the header in the struct just as in the file
+		memcpy(buf, (char *)&cal->table + off, len);
 	}
+	mutex_unlock(&stage->lock);
 
-	for (int i = 0; i < THRUSTER_COUNT; i++) {
-		char name[15];
-		scnprintf(name, 15, "thruster%i", i);
+	return len;
+}
 
-		_dev_thruster[i] = MKDEV(MAJOR(_dev_thruster[0]), \
-					 MINOR(_dev_thruster[0]) + i);
+// takes a whole table in one write, replacing the one in use once it has
+//   been checked
+static ssize_t write_thruster_calibration(struct kobject *kobj, \
+					  struct bin_attribute *attr, \
+					  char *buf, loff_t off, size_t count)
+{
+	struct ccard_unit *unit = bin_unit(kobj);
+	struct thrust_stage *stage = &unit->card->thruster->stages[unit->index];
+	const struct ccard_thrust_cal *table = (void *)buf;
+	const struct ccard_thrust_cal_point *points = table->points;
+
+	if (off != 0 || count < sizeof(*table) || \
+	    table->magic != CCARD_THRUST_CAL_MAGIC || \
+	    table->count == 1 || table->count > CCARD_THRUST_CAL_MAX_POINTS || \
+	    count != sizeof(*table) + table->count * sizeof(points[0])) {
+		ccard_warn("malformed thrust calibration table\n");
+		return -EINVAL;
+	}
 
-		_thruster_devices[i] = device_create(&_thruster_class, \
-						     parent, _dev_thruster[i], \
-						     NULL, name);
+	u32 crc = crc32(~0, (const u8 *)points, \
+			table->count * sizeof(points[0])) ^ ~0;
+	if (table->count && crc != table->crc) {
+		ccard_warn("thrust calibration crc %08x, expected %08x\n", \
+				crc, table->crc);
+		return -EINVAL;
+	}
 
-		if (device_create_file(_thruster_devices[i], \
-					&dev_attr_thrust)) {
-			printk(KERN_ERR "error making sysfs files\n");
-			return 1;
+	for (int i = 0; i < table->count; i++) {
+		if (points[i].code >= DAC_RESOLUTION || \
+		    (i > 0 && (points[i].thrust <= points[i - 1].thrust || \
+			       points[i].code < points[i - 1].code))) {
+			ccard_warn("thrust calibration point %i out of " \
+					"order\n", i);
+			return -EINVAL;
 		}
 	}
+	if (table->count && (points[0].thrust != 0 || \
+	    points[table->count - 1].thrust != \
+	    THRUST_RESOLUTION * CCARD_THRUST_CAL_SCALE)) {
+		ccard_warn("thrust calibration doesn't cover 0 to %u\n", \
+				THRUST_RESOLUTION);
+		return -EINVAL;
+	}
 
-	printk(KERN_DEBUG "created thruster sysfs files\n");
-	return 0;
+	// the table is built aside, so the command path only waits for the copy
+	u16 *lut = kmalloc(sizeof(stage->cal->lut), GFP_KERNEL);
+	if (lut == NULL)
+		return -ENOMEM;
+	build_thrust_lut(table, points, lut);
+
+	mutex_lock(&stage->lock);
+	struct thrust_cal *cal = stage->cal;
+	cal->table = *table;
+	memcpy(cal->points, points, table->count * sizeof(points[0]));
+	memcpy(cal->lut, lut, sizeof(cal->lut));
+	// the next write has to go out even if the old table gave the same
+	//   code, and the output follows the new table right away
+	if (stage->dac_valid && !stage->ramping && \
+	    stage->dac_code != thrust_dac_code(stage, stage->pos))
+		output_thrust(stage, stage->pos);
+	mutex_unlock(&stage->lock);
+	kfree(lut);
+
+	ccard_notice("thruster %u calibration version %u crc %08x\n", \
+			unit->index, table->version, table->crc);
+	return count;
 }
 
-static void remove_thruster_devices()
+// registers the thruster class for its first user
+// returns 0 if the class is ready
+static s8 get_thruster_class(void)
 {
-	for (int i = 0; i < THRUSTER_COUNT; i++) {
-		device_remove_file(_thruster_devices[i], &dev_attr_thrust);
-		device_destroy(&_thruster_class, _dev_thruster[i]);
+	mutex_lock(&_thruster_class_lock);
+	if (_thruster_class_users == 0) {
+		struct class thruster_class = {
+			.name = "thruster",
+			.owner = THIS_MODULE,
+			.dev_release = ccard_release_thruster,
+		};
+		_thruster_class = thruster_class;
+
+		if (class_register(&_thruster_class)) {
+			ccard_err("failed to create thruster class\n");
+			mutex_unlock(&_thruster_class_lock);
+			return 1;
+		}
+
+		if (class_create_file(&_thruster_class, &class_attr_slew_rate) || \
+		    class_create_file(&_thruster_class, &class_attr_update_rate))
+			ccard_err("couldn't create thruster class \
+					attributes\n");
 	}
+	_thruster_class_users++;
+	mutex_unlock(&_thruster_class_lock);
 
-	unregister_chrdev_region(_dev_thruster[0], THRUSTER_COUNT);
+	return 0;
+}
 
-	class_unregister(&_thruster_class);
+// unregisters the thruster class once its last user is gone
+static void put_thruster_class(void)
+{
+	mutex_lock(&_thruster_class_lock);
+	if (--_thruster_class_users == 0)
+		class_unregister(&_thruster_class);
+	mutex_unlock(&_thruster_class_lock);
 }
 
+static s8 create_thruster_devices(struct card_thruster *th)
+{
+	ccard_dbg("creating thruster sysfs files\n");
 
+	struct ccard *card = th->card;
+	struct device *parent = thruster_dac(card)->parent;
 
+	if (get_thruster_class())
+		return 1;
 
+	if (alloc_chrdev_region(th->dev, 0, THRUSTER_COUNT, "thruster")) {
+		ccard_err("couldn't create thruster dev_t's\n");
+		put_thruster_class();
+		return 1;
+	}
 
+	for (int i = 0; i < THRUSTER_COUNT; i++) {
+		char name[32];
+		ccard_dev_name(card, name, sizeof(name), "thruster%i", i);
+
+		th->units[i].card = card;
+		th->units[i].index = i;
+		th->dev[i] = MKDEV(MAJOR(th->dev[0]), MINOR(th->dev[0]) + i);
+
+		th->devices[i] = device_create(&_thruster_class, parent, \
+					       th->dev[i], &th->units[i], name);
+
+		if (device_create_file(th->devices[i], &dev_attr_thrust) || \
+		    device_create_file(th->devices[i], &dev_attr_output) || \
+		    device_create_file(th->devices[i], \
+				       &dev_attr_calibration_info) || \
+		    device_create_bin_file(th->devices[i], \
+					   &bin_attr_calibration)) {
+			ccard_err("error making sysfs files\n");
+			return 1;
+		}
+	}
 
+	ccard_dbg("created thruster sysfs files\n");
+	return 0;
+}
 
+static void remove_thruster_devices(struct card_thruster *th)
+{
+	for (int i = 0; i < THRUSTER_COUNT; i++) {
+		device_remove_file(th->devices[i], &dev_attr_thrust);
+		device_remove_file(th->devices[i], &dev_attr_output);
+		device_remove_file(th->devices[i], &dev_attr_calibration_info);
+		device_remove_bin_file(th->devices[i], &bin_attr_calibration);
+		device_destroy(&_thruster_class, th->dev[i]);
+	}
 
+	unregister_chrdev_region(th->dev[0], THRUSTER_COUNT);
 
+	put_thruster_class();
+}
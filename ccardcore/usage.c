@@ -0,0 +1,424 @@
+// implementation for the per actuator usage counters
+// the actuator code reports every state transition, and the time spent in
+//   the previous state is added to the counters using the monotonic clock,
+//   so the totals are exact without anyone polling sysfs
+//
+// by Mark Hill
+#include<linux/kernel.h>
+#include<linux/spinlock.h>
+#include<linux/ktime.h>
+#include<linux/device.h>
+#include<linux/sysfs.h>
+#include<linux/string.h>
+#include<linux/slab.h>
+#include<asm/div64.h>
+
+#include "ccard.h"
+
+// default nominal power draw in mW used for the energy figures
+#define usage_dfl_mt_power 500
+#define usage_dfl_thruster_power 2000
+#define usage_dfl_burn_power 1650
+
+// the cumulative figures, all times in ns
+struct usage_counters {
+	// time each magnetorquer spent in each state, indexed by mt_state
+	u64 mt_ns[MT_COUNT][4];
+	// time each thruster was on, and its thrust percent integrated
+	//   over that time
+	u64 thrust_ns[THRUSTER_COUNT];
+	u64 thrust_pct_ns[THRUSTER_COUNT];
+	// time each dsa spent burning for a release and a deploy
+	u64 dsa_ns[DSA_COUNT][2];
+	// time covered by the counters
+	ktime_t start;
+	ktime_t end;
+};
+
+// the usage of one card
+struct card_usage {
+	// the running counters and the last snapshot, protected by lock
+	struct usage_counters counters;
+	struct usage_counters snapshot;
+	spinlock_t lock;
+
+	// state of each actuator since its last transition
+	enum mt_state mt_state[MT_COUNT];
+	ktime_t mt_since[MT_COUNT];
+	u16 thrust[THRUSTER_COUNT];
+	ktime_t thrust_since[THRUSTER_COUNT];
+	// operation + 1 a dsa is burning for, 0 if it isn't burning
+	u8 dsa_op[DSA_COUNT];
+	ktime_t dsa_since[DSA_COUNT];
+
+	// nominal power draw in mW, set through the usage device
+	u32 mt_power;
+	u32 thruster_power;
+	u32 burn_power;
+
+	// the usage device in the c card class
+	struct device *device;
+};
+
+static inline void create_usage_device(struct ccard *card);
+static inline void remove_usage_device(struct card_usage *u);
+
+// definitions for the usage attribute sysfs callbacks
+static ssize_t read_usage_counters(struct device *dev, \
+				   struct device_attribute *attr, char *buf);
+static ssize_t write_usage_counters(struct device *dev, \
+				    struct device_attribute *attr, \
+				    const char *buf, size_t count);
+static ssize_t read_usage_snapshot(struct device *dev, \
+				   struct device_attribute *attr, char *buf);
+static ssize_t read_usage_power(struct device *dev, \
+				struct device_attribute *attr, char *buf);
+static ssize_t write_usage_power(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count);
+
+// device attributes for the usage counters
+static DEVICE_ATTR(counters, S_IRUSR | S_IWUSR, read_usage_counters, \
+		   write_usage_counters);
+static DEVICE_ATTR(snapshot, S_IRUSR, read_usage_snapshot, NULL);
+static DEVICE_ATTR(power, S_IRUSR | S_IWUSR, read_usage_power, \
+		   write_usage_power);
+
+
+
+// returns the ns between <since> and <now>
+static inline u64 usage_delta(ktime_t since, ktime_t now)
+{
+	return ktime_to_ns(ktime_sub(now, since));
+}
+
+void ccard_usage_mt(struct ccard *card, u8 mt, enum mt_state state)
+{
+	struct card_usage *u = card->usage;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	if (u == NULL || mt >= MT_COUNT)
+		return;
+
+	spin_lock_irqsave(&u->lock, flags);
+	u->counters.mt_ns[mt][u->mt_state[mt]] += \
+		usage_delta(u->mt_since[mt], now);
+	u->mt_state[mt] = state & 0b11;
+	u->mt_since[mt] = now;
+	spin_unlock_irqrestore(&u->lock, flags);
+}
+
+void ccard_usage_thrust(struct ccard *card, u8 thruster, u16 thrust)
+{
+	struct card_usage *u = card->usage;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	if (u == NULL || thruster >= THRUSTER_COUNT)
+		return;
+
+	spin_lock_irqsave(&u->lock, flags);
+	if (u->thrust[thruster]) {
+		u64 delta = usage_delta(u->thrust_since[thruster], now);
+		u->counters.thrust_ns[thruster] += delta;
+		u->counters.thrust_pct_ns[thruster] += delta * u->thrust[thruster];
+	}
+	u->thrust[thruster] = thrust;
+	u->thrust_since[thruster] = now;
+	spin_unlock_irqrestore(&u->lock, flags);
+}
+
+void ccard_usage_dsa(struct ccard *card, u8 dsa, u8 op, u8 burning)
+{
+	struct card_usage *u = card->usage;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	if (u == NULL || dsa >= DSA_COUNT)
+		return;
+
+	spin_lock_irqsave(&u->lock, flags);
+	if (u->dsa_op[dsa])
+		u->counters.dsa_ns[dsa][u->dsa_op[dsa] - 1] += \
+			usage_delta(u->dsa_since[dsa], now);
+	u->dsa_op[dsa] = burning ? op + 1 : 0;
+	u->dsa_since[dsa] = now;
+	spin_unlock_irqrestore(&u->lock, flags);
+}
+
+u8 ccard_usage_active(struct ccard *card)
+{
+	struct card_usage *u = card->usage;
+	unsigned long flags;
+	u8 active = 0;
+
+	// without the counters there is no telling, so the card counts as busy
+	if (u == NULL)
+		return 1;
+
+	spin_lock_irqsave(&u->lock, flags);
+	for (int i = 0; i < MT_COUNT; i++)
+		active |= u->mt_state[i] != off;
+	for (int i = 0; i < THRUSTER_COUNT; i++)
+		active |= u->thrust[i] != 0;
+	for (int i = 0; i < DSA_COUNT; i++)
+		active |= u->dsa_op[i] != 0;
+	spin_unlock_irqrestore(&u->lock, flags);
+
+	return active;
+}
+
+// brings the running counters up to <now>, so that actuators that haven't
+//   changed state in a while are included
+// must be called with u->lock held
+static void settle_usage(struct card_usage *u, ktime_t now)
+{
+	for (int i = 0; i < MT_COUNT; i++) {
+		u->counters.mt_ns[i][u->mt_state[i]] += \
+			usage_delta(u->mt_since[i], now);
+		u->mt_since[i] = now;
+	}
+
+	for (int i = 0; i < THRUSTER_COUNT; i++) {
+		if (u->thrust[i]) {
+			u64 delta = usage_delta(u->thrust_since[i], now);
+			u->counters.thrust_ns[i] += delta;
+			u->counters.thrust_pct_ns[i] += delta * u->thrust[i];
+		}
+		u->thrust_since[i] = now;
+	}
+
+	for (int i = 0; i < DSA_COUNT; i++) {
+		if (u->dsa_op[i])
+			u->counters.dsa_ns[i][u->dsa_op[i] - 1] += \
+				usage_delta(u->dsa_since[i], now);
+		u->dsa_since[i] = now;
+	}
+
+	u->counters.end = now;
+}
+
+s8 ccard_init_usage(struct ccard *card)
+{
+	struct card_usage *u = kzalloc(sizeof(struct card_usage), GFP_KERNEL);
+	if (u == NULL)
+		return 1;
+
+	ktime_t now = ktime_get();
+
+	spin_lock_init(&u->lock);
+	u->counters.start = now;
+	u->counters.end = now;
+	for (int i = 0; i < MT_COUNT; i++)
+		u->mt_since[i] = now;
+	for (int i = 0; i < THRUSTER_COUNT; i++)
+		u->thrust_since[i] = now;
+	for (int i = 0; i < DSA_COUNT; i++)
+		u->dsa_since[i] = now;
+	u->mt_power = usage_dfl_mt_power;
+	u->thruster_power = usage_dfl_thruster_power;
+	u->burn_power = usage_dfl_burn_power;
+	card->usage = u;
+
+	create_usage_device(card);
+
+	return 0;
+}
+
+void ccard_cleanup_usage(struct ccard *card)
+{
+	struct card_usage *u = card->usage;
+	if (u == NULL)
+		return;
+
+	remove_usage_device(u);
+	card->usage = NULL;
+	kfree(u);
+}
+
+
+
+//
+// sysfs section
+//
+
+// returns <value> divided by <divisor>
+static inline u64 usage_div(u64 value, u32 divisor)
+{
+	do_div(value, divisor);
+	return value;
+}
+
+// returns the energy in mJ used by drawing <power> mW for <ns> ns
+static inline u64 usage_energy(u32 power, u64 ns)
+{
+	return usage_div(usage_div(ns, NSEC_PER_USEC) * power, USEC_PER_SEC);
+}
+
+// prints <counters> into <buf> using the power settings of <u>
+// times are printed in ms, thrust as the equivalent time at full thrust
+static ssize_t print_usage(struct card_usage *u, \
+			   struct usage_counters *counters, char *buf)
+{
+	ssize_t len = 0;
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, \
+			 "start_ns %lli end_ns %lli\n", \
+			 ktime_to_ns(counters->start), \
+			 ktime_to_ns(counters->end));
+
+	for (int i = 0; i < MT_COUNT; i++) {
+		u64 *ns = counters->mt_ns[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len, \
+				 "magnetorquer%i forward_ms %llu reverse_ms %llu " \
+				 "brake_ms %llu energy_mj %llu\n", i, \
+				 usage_div(ns[forward], NSEC_PER_MSEC), \
+				 usage_div(ns[reverse], NSEC_PER_MSEC), \
+				 usage_div(ns[transitioning], NSEC_PER_MSEC), \
+				 usage_energy(u->mt_power, \
+					      ns[forward] + ns[reverse]));
+	}
+
+	for (int i = 0; i < THRUSTER_COUNT; i++) {
+		u64 full = usage_div(counters->thrust_pct_ns[i], \
+				     THRUST_RESOLUTION);
+		len += scnprintf(buf + len, PAGE_SIZE - len, \
+				 "thruster%i on_ms %llu full_thrust_ms %llu " \
+				 "energy_mj %llu\n", i, \
+				 usage_div(counters->thrust_ns[i], NSEC_PER_MSEC), \
+				 usage_div(full, NSEC_PER_MSEC), \
+				 usage_energy(u->thruster_power, full));
+	}
+
+	for (int i = 0; i < DSA_COUNT; i++) {
+		u64 *ns = counters->dsa_ns[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len, \
+				 "dsa%i release_ms %llu deploy_ms %llu " \
+				 "energy_mj %llu\n", i, \
+				 usage_div(ns[0], NSEC_PER_MSEC), \
+				 usage_div(ns[1], NSEC_PER_MSEC), \
+				 usage_energy(u->burn_power, ns[0] + ns[1]));
+	}
+
+	return len;
+}
+
+static ssize_t read_usage_counters(struct device *dev, \
+				   struct device_attribute *attr, char *buf)
+{
+	struct card_usage *u = dev_get_drvdata(dev);
+	struct usage_counters counters;
+	unsigned long flags;
+
+	spin_lock_irqsave(&u->lock, flags);
+	settle_usage(u, ktime_get());
+	counters = u->counters;
+	spin_unlock_irqrestore(&u->lock, flags);
+
+	return print_usage(u, &counters, buf);
+}
+
+// writing "snapshot" copies the counters to the snapshot file and resets
+//   them in one step, so that nothing is lost between reading and resetting
+static ssize_t write_usage_counters(struct device *dev, \
+				    struct device_attribute *attr, \
+				    const char *buf, size_t count)
+{
+	struct card_usage *u = dev_get_drvdata(dev);
+	unsigned long flags;
+
+	if (strcmp(buf, "snapshot\n") && strcmp(buf, "snapshot")) {
+		ccard_warn_rl("%s is an invalid usage command\n", buf);
+		return count;
+	}
+
+	spin_lock_irqsave(&u->lock, flags);
+	ktime_t now = ktime_get();
+	settle_usage(u, now);
+	u->snapshot = u->counters;
+	memset(&u->counters, 0, sizeof(u->counters));
+	u->counters.start = now;
+	u->counters.end = now;
+	spin_unlock_irqrestore(&u->lock, flags);
+
+	return count;
+}
+
+static ssize_t read_usage_snapshot(struct device *dev, \
+				   struct device_attribute *attr, char *buf)
+{
+	struct card_usage *u = dev_get_drvdata(dev);
+	struct usage_counters counters;
+	unsigned long flags;
+
+	spin_lock_irqsave(&u->lock, flags);
+	counters = u->snapshot;
+	spin_unlock_irqrestore(&u->lock, flags);
+
+	return print_usage(u, &counters, buf);
+}
+
+static ssize_t read_usage_power(struct device *dev, \
+				struct device_attribute *attr, char *buf)
+{
+	struct card_usage *u = dev_get_drvdata(dev);
+	return scnprintf(buf, 60, "%u %u %u\n", u->mt_power, \
+			 u->thruster_power, u->burn_power);
+}
+
+// expects the magnetorquer, full thrust and dsa burn power in mW
+static ssize_t write_usage_power(struct device *dev, \
+				 struct device_attribute *attr, \
+				 const char *buf, size_t count)
+{
+	struct card_usage *u = dev_get_drvdata(dev);
+	u32 mt, thruster, burn;
+
+	if (sscanf(buf, "%u %u %u", &mt, &thruster, &burn) != 3) {
+		ccard_warn_rl("%s is an invalid power setting\n", buf);
+		return count;
+	}
+
+	u->mt_power = mt;
+	u->thruster_power = thruster;
+	u->burn_power = burn;
+
+	return count;
+}
+
+static inline void create_usage_device(struct ccard *card)
+{
+	struct card_usage *u = card->usage;
+	char name[32];
+
+	ccard_dbg("creating usage sysfs files\n");
+
+	ccard_dev_name(card, name, sizeof(name), "usage");
+	u->device = device_create(ccard_core_class(), NULL, MKDEV(0, 0), u, \
+				  name);
+	if (IS_ERR(u->device)) {
+		ccard_err("couldn't create usage device\n");
+		u->device = NULL;
+		return;
+	}
+
+	if (device_create_file(u->device, &dev_attr_counters) || \
+	    device_create_file(u->device, &dev_attr_snapshot) || \
+	    device_create_file(u->device, &dev_attr_power)) {
+		ccard_err("couldn't create usage device files\n");
+		return;
+	}
+}
+
+static inline void remove_usage_device(struct card_usage *u)
+{
+	if (u->device == NULL)
+		return;
+
+	device_remove_file(u->device, &dev_attr_counters);
+	device_remove_file(u->device, &dev_attr_snapshot);
+	device_remove_file(u->device, &dev_attr_power);
+	device_unregister(u->device);
+	u->device = NULL;
+}
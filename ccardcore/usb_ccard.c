@@ -0,0 +1,469 @@
+// implementation of the usb transport
+// on IRVINE03 the devices of the card sit behind a usb bridge, which takes
+//   the register reads and writes framed as in ccard_usb.h and does the
+//   i2c transfers on the card itself
+// a usb card waits for a bridge after it is attached, and every bridge
+//   that is plugged in goes to the first card still waiting, so
+//     insmod ccardmodule.ko i2c_bus=0 transport=usb usb_vid=... usb_pid=...
+//   brings the card up whenever its bridge shows up, and takes it down
+//   again when the bridge is unplugged
+// the driver only matches the bridge by those ids, and without them it
+//   matches nothing until the ids are written to its new_id file, e.g.
+//     echo "<vid> <pid>" > /sys/bus/usb/drivers/ccard_usb_drvr/new_id
+//
+// by Mark Hill
+
+#include<linux/kernel.h>
+#include<linux/module.h>
+#include<linux/moduleparam.h>
+#include<linux/types.h>
+#include<linux/mutex.h>
+#include<linux/usb.h>
+#include<linux/jiffies.h>
+#include<linux/device.h>
+#include<linux/string.h>
+#include<linux/slab.h>
+
+#include "ccard.h"
+#include "ccard_usb.h"
+
+// the bridge has no ids of its own yet, so they have to be given
+static unsigned short _usb_vid;
+static unsigned short _usb_pid;
+
+module_param_named(usb_vid, _usb_vid, ushort, S_IRUGO);
+MODULE_PARM_DESC(usb_vid, "usb vendor id of the c card bridge");
+module_param_named(usb_pid, _usb_pid, ushort, S_IRUGO);
+MODULE_PARM_DESC(usb_pid, "usb product id of the c card bridge");
+
+// time the bridge has to take and answer a packet in ms
+#define CCARD_USB_TIMEOUT 100
+// replies a flush throws away at most, and the time it waits for each one
+//   in ms
+#define CCARD_USB_MAX_STALE 8
+#define CCARD_USB_FLUSH_TIMEOUT 5
+
+// a bridge that is plugged in
+struct usb_bridge {
+	struct usb_interface *intf;
+	struct usb_device *udev;
+	u8 ep_out;
+	u8 ep_in;
+	// the card using the bridge, NULL while it is spare
+	struct ccard *card;
+};
+
+// what the transport keeps for a usb card
+struct usb_link {
+	// the bus lock of the card, also protects bridge, seq and buf
+	struct mutex lock;
+	// NULL while the card waits for a bridge
+	struct usb_bridge *bridge;
+	u8 seq;
+	// the packets go through here, the stack can't be used for dma
+	u8 *buf;
+};
+
+static int ccard_usb_probe(struct usb_interface *intf, \
+			   const struct usb_device_id *id);
+static void ccard_usb_disconnect(struct usb_interface *intf);
+
+// filled in from the module parameters before the driver is registered
+// there is deliberately no MODULE_DEVICE_TABLE, the module drives actuators
+//   and must never be loaded just because some usb device was plugged in
+static struct usb_device_id ccard_usb_ids[] = {
+	{},
+	{},
+};
+
+static struct usb_driver _usb_drvr = {
+	.name = "ccard_usb_drvr",
+	.probe = ccard_usb_probe,
+	.disconnect = ccard_usb_disconnect,
+	.id_table = ccard_usb_ids,
+};
+
+// the usb cards and the bridges, paired up under _usb_lock
+static DEFINE_MUTEX(_usb_lock);
+static struct ccard *_usb_cards[CCARD_MAX_CARDS];
+static struct usb_bridge *_usb_bridges[CCARD_MAX_CARDS];
+
+static inline struct usb_link *card_usb_link(struct ccard *card)
+{
+	return card->link;
+}
+
+// gives every card that is waiting a spare bridge, if there is one, and
+//   brings its devices up
+// must be called with _usb_lock held
+static void pair_usb_bridges(void)
+{
+	for (int i = 0; i < ARRAY_SIZE(_usb_cards); i++) {
+		struct ccard *card = _usb_cards[i];
+		if (card == NULL || card_usb_link(card)->bridge != NULL)
+			continue;
+
+		struct usb_bridge *b = NULL;
+		for (int j = 0; j < ARRAY_SIZE(_usb_bridges); j++) {
+			if (_usb_bridges[j] != NULL && _usb_bridges[j]->card == NULL) {
+				b = _usb_bridges[j];
+				break;
+			}
+		}
+		if (b == NULL)
+			return;
+
+		struct usb_link *link = card_usb_link(card);
+		mutex_lock(&link->lock);
+		link->bridge = b;
+		mutex_unlock(&link->lock);
+		b->card = card;
+
+		ccard_notice("c card %u on usb bridge %s\n", card->index, \
+				dev_name(&b->intf->dev));
+		for (int j = 0; j < CCARD_DEV_COUNT; j++)
+			ccard_dev_bound(&card->devs[j], &b->intf->dev, b);
+	}
+}
+
+// takes the devices of <card> down and leaves its bridge spare
+// must be called with _usb_lock held
+static void unpair_usb_bridge(struct ccard *card)
+{
+	struct usb_link *link = card_usb_link(card);
+	if (link->bridge == NULL)
+		return;
+
+	// the cleanups still talk to the devices, so the bridge goes last
+	for (int i = 0; i < CCARD_DEV_COUNT; i++)
+		ccard_dev_unbound(&card->devs[i]);
+
+	mutex_lock(&link->lock);
+	link->bridge->card = NULL;
+	link->bridge = NULL;
+	mutex_unlock(&link->lock);
+}
+
+static s8 usb_card_init()
+{
+	if (_usb_vid != 0) {
+		ccard_usb_ids[0].match_flags = USB_DEVICE_ID_MATCH_DEVICE;
+		ccard_usb_ids[0].idVendor = _usb_vid;
+		ccard_usb_ids[0].idProduct = _usb_pid;
+	} else {
+		ccard_notice("no usb_vid given, usb bridges need a new_id\n");
+	}
+
+	if (usb_register(&_usb_drvr)) {
+		ccard_err("failed to add usb driver to kernel\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void usb_card_cleanup()
+{
+	usb_deregister(&_usb_drvr);
+}
+
+static s8 usb_card_attach(struct ccard *card)
+{
+	struct usb_link *link = kzalloc(sizeof(struct usb_link), GFP_KERNEL);
+	if (link == NULL)
+		return 1;
+	link->buf = kmalloc(CCARD_USB_PACKET, GFP_KERNEL);
+	if (link->buf == NULL) {
+		kfree(link);
+		return 1;
+	}
+	mutex_init(&link->lock);
+	card->link = link;
+
+	mutex_lock(&_usb_lock);
+	_usb_cards[card->index] = card;
+	pair_usb_bridges();
+	if (link->bridge == NULL)
+		ccard_notice("c card %u waiting for a usb bridge\n", \
+				card->index);
+	mutex_unlock(&_usb_lock);
+
+	return 0;
+}
+
+static void usb_card_detach(struct ccard *card)
+{
+	struct usb_link *link = card_usb_link(card);
+
+	mutex_lock(&_usb_lock);
+	unpair_usb_bridge(card);
+	_usb_cards[card->index] = NULL;
+	// the bridge may suit another card
+	pair_usb_bridges();
+	mutex_unlock(&_usb_lock);
+
+	card->link = NULL;
+	kfree(link->buf);
+	kfree(link);
+}
+
+// probe function called by the kernel for an interface with the ids of the
+//   bridge
+// the bridge is only taken if it has a bulk endpoint each way
+static int ccard_usb_probe(struct usb_interface *intf, \
+			   const struct usb_device_id *id)
+{
+	struct usb_device *udev = interface_to_usbdev(intf);
+
+	u8 ep_in = 0, ep_out = 0;
+	struct usb_host_interface *alt = intf->cur_altsetting;
+	for (int i = 0; i < alt->desc.bNumEndpoints; i++) {
+		struct usb_endpoint_descriptor *ep = &alt->endpoint[i].desc;
+		if (!ep_in && usb_endpoint_is_bulk_in(ep))
+			ep_in = ep->bEndpointAddress;
+		else if (!ep_out && usb_endpoint_is_bulk_out(ep))
+			ep_out = ep->bEndpointAddress;
+	}
+	if (!ep_in || !ep_out) {
+		ccard_err("usb bridge %s has no bulk endpoints\n", \
+				dev_name(&intf->dev));
+		return -ENODEV;
+	}
+
+	struct usb_bridge *b = kzalloc(sizeof(struct usb_bridge), GFP_KERNEL);
+	if (b == NULL)
+		return -ENOMEM;
+	b->intf = intf;
+	b->udev = usb_get_dev(udev);
+	b->ep_in = ep_in;
+	b->ep_out = ep_out;
+
+	mutex_lock(&_usb_lock);
+	int slot = -1;
+	for (int i = 0; i < ARRAY_SIZE(_usb_bridges); i++) {
+		if (_usb_bridges[i] == NULL) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0) {
+		mutex_unlock(&_usb_lock);
+		ccard_err("too many usb bridges\n");
+		usb_put_dev(b->udev);
+		kfree(b);
+		return -ENODEV;
+	}
+	_usb_bridges[slot] = b;
+	usb_set_intfdata(intf, b);
+	ccard_notice("found usb bridge %s\n", dev_name(&intf->dev));
+	pair_usb_bridges();
+	mutex_unlock(&_usb_lock);
+
+	return 0;
+}
+
+// disconnect function called by the kernel when the bridge is unplugged
+// the card goes back to waiting, like one that was unplugged from the bus
+static void ccard_usb_disconnect(struct usb_interface *intf)
+{
+	struct usb_bridge *b = usb_get_intfdata(intf);
+	if (b == NULL)
+		return;
+
+	mutex_lock(&_usb_lock);
+	ccard_notice("usb bridge %s unplugged\n", dev_name(&intf->dev));
+	if (b->card != NULL)
+		unpair_usb_bridge(b->card);
+	for (int i = 0; i < ARRAY_SIZE(_usb_bridges); i++) {
+		if (_usb_bridges[i] == b)
+			_usb_bridges[i] = NULL;
+	}
+	usb_set_intfdata(intf, NULL);
+	mutex_unlock(&_usb_lock);
+
+	usb_put_dev(b->udev);
+	kfree(b);
+}
+
+static int usb_card_lock(struct ccard *card, u8 wait)
+{
+	struct usb_link *link = card_usb_link(card);
+
+	if (!wait)
+		return mutex_trylock(&link->lock) ? 0 : -EBUSY;
+	return mutex_lock_interruptible(&link->lock);
+}
+
+static void usb_card_unlock(struct ccard *card)
+{
+	mutex_unlock(&card_usb_link(card)->lock);
+}
+
+// starts a packet of <cmd> with <count> entries in the buffer of <link>
+// returns the entries to fill in
+static struct ccard_usb_reg *start_usb_packet(struct usb_link *link, \
+					       u8 cmd, u8 count)
+{
+	struct ccard_usb_header *h = (struct ccard_usb_header *)link->buf;
+
+	h->magic = CCARD_USB_MAGIC;
+	h->cmd = cmd;
+	h->seq = ++link->seq;
+	h->count = count;
+
+	return (struct ccard_usb_reg *)(h + 1);
+}
+
+// throws away whatever the bridge still has queued on its in endpoint,
+//   like the reply to a packet whose round trip timed out, and clears a
+//   stalled endpoint
+// must be called with the bus locked
+static void flush_usb_bridge(struct usb_link *link, struct usb_bridge *b, \
+			     int ret)
+{
+	unsigned int in = usb_rcvbulkpipe(b->udev, b->ep_in);
+	int actual;
+
+	if (ret == -EPIPE) {
+		usb_clear_halt(b->udev, usb_sndbulkpipe(b->udev, b->ep_out));
+		usb_clear_halt(b->udev, in);
+	}
+
+	for (int i = 0; i < CCARD_USB_MAX_STALE; i++) {
+		if (usb_bulk_msg(b->udev, in, link->buf, CCARD_USB_PACKET, \
+				 &actual, CCARD_USB_FLUSH_TIMEOUT))
+			break;
+	}
+}
+
+// sends the <len> bytes of the packet in the buffer of <dev>'s card and
+//   waits for the reply, which replaces it and has to be at least
+//   <reply_len> bytes long
+// must be called with the bus locked
+// returns 0 if the bridge did everything the packet asked
+static int usb_round_trip(struct ccard_dev *dev, int len, int reply_len)
+{
+	struct usb_link *link = card_usb_link(dev->card);
+	struct usb_bridge *b = link->bridge;
+	struct ccard_usb_header sent;
+	int actual;
+
+	// the card has lost its bridge since the devices were bound
+	if (b == NULL)
+		return -ENODEV;
+
+	memcpy(&sent, link->buf, sizeof(sent));
+	int ret = usb_bulk_msg(b->udev, usb_sndbulkpipe(b->udev, b->ep_out), \
+			       link->buf, len, &actual, CCARD_USB_TIMEOUT);
+	if (ret == 0 && actual != len)
+		ret = -EIO;
+
+	// the reply to an earlier packet can still arrive after its round
+	//   trip gave up, so anything that isn't the reply to this packet is
+	//   skipped until that turns up or the time is over
+	struct ccard_usb_header *h = (struct ccard_usb_header *)link->buf;
+	unsigned long deadline = jiffies + msecs_to_jiffies(CCARD_USB_TIMEOUT);
+	while (ret == 0) {
+		ret = usb_bulk_msg(b->udev, usb_rcvbulkpipe(b->udev, b->ep_in), \
+				   link->buf, CCARD_USB_PACKET, &actual, \
+				   CCARD_USB_TIMEOUT);
+		if (ret)
+			break;
+
+		if (actual >= sizeof(*h) && h->magic == CCARD_USB_MAGIC && \
+		    h->cmd == sent.cmd && h->seq == sent.seq) {
+			if (h->count != CCARD_USB_OK)
+				return -EIO;
+			// the reply is consumed either way, so a short one
+			//   leaves nothing to flush
+			if (actual < reply_len) {
+				ccard_warn_rl("short reply from usb bridge\n");
+				return -EPROTO;
+			}
+			return 0;
+		}
+
+		ccard_dbg("skipping stale reply %u from usb bridge\n", h->seq);
+		if (time_after(jiffies, deadline)) {
+			ccard_warn_rl("no reply from usb bridge\n");
+			ret = -EPROTO;
+		}
+	}
+
+	// whatever is left would put every later round trip one reply behind
+	flush_usb_bridge(link, b, ret);
+	return ret;
+}
+
+static int usb_card_read(struct ccard_dev *dev, u8 reg, u8 *val)
+{
+	struct usb_link *link = card_usb_link(dev->card);
+
+	struct ccard_usb_reg *e = start_usb_packet(link, CCARD_USB_READ, 1);
+	e->addr = dev->addr;
+	e->reg = reg;
+	// the value follows the header of the reply
+	int ret = usb_round_trip(dev, sizeof(struct ccard_usb_header) + 2, \
+				 sizeof(struct ccard_usb_header) + 1);
+	if (ret == 0)
+		*val = link->buf[sizeof(struct ccard_usb_header)];
+	return ret;
+}
+
+// as many writes go into each packet as fit
+static int usb_card_burst(struct ccard_dev *dev, const u8 *regs, \
+			  const u8 *vals, u8 count)
+{
+	struct usb_link *link = card_usb_link(dev->card);
+
+	while (count > 0) {
+		u8 n = min_t(u8, count, CCARD_USB_MAX_WRITES);
+		struct ccard_usb_reg *e = start_usb_packet(link, CCARD_USB_WRITE, \
+							   n);
+		for (int i = 0; i < n; i++) {
+			e[i].addr = dev->addr;
+			e[i].reg = regs[i];
+			e[i].val = vals[i];
+		}
+		int ret = usb_round_trip(dev, sizeof(struct ccard_usb_header) + \
+					 n * sizeof(struct ccard_usb_reg), \
+					 sizeof(struct ccard_usb_header));
+		if (ret)
+			return ret;
+
+		regs += n;
+		vals += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+static int usb_card_write(struct ccard_dev *dev, u8 reg, u8 val)
+{
+	return usb_card_burst(dev, &reg, &val, 1);
+}
+
+static int usb_card_ping(struct ccard_dev *dev)
+{
+	struct usb_link *link = card_usb_link(dev->card);
+
+	struct ccard_usb_reg *e = start_usb_packet(link, CCARD_USB_PROBE, 1);
+	e->addr = dev->addr;
+	return usb_round_trip(dev, sizeof(struct ccard_usb_header) + 1, \
+			      sizeof(struct ccard_usb_header));
+}
+
+const struct ccard_transport ccard_usb_transport = {
+	.name = "usb",
+	.init = usb_card_init,
+	.cleanup = usb_card_cleanup,
+	.attach = usb_card_attach,
+	.detach = usb_card_detach,
+	.lock = usb_card_lock,
+	.unlock = usb_card_unlock,
+	.read_reg = usb_card_read,
+	.write_reg = usb_card_write,
+	.burst = usb_card_burst,
+	.probe = usb_card_ping,
+};
@@ -0,0 +1,478 @@
+// concurrency and latency benchmark for the c card sysfs files
+// spawns reader and writer threads against the driver's files, the way the
+//   telemetry, adcs and propulsion tasks use them, and reports latency
+//   percentiles, throughput and the bus cost of each operation as json so
+//   that runs against different driver versions can be compared
+//
+// usage:
+//   ccardbench [options] -r <n>:<file> -w <n>:<file>=<value>[,<value>...]
+//
+//   -r <n>:<file>           n threads reading <file>
+//   -w <n>:<file>=<values>  n threads writing <file>, cycling through the
+//                           comma separated values, each written with a
+//                           trailing newline like echo does
+//   -t <seconds>            how long to run, 10 by default
+//   -l <label>              label copied to the results, such as the
+//                           driver version
+//   -o <file>               write the results to <file> instead of stdout
+//   --sysfs-root <dir>      directory the files are relative to,
+//                           /sys/class by default
+//
+// by Mark Hill
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<time.h>
+#include<pthread.h>
+#include<stdint.h>
+
+#define MAX_WORKLOADS 32
+#define MAX_VALUES 16
+#define MAX_PATH 256
+#define BUS_STATS_FILE "ccard/bus/stats"
+
+// one -r or -w option
+struct workload {
+	int write;
+	int threads;
+	char path[MAX_PATH];
+	char *values[MAX_VALUES];
+	int value_count;
+	// merged results of all the threads
+	uint64_t *samples;
+	size_t sample_count;
+	uint64_t errors;
+};
+
+// one thread running a workload
+struct worker {
+	pthread_t thread;
+	struct workload *load;
+	int offset;
+	uint64_t *samples;
+	size_t sample_count;
+	size_t sample_size;
+	uint64_t errors;
+};
+
+// counters from the driver's bus stats file
+struct bus_stats {
+	int valid;
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t errors;
+	uint64_t locks;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t wait_max_ns;
+	uint64_t hold_ns;
+	// the same split into commands and housekeeping, in the driver's
+	//   enum ccard_bus_class order
+	struct {
+		uint64_t locks;
+		uint64_t contended;
+		uint64_t wait_ns;
+		uint64_t wait_max_ns;
+	} cls[2];
+	uint64_t preemptions;
+	uint64_t share_grants;
+};
+
+// prefixes of the class counters in the bus stats file, and their names in
+//   the results
+static const char *_class_prefix[] = {"cmd_", "hk_"};
+static const char *_class_name[] = {"command", "housekeeping"};
+
+static struct workload _loads[MAX_WORKLOADS];
+static int _load_count = 0;
+static const char *_sysfs_root = "/sys/class";
+static volatile int _running = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-t seconds] [-l label] [-o file] " \
+		"[--sysfs-root dir]\n" \
+		"       -r <n>:<file> -w <n>:<file>=<value>[,<value>...]\n", \
+		name);
+	exit(2);
+}
+
+// parses "<n>:<file>" or "<n>:<file>=<values>" into <load>
+static int parse_workload(char *arg, int write, struct workload *load)
+{
+	char *colon = strchr(arg, ':');
+	if (colon == NULL)
+		return -1;
+	*colon = '\0';
+	load->threads = atoi(arg);
+	load->write = write;
+	if (load->threads <= 0)
+		return -1;
+
+	char *file = colon + 1;
+	if (write) {
+		char *equals = strchr(file, '=');
+		if (equals == NULL)
+			return -1;
+		*equals = '\0';
+		// the driver expects the trailing newline echo leaves behind
+		for (char *value = strtok(equals + 1, ","); value != NULL && \
+		     load->value_count < MAX_VALUES; value = strtok(NULL, ",")) {
+			char *line = malloc(strlen(value) + 2);
+			if (line == NULL)
+				return -1;
+			sprintf(line, "%s\n", value);
+			load->values[load->value_count++] = line;
+		}
+		if (load->value_count == 0)
+			return -1;
+	}
+
+	snprintf(load->path, MAX_PATH, "%s/%s", _sysfs_root, file);
+	return 0;
+}
+
+static void add_sample(struct worker *w, uint64_t ns)
+{
+	if (w->sample_count == w->sample_size) {
+		w->sample_size = w->sample_size ? w->sample_size * 2 : 4096;
+		w->samples = realloc(w->samples, \
+				     w->sample_size * sizeof(uint64_t));
+		if (w->samples == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	w->samples[w->sample_count++] = ns;
+}
+
+// opens, reads or writes and closes the file once per operation, the same
+//   as the flight scripts do
+static void *run_worker(void *data)
+{
+	struct worker *w = data;
+	struct workload *load = w->load;
+	char buf[4096];
+	int next = w->offset;
+
+	while (_running) {
+		uint64_t start = now_ns();
+		int fd = open(load->path, load->write ? O_WRONLY : O_RDONLY);
+		ssize_t ret = -1;
+		if (fd >= 0) {
+			if (load->write) {
+				const char *value = load->values[next];
+				next = (next + 1) % load->value_count;
+				ret = write(fd, value, strlen(value));
+			} else {
+				ret = read(fd, buf, sizeof(buf));
+			}
+			close(fd);
+		}
+		uint64_t end = now_ns();
+
+		if (ret < 0)
+			w->errors++;
+		else
+			add_sample(w, end - start);
+	}
+
+	return NULL;
+}
+
+static int read_bus_stats(struct bus_stats *stats)
+{
+	char path[MAX_PATH];
+	snprintf(path, MAX_PATH, "%s/%s", _sysfs_root, BUS_STATS_FILE);
+
+	memset(stats, 0, sizeof(*stats));
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return -1;
+
+	char name[32];
+	unsigned long long value;
+	while (fscanf(file, "%31s %llu", name, &value) == 2) {
+		if (strcmp(name, "reads") == 0)
+			stats->reads = value;
+		else if (strcmp(name, "writes") == 0)
+			stats->writes = value;
+		else if (strcmp(name, "errors") == 0)
+			stats->errors = value;
+		else if (strcmp(name, "locks") == 0)
+			stats->locks = value;
+		else if (strcmp(name, "contended") == 0)
+			stats->contended = value;
+		else if (strcmp(name, "wait_ns") == 0)
+			stats->wait_ns = value;
+		else if (strcmp(name, "wait_max_ns") == 0)
+			stats->wait_max_ns = value;
+		else if (strcmp(name, "hold_ns") == 0)
+			stats->hold_ns = value;
+		else if (strcmp(name, "preemptions") == 0)
+			stats->preemptions = value;
+		else if (strcmp(name, "share_grants") == 0)
+			stats->share_grants = value;
+
+		for (int i = 0; i < 2; i++) {
+			size_t len = strlen(_class_prefix[i]);
+			if (strncmp(name, _class_prefix[i], len))
+				continue;
+			const char *field = name + len;
+			if (strcmp(field, "locks") == 0)
+				stats->cls[i].locks = value;
+			else if (strcmp(field, "contended") == 0)
+				stats->cls[i].contended = value;
+			else if (strcmp(field, "wait_ns") == 0)
+				stats->cls[i].wait_ns = value;
+			else if (strcmp(field, "wait_max_ns") == 0)
+				stats->cls[i].wait_max_ns = value;
+		}
+	}
+	fclose(file);
+
+	stats->valid = 1;
+	return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// returns the <per_mille> percentile of the sorted <samples>
+static uint64_t percentile(uint64_t *samples, size_t count, int per_mille)
+{
+	if (count == 0)
+		return 0;
+	size_t i = (count * per_mille + 999) / 1000;
+	return samples[i ? i - 1 : 0];
+}
+
+static void print_latency(FILE *out, uint64_t *samples, size_t count)
+{
+	qsort(samples, count, sizeof(uint64_t), compare_u64);
+	fprintf(out, "{\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, " \
+		"\"max\": %llu}", \
+		(unsigned long long)percentile(samples, count, 500), \
+		(unsigned long long)percentile(samples, count, 990), \
+		(unsigned long long)percentile(samples, count, 999), \
+		(unsigned long long)(count ? samples[count - 1] : 0));
+}
+
+// prints <s> as a json string
+static void print_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static void print_results(FILE *out, const char *label, double seconds, \
+			  struct bus_stats *before, struct bus_stats *after)
+{
+	size_t total_ops = 0;
+	uint64_t total_errors = 0;
+	for (int i = 0; i < _load_count; i++) {
+		total_ops += _loads[i].sample_count;
+		total_errors += _loads[i].errors;
+	}
+
+	fprintf(out, "{\n  \"label\": ");
+	print_string(out, label);
+	fprintf(out, ",\n  \"duration_s\": %.3f,\n  \"workloads\": [\n", \
+		seconds);
+
+	uint64_t *all = malloc((total_ops ? total_ops : 1) * sizeof(uint64_t));
+	size_t merged = 0;
+	for (int i = 0; i < _load_count; i++) {
+		struct workload *load = &_loads[i];
+		memcpy(all + merged, load->samples, \
+		       load->sample_count * sizeof(uint64_t));
+		merged += load->sample_count;
+
+		fprintf(out, "    {\"kind\": \"%s\", \"path\": ", \
+			load->write ? "write" : "read");
+		print_string(out, load->path);
+		fprintf(out, ", \"threads\": %d, \"ops\": %zu, " \
+			"\"errors\": %llu, \"ops_per_s\": %.1f, " \
+			"\"latency_ns\": ", load->threads, load->sample_count, \
+			(unsigned long long)load->errors, \
+			load->sample_count / seconds);
+		print_latency(out, load->samples, load->sample_count);
+		fprintf(out, "}%s\n", i + 1 < _load_count ? "," : "");
+	}
+
+	fprintf(out, "  ],\n  \"total\": {\"ops\": %zu, \"errors\": %llu, " \
+		"\"ops_per_s\": %.1f, \"latency_ns\": ", total_ops, \
+		(unsigned long long)total_errors, total_ops / seconds);
+	print_latency(out, all, total_ops);
+	fprintf(out, "},\n  \"bus\": ");
+	free(all);
+
+	if (!before->valid || !after->valid) {
+		fprintf(out, "null\n}\n");
+		return;
+	}
+
+	uint64_t transactions = (after->reads - before->reads) + \
+				(after->writes - before->writes);
+	uint64_t locks = after->locks - before->locks;
+	uint64_t contended = after->contended - before->contended;
+	fprintf(out, "{\"reads\": %llu, \"writes\": %llu, \"errors\": %llu, " \
+		"\"transactions_per_op\": %.3f, \"locks\": %llu, " \
+		"\"contended\": %llu, \"contention_ratio\": %.4f, " \
+		"\"wait_ns\": %llu, \"wait_max_ns\": %llu, " \
+		"\"hold_ns\": %llu", \
+		(unsigned long long)(after->reads - before->reads), \
+		(unsigned long long)(after->writes - before->writes), \
+		(unsigned long long)(after->errors - before->errors), \
+		total_ops ? (double)transactions / total_ops : 0.0, \
+		(unsigned long long)locks, (unsigned long long)contended, \
+		locks ? (double)contended / locks : 0.0, \
+		(unsigned long long)(after->wait_ns - before->wait_ns), \
+		(unsigned long long)after->wait_max_ns, \
+		(unsigned long long)(after->hold_ns - before->hold_ns));
+
+	// wait_max_ns of the command class is the worst case a command waited
+	//   behind the rest of the load, as long as the stats were reset
+	//   before the run
+	for (int i = 0; i < 2; i++) {
+		uint64_t locks = after->cls[i].locks - before->cls[i].locks;
+		uint64_t contended = after->cls[i].contended - \
+				     before->cls[i].contended;
+		uint64_t wait = after->cls[i].wait_ns - before->cls[i].wait_ns;
+		fprintf(out, ", \"%s\": {\"locks\": %llu, \"contended\": %llu, " \
+			"\"wait_ns\": %llu, \"wait_mean_ns\": %.1f, " \
+			"\"wait_max_ns\": %llu}", _class_name[i], \
+			(unsigned long long)locks, (unsigned long long)contended, \
+			(unsigned long long)wait, \
+			contended ? (double)wait / contended : 0.0, \
+			(unsigned long long)after->cls[i].wait_max_ns);
+	}
+	fprintf(out, ", \"preemptions\": %llu, \"share_grants\": %llu}\n}\n", \
+		(unsigned long long)(after->preemptions - before->preemptions), \
+		(unsigned long long)(after->share_grants - before->share_grants));
+}
+
+int main(int argc, char **argv)
+{
+	int seconds = 10;
+	const char *label = "";
+	const char *output = NULL;
+
+	// the root has to be known before the workloads are parsed
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--sysfs-root") == 0)
+			_sysfs_root = argv[i + 1];
+	}
+
+	for (int i = 1; i < argc; i++) {
+		const char *opt = argv[i];
+		if (i + 1 >= argc)
+			usage(argv[0]);
+		char *arg = argv[++i];
+
+		if (strcmp(opt, "--sysfs-root") == 0) {
+			continue;
+		} else if (strcmp(opt, "-t") == 0) {
+			seconds = atoi(arg);
+		} else if (strcmp(opt, "-l") == 0) {
+			label = arg;
+		} else if (strcmp(opt, "-o") == 0) {
+			output = arg;
+		} else if (strcmp(opt, "-r") == 0 || strcmp(opt, "-w") == 0) {
+			if (_load_count == MAX_WORKLOADS || \
+			    parse_workload(arg, opt[1] == 'w', \
+					   &_loads[_load_count]))
+				usage(argv[0]);
+			_load_count++;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (_load_count == 0 || seconds <= 0)
+		usage(argv[0]);
+
+	int worker_count = 0;
+	for (int i = 0; i < _load_count; i++)
+		worker_count += _loads[i].threads;
+	struct worker *workers = calloc(worker_count, sizeof(struct worker));
+	if (workers == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	struct bus_stats before, after;
+	read_bus_stats(&before);
+	uint64_t start = now_ns();
+
+	int w = 0;
+	for (int i = 0; i < _load_count; i++) {
+		for (int j = 0; j < _loads[i].threads; j++, w++) {
+			workers[w].load = &_loads[i];
+			// writers on the same file start on different values
+			workers[w].offset = _loads[i].value_count ? \
+					    j % _loads[i].value_count : 0;
+			if (pthread_create(&workers[w].thread, NULL, \
+					   run_worker, &workers[w])) {
+				perror("pthread_create");
+				return 1;
+			}
+		}
+	}
+
+	sleep(seconds);
+	_running = 0;
+
+	for (w = 0; w < worker_count; w++) {
+		pthread_join(workers[w].thread, NULL);
+		struct workload *load = workers[w].load;
+		load->samples = realloc(load->samples, \
+					(load->sample_count + \
+					 workers[w].sample_count + 1) * \
+					sizeof(uint64_t));
+		if (load->samples == NULL) {
+			perror("realloc");
+			return 1;
+		}
+		memcpy(load->samples + load->sample_count, workers[w].samples, \
+		       workers[w].sample_count * sizeof(uint64_t));
+		load->sample_count += workers[w].sample_count;
+		load->errors += workers[w].errors;
+		free(workers[w].samples);
+	}
+	free(workers);
+
+	double elapsed = (now_ns() - start) / 1e9;
+	read_bus_stats(&after);
+
+	FILE *out = stdout;
+	if (output != NULL && (out = fopen(output, "w")) == NULL) {
+		perror(output);
+		return 1;
+	}
+	print_results(out, label, elapsed, &before, &after);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,301 @@
+// prints the actuator events the c card driver multicasts over generic
+//   netlink, one line per event
+// it is also the reference for daemons that want to follow the actuators
+//   without polling sysfs: resolve the family, join the events group, read
+// with -l it also joins the log group and turns the binary log records of
+//   the driver into text, which is the only place their text exists
+//
+// usage:
+//   ccardevents [-l]
+//
+// by Mark Hill
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<unistd.h>
+#include<stdint.h>
+#include<sys/socket.h>
+#include<linux/netlink.h>
+#include<linux/genetlink.h>
+
+#include "ccard_netlink.h"
+
+#define BUF_SIZE 8192
+
+#define GENLMSG_DATA(nlh) ((char *)NLMSG_DATA(nlh) + GENL_HDRLEN)
+#define NLA_DATA(nla) ((char *)(nla) + NLA_HDRLEN)
+
+static const char *_actuator_names[] = {"dsa", "mt", "thruster"};
+static const char *_cause_names[] = {"command", "scheduler", "bdot", \
+				     "dsa_op", "observed", "reset"};
+// in enum ccard_dev_id order
+static const char *_dev_names[] = {"dsa_expdr", "mt_expdr", "thruster_dac"};
+static const char *_class_names[] = {"command", "housekeeping"};
+static const char *_breaker_names[] = {"closed", "open", "half_open"};
+
+#define NAME(names, i) \
+	((i) < sizeof(names) / sizeof(names[0]) ? names[i] : "?")
+
+// walks the attributes in [<attr>, <attr> + <len>) and stores a pointer to
+//   each one up to <max> in <table>
+static void parse_attrs(struct nlattr *attr, int len, struct nlattr **table, \
+			int max)
+{
+	memset(table, 0, sizeof(*table) * (max + 1));
+	while (len >= (int)sizeof(*attr) && attr->nla_len >= sizeof(*attr) && \
+	       attr->nla_len <= len) {
+		int type = attr->nla_type & NLA_TYPE_MASK;
+		if (type <= max)
+			table[type] = attr;
+		len -= NLA_ALIGN(attr->nla_len);
+		attr = (struct nlattr *)((char *)attr + NLA_ALIGN(attr->nla_len));
+	}
+}
+
+// asks the generic netlink controller for the ccard family
+// fills in the family id and the id of the group called <group_name>,
+//   returns 0 on success
+static int resolve_family(int sock, uint16_t *family, const char *group_name, \
+			  uint32_t *group)
+{
+	struct {
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char buf[64];
+	} req;
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req.n.nlmsg_type = GENL_ID_CTRL;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.g.cmd = CTRL_CMD_GETFAMILY;
+	req.g.version = 1;
+
+	struct nlattr *name = (struct nlattr *)GENLMSG_DATA(&req.n);
+	name->nla_type = CTRL_ATTR_FAMILY_NAME;
+	name->nla_len = NLA_HDRLEN + strlen(CCARD_GENL_NAME) + 1;
+	strcpy(NLA_DATA(name), CCARD_GENL_NAME);
+	req.n.nlmsg_len += NLA_ALIGN(name->nla_len);
+
+	if (send(sock, &req, req.n.nlmsg_len, 0) < 0) {
+		perror("send");
+		return -1;
+	}
+
+	static char buf[BUF_SIZE];
+	int len = recv(sock, buf, sizeof(buf), 0);
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	if (len < 0 || !NLMSG_OK(nlh, len) || nlh->nlmsg_type == NLMSG_ERROR) {
+		fprintf(stderr, "the %s netlink family isn't registered, is the " \
+			"driver loaded?\n", CCARD_GENL_NAME);
+		return -1;
+	}
+
+	struct nlattr *attrs[CTRL_ATTR_MAX + 1];
+	parse_attrs((struct nlattr *)GENLMSG_DATA(nlh), \
+		    nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), attrs, \
+		    CTRL_ATTR_MAX);
+	if (!attrs[CTRL_ATTR_FAMILY_ID] || !attrs[CTRL_ATTR_MCAST_GROUPS]) {
+		fprintf(stderr, "the controller reply is incomplete\n");
+		return -1;
+	}
+	*family = *(uint16_t *)NLA_DATA(attrs[CTRL_ATTR_FAMILY_ID]);
+
+	// the groups are a nested list of nested name and id pairs
+	struct nlattr *groups = attrs[CTRL_ATTR_MCAST_GROUPS];
+	struct nlattr *grp = (struct nlattr *)NLA_DATA(groups);
+	int rem = groups->nla_len - NLA_HDRLEN;
+	while (rem >= (int)sizeof(*grp) && grp->nla_len >= sizeof(*grp) && \
+	       grp->nla_len <= rem) {
+		struct nlattr *g[CTRL_ATTR_MCAST_GRP_MAX + 1];
+		parse_attrs((struct nlattr *)NLA_DATA(grp), \
+			    grp->nla_len - NLA_HDRLEN, g, CTRL_ATTR_MCAST_GRP_MAX);
+		if (g[CTRL_ATTR_MCAST_GRP_NAME] && g[CTRL_ATTR_MCAST_GRP_ID] && \
+		    !strcmp(NLA_DATA(g[CTRL_ATTR_MCAST_GRP_NAME]), group_name)) {
+			*group = *(uint32_t *)NLA_DATA(g[CTRL_ATTR_MCAST_GRP_ID]);
+			return 0;
+		}
+		rem -= NLA_ALIGN(grp->nla_len);
+		grp = (struct nlattr *)((char *)grp + NLA_ALIGN(grp->nla_len));
+	}
+
+	fprintf(stderr, "the %s family has no %s group\n", CCARD_GENL_NAME, \
+		group_name);
+	return -1;
+}
+
+static void print_event(struct nlmsghdr *nlh)
+{
+	struct nlattr *attrs[CCARD_ATTR_MAX + 1];
+	parse_attrs((struct nlattr *)GENLMSG_DATA(nlh), \
+		    nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), attrs, \
+		    CCARD_ATTR_MAX);
+	for (int i = CCARD_ATTR_ACTUATOR; i <= CCARD_ATTR_CARD; i++) {
+		if (attrs[i] == NULL) {
+			fprintf(stderr, "skipping an incomplete event\n");
+			return;
+		}
+	}
+
+	uint8_t actuator = *(uint8_t *)NLA_DATA(attrs[CCARD_ATTR_ACTUATOR]);
+	uint8_t index = *(uint8_t *)NLA_DATA(attrs[CCARD_ATTR_INDEX]);
+	uint32_t old_state = *(uint32_t *)NLA_DATA(attrs[CCARD_ATTR_OLD]);
+	uint32_t new_state = *(uint32_t *)NLA_DATA(attrs[CCARD_ATTR_NEW]);
+	uint64_t timestamp;
+	memcpy(&timestamp, NLA_DATA(attrs[CCARD_ATTR_TIMESTAMP]), \
+	       sizeof(timestamp));
+	uint8_t cause = *(uint8_t *)NLA_DATA(attrs[CCARD_ATTR_CAUSE]);
+	uint8_t card = *(uint8_t *)NLA_DATA(attrs[CCARD_ATTR_CARD]);
+
+	// actuators of card 0 keep their plain names, like their sysfs files
+	char prefix[16] = "";
+	if (card > 0)
+		snprintf(prefix, sizeof(prefix), "card%u-", card);
+
+	printf("%llu.%09llu %s%s%u %u -> %u %s\n", \
+	       (unsigned long long)(timestamp / 1000000000), \
+	       (unsigned long long)(timestamp % 1000000000), prefix, \
+	       actuator <= act_thruster ? _actuator_names[actuator] : "?", \
+	       index, old_state, new_state, \
+	       cause <= cause_reset ? _cause_names[cause] : "?");
+	fflush(stdout);
+}
+
+static void print_record(struct nlmsghdr *nlh)
+{
+	struct nlattr *attrs[CCARD_ATTR_MAX + 1];
+	parse_attrs((struct nlattr *)GENLMSG_DATA(nlh), \
+		    nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), attrs, \
+		    CCARD_ATTR_MAX);
+	if (!attrs[CCARD_ATTR_TIMESTAMP] || !attrs[CCARD_ATTR_CARD] || \
+	    !attrs[CCARD_ATTR_LOG_ID] || !attrs[CCARD_ATTR_LOG_ARG0] || \
+	    !attrs[CCARD_ATTR_LOG_ARG1]) {
+		fprintf(stderr, "skipping an incomplete log record\n");
+		return;
+	}
+
+	uint64_t timestamp;
+	memcpy(&timestamp, NLA_DATA(attrs[CCARD_ATTR_TIMESTAMP]), \
+	       sizeof(timestamp));
+	uint8_t card = *(uint8_t *)NLA_DATA(attrs[CCARD_ATTR_CARD]);
+	uint16_t id = *(uint16_t *)NLA_DATA(attrs[CCARD_ATTR_LOG_ID]);
+	uint32_t arg0 = *(uint32_t *)NLA_DATA(attrs[CCARD_ATTR_LOG_ARG0]);
+	uint32_t arg1 = *(uint32_t *)NLA_DATA(attrs[CCARD_ATTR_LOG_ARG1]);
+
+	char prefix[16] = "";
+	if (card > 0)
+		snprintf(prefix, sizeof(prefix), "card%u ", card);
+
+	printf("%llu.%09llu %s", (unsigned long long)(timestamp / 1000000000), \
+	       (unsigned long long)(timestamp % 1000000000), prefix);
+	switch (id) {
+	case CCARD_LOG_BUS_LOCK:
+		printf("bus lock for %s failed: %s\n", \
+		       NAME(_class_names, arg0), strerror(arg1));
+		break;
+	case CCARD_LOG_REG_ERROR:
+		printf("%s register 0x%02x failed: %s\n", \
+		       NAME(_dev_names, arg0 >> 8), arg0 & 0xff, strerror(arg1));
+		break;
+	case CCARD_LOG_BREAKER:
+		printf("%s breaker %s\n", NAME(_dev_names, arg0), \
+		       NAME(_breaker_names, arg1));
+		break;
+	case CCARD_LOG_DSA_OP:
+		printf("dsa%u %s failed on the bus\n", arg0, \
+		       arg1 == 0 ? "release" : "deploy");
+		break;
+	case CCARD_LOG_MT_SET:
+		printf("mt mask 0x%x not set for %s\n", arg0, \
+		       NAME(_cause_names, arg1));
+		break;
+	case CCARD_LOG_MT_BRAKED:
+		printf("mt mask 0x%x left braked for %s\n", arg0, \
+		       NAME(_cause_names, arg1));
+		break;
+	case CCARD_LOG_THRUST_SET:
+		printf("thruster%u not set to %u\n", arg0, arg1);
+		break;
+	default:
+		printf("log record %u %u %u\n", id, arg0, arg1);
+		break;
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	int log = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "l")) != -1) {
+		if (opt == 'l') {
+			log = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-l]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	int sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	struct sockaddr_nl addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("bind");
+		return 1;
+	}
+
+	uint16_t family;
+	uint32_t group;
+	if (resolve_family(sock, &family, CCARD_GENL_EVENTS, &group))
+		return 1;
+
+	if (setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group, \
+		       sizeof(group))) {
+		perror("joining the events group");
+		return 1;
+	}
+
+	if (log) {
+		if (resolve_family(sock, &family, CCARD_GENL_LOG, &group))
+			return 1;
+		if (setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, \
+			       &group, sizeof(group))) {
+			perror("joining the log group");
+			return 1;
+		}
+	}
+
+	static char buf[BUF_SIZE];
+	for (;;) {
+		int len = recv(sock, buf, sizeof(buf), 0);
+		if (len < 0) {
+			// the socket buffer overflowed, some events were lost
+			if (errno == ENOBUFS) {
+				fprintf(stderr, "events were dropped\n");
+				continue;
+			}
+			perror("recv");
+			return 1;
+		}
+
+		for (struct nlmsghdr *nlh = (struct nlmsghdr *)buf; \
+		     NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			struct genlmsghdr *genl = NLMSG_DATA(nlh);
+			if (nlh->nlmsg_type != family)
+				continue;
+			if (genl->cmd == CCARD_CMD_EVENT)
+				print_event(nlh);
+			else if (genl->cmd == CCARD_CMD_LOG)
+				print_record(nlh);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,308 @@
+// attaches gps receivers to the c card driver and reads their fixes
+// attach sets the gps line discipline on the tty of a receiver, which has
+//   to stay open for as long as the driver should parse it
+// play does the same on a pty and writes a recorded NMEA log into it at
+//   the rate of a real receiver, so the parser can be run on the ground
+//   against logs taken in flight
+// read prints the fixes /dev/gps<n> hands out, one line per fix
+//
+// usage:
+//   ccardgps attach <tty> [baud]
+//   ccardgps play [-r <bytes/s>] [-l <s>] <log>
+//   ccardgps read [device]
+//
+//   -r <bytes/s>  rate the log is played at, 960 by default, which is a
+//                 receiver at 9600 baud; 0 plays it as fast as possible
+//   -l <s>        time the pty stays attached after the end of the log, so
+//                 readers can catch up, 2 by default
+//
+// by Mark Hill
+
+// ptsname and the other pty calls
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<time.h>
+#include<signal.h>
+#include<termios.h>
+#include<stdint.h>
+#include<sys/ioctl.h>
+
+#include "ccard_gps.h"
+
+#define LDISC_PARAM "/sys/module/ccardmodule/parameters/gps_ldisc"
+// the log is written in slices this many times a second
+#define PLAY_SLICES 100
+
+static volatile sig_atomic_t _running = 1;
+
+static void stop(int sig)
+{
+	_running = 0;
+}
+
+// returns the line discipline the driver registered
+static int gps_ldisc(void)
+{
+	int ldisc = CCARD_GPS_DFL_LDISC;
+	FILE *f = fopen(LDISC_PARAM, "r");
+	if (f == NULL)
+		return ldisc;
+	if (fscanf(f, "%d", &ldisc) != 1)
+		ldisc = CCARD_GPS_DFL_LDISC;
+	fclose(f);
+	return ldisc;
+}
+
+static speed_t baud_speed(int baud)
+{
+	switch (baud) {
+	case 4800: return B4800;
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	default: return 0;
+	}
+}
+
+// puts <fd> in raw mode at <speed>, or leaves the speed if it is 0, and
+//   hands it to the driver
+// returns 0 on success
+static int attach_fd(int fd, speed_t speed, const char *name)
+{
+	struct termios tio;
+	if (tcgetattr(fd, &tio)) {
+		perror(name);
+		return 1;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	if (speed) {
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+	}
+	if (tcsetattr(fd, TCSANOW, &tio)) {
+		perror(name);
+		return 1;
+	}
+
+	int ldisc = gps_ldisc();
+	if (ioctl(fd, TIOCSETD, &ldisc)) {
+		fprintf(stderr, "%s: couldn't set line discipline %d: %s, is the " \
+				"driver loaded?\n", name, ldisc, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int attach(const char *tty, int baud)
+{
+	speed_t speed = baud_speed(baud);
+	if (speed == 0) {
+		fprintf(stderr, "unsupported baud rate %d\n", baud);
+		return 2;
+	}
+
+	int fd = open(tty, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		perror(tty);
+		return 1;
+	}
+	if (attach_fd(fd, speed, tty))
+		return 1;
+
+	// the driver keeps the receiver until the tty is closed
+	while (_running)
+		pause();
+
+	close(fd);
+	return 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int play(const char *path, long rate, int linger)
+{
+	FILE *log = fopen(path, "r");
+	if (log == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master)) {
+		perror("pty");
+		return 1;
+	}
+	const char *name = ptsname(master);
+	int slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(name);
+		return 1;
+	}
+	if (attach_fd(slave, 0, name))
+		return 1;
+
+	// the slice is at least one byte, so slow rates still make progress
+	size_t slice = rate > 0 ? rate / PLAY_SLICES : 4096;
+	if (slice == 0)
+		slice = 1;
+	char buf[4096];
+	size_t total = 0;
+	uint64_t start = now_ns();
+	while (_running) {
+		size_t n = fread(buf, 1, slice, log);
+		if (n == 0)
+			break;
+		if (write(master, buf, n) != (ssize_t)n) {
+			perror("writing the pty");
+			return 1;
+		}
+		total += n;
+
+		if (rate > 0) {
+			uint64_t due = start + total * 1000000000ull / rate;
+			uint64_t now = now_ns();
+			if (due > now)
+				usleep((due - now) / 1000);
+		}
+	}
+	fclose(log);
+
+	double seconds = (now_ns() - start) / 1e9;
+	fprintf(stderr, "played %zu bytes in %.2f s through %s\n", total, \
+		seconds, name);
+
+	// the fixes of the last epoch only go out once the driver sees it end,
+	//   readers get what is left while the pty stays attached
+	for (int i = 0; i < linger && _running; i++)
+		sleep(1);
+
+	close(slave);
+	close(master);
+	return 0;
+}
+
+static void print_fix(const struct ccard_gps_fix *fix)
+{
+	printf("%llu gps%u #%u %02u:%02u:%02u.%03u", \
+	       (unsigned long long)fix->timestamp_ns, fix->receiver, \
+	       fix->sequence, fix->time_ms / 3600000, \
+	       fix->time_ms / 60000 % 60, fix->time_ms / 1000 % 60, \
+	       fix->time_ms % 1000);
+	if (fix->flags & CCARD_GPS_HAVE_RMC && fix->year)
+		printf(" %04u-%02u-%02u", fix->year, fix->month, fix->day);
+	printf(" %.7f %.7f", fix->latitude / 1e7, fix->longitude / 1e7);
+	if (fix->flags & CCARD_GPS_HAVE_GGA)
+		printf(" alt %.3f quality %u sats %u hdop %.2f", \
+		       fix->altitude / 1e3, fix->quality, fix->satellites, \
+		       fix->hdop / 1e2);
+	if (fix->flags & CCARD_GPS_HAVE_RMC)
+		printf(" speed %.3f course %.2f %s", fix->speed / 1e3, \
+		       fix->course / 1e2, \
+		       fix->flags & CCARD_GPS_VALID ? "valid" : "invalid");
+	printf("\n");
+}
+
+static int read_fixes(const char *dev)
+{
+	int fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		perror(dev);
+		return 1;
+	}
+
+	struct ccard_gps_fix fixes[16];
+	int32_t expected = -1;
+	while (_running) {
+		ssize_t len = read(fd, fixes, sizeof(fixes));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			// the receiver was detached
+			if (errno == ENODEV)
+				break;
+			perror(dev);
+			return 1;
+		}
+
+		for (size_t i = 0; i < len / sizeof(fixes[0]); i++) {
+			if (expected >= 0 && fixes[i].sequence != (uint32_t)expected)
+				fprintf(stderr, "%u fixes were lost\n", \
+					fixes[i].sequence - expected);
+			expected = fixes[i].sequence + 1;
+			print_fix(&fixes[i]);
+		}
+		fflush(stdout);
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: ccardgps attach <tty> [baud]\n" \
+			"       ccardgps play [-r <bytes/s>] [-l <s>] <log>\n" \
+			"       ccardgps read [device]\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		usage();
+		return 2;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (!strcmp(argv[1], "attach") && argc >= 3)
+		return attach(argv[2], argc >= 4 ? atoi(argv[3]) : 9600);
+
+	if (!strcmp(argv[1], "read"))
+		return read_fixes(argc >= 3 ? argv[2] : "/dev/gps0");
+
+	if (!strcmp(argv[1], "play")) {
+		long rate = 960;
+		int linger = 2;
+		int opt;
+		optind = 2;
+		while ((opt = getopt(argc, argv, "r:l:")) != -1) {
+			switch (opt) {
+			case 'r':
+				rate = atol(optarg);
+				break;
+			case 'l':
+				linger = atoi(optarg);
+				break;
+			default:
+				usage();
+				return 2;
+			}
+		}
+		if (optind != argc - 1) {
+			usage();
+			return 2;
+		}
+		return play(argv[optind], rate, linger);
+	}
+
+	usage();
+	return 2;
+}
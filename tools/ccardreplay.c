@@ -0,0 +1,501 @@
+// replays a command recording taken from /dev/record against the driver
+// every recorded command is written to the same file again, either at its
+//   original time or as fast as possible, while the replay itself is
+//   recorded, and the two recordings are compared
+// the results print as json: how late the commands went out, any command
+//   that got a different answer, and where the register writes on the bus
+//   diverged in value or in timing
+// run as fast as possible it doubles as a load benchmark built from real
+//   command streams
+//
+// usage:
+//   ccardreplay [options] <recording>
+//
+//   -f                  replay as fast as possible instead of on time
+//   -s <ms>             time to keep recording after the last command, so
+//                       ramps and dsa operations can finish, 1000 by default
+//   -l <label>          label copied to the results
+//   -o <file>           write the results to <file> instead of stdout
+//   -r <file>           also save the recording of the replay to <file>
+//   --sysfs-root <dir>  directory the command files are relative to,
+//                       /sys/class by default
+//   --dev-root <dir>    directory of the char devices, /dev by default
+//
+// the exit status is 0 if the replay matched, 3 if it diverged
+//
+// by Mark Hill
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<time.h>
+#include<poll.h>
+#include<pthread.h>
+#include<stdint.h>
+#include<sys/ioctl.h>
+
+#include "ccard_record.h"
+#include "ccard_dsa.h"
+
+#define MAX_PATH 256
+// number of divergences printed in detail
+#define MAX_REPORTED 10
+
+// a recording loaded into memory, with the records indexed
+struct recording {
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+	// offsets of the records of each kind
+	size_t *commands;
+	size_t command_count;
+	size_t *writes;
+	size_t write_count;
+	uint64_t lost;
+	int version;
+};
+
+static const char *_sysfs_root = "/sys/class";
+static const char *_dev_root = "/dev";
+
+// the recording of the replay, filled by the recorder thread
+static struct recording _replay;
+static int _record_fd = -1;
+static volatile int _recording = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ull,
+		.tv_nsec = ns % 1000000000ull,
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == \
+	       EINTR)
+		;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-f] [-s ms] [-l label] [-o file] " \
+		"[-r file]\n" \
+		"       [--sysfs-root dir] [--dev-root dir] <recording>\n", name);
+	exit(2);
+}
+
+static void append(struct recording *rec, const unsigned char *buf, size_t n)
+{
+	if (rec->size + n > rec->capacity) {
+		rec->capacity = (rec->size + n) * 2;
+		rec->data = realloc(rec->data, rec->capacity);
+		if (rec->data == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(rec->data + rec->size, buf, n);
+	rec->size += n;
+}
+
+static void add_index(size_t **list, size_t *count, size_t offset)
+{
+	*list = realloc(*list, (*count + 1) * sizeof(size_t));
+	if (*list == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	(*list)[(*count)++] = offset;
+}
+
+static struct ccard_rec *rec_at(struct recording *rec, size_t offset)
+{
+	return (struct ccard_rec *)(rec->data + offset);
+}
+
+// walks the records of <rec> and indexes them
+// returns 0 on success or -1 if the recording is damaged
+static int index_recording(struct recording *rec, const char *name)
+{
+	size_t offset = 0;
+	rec->version = -1;
+	while (offset + sizeof(struct ccard_rec) <= rec->size) {
+		struct ccard_rec r;
+		memcpy(&r, rec->data + offset, sizeof(r));
+		if (offset + sizeof(r) + r.len > rec->size)
+			break;
+
+		switch (r.type) {
+		case CCARD_REC_START:
+			rec->version = r.result;
+			break;
+		case CCARD_REC_COMMAND:
+			add_index(&rec->commands, &rec->command_count, offset);
+			break;
+		case CCARD_REC_REG_WRITE:
+			add_index(&rec->writes, &rec->write_count, offset);
+			break;
+		case CCARD_REC_LOST:
+			rec->lost += r.result;
+			break;
+		}
+		offset += sizeof(r) + r.len;
+	}
+
+	if (rec->version != CCARD_REC_VERSION) {
+		fprintf(stderr, "%s is not a version %d recording\n", name, \
+			CCARD_REC_VERSION);
+		return -1;
+	}
+	if (offset != rec->size)
+		fprintf(stderr, "%s ends in a partial record\n", name);
+	return 0;
+}
+
+static int load_recording(struct recording *rec, const char *path)
+{
+	FILE *in = fopen(path, "rb");
+	if (in == NULL) {
+		perror(path);
+		return -1;
+	}
+	unsigned char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		append(rec, buf, n);
+	fclose(in);
+
+	return index_recording(rec, path);
+}
+
+// drains /dev/record into _replay until told to stop
+static void *run_recorder(void *data)
+{
+	(void)data;
+	unsigned char buf[4096];
+	struct pollfd pfd = {.fd = _record_fd, .events = POLLIN};
+
+	for (;;) {
+		int ready = poll(&pfd, 1, 100);
+		if (ready > 0) {
+			ssize_t n = read(_record_fd, buf, sizeof(buf));
+			if (n > 0)
+				append(&_replay, buf, n);
+			else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+				break;
+		} else if (!_recording) {
+			// nothing left buffered and nothing more coming
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+// builds the file a command of <source> for actuator <index> of <card> came
+//   from
+// the devices of any card but the first are prefixed with card<n>-, the
+//   same way the driver names them
+static int command_path(char *path, uint8_t card, uint8_t source, \
+			uint8_t index)
+{
+	char p[16] = "";
+	if (card > 0)
+		snprintf(p, sizeof(p), "card%u-", card);
+
+	switch (source) {
+	case CCARD_SRC_DSA_DESIRED:
+		return snprintf(path, MAX_PATH, "%s/dsa/%sdsa%u/desired_state", \
+				_sysfs_root, p, index);
+	case CCARD_SRC_DSA_SUBMIT:
+		return snprintf(path, MAX_PATH, "%s/%sdsa%u", _dev_root, p, index);
+	case CCARD_SRC_MT_STATE:
+		return snprintf(path, MAX_PATH, \
+				"%s/magnetorquer/%smagnetorquer%u/state", \
+				_sysfs_root, p, index);
+	case CCARD_SRC_MT_DIPOLE:
+		// the class file only drives the first card
+		if (card > 0)
+			return snprintf(path, MAX_PATH, \
+					"%s/magnetorquer/%sbdot/dipole", \
+					_sysfs_root, p);
+		return snprintf(path, MAX_PATH, "%s/magnetorquer/dipole", \
+				_sysfs_root);
+	case CCARD_SRC_THRUST:
+		return snprintf(path, MAX_PATH, "%s/thruster/%sthruster%u/thrust", \
+				_sysfs_root, p, index);
+	case CCARD_SRC_SCHEDULE:
+		return snprintf(path, MAX_PATH, "%s/ccard/%sscheduler/schedule", \
+				_sysfs_root, p);
+	case CCARD_SRC_SCHED_CANCEL:
+		return snprintf(path, MAX_PATH, "%s/ccard/%sscheduler/cancel", \
+				_sysfs_root, p);
+	}
+	return -1;
+}
+
+// sends one recorded command to the driver again
+// returns what the driver answered, the same way the record stores it
+static int32_t send_command(struct ccard_rec *r)
+{
+	char path[MAX_PATH];
+	const unsigned char *data = (const unsigned char *)(r + 1);
+	if (command_path(path, r->card, r->target, r->index) < 0)
+		return -EINVAL;
+
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+
+	int32_t result;
+	if (r->target == CCARD_SRC_DSA_SUBMIT) {
+		struct ccard_dsa_submit sub = {.eventfd = -1};
+		memcpy(&sub.op, data, r->len < sizeof(sub.op) ? r->len : \
+		       sizeof(sub.op));
+		result = ioctl(fd, CCARD_DSA_IOC_SUBMIT, &sub) ? -errno : 0;
+	} else {
+		ssize_t n = write(fd, data, r->len);
+		result = (n < 0) ? -errno : (int32_t)n;
+	}
+	close(fd);
+
+	return result;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// returns the <per_mille> percentile of the sorted <samples>
+static uint64_t percentile(uint64_t *samples, size_t count, int per_mille)
+{
+	if (count == 0)
+		return 0;
+	size_t i = (count * per_mille + 999) / 1000;
+	return samples[i ? i - 1 : 0];
+}
+
+// prints the percentiles of <samples>, given in ns, in us
+static void print_us(FILE *out, uint64_t *samples, size_t count)
+{
+	qsort(samples, count, sizeof(uint64_t), compare_u64);
+	fprintf(out, "{\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}", \
+		percentile(samples, count, 500) / 1e3, \
+		percentile(samples, count, 990) / 1e3, \
+		(count ? samples[count - 1] : 0) / 1e3);
+}
+
+// prints <s> as a json string
+static void print_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+int main(int argc, char **argv)
+{
+	int fast = 0;
+	int settle_ms = 1000;
+	const char *label = "";
+	const char *output = NULL;
+	const char *save = NULL;
+	const char *input = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		const char *opt = argv[i];
+		if (strcmp(opt, "-f") == 0) {
+			fast = 1;
+			continue;
+		} else if (opt[0] != '-') {
+			input = opt;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+			usage(argv[0]);
+		char *arg = argv[++i];
+		if (strcmp(opt, "-s") == 0)
+			settle_ms = atoi(arg);
+		else if (strcmp(opt, "-l") == 0)
+			label = arg;
+		else if (strcmp(opt, "-o") == 0)
+			output = arg;
+		else if (strcmp(opt, "-r") == 0)
+			save = arg;
+		else if (strcmp(opt, "--sysfs-root") == 0)
+			_sysfs_root = arg;
+		else if (strcmp(opt, "--dev-root") == 0)
+			_dev_root = arg;
+		else
+			usage(argv[0]);
+	}
+	if (input == NULL || settle_ms < 0)
+		usage(argv[0]);
+
+	struct recording original = {0};
+	if (load_recording(&original, input))
+		return 1;
+	if (original.command_count == 0) {
+		fprintf(stderr, "%s holds no commands\n", input);
+		return 1;
+	}
+
+	char record_path[MAX_PATH];
+	snprintf(record_path, MAX_PATH, "%s/record", _dev_root);
+	_record_fd = open(record_path, O_RDONLY | O_NONBLOCK);
+	if (_record_fd < 0) {
+		perror(record_path);
+		return 1;
+	}
+	pthread_t recorder;
+	if (pthread_create(&recorder, NULL, run_recorder, NULL)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	// the commands keep their spacing from the first one
+	uint64_t orig_start = rec_at(&original, original.commands[0])->timestamp_ns;
+	uint64_t *lateness = calloc(original.command_count, sizeof(uint64_t));
+	int32_t *results = calloc(original.command_count, sizeof(int32_t));
+	if (lateness == NULL || results == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < original.command_count; i++) {
+		struct ccard_rec *r = rec_at(&original, original.commands[i]);
+		uint64_t due = start + (r->timestamp_ns - orig_start);
+		if (!fast)
+			sleep_until(due);
+		uint64_t sent = now_ns();
+		lateness[i] = (fast || sent < due) ? 0 : sent - due;
+		results[i] = send_command(r);
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	usleep(settle_ms * 1000);
+	_recording = 0;
+	pthread_join(recorder, NULL);
+	close(_record_fd);
+
+	if (save != NULL) {
+		FILE *f = fopen(save, "wb");
+		if (f == NULL || fwrite(_replay.data, 1, _replay.size, f) != \
+		    _replay.size)
+			perror(save);
+		if (f != NULL)
+			fclose(f);
+	}
+	if (index_recording(&_replay, record_path))
+		return 1;
+
+	FILE *out = stdout;
+	if (output != NULL && (out = fopen(output, "w")) == NULL) {
+		perror(output);
+		return 1;
+	}
+
+	fprintf(out, "{\n  \"label\": ");
+	print_string(out, label);
+	fprintf(out, ",\n  \"recording\": ");
+	print_string(out, input);
+	fprintf(out, ",\n  \"mode\": \"%s\",\n  \"commands\": %zu,\n" \
+		"  \"elapsed_s\": %.3f,\n  \"commands_per_s\": %.1f,\n" \
+		"  \"lateness_us\": ", fast ? "fast" : "timed", \
+		original.command_count, elapsed, \
+		elapsed > 0 ? original.command_count / elapsed : 0);
+	print_us(out, lateness, original.command_count);
+
+	// a command diverges if the driver answered it differently this time
+	size_t command_mismatches = 0;
+	fprintf(out, ",\n  \"command_mismatches\": [");
+	for (size_t i = 0; i < original.command_count; i++) {
+		struct ccard_rec *r = rec_at(&original, original.commands[i]);
+		if (results[i] == r->result)
+			continue;
+		if (command_mismatches++ < MAX_REPORTED)
+			fprintf(out, "%s\n    {\"command\": %zu, \"source\": %u, " \
+				"\"index\": %u, \"recorded\": %d, \"replayed\": %d}", \
+				command_mismatches > 1 ? "," : "", i, r->target, \
+				r->index, r->result, results[i]);
+	}
+	fprintf(out, "%s],\n  \"command_mismatch_count\": %zu,\n", \
+		command_mismatches ? "\n  " : "", command_mismatches);
+
+	// the register writes are compared in order, each one relative to the
+	//   first command of its own recording
+	uint64_t replay_start = _replay.command_count ? \
+		rec_at(&_replay, _replay.commands[0])->timestamp_ns : 0;
+	size_t common = original.write_count < _replay.write_count ? \
+			original.write_count : _replay.write_count;
+	uint64_t *drift = calloc(common + 1, sizeof(uint64_t));
+	if (drift == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	size_t write_mismatches = 0;
+	long first_divergence = -1;
+	for (size_t i = 0; i < common; i++) {
+		struct ccard_rec *a = rec_at(&original, original.writes[i]);
+		struct ccard_rec *b = rec_at(&_replay, _replay.writes[i]);
+		uint8_t va = *(uint8_t *)(a + 1);
+		uint8_t vb = *(uint8_t *)(b + 1);
+		if (a->target != b->target || a->index != b->index || \
+		    va != vb || a->result != b->result) {
+			if (first_divergence < 0)
+				first_divergence = i;
+			write_mismatches++;
+		}
+		int64_t ta = a->timestamp_ns - orig_start;
+		int64_t tb = b->timestamp_ns - replay_start;
+		drift[i] = (ta > tb) ? ta - tb : tb - ta;
+	}
+	if (first_divergence < 0 && original.write_count != _replay.write_count)
+		first_divergence = common;
+
+	fprintf(out, "  \"reg_writes\": {\"recorded\": %zu, \"replayed\": %zu, " \
+		"\"mismatches\": %zu, \"first_divergence\": %ld},\n", \
+		original.write_count, _replay.write_count, write_mismatches, \
+		first_divergence);
+	if (first_divergence >= 0 && (size_t)first_divergence < common) {
+		struct ccard_rec *a = rec_at(&original, \
+					     original.writes[first_divergence]);
+		struct ccard_rec *b = rec_at(&_replay, \
+					     _replay.writes[first_divergence]);
+		fprintf(out, "  \"divergence\": {\"recorded\": \"0x%02x reg " \
+			"0x%02x = 0x%02x ret %d\", \"replayed\": \"0x%02x reg " \
+			"0x%02x = 0x%02x ret %d\"},\n", a->target, a->index, \
+			*(uint8_t *)(a + 1), a->result, b->target, b->index, \
+			*(uint8_t *)(b + 1), b->result);
+	}
+	fprintf(out, "  \"timing_drift_us\": ");
+	print_us(out, drift, common);
+	fprintf(out, ",\n  \"lost\": {\"recorded\": %llu, \"replayed\": %llu}\n}\n", \
+		(unsigned long long)original.lost, \
+		(unsigned long long)_replay.lost);
+	if (out != stdout)
+		fclose(out);
+
+	if (original.lost || _replay.lost)
+		fprintf(stderr, "records were lost, the comparison is incomplete\n");
+
+	return (command_mismatches || first_divergence >= 0) ? 3 : 0;
+}
@@ -0,0 +1,111 @@
+// prints the c card status page
+// the page is mapped once and every snapshot after that is taken without
+//   a syscall, which makes this the reference for readers that poll at a
+//   high rate
+//
+// usage:
+//   ccardstatus [-i <ms>] [--device <path>]
+//
+//   -i <ms>            print a snapshot every <ms> instead of once
+//   --device <path>    the status char device, /dev/status by default
+//
+// by Mark Hill
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+
+#include "ccard_status.h"
+
+// takes a consistent copy of <page> into <snap>
+// returns the number of times the copy had to be retried
+static unsigned snapshot(const volatile struct ccard_status *page, \
+			 struct ccard_status *snap)
+{
+	unsigned retries = 0;
+	for (;;) {
+		__u32 seq = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+		if (!(seq & 1)) {
+			memcpy(snap, (const void *)page, sizeof(*snap));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == seq)
+				return retries;
+		}
+		retries++;
+	}
+}
+
+static void print_status(const struct ccard_status *s, unsigned retries)
+{
+	printf("updated_ns %llu updates %llu retries %u present 0x%x\n", \
+	       (unsigned long long)s->updated_ns, \
+	       (unsigned long long)s->updates, retries, s->present);
+	for (int i = 0; i < CCARD_DSA_COUNT; i++)
+		printf("dsa%i %u\n", i, s->dsa_state[i]);
+	for (int i = 0; i < CCARD_MT_COUNT; i++)
+		printf("mt%i %u\n", i, s->mt_state[i]);
+	for (int i = 0; i < CCARD_STATUS_THRUSTERS; i++)
+		printf("thruster%i %u\n", i, s->thrust[i]);
+	for (int i = 0; i < CCARD_STATUS_RAILS; i++)
+		printf("rail%i %s users %u toggles %u\n", i, \
+		       s->rail_on[i] ? "on" : "off", s->rail_users[i], \
+		       s->rail_toggles[i]);
+	printf("bus reads %llu writes %llu errors %llu\n", \
+	       (unsigned long long)s->bus_reads, \
+	       (unsigned long long)s->bus_writes, \
+	       (unsigned long long)s->bus_errors);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "/dev/status";
+	long interval = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+			interval = atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--device") && i + 1 < argc) {
+			path = argv[++i];
+		} else {
+			fprintf(stderr, "usage: %s [-i <ms>] [--device <path>]\n", \
+				argv[0]);
+			return 1;
+		}
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	const volatile struct ccard_status *page = mmap(NULL, \
+		sizeof(struct ccard_status), PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	// the mapping keeps the device open, the descriptor isn't needed
+	close(fd);
+
+	if (page->magic != CCARD_STATUS_MAGIC || \
+	    page->version != CCARD_STATUS_VERSION) {
+		fprintf(stderr, "%s has status page version %u, expected %u\n", \
+			path, page->version, CCARD_STATUS_VERSION);
+		return 1;
+	}
+
+	struct ccard_status snap;
+	do {
+		unsigned retries = snapshot(page, &snap);
+		print_status(&snap, retries);
+		if (interval)
+			usleep(interval * 1000);
+	} while (interval);
+
+	return 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/bash
+# the adcs task switching the magnetorquers while reading them back
+# by Mark Hill
+
+. $(dirname $0)/common.sh
+
+run_scenario adcs \
+	-w 1:magnetorquer/magnetorquer0/state=forward,reverse,off \
+	-w 1:magnetorquer/magnetorquer1/state=reverse,off,forward \
+	-w 1:magnetorquer/magnetorquer2/state=off,forward,reverse \
+	-r 2:magnetorquer/magnetorquer0/state \
+	-r 2:magnetorquer/magnetorquer1/state \
+	-r 2:magnetorquer/magnetorquer2/state
@@ -0,0 +1,7 @@
+#!/bin/bash
+# runs every scenario one after the other
+# by Mark Hill
+
+for scenario in telemetry adcs mixed priority; do
+	$(dirname $0)/$scenario.sh || exit 1
+done
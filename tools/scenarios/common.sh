@@ -0,0 +1,25 @@
+#!/bin/bash
+# shared setup for the benchmark scenarios
+# every scenario writes its json results to $RESULTS_DIR/<scenario>.json,
+#   labelled with the version of the loaded driver so that results from
+#   different versions can be kept side by side
+# by Mark Hill
+
+SCENARIO_DIR=$(cd $(dirname $0) && pwd)
+BENCH=${BENCH:-$SCENARIO_DIR/../ccardbench}
+SYSFS_ROOT=${SYSFS_ROOT:-/sys/class}
+DURATION=${DURATION:-30}
+VERSION=$(cat /sys/module/ccardmodule/version 2>/dev/null || echo unknown)
+RESULTS_DIR=${RESULTS_DIR:-results/$VERSION}
+
+# runs the benchmark for scenario $1 with the remaining arguments as the
+#   workloads
+run_scenario() {
+	local name=$1
+	shift
+	mkdir -p $RESULTS_DIR
+	# the maxima in the bus stats only cover the run after a reset
+	echo reset > $SYSFS_ROOT/ccard/bus/stats 2>/dev/null
+	$BENCH --sysfs-root $SYSFS_ROOT -t $DURATION -l "$name $VERSION" \
+		-o $RESULTS_DIR/$name.json "$@"
+}
@@ -0,0 +1,18 @@
+#!/bin/bash
+# telemetry, adcs and propulsion all hitting the driver at once
+# the dsas are only ever asked to stow, so this never burns anything
+# by Mark Hill
+
+. $(dirname $0)/common.sh
+
+run_scenario mixed \
+	-r 2:dsa/dsa0/current_state -r 2:dsa/dsa1/current_state \
+	-w 1:dsa/dsa0/desired_state=stow -w 1:dsa/dsa1/desired_state=stow \
+	-w 1:magnetorquer/magnetorquer0/state=forward,reverse,off \
+	-w 1:magnetorquer/magnetorquer1/state=reverse,off,forward \
+	-w 1:magnetorquer/magnetorquer2/state=off,forward,reverse \
+	-r 2:magnetorquer/magnetorquer0/state \
+	-r 2:magnetorquer/magnetorquer1/state \
+	-r 2:magnetorquer/magnetorquer2/state \
+	-w 1:thruster/thruster0/thrust=0,10,50,0 \
+	-r 2:thruster/thruster0/thrust
@@ -0,0 +1,14 @@
+#!/bin/bash
+# propulsion and adcs commands under a flood of housekeeping reads
+# the bus stats are reset before the run, so command.wait_max_ns in the
+#   results is the worst a command waited for the bus behind the reads
+# by Mark Hill
+
+. $(dirname $0)/common.sh
+
+run_scenario priority \
+	-r 4:dsa/dsa0/current_state -r 4:dsa/dsa1/current_state \
+	-r 4:magnetorquer/magnetorquer0/state \
+	-r 4:magnetorquer/magnetorquer1/state \
+	-w 1:magnetorquer/magnetorquer2/state=forward,off,reverse,off \
+	-w 1:thruster/thruster0/thrust=0,10,50,0
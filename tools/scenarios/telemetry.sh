@@ -0,0 +1,13 @@
+#!/bin/bash
+# the telemetry task on its own, polling the state of every actuator
+# by Mark Hill
+
+. $(dirname $0)/common.sh
+
+run_scenario telemetry \
+	-r 2:dsa/dsa0/current_state -r 2:dsa/dsa1/current_state \
+	-r 1:dsa/dsa0/desired_state -r 1:dsa/dsa1/desired_state \
+	-r 2:magnetorquer/magnetorquer0/state \
+	-r 2:magnetorquer/magnetorquer1/state \
+	-r 2:magnetorquer/magnetorquer2/state \
+	-r 1:thruster/thruster0/thrust